@@ -398,6 +398,41 @@ Tree::listDirectoryEx(const std::string& path) const
     return children;
 }
 
+Result
+Tree::listDirectory(const std::string& path,
+                    const std::string& prefix,
+                    const std::string& startAfter,
+                    uint64_t limit,
+                    std::vector<std::string>& children,
+                    bool& more) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->listDirectory(
+        path,
+        treeDetails->workingDirectory,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        prefix,
+        startAfter,
+        limit,
+        children,
+        more);
+}
+
+std::vector<std::string>
+Tree::listDirectoryEx(const std::string& path,
+                      const std::string& prefix,
+                      const std::string& startAfter,
+                      uint64_t limit,
+                      bool& more) const
+{
+    std::vector<std::string> children;
+    throwException(listDirectory(path, prefix, startAfter, limit,
+                                 children, more),
+                   treeDetails->timeoutNanos);
+    return children;
+}
+
 Result
 Tree::removeDirectory(const std::string& path)
 {
@@ -433,6 +468,29 @@ Tree::writeEx(const std::string& path, const std::string& contents)
     throwException(write(path, contents), treeDetails->timeoutNanos);
 }
 
+Result
+Tree::write(const std::string& path,
+            uint64_t offset,
+            const std::string& contents)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->write(
+        path,
+        treeDetails->workingDirectory,
+        offset,
+        contents,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos));
+}
+
+void
+Tree::writeEx(const std::string& path,
+              uint64_t offset,
+              const std::string& contents)
+{
+    throwException(write(path, offset, contents), treeDetails->timeoutNanos);
+}
+
 Result
 Tree::read(const std::string& path, std::string& contents) const
 {
@@ -453,6 +511,37 @@ Tree::readEx(const std::string& path) const
     return contents;
 }
 
+Result
+Tree::read(const std::string& path,
+           uint64_t offset,
+           uint64_t length,
+           std::string& contents,
+           uint64_t& size) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->read(
+        path,
+        treeDetails->workingDirectory,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        offset,
+        length,
+        contents,
+        size);
+}
+
+std::string
+Tree::readEx(const std::string& path,
+             uint64_t offset,
+             uint64_t length,
+             uint64_t& size) const
+{
+    std::string contents;
+    throwException(read(path, offset, length, contents, size),
+                   treeDetails->timeoutNanos);
+    return contents;
+}
+
 Result
 Tree::removeFile(const std::string& path)
 {
@@ -470,6 +559,96 @@ Tree::removeFileEx(const std::string& path)
     throwException(removeFile(path), treeDetails->timeoutNanos);
 }
 
+Result
+Tree::increment(const std::string& path, int64_t delta, int64_t& value)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->increment(
+        path,
+        treeDetails->workingDirectory,
+        delta,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        value);
+}
+
+int64_t
+Tree::incrementEx(const std::string& path, int64_t delta)
+{
+    int64_t value = 0;
+    throwException(increment(path, delta, value), treeDetails->timeoutNanos);
+    return value;
+}
+
+Result
+Tree::append(const std::string& path, const std::string& contents)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->append(
+        path,
+        treeDetails->workingDirectory,
+        contents,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos));
+}
+
+void
+Tree::appendEx(const std::string& path, const std::string& contents)
+{
+    throwException(append(path, contents), treeDetails->timeoutNanos);
+}
+
+Result
+Tree::createSequential(const std::string& path,
+                       const std::string& contents,
+                       std::string& created)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->createSequential(
+        path,
+        treeDetails->workingDirectory,
+        contents,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        created);
+}
+
+std::string
+Tree::createSequentialEx(const std::string& path, const std::string& contents)
+{
+    std::string created;
+    throwException(createSequential(path, contents, created),
+                   treeDetails->timeoutNanos);
+    return created;
+}
+
+Result
+Tree::watch(const std::string& path,
+            bool recursive,
+            uint64_t afterIndex,
+            uint64_t& index) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->watch(
+        path,
+        treeDetails->workingDirectory,
+        recursive,
+        afterIndex,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        index);
+}
+
+uint64_t
+Tree::watchEx(const std::string& path,
+              bool recursive,
+              uint64_t afterIndex) const
+{
+    uint64_t index = 0;
+    throwException(watch(path, recursive, afterIndex, index),
+                   treeDetails->timeoutNanos);
+    return index;
+}
+
 std::shared_ptr<const TreeDetails>
 Tree::getTreeDetails() const
 {
@@ -479,6 +658,62 @@ Tree::getTreeDetails() const
     return ret;
 }
 
+////////// DirectoryIterator //////////
+
+DirectoryIterator::DirectoryIterator(const Tree& tree,
+                                     const std::string& path,
+                                     const std::string& prefix,
+                                     uint64_t pageSize)
+    : tree(tree)
+    , path(path)
+    , prefix(prefix)
+    , pageSize(pageSize)
+    , page()
+    , index(0)
+    , more(true)
+{
+}
+
+DirectoryIterator::~DirectoryIterator()
+{
+}
+
+Result
+DirectoryIterator::next(std::string& child, bool& done)
+{
+    child.clear();
+    done = false;
+    if (index == page.size() && more) {
+        std::string startAfter;
+        if (!page.empty())
+            startAfter = page.back();
+        std::vector<std::string> nextPage;
+        bool nextMore = false;
+        Result result = tree.listDirectory(path, prefix, startAfter,
+                                           pageSize, nextPage, nextMore);
+        if (result.status != Status::OK)
+            return result;
+        page = std::move(nextPage);
+        index = 0;
+        more = nextMore;
+    }
+    if (index == page.size()) {
+        done = true;
+        return Result();
+    }
+    child = page.at(index);
+    ++index;
+    return Result();
+}
+
+bool
+DirectoryIterator::nextEx(std::string& child)
+{
+    bool done;
+    throwException(next(child, done), tree.getTimeout());
+    return !done;
+}
+
 ////////// TestingCallbacks //////////
 
 TestingCallbacks::TestingCallbacks()
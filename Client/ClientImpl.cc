@@ -113,6 +113,55 @@ split(const std::string& path, std::vector<std::string>& components)
         components.push_back(word);
 }
 
+/**
+ * Apply a ListDirectory request's prefix, start_after, and limit to the full
+ * listing from an older server, which ignores those fields. This matches the
+ * order of Tree::Directory::getChildren(): directories (with a trailing
+ * slash) sorted by name, then files sorted by name.
+ * \param all
+ *      Every child of the directory, as returned by the server.
+ * \param prefix
+ *      See Protocol::Client::ReadOnlyTree::Request::ListDirectory.
+ * \param startAfter
+ *      See Protocol::Client::ReadOnlyTree::Request::ListDirectory.
+ * \param limit
+ *      See Protocol::Client::ReadOnlyTree::Request::ListDirectory.
+ * \param[out] children
+ *      The children that the request selects are appended here.
+ * \return
+ *      True if more children matching 'prefix' follow those in 'children'.
+ */
+bool
+filterChildren(const std::vector<std::string>& all,
+               const std::string& prefix,
+               const std::string& startAfter,
+               uint64_t limit,
+               std::vector<std::string>& children)
+{
+    bool cursorIsDirectory = Core::StringUtil::endsWith(startAfter, "/");
+    std::string cursor = startAfter;
+    if (cursorIsDirectory)
+        cursor.erase(cursor.size() - 1);
+    for (auto it = all.begin(); it != all.end(); ++it) {
+        bool isDirectory = Core::StringUtil::endsWith(*it, "/");
+        std::string name = *it;
+        if (isDirectory)
+            name.erase(name.size() - 1);
+        if (!Core::StringUtil::startsWith(name, prefix))
+            continue;
+        if (!startAfter.empty()) {
+            if (isDirectory && !cursorIsDirectory)
+                continue;
+            if (isDirectory == cursorIsDirectory && name <= cursor)
+                continue;
+        }
+        if (limit > 0 && children.size() == limit)
+            return true;
+        children.push_back(*it);
+    }
+    return false;
+}
+
 /**
  * Wrapper around LeaderRPC::call() that repackages a timeout as a
  * ReadOnlyTree status and error message.
@@ -145,10 +194,10 @@ treeCall(LeaderRPCBase& leaderRPC,
             VERBOSE("Timeout elapsed on read-only tree query");
             break;
         case LeaderRPC::Status::INVALID_REQUEST:
-            // TODO(ongaro): Once any new Tree request types are introduced,
-            // this PANIC will need to move up the call stack, so that we can
-            // try a new-style request and then ask for forgiveness if it
-            // fails. Same for the read-write tree calls below.
+            // TODO(ongaro): Once any new read-only Tree request types are
+            // introduced, this PANIC will need to move up the call stack, so
+            // that we can try a new-style request and then ask for
+            // forgiveness if it fails, as for the read-write calls below.
             PANIC("The server and/or replicated state machine doesn't support "
                   "the read-only tree query or claims the request is "
                   "malformed. Request is: %s",
@@ -196,10 +245,19 @@ treeCall(LeaderRPCBase& leaderRPC,
             VERBOSE("Timeout elapsed on read-write tree command");
             break;
         case LeaderRPC::Status::INVALID_REQUEST:
-            PANIC("The server and/or replicated state machine doesn't support "
-                  "the read-write tree command or claims the request is "
-                  "malformed. Request is: %s",
-                  Core::ProtoBuf::dumpString(request).c_str());
+            // Newer commands (such as Increment) are rejected by clusters
+            // running older state machine versions. This shouldn't happen for
+            // the commands that have been around since version 1.
+            response.set_status(Protocol::Client::Status::INVALID_ARGUMENT);
+            response.set_error("The server and/or replicated state machine "
+                               "doesn't support this read-write tree command "
+                               "or claims the request is malformed. Consider "
+                               "upgrading your servers.");
+            WARNING("The server and/or replicated state machine doesn't "
+                    "support the read-write tree command or claims the "
+                    "request is malformed. Request is: %s",
+                    Core::ProtoBuf::dumpString(request).c_str());
+            break;
     }
 }
 
@@ -713,8 +771,25 @@ ClientImpl::listDirectory(const std::string& path,
                           const Condition& condition,
                           TimePoint timeout,
                           std::vector<std::string>& children)
+{
+    bool more;
+    return listDirectory(path, workingDirectory, condition, timeout,
+                         "", "", 0, children, more);
+}
+
+Result
+ClientImpl::listDirectory(const std::string& path,
+                          const std::string& workingDirectory,
+                          const Condition& condition,
+                          TimePoint timeout,
+                          const std::string& prefix,
+                          const std::string& startAfter,
+                          uint64_t limit,
+                          std::vector<std::string>& children,
+                          bool& more)
 {
     children.clear();
+    more = false;
     std::string realPath;
     Result result = canonicalize(path, workingDirectory, realPath);
     if (result.status != Status::OK)
@@ -722,14 +797,28 @@ ClientImpl::listDirectory(const std::string& path,
     Protocol::Client::ReadOnlyTree::Request request;
     setCondition(request, condition);
     request.mutable_list_directory()->set_path(realPath);
+    if (!prefix.empty())
+        request.mutable_list_directory()->set_prefix(prefix);
+    if (!startAfter.empty())
+        request.mutable_list_directory()->set_start_after(startAfter);
+    if (limit > 0)
+        request.mutable_list_directory()->set_limit(limit);
     Protocol::Client::ReadOnlyTree::Response response;
     treeCall(*leaderRPC,
              request, response, timeout);
     if (response.status() != Protocol::Client::Status::OK)
         return treeError(response);
-    children = std::vector<std::string>(
+    std::vector<std::string> listed(
                     response.list_directory().child().begin(),
                     response.list_directory().child().end());
+    if (response.list_directory().has_more()) {
+        children = std::move(listed);
+        more = response.list_directory().more();
+    } else {
+        // Older servers ignore prefix, start_after, and limit and return
+        // every child.
+        more = filterChildren(listed, prefix, startAfter, limit, children);
+    }
     return Result();
 }
 
@@ -783,6 +872,34 @@ ClientImpl::write(const std::string& path,
     return Result();
 }
 
+Result
+ClientImpl::write(const std::string& path,
+                  const std::string& workingDirectory,
+                  uint64_t offset,
+                  const std::string& contents,
+                  const Condition& condition,
+                  TimePoint timeout)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    Protocol::Client::ReadWriteTree::Request request;
+    *request.mutable_exactly_once() =
+        exactlyOnceRPCHelper.getRPCInfo(timeout);
+    setCondition(request, condition);
+    request.mutable_write()->set_path(realPath);
+    request.mutable_write()->set_contents(contents);
+    request.mutable_write()->set_offset(offset);
+    Protocol::Client::ReadWriteTree::Response response;
+    treeCall(*leaderRPC,
+             request, response, timeout);
+    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
+    if (response.status() != Protocol::Client::Status::OK)
+        return treeError(response);
+    return Result();
+}
+
 Result
 ClientImpl::read(const std::string& path,
                  const std::string& workingDirectory,
@@ -807,6 +924,45 @@ ClientImpl::read(const std::string& path,
     return Result();
 }
 
+Result
+ClientImpl::read(const std::string& path,
+                 const std::string& workingDirectory,
+                 const Condition& condition,
+                 TimePoint timeout,
+                 uint64_t offset,
+                 uint64_t length,
+                 std::string& contents,
+                 uint64_t& size)
+{
+    contents = "";
+    size = 0;
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    Protocol::Client::ReadOnlyTree::Request request;
+    setCondition(request, condition);
+    request.mutable_read()->set_path(realPath);
+    request.mutable_read()->set_offset(offset);
+    request.mutable_read()->set_length(length);
+    Protocol::Client::ReadOnlyTree::Response response;
+    treeCall(*leaderRPC,
+             request, response, timeout);
+    if (response.status() != Protocol::Client::Status::OK)
+        return treeError(response);
+    if (response.read().has_size()) {
+        contents = response.read().contents();
+        size = response.read().size();
+    } else {
+        // Older servers ignore the range and return the entire file.
+        const std::string& whole = response.read().contents();
+        size = whole.size();
+        if (offset < size)
+            contents = whole.substr(offset, length == 0 ? size : length);
+    }
+    return Result();
+}
+
 Result
 ClientImpl::removeFile(const std::string& path,
                        const std::string& workingDirectory,
@@ -831,6 +987,157 @@ ClientImpl::removeFile(const std::string& path,
     return Result();
 }
 
+Result
+ClientImpl::increment(const std::string& path,
+                      const std::string& workingDirectory,
+                      int64_t delta,
+                      const Condition& condition,
+                      TimePoint timeout,
+                      int64_t& value)
+{
+    value = 0;
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    Protocol::Client::ReadWriteTree::Request request;
+    *request.mutable_exactly_once() =
+        exactlyOnceRPCHelper.getRPCInfo(timeout);
+    setCondition(request, condition);
+    request.mutable_increment()->set_path(realPath);
+    request.mutable_increment()->set_delta(delta);
+    Protocol::Client::ReadWriteTree::Response response;
+    treeCall(*leaderRPC,
+             request, response, timeout);
+    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
+    if (response.status() != Protocol::Client::Status::OK)
+        return treeError(response);
+    value = response.increment().value();
+    return Result();
+}
+
+Result
+ClientImpl::append(const std::string& path,
+                   const std::string& workingDirectory,
+                   const std::string& contents,
+                   const Condition& condition,
+                   TimePoint timeout)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    Protocol::Client::ReadWriteTree::Request request;
+    *request.mutable_exactly_once() =
+        exactlyOnceRPCHelper.getRPCInfo(timeout);
+    setCondition(request, condition);
+    request.mutable_append()->set_path(realPath);
+    request.mutable_append()->set_contents(contents);
+    Protocol::Client::ReadWriteTree::Response response;
+    treeCall(*leaderRPC,
+             request, response, timeout);
+    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
+    if (response.status() != Protocol::Client::Status::OK)
+        return treeError(response);
+    return Result();
+}
+
+Result
+ClientImpl::createSequential(const std::string& path,
+                             const std::string& workingDirectory,
+                             const std::string& contents,
+                             const Condition& condition,
+                             TimePoint timeout,
+                             std::string& created)
+{
+    created.clear();
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    // canonicalize() drops trailing slashes, but the server needs it to tell
+    // a directory apart from a name prefix.
+    if (Core::StringUtil::endsWith(path, "/") && realPath != "/")
+        realPath += "/";
+    Protocol::Client::ReadWriteTree::Request request;
+    *request.mutable_exactly_once() =
+        exactlyOnceRPCHelper.getRPCInfo(timeout);
+    setCondition(request, condition);
+    request.mutable_create_sequential()->set_path(realPath);
+    request.mutable_create_sequential()->set_contents(contents);
+    Protocol::Client::ReadWriteTree::Response response;
+    treeCall(*leaderRPC,
+             request, response, timeout);
+    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
+    if (response.status() != Protocol::Client::Status::OK)
+        return treeError(response);
+    created = response.create_sequential().path();
+    return Result();
+}
+
+Result
+ClientImpl::watch(const std::string& path,
+                  const std::string& workingDirectory,
+                  bool recursive,
+                  uint64_t afterIndex,
+                  TimePoint timeout,
+                  uint64_t& index)
+{
+    index = 0;
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    Protocol::Client::StateMachineQuery::Request qrequest;
+    Protocol::Client::WatchTree::Request& request = *qrequest.mutable_watch();
+    request.set_path(realPath);
+    request.set_recursive(recursive);
+
+    // Each long-poll ends after the server's maximum watch timeout with
+    // 'changed' unset; keep asking until something changes or the
+    // client-specified timeout elapses.
+    while (true) {
+        uint64_t timeoutMs = 0; // server's maximum
+        if (timeout != TimePoint::max()) {
+            TimePoint now = Clock::now();
+            if (now >= timeout)
+                break;
+            timeoutMs = uint64_t(std::chrono::duration_cast<
+                std::chrono::milliseconds>(timeout - now).count()) + 1;
+        }
+        request.set_after_index(afterIndex);
+        request.set_timeout_ms(timeoutMs);
+        VERBOSE("Calling watch query with request:\n%s",
+                Core::StringUtil::trim(
+                    Core::ProtoBuf::dumpString(request)).c_str());
+        Protocol::Client::StateMachineQuery::Response qresponse;
+        LeaderRPC::Status status =
+            leaderRPC->call(OpCode::STATE_MACHINE_QUERY,
+                            qrequest, qresponse, timeout);
+        if (status == LeaderRPC::Status::TIMEOUT)
+            break;
+        if (status == LeaderRPC::Status::INVALID_REQUEST) {
+            result.status = Status::INVALID_ARGUMENT;
+            result.error = "The cluster does not support watches (they "
+                           "were introduced in LogCabin v1.2.0)";
+            return result;
+        }
+        const Protocol::Client::WatchTree::Response& response =
+            qresponse.watch();
+        if (response.status() != Protocol::Client::Status::OK)
+            return treeError(response);
+        if (response.changed()) {
+            index = response.index();
+            return Result();
+        }
+        afterIndex = std::max(afterIndex, response.index());
+    }
+    VERBOSE("Timeout elapsed on watch query");
+    result.status = Status::TIMEOUT;
+    result.error = "Client-specified timeout elapsed";
+    return result;
+}
+
 Result
 ClientImpl::serverControl(const std::string& host,
                           TimePoint timeout,
@@ -124,6 +124,17 @@ class ClientImpl {
                          TimePoint timeout,
                          std::vector<std::string>& children);
 
+    /// See Tree::listDirectory (paginated version).
+    Result listDirectory(const std::string& path,
+                         const std::string& workingDirectory,
+                         const Condition& condition,
+                         TimePoint timeout,
+                         const std::string& prefix,
+                         const std::string& startAfter,
+                         uint64_t limit,
+                         std::vector<std::string>& children,
+                         bool& more);
+
     /// See Tree::removeDirectory.
     Result removeDirectory(const std::string& path,
                            const std::string& workingDirectory,
@@ -137,6 +148,14 @@ class ClientImpl {
                  const Condition& condition,
                  TimePoint timeout);
 
+    /// See Tree::write (ranged version).
+    Result write(const std::string& path,
+                 const std::string& workingDirectory,
+                 uint64_t offset,
+                 const std::string& contents,
+                 const Condition& condition,
+                 TimePoint timeout);
+
     /// See Tree::read.
     Result read(const std::string& path,
                 const std::string& workingDirectory,
@@ -144,12 +163,53 @@ class ClientImpl {
                 TimePoint timeout,
                 std::string& contents);
 
+    /// See Tree::read (ranged version).
+    Result read(const std::string& path,
+                const std::string& workingDirectory,
+                const Condition& condition,
+                TimePoint timeout,
+                uint64_t offset,
+                uint64_t length,
+                std::string& contents,
+                uint64_t& size);
+
     /// See Tree::removeFile.
     Result removeFile(const std::string& path,
                       const std::string& workingDirectory,
                       const Condition& condition,
                       TimePoint timeout);
 
+    /// See Tree::increment.
+    Result increment(const std::string& path,
+                     const std::string& workingDirectory,
+                     int64_t delta,
+                     const Condition& condition,
+                     TimePoint timeout,
+                     int64_t& value);
+
+    /// See Tree::append.
+    Result append(const std::string& path,
+                  const std::string& workingDirectory,
+                  const std::string& contents,
+                  const Condition& condition,
+                  TimePoint timeout);
+
+    /// See Tree::createSequential.
+    Result createSequential(const std::string& path,
+                            const std::string& workingDirectory,
+                            const std::string& contents,
+                            const Condition& condition,
+                            TimePoint timeout,
+                            std::string& created);
+
+    /// See Tree::watch.
+    Result watch(const std::string& path,
+                 const std::string& workingDirectory,
+                 bool recursive,
+                 uint64_t afterIndex,
+                 TimePoint timeout,
+                 uint64_t& index);
+
     /**
      * Low-level interface to ServerControl service used by
      * Client/ServerControl.cc.
@@ -345,6 +345,56 @@ TEST_F(ClientClientImplTest, listDirectory_timeout) {
     EXPECT_EQ(std::vector<std::string> { }, children);
 }
 
+TEST_F(ClientClientImplTest, listDirectory_olderServer) {
+    typedef Client::LeaderRPCMock::OpCode OpCode;
+    Client::LeaderRPCMock* mockRPC = new Client::LeaderRPCMock();
+    client.leaderRPC = std::unique_ptr<Client::LeaderRPCBase>(mockRPC);
+    // Older servers list every child and leave 'more' unset.
+    Protocol::Client::StateMachineQuery::Response all =
+        fromString<Protocol::Client::StateMachineQuery::Response>(
+            "tree { status: OK, list_directory { "
+            "  child: ['ab/', 'b/', 'a', 'ab', 'abc', 'b'] } }");
+    std::vector<std::string> children;
+    bool more = false;
+
+    mockRPC->expect(OpCode::STATE_MACHINE_QUERY, all);
+    EXPECT_EQ(Client::Status::OK,
+              client.listDirectory("/", "/", Client::Condition {"", ""},
+                                   TimePoint::max(), "a", "", 2,
+                                   children, more).status);
+    EXPECT_EQ((std::vector<std::string>{ "ab/", "a" }), children);
+    EXPECT_TRUE(more);
+
+    mockRPC->expect(OpCode::STATE_MACHINE_QUERY, all);
+    EXPECT_EQ(Client::Status::OK,
+              client.listDirectory("/", "/", Client::Condition {"", ""},
+                                   TimePoint::max(), "a", "a", 2,
+                                   children, more).status);
+    EXPECT_EQ((std::vector<std::string>{ "ab", "abc" }), children);
+    EXPECT_FALSE(more);
+
+    mockRPC->expect(OpCode::STATE_MACHINE_QUERY, all);
+    EXPECT_EQ(Client::Status::OK,
+              client.listDirectory("/", "/", Client::Condition {"", ""},
+                                   TimePoint::max(), "", "ab/", 0,
+                                   children, more).status);
+    EXPECT_EQ((std::vector<std::string>{ "b/", "a", "ab", "abc", "b" }),
+              children);
+    EXPECT_FALSE(more);
+
+    // Newer servers' listings are used as is.
+    mockRPC->expect(OpCode::STATE_MACHINE_QUERY,
+        fromString<Protocol::Client::StateMachineQuery::Response>(
+            "tree { status: OK, list_directory { "
+            "  child: ['ab/', 'a'], more: false } }"));
+    EXPECT_EQ(Client::Status::OK,
+              client.listDirectory("/", "/", Client::Condition {"", ""},
+                                   TimePoint::max(), "a", "", 1,
+                                   children, more).status);
+    EXPECT_EQ((std::vector<std::string>{ "ab/", "a" }), children);
+    EXPECT_FALSE(more);
+}
+
 TEST_F(ClientClientImplServiceMockTest, serverControl) {
     Protocol::ServerControl::ServerInfoGet::Request request;
     Protocol::ServerControl::ServerInfoGet::Response response;
@@ -195,6 +195,63 @@ TEST_F(ClientTreeTest, listDirectory)
               children);
 }
 
+TEST_F(ClientTreeTest, listDirectory_paginated)
+{
+    std::vector<std::string> children;
+    bool more = true;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.listDirectory("/..", "", "", 1, children, more).status);
+    EXPECT_FALSE(more);
+    EXPECT_OK(tree.makeDirectory("/foo"));
+    EXPECT_OK(tree.write("/bar", "x"));
+    EXPECT_OK(tree.write("/baz", "x"));
+    EXPECT_OK(tree.listDirectory("/", "", "", 2, children, more));
+    EXPECT_EQ((std::vector<std::string>{"foo/", "bar"}),
+              children);
+    EXPECT_TRUE(more);
+    EXPECT_OK(tree.listDirectory("/", "ba", "bar", 2, children, more));
+    EXPECT_EQ((std::vector<std::string>{"baz"}),
+              children);
+    EXPECT_FALSE(more);
+    EXPECT_EQ((std::vector<std::string>{"bar", "baz"}),
+              tree.listDirectoryEx("/", "ba", "", 0, more));
+    EXPECT_THROW(tree.listDirectoryEx("/..", "", "", 0, more),
+                 Client::InvalidArgumentException);
+}
+
+TEST_F(ClientTreeTest, DirectoryIterator)
+{
+    EXPECT_OK(tree.makeDirectory("/d"));
+    for (uint32_t i = 0; i < 10; ++i)
+        EXPECT_OK(tree.write(format("/d/f%u", i), "x"));
+    EXPECT_OK(tree.makeDirectory("/d/g"));
+    std::vector<std::string> expected =
+        tree.listDirectoryEx("/d");
+    for (uint64_t pageSize = 0; pageSize < 13; ++pageSize) {
+        Client::DirectoryIterator it(tree, "/d", "", pageSize);
+        std::vector<std::string> actual;
+        std::string child;
+        while (it.nextEx(child))
+            actual.push_back(child);
+        EXPECT_EQ("", child);
+        EXPECT_FALSE(it.nextEx(child));
+        EXPECT_EQ(expected, actual) << "pageSize " << pageSize;
+    }
+
+    Client::DirectoryIterator prefixIt(tree, "/d", "g", 1);
+    std::string child;
+    bool done = true;
+    EXPECT_OK(prefixIt.next(child, done));
+    EXPECT_FALSE(done);
+    EXPECT_EQ("g/", child);
+    EXPECT_OK(prefixIt.next(child, done));
+    EXPECT_TRUE(done);
+    EXPECT_EQ("", child);
+
+    Client::DirectoryIterator badIt(tree, "/d/f0");
+    EXPECT_THROW(badIt.nextEx(child), Client::TypeException);
+}
+
 TEST_F(ClientTreeTest, removeDirectory)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT,
@@ -217,6 +274,17 @@ TEST_F(ClientTreeTest, write)
     EXPECT_EQ("bar", contents);
 }
 
+TEST_F(ClientTreeTest, write_range)
+{
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.write("/..", 0, "bar").status);
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.write("/foo", 1, "bar").status);
+    EXPECT_OK(tree.write("/foo", 0, "bar"));
+    tree.writeEx("/foo", 2, "zaar");
+    EXPECT_EQ("bazaar", tree.readEx("/foo"));
+}
+
 TEST_F(ClientTreeTest, read)
 {
     std::string contents;
@@ -227,6 +295,19 @@ TEST_F(ClientTreeTest, read)
     EXPECT_EQ("bar", contents);
 }
 
+TEST_F(ClientTreeTest, read_range)
+{
+    std::string contents;
+    uint64_t size = 0;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.read("/..", 0, 0, contents, size).status);
+    EXPECT_OK(tree.write("/foo", "bazaar"));
+    EXPECT_OK(tree.read("/foo", 1, 2, contents, size));
+    EXPECT_EQ("az", contents);
+    EXPECT_EQ(6U, size);
+    EXPECT_EQ("aar", tree.readEx("/foo", 3, 0, size));
+}
+
 TEST_F(ClientTreeTest, removeFile)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT,
@@ -239,6 +320,58 @@ TEST_F(ClientTreeTest, removeFile)
               children);
 }
 
+TEST_F(ClientTreeTest, increment)
+{
+    int64_t value = 3;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.increment("/..", 1, value).status);
+    EXPECT_EQ(0, value);
+    EXPECT_OK(tree.increment("/foo", 4, value));
+    EXPECT_EQ(4, value);
+    EXPECT_EQ(-1, tree.incrementEx("/foo", -5));
+    EXPECT_EQ("-1", tree.readEx("/foo"));
+    tree.writeEx("/foo", "bar");
+    EXPECT_EQ(Status::TYPE_ERROR,
+              tree.increment("/foo", 1, value).status);
+}
+
+TEST_F(ClientTreeTest, append)
+{
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.append("/..", "bar").status);
+    EXPECT_OK(tree.append("/foo", "bar"));
+    tree.appendEx("/foo", "baz");
+    EXPECT_EQ("barbaz", tree.readEx("/foo"));
+}
+
+TEST_F(ClientTreeTest, createSequential)
+{
+    std::string created;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.createSequential("/..", "bar", created).status);
+    EXPECT_OK(tree.makeDirectory("/q"));
+    EXPECT_OK(tree.createSequential("/q/item-", "a", created));
+    EXPECT_EQ("/q/item-0000000000", created);
+    EXPECT_EQ("/q/0000000001", tree.createSequentialEx("/q/", "b"));
+    tree.setWorkingDirectory("/q");
+    EXPECT_EQ("/q/0000000002", tree.createSequentialEx("./", "c"));
+    EXPECT_EQ("/q/x-0000000003", tree.createSequentialEx("x-", "d"));
+    EXPECT_EQ("a", tree.readEx("/q/item-0000000000"));
+    EXPECT_EQ("c", tree.readEx("/q/0000000002"));
+}
+
+TEST_F(ClientTreeTest, watch)
+{
+    uint64_t index = 7;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.watch("/..", false, 0, index).status);
+    EXPECT_EQ(0U, index);
+    // the mock cluster reports a change right away
+    EXPECT_OK(tree.watch("/foo", true, 0, index));
+    EXPECT_EQ(1U, index);
+    EXPECT_EQ(4U, tree.watchEx("/foo", false, 3));
+}
+
 TEST_F(ClientTreeTest, conditions)
 {
     tree.setCondition("/a", "c");
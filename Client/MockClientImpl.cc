@@ -79,6 +79,14 @@ class TreeLeaderRPC : public LeaderRPCBase {
                 LogCabin::Tree::ProtoBuf::readOnlyTreeRPC(
                     tree, qrequest.tree(), *qresponse.mutable_tree());
                 return Status::OK;
+            } else if (qrequest.has_watch()) {
+                // There is no log to wait on: report a change right away.
+                PC::WatchTree::Response& wresponse =
+                    *qresponse.mutable_watch();
+                wresponse.set_status(PC::Status::OK);
+                wresponse.set_index(qrequest.watch().after_index() + 1);
+                wresponse.set_changed(true);
+                return Status::OK;
             }
         } else if (opCode == OpCode::STATE_MACHINE_COMMAND) {
             PC::StateMachineCommand::Request crequest;
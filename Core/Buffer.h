@@ -119,6 +119,12 @@ class Buffer {
      */
     uint64_t getLength() const { return length; }
 
+    /**
+     * Return the deleter for the data, or NULL if the memory is managed
+     * externally.
+     */
+    Deleter getDeleter() const { return deleter; }
+
     /**
      * Replace the data contained in this Buffer.
      * The memory for the previously existing data, if any, will be reclaimed
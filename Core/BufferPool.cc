@@ -0,0 +1,306 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <pthread.h>
+#include <vector>
+
+#include "Core/BufferPool.h"
+#include "Core/CompatAtomic.h"
+#include "Core/Debug.h"
+
+namespace LogCabin {
+namespace Core {
+namespace BufferPool {
+
+namespace Internal {
+
+static_assert((MIN_BLOCK_BYTES << (NUM_CLASSES - 1)) == MAX_BLOCK_BYTES,
+              "NUM_CLASSES doesn't match MIN_BLOCK_BYTES and MAX_BLOCK_BYTES");
+
+/**
+ * Roughly how many bytes of free blocks each thread may cache for each size
+ * class. The shared cache holds up to SHARED_CACHE_FACTOR times as much.
+ */
+const uint64_t THREAD_CACHE_BYTES = 256 * 1024;
+
+/**
+ * See THREAD_CACHE_BYTES.
+ */
+const uint64_t SHARED_CACHE_FACTOR = 8;
+
+/**
+ * Precedes the memory handed out by allocate(). It's 16 bytes so that the
+ * memory that follows stays as aligned as malloc's.
+ */
+struct BlockHeader {
+    /**
+     * The size class of the block, or UNPOOLED.
+     */
+    uint32_t sizeClass;
+    uint32_t unused0;
+    uint64_t unused1;
+};
+static_assert(sizeof(BlockHeader) == 16, "BlockHeader should be 16 bytes");
+
+/**
+ * Return the number of usable bytes in blocks of the given size class.
+ */
+uint64_t
+classBytes(uint32_t sizeClass)
+{
+    return MIN_BLOCK_BYTES << sizeClass;
+}
+
+uint32_t
+classFor(uint64_t length)
+{
+    uint32_t sizeClass = 0;
+    while (sizeClass < NUM_CLASSES && classBytes(sizeClass) < length)
+        ++sizeClass;
+    return sizeClass;
+}
+
+uint64_t
+threadCacheLimit(uint32_t sizeClass)
+{
+    return std::max(uint64_t(4), THREAD_CACHE_BYTES / classBytes(sizeClass));
+}
+
+std::atomic<uint64_t> numAllocations(0);
+std::atomic<uint64_t> numMallocs(0);
+std::atomic<uint64_t> numFrees(0);
+
+/**
+ * Get a block from the system.
+ */
+BlockHeader*
+mallocBlock(uint32_t sizeClass, uint64_t length)
+{
+    void* memory = malloc(sizeof(BlockHeader) + length);
+    if (memory == NULL)
+        PANIC("Could not allocate %lu bytes", sizeof(BlockHeader) + length);
+    numMallocs.fetch_add(1, std::memory_order_relaxed);
+    BlockHeader* block = static_cast<BlockHeader*>(memory);
+    block->sizeClass = sizeClass;
+    return block;
+}
+
+/**
+ * Give a block back to the system.
+ */
+void
+freeBlock(BlockHeader* block)
+{
+    numFrees.fetch_add(1, std::memory_order_relaxed);
+    free(block);
+}
+
+/**
+ * Free blocks shared by all threads.
+ */
+struct SharedCache {
+    SharedCache()
+        : mutex()
+        , blocks()
+    {
+        // A child process forked while another thread holds #mutex, such as
+        // the snapshot process, would block forever the first time its
+        // thread cache ran dry. Holding #mutex across fork() avoids that.
+        int err = pthread_atfork(lockSharedCache,
+                                 unlockSharedCache,
+                                 unlockSharedCache);
+        if (err != 0) {
+            PANIC("Failed to set up pthread_atfork() handler for the buffer "
+                  "pool: %s", strerror(err));
+        }
+    }
+    /**
+     * Protects #blocks.
+     */
+    std::mutex mutex;
+    /**
+     * Free blocks indexed by size class.
+     */
+    std::vector<BlockHeader*> blocks[NUM_CLASSES];
+};
+
+/**
+ * Return the shared cache. This is never destroyed, since Buffers owned by
+ * other static objects may be released during exit.
+ */
+SharedCache&
+getSharedCache()
+{
+    static SharedCache* shared = new SharedCache();
+    return *shared;
+}
+
+/**
+ * Move blocks from 'from' into the shared cache, until the shared cache is
+ * full or 'from' has only 'keep' blocks left. Any blocks beyond 'keep' that
+ * don't fit are freed.
+ */
+void
+flushToShared(uint32_t sizeClass,
+              std::vector<BlockHeader*>& from,
+              uint64_t keep)
+{
+    SharedCache& shared = getSharedCache();
+    uint64_t sharedLimit = SHARED_CACHE_FACTOR * threadCacheLimit(sizeClass);
+    std::lock_guard<std::mutex> lockGuard(shared.mutex);
+    std::vector<BlockHeader*>& to = shared.blocks[sizeClass];
+    while (from.size() > keep) {
+        if (to.size() < sharedLimit)
+            to.push_back(from.back());
+        else
+            freeBlock(from.back());
+        from.pop_back();
+    }
+}
+
+/**
+ * Set once the calling thread's cache has been destroyed during thread exit;
+ * after that, released blocks go straight to the shared cache.
+ */
+__thread bool threadCacheDestroyed = false;
+
+/**
+ * Free blocks cached by one thread. This needs no locking.
+ */
+struct ThreadCache {
+    ThreadCache()
+        : blocks()
+    {
+    }
+    ~ThreadCache() {
+        for (uint32_t sizeClass = 0; sizeClass < NUM_CLASSES; ++sizeClass)
+            flushToShared(sizeClass, blocks[sizeClass], 0);
+        threadCacheDestroyed = true;
+    }
+    /**
+     * Free blocks indexed by size class.
+     */
+    std::vector<BlockHeader*> blocks[NUM_CLASSES];
+};
+
+thread_local ThreadCache threadCache;
+
+void
+lockSharedCache()
+{
+    getSharedCache().mutex.lock();
+}
+
+void
+unlockSharedCache()
+{
+    getSharedCache().mutex.unlock();
+}
+
+uint64_t
+numThreadCached(uint32_t sizeClass)
+{
+    return threadCache.blocks[sizeClass].size();
+}
+
+uint64_t
+numSharedCached(uint32_t sizeClass)
+{
+    SharedCache& shared = getSharedCache();
+    std::lock_guard<std::mutex> lockGuard(shared.mutex);
+    return shared.blocks[sizeClass].size();
+}
+
+} // namespace LogCabin::Core::BufferPool::Internal
+using namespace Internal; // NOLINT
+
+void*
+allocate(uint64_t length)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    uint32_t sizeClass = classFor(length);
+    BlockHeader* block = NULL;
+    if (sizeClass == UNPOOLED) {
+        block = mallocBlock(UNPOOLED, length);
+    } else if (threadCacheDestroyed) {
+        block = mallocBlock(sizeClass, classBytes(sizeClass));
+    } else {
+        std::vector<BlockHeader*>& cached = threadCache.blocks[sizeClass];
+        if (cached.empty()) {
+            // Refill half of the thread's cache from the shared cache.
+            SharedCache& shared = getSharedCache();
+            std::lock_guard<std::mutex> lockGuard(shared.mutex);
+            std::vector<BlockHeader*>& from = shared.blocks[sizeClass];
+            uint64_t count = std::min(uint64_t(from.size()),
+                                      threadCacheLimit(sizeClass) / 2);
+            cached.insert(cached.end(),
+                          from.end() - int64_t(count),
+                          from.end());
+            from.resize(from.size() - count);
+        }
+        if (cached.empty()) {
+            block = mallocBlock(sizeClass, classBytes(sizeClass));
+        } else {
+            block = cached.back();
+            cached.pop_back();
+        }
+    }
+    return block + 1;
+}
+
+void
+allocate(Buffer& buffer, uint64_t length)
+{
+    buffer.setData(allocate(length), length, release);
+}
+
+void
+release(void* data)
+{
+    if (data == NULL)
+        return;
+    BlockHeader* block = static_cast<BlockHeader*>(data) - 1;
+    uint32_t sizeClass = block->sizeClass;
+    if (sizeClass == UNPOOLED) {
+        freeBlock(block);
+    } else if (threadCacheDestroyed) {
+        std::vector<BlockHeader*> one(1, block);
+        flushToShared(sizeClass, one, 0);
+    } else {
+        std::vector<BlockHeader*>& cached = threadCache.blocks[sizeClass];
+        cached.push_back(block);
+        uint64_t limit = threadCacheLimit(sizeClass);
+        if (cached.size() > limit)
+            flushToShared(sizeClass, cached, limit / 2);
+    }
+}
+
+Stats
+getStats()
+{
+    Stats stats;
+    stats.numAllocations = numAllocations.load(std::memory_order_relaxed);
+    stats.numMallocs = numMallocs.load(std::memory_order_relaxed);
+    stats.numFrees = numFrees.load(std::memory_order_relaxed);
+    return stats;
+}
+
+} // namespace LogCabin::Core::BufferPool
+} // namespace LogCabin::Core
+} // namespace LogCabin
@@ -0,0 +1,158 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cinttypes>
+
+#include "Core/Buffer.h"
+
+#ifndef LOGCABIN_CORE_BUFFERPOOL_H
+#define LOGCABIN_CORE_BUFFERPOOL_H
+
+namespace LogCabin {
+namespace Core {
+
+/**
+ * Recycles the memory used for message buffers, to avoid a trip to malloc for
+ * every RPC request and response.
+ *
+ * Requests are rounded up to one of several power-of-two size classes. Freed
+ * blocks go to a small cache for the current thread, with no locking; when
+ * that cache fills up or runs dry, blocks move in batches to or from a shared
+ * cache protected by a mutex. Requests larger than the largest size class
+ * bypass the pool.
+ *
+ * Memory from allocate() may be released on any thread.
+ */
+namespace BufferPool {
+
+/**
+ * The smallest size class, in bytes.
+ */
+const uint64_t MIN_BLOCK_BYTES = 64;
+
+/**
+ * The largest size class, in bytes. Larger requests go straight to malloc.
+ */
+const uint64_t MAX_BLOCK_BYTES = 1024 * 1024;
+
+/**
+ * Allocate memory from the pool.
+ * \param length
+ *      The number of bytes needed.
+ * \return
+ *      At least 'length' bytes of memory, aligned for any type. This must be
+ *      released with release().
+ */
+void* allocate(uint64_t length);
+
+/**
+ * Return memory to the pool. This may be used as a Buffer::Deleter.
+ * \param data
+ *      Memory returned by allocate(), or NULL.
+ */
+void release(void* data);
+
+/**
+ * Set the contents of a Buffer to a fresh allocation from the pool, with
+ * release() as its deleter. The contents of the memory are unspecified.
+ * \param buffer
+ *      Its existing contents are released first.
+ * \param length
+ *      The number of bytes needed.
+ */
+void allocate(Buffer& buffer, uint64_t length);
+
+/**
+ * Counters describing the pool's use since the process started. These are
+ * useful for benchmarks and tests.
+ */
+struct Stats {
+    /**
+     * The number of calls to allocate().
+     */
+    uint64_t numAllocations;
+    /**
+     * The number of those calls that needed new memory from malloc, either
+     * because no cached block was available or because the request was too
+     * large for the pool.
+     */
+    uint64_t numMallocs;
+    /**
+     * The number of blocks the pool has given back to the system with free.
+     */
+    uint64_t numFrees;
+};
+
+/**
+ * Return the pool's counters.
+ */
+Stats getStats();
+
+/**
+ * Exposed for unit testing.
+ */
+namespace Internal {
+
+/**
+ * Size classes are MIN_BLOCK_BYTES, twice that, and so on up to
+ * MAX_BLOCK_BYTES.
+ */
+const uint32_t NUM_CLASSES = 15;
+
+/**
+ * Marks blocks that are too large for any size class.
+ */
+const uint32_t UNPOOLED = NUM_CLASSES;
+
+/**
+ * Return the smallest size class that can hold 'length' bytes, or UNPOOLED.
+ */
+uint32_t classFor(uint64_t length);
+
+/**
+ * Return the maximum number of blocks a thread caches for the size class.
+ */
+uint64_t threadCacheLimit(uint32_t sizeClass);
+
+/**
+ * Return the number of free blocks of the size class cached by the calling
+ * thread.
+ */
+uint64_t numThreadCached(uint32_t sizeClass);
+
+/**
+ * Return the number of free blocks of the size class in the shared cache.
+ */
+uint64_t numSharedCached(uint32_t sizeClass);
+
+/**
+ * Acquire the shared cache's mutex. This is called before fork(), so that
+ * the child process doesn't inherit it locked by some other thread.
+ */
+void lockSharedCache();
+
+/**
+ * Release the shared cache's mutex. This is called after fork() in both the
+ * parent and the child.
+ */
+void unlockSharedCache();
+
+} // namespace LogCabin::Core::BufferPool::Internal
+
+} // namespace LogCabin::Core::BufferPool
+} // namespace LogCabin::Core
+} // namespace LogCabin
+
+#endif /* LOGCABIN_CORE_BUFFERPOOL_H */
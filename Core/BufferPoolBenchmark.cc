@@ -0,0 +1,280 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "build/Protocol/Raft.pb.h"
+#include "Core/BufferPool.h"
+#include "Core/CompatAtomic.h"
+#include "Core/ProtoBuf.h"
+#include "Core/StringUtil.h"
+#include "Core/Time.h"
+#include "Core/Util.h"
+
+namespace {
+
+/**
+ * The number of calls to operator new and new[] in this process.
+ */
+std::atomic<uint64_t> numNews(0);
+
+} // anonymous namespace
+
+// Count every allocation made through operator new, including those made by
+// the protobuf library.
+void*
+operator new(size_t size)
+{
+    numNews.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void*
+operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void
+operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+namespace {
+
+using namespace LogCabin;
+using Core::StringUtil::format;
+
+/**
+ * Parses argv for the main function.
+ */
+class OptionParser {
+  public:
+    OptionParser(int& argc, char**& argv)
+        : argc(argc)
+        , argv(argv)
+        , messages(1000000)
+        , size(1024)
+        , threads(1)
+    {
+        while (true) {
+            static struct option longOptions[] = {
+               {"help",  no_argument, NULL, 'h'},
+               {"messages",  required_argument, NULL, 'm'},
+               {"size",  required_argument, NULL, 's'},
+               {"threads",  required_argument, NULL, 't'},
+               {0, 0, 0, 0}
+            };
+            int c = getopt_long(argc, argv, "hm:s:t:", longOptions, NULL);
+
+            // Detect the end of the options.
+            if (c == -1)
+                break;
+
+            switch (c) {
+                case 'h':
+                    usage();
+                    exit(0);
+                case 'm':
+                    messages = parseUInt(optarg);
+                    break;
+                case 's':
+                    size = parseUInt(optarg);
+                    break;
+                case 't':
+                    threads = std::max(1UL, parseUInt(optarg));
+                    break;
+                case '?':
+                default:
+                    // getopt_long already printed an error message.
+                    usage();
+                    exit(1);
+            }
+        }
+
+        // We don't expect any additional command line arguments (not options).
+        if (optind != argc) {
+            usage();
+            exit(1);
+        }
+    }
+
+    uint64_t parseUInt(const char* s) {
+        char* end = NULL;
+        uint64_t value = strtoul(s, &end, 10);
+        if (*s == '\0' || *end != '\0') {
+            std::cerr << "Expected a non-negative integer, got '"
+                      << s << "'" << std::endl;
+            usage();
+            exit(1);
+        }
+        return value;
+    }
+
+    void usage() {
+        std::cout
+            << "Measures the heap allocations made on the RPC path for each "
+            << "message: a"
+            << std::endl
+            << "request is serialized (as the sender does), copied into a "
+            << "receive buffer"
+            << std::endl
+            << "(as the receiver does), and parsed. This is done once with "
+            << "buffers from"
+            << std::endl
+            << "new[] and once with buffers from Core::BufferPool."
+            << std::endl
+            << std::endl
+            << "This program is subject to change (it is not part of "
+            << "LogCabin's stable API)."
+            << std::endl
+            << std::endl
+
+            << "Usage: " << argv[0] << " [options]"
+            << std::endl
+            << std::endl
+
+            << "Options:"
+            << std::endl
+
+            << "  -h, --help                   "
+            << "Print this usage information"
+            << std::endl
+
+            << "  -m <num>, --messages=<num>   "
+            << "Number of messages per thread [default: 1000000]"
+            << std::endl
+
+            << "  -s <bytes>, --size=<bytes>   "
+            << "Size of each message's payload [default: 1024]"
+            << std::endl
+
+            << "  -t <num>, --threads=<num>    "
+            << "Number of threads [default: 1]"
+            << std::endl;
+    }
+
+    int& argc;
+    char**& argv;
+    uint64_t messages;
+    uint64_t size;
+    uint64_t threads;
+};
+
+/**
+ * Serialize, copy, and parse 'entry' the given number of times.
+ * \param pooled
+ *      If true, use Core::BufferPool for the buffers; otherwise, use new[].
+ */
+void
+run(const Protocol::Raft::Entry& entry, uint64_t messages, bool pooled)
+{
+    Protocol::Raft::Entry parsed;
+    for (uint64_t i = 0; i < messages; ++i) {
+        Core::Buffer sent;
+        if (pooled) {
+            Core::ProtoBuf::serialize(entry, sent);
+        } else {
+            uint64_t length = uint64_t(entry.ByteSize());
+            sent.setData(new char[length], length,
+                         Core::Buffer::deleteArrayFn<char>);
+            entry.SerializeToArray(sent.getData(), int(length));
+        }
+        Core::Buffer received;
+        if (pooled) {
+            Core::BufferPool::allocate(received, sent.getLength());
+        } else {
+            received.setData(new char[sent.getLength()], sent.getLength(),
+                             Core::Buffer::deleteArrayFn<char>);
+        }
+        memcpy(received.getData(), sent.getData(), sent.getLength());
+        sent.reset();
+        Core::ProtoBuf::parse(received, parsed);
+    }
+}
+
+/**
+ * Run the benchmark on several threads and print a line of results.
+ */
+void
+report(const Protocol::Raft::Entry& entry,
+       const OptionParser& options,
+       bool pooled)
+{
+    Core::BufferPool::Stats poolBefore = Core::BufferPool::getStats();
+    uint64_t newsBefore = numNews.load();
+    Core::Time::SteadyClock::time_point start =
+        Core::Time::SteadyClock::now();
+    std::vector<std::thread> threads;
+    for (uint64_t i = 0; i < options.threads; ++i)
+        threads.emplace_back(run, std::ref(entry), options.messages, pooled);
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    uint64_t nanos = uint64_t(std::chrono::nanoseconds(
+        Core::Time::SteadyClock::now() - start).count());
+    Core::BufferPool::Stats poolAfter = Core::BufferPool::getStats();
+    uint64_t news = numNews.load() - newsBefore;
+    uint64_t mallocs = poolAfter.numMallocs - poolBefore.numMallocs;
+    double total = double(options.messages * options.threads);
+    std::cout << format("%-8s %8.1f ns/msg  %6.3f new/msg  "
+                        "%6.3f pool malloc/msg",
+                        pooled ? "pooled:" : "new[]:",
+                        double(nanos) / total,
+                        double(news) / total,
+                        double(mallocs) / total)
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int
+main(int argc, char** argv)
+{
+    Core::Util::Finally _(google::protobuf::ShutdownProtobufLibrary);
+    OptionParser options(argc, argv);
+
+    Protocol::Raft::Entry entry;
+    entry.set_term(1);
+    entry.set_index(1);
+    entry.set_cluster_time(1);
+    entry.set_type(Protocol::Raft::EntryType::DATA);
+    entry.set_data(std::string(options.size, 'x'));
+
+    std::cout << format("%lu messages of %lu bytes on each of %lu threads",
+                        options.messages, options.size, options.threads)
+              << std::endl;
+    report(entry, options, false);
+    report(entry, options, true);
+    return 0;
+}
@@ -0,0 +1,161 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstring>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Core/BufferPool.h"
+
+namespace LogCabin {
+namespace Core {
+namespace BufferPool {
+namespace {
+
+using namespace Internal; // NOLINT
+
+TEST(CoreBufferPoolTest, classFor) {
+    EXPECT_EQ(0U, classFor(0));
+    EXPECT_EQ(0U, classFor(64));
+    EXPECT_EQ(1U, classFor(65));
+    EXPECT_EQ(1U, classFor(128));
+    EXPECT_EQ(NUM_CLASSES - 1, classFor(MAX_BLOCK_BYTES));
+    EXPECT_EQ(UNPOOLED, classFor(MAX_BLOCK_BYTES + 1));
+}
+
+TEST(CoreBufferPoolTest, allocate_reusesBlocks) {
+    void* first = allocate(100);
+    memset(first, 'x', 100);
+    release(first);
+    Stats before = getStats();
+    // same size class
+    void* second = allocate(120);
+    EXPECT_EQ(first, second);
+    Stats after = getStats();
+    EXPECT_EQ(before.numAllocations + 1, after.numAllocations);
+    EXPECT_EQ(before.numMallocs, after.numMallocs);
+    release(second);
+}
+
+TEST(CoreBufferPoolTest, allocate_large) {
+    Stats before = getStats();
+    void* data = allocate(MAX_BLOCK_BYTES + 1);
+    memset(data, 'x', MAX_BLOCK_BYTES + 1);
+    release(data);
+    Stats after = getStats();
+    EXPECT_EQ(before.numMallocs + 1, after.numMallocs);
+    EXPECT_EQ(before.numFrees + 1, after.numFrees);
+}
+
+TEST(CoreBufferPoolTest, allocate_buffer) {
+    Buffer buffer;
+    allocate(buffer, 10);
+    EXPECT_EQ(10U, buffer.getLength());
+    void* data = buffer.getData();
+    buffer.reset();
+    EXPECT_EQ(data, allocate(10));
+    release(data);
+}
+
+TEST(CoreBufferPoolTest, release_null) {
+    release(NULL);
+}
+
+TEST(CoreBufferPoolTest, release_flushesToShared) {
+    uint32_t sizeClass = classFor(MAX_BLOCK_BYTES);
+    uint64_t limit = threadCacheLimit(sizeClass);
+    // Allocate until both caches are empty for the size class.
+    std::vector<void*> blocks;
+    uint64_t numMallocs = getStats().numMallocs;
+    while (getStats().numMallocs == numMallocs)
+        blocks.push_back(allocate(MAX_BLOCK_BYTES));
+    EXPECT_EQ(0U, numThreadCached(sizeClass));
+    EXPECT_EQ(0U, numSharedCached(sizeClass));
+    while (blocks.size() < limit + 1)
+        blocks.push_back(allocate(MAX_BLOCK_BYTES));
+
+    for (uint64_t i = 0; i < limit + 1; ++i)
+        release(blocks.at(i));
+    EXPECT_EQ(limit / 2, numThreadCached(sizeClass));
+    EXPECT_EQ(limit / 2 + 1, numSharedCached(sizeClass));
+
+    // an empty thread cache refills from the shared cache
+    Stats before = getStats();
+    for (uint64_t i = 0; i < limit / 2 + 1; ++i)
+        blocks.at(i) = allocate(MAX_BLOCK_BYTES);
+    EXPECT_EQ(before.numMallocs, getStats().numMallocs);
+    for (auto it = blocks.begin(); it != blocks.end(); ++it)
+        release(*it);
+}
+
+TEST(CoreBufferPoolTest, threadExit) {
+    uint32_t sizeClass = classFor(MAX_BLOCK_BYTES / 2);
+    Stats before = getStats();
+    std::thread thread([] () {
+        release(allocate(MAX_BLOCK_BYTES / 2));
+    });
+    thread.join();
+    // The thread's cached block went to the shared cache.
+    EXPECT_LE(1U, numSharedCached(sizeClass));
+    EXPECT_EQ(before.numFrees, getStats().numFrees);
+}
+
+TEST(CoreBufferPoolTest, fork) {
+    // Another thread holds the shared cache's lock when fork() is called.
+    lockSharedCache();
+    std::thread thread([] () {
+        usleep(10000);
+        unlockSharedCache();
+    });
+    pid_t pid = fork();
+    ASSERT_NE(-1, pid) << strerror(errno);
+    if (pid == 0) { // child
+        numSharedCached(0);
+        _exit(0);
+    }
+    thread.join();
+    int status = 0;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status));
+}
+
+TEST(CoreBufferPoolTest, concurrent) {
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; ++t) {
+        threads.emplace_back([] () {
+            std::vector<void*> blocks;
+            for (uint64_t i = 0; i < 10000; ++i) {
+                blocks.push_back(allocate(i % 5000));
+                if (blocks.size() > 100) {
+                    release(blocks.front());
+                    blocks.erase(blocks.begin());
+                }
+            }
+            for (auto it = blocks.begin(); it != blocks.end(); ++it)
+                release(*it);
+        });
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+}
+
+} // namespace LogCabin::Core::BufferPool::<anonymous>
+} // namespace LogCabin::Core::BufferPool
+} // namespace LogCabin::Core
+} // namespace LogCabin
@@ -0,0 +1,239 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstring>
+#include <vector>
+
+#include "Core/LZ4.h"
+
+namespace LogCabin {
+namespace Core {
+namespace LZ4 {
+
+namespace {
+
+/// Matches are at least this long.
+const uint64_t MIN_MATCH = 4;
+/// The last this many bytes of a block are always literals.
+const uint64_t LAST_LITERALS = 5;
+/// The last match must start at least this many bytes before the end.
+const uint64_t MATCH_FIND_LIMIT = 12;
+/// Matches may refer back at most this far.
+const uint64_t MAX_DISTANCE = 65535;
+/// log2 of the largest number of entries in the compressor's hash table.
+const uint32_t MAX_HASH_BITS = 16;
+/// log2 of the smallest number of entries in the compressor's hash table.
+const uint32_t MIN_HASH_BITS = 8;
+
+/**
+ * The compressor's hash table, kept for each thread so that compressing
+ * doesn't allocate. Only the first 2^hashBits entries of it are used, where
+ * hashBits depends on the input length (see compress()), so that small inputs
+ * don't pay to clear the whole thing.
+ */
+thread_local std::vector<uint32_t> hashTable;
+
+uint32_t
+read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t
+hash(uint32_t sequence, uint32_t hashBits)
+{
+    return (sequence * 2654435761U) >> (32 - hashBits);
+}
+
+/**
+ * Append a length in LZ4's variable-length encoding: the part that did not
+ * fit in the token, as a run of 255s and a final byte less than 255.
+ */
+uint8_t*
+writeLength(uint8_t* out, uint64_t length)
+{
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = uint8_t(length);
+    return out;
+}
+
+/**
+ * Append a sequence: a token, 'literalLength' literals, and (unless
+ * matchLength is 0) a match.
+ */
+uint8_t*
+writeSequence(uint8_t* out,
+              const uint8_t* literals, uint64_t literalLength,
+              uint64_t offset, uint64_t matchLength)
+{
+    uint8_t* token = out++;
+    if (literalLength >= 15) {
+        *token = 15 << 4;
+        out = writeLength(out, literalLength - 15);
+    } else {
+        *token = uint8_t(literalLength << 4);
+    }
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (matchLength == 0)
+        return out;
+    *out++ = uint8_t(offset);
+    *out++ = uint8_t(offset >> 8);
+    matchLength -= MIN_MATCH;
+    if (matchLength >= 15) {
+        *token = uint8_t(*token | 15);
+        out = writeLength(out, matchLength - 15);
+    } else {
+        *token = uint8_t(*token | matchLength);
+    }
+    return out;
+}
+
+/**
+ * Read the rest of a length in LZ4's variable-length encoding.
+ * \return
+ *      False if the input ended first.
+ */
+bool
+readLength(const uint8_t*& in, const uint8_t* end, uint64_t& length)
+{
+    uint8_t b;
+    do {
+        if (in == end)
+            return false;
+        b = *in++;
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+} // anonymous namespace
+
+uint64_t
+maxCompressedLength(uint64_t length)
+{
+    return length + length / 255 + 16;
+}
+
+uint64_t
+compress(const void* data, uint64_t length, void* output)
+{
+    const uint8_t* in = static_cast<const uint8_t*>(data);
+    uint8_t* out = static_cast<uint8_t*>(output);
+    uint8_t* const outStart = out;
+    uint64_t anchor = 0;
+    if (length > MATCH_FIND_LIMIT) {
+        // About one entry per input byte, within limits.
+        uint32_t hashBits = MIN_HASH_BITS;
+        while (hashBits < MAX_HASH_BITS && (1UL << hashBits) < length)
+            ++hashBits;
+        if (hashTable.size() < (1UL << hashBits))
+            hashTable.resize(1UL << hashBits);
+        uint32_t* table = hashTable.data();
+        // Positions are stored plus one, so that 0 means empty.
+        memset(table, 0, sizeof(uint32_t) << hashBits);
+        const uint64_t matchLimit = length - LAST_LITERALS;
+        const uint64_t findLimit = length - MATCH_FIND_LIMIT;
+        uint64_t pos = 0;
+        uint64_t misses = 0;
+        while (pos <= findLimit) {
+            uint32_t sequence = read32(in + pos);
+            uint32_t& entry = table[hash(sequence, hashBits)];
+            uint64_t candidate = entry;
+            entry = uint32_t(pos + 1);
+            if (candidate == 0 ||
+                pos - (candidate - 1) > MAX_DISTANCE ||
+                read32(in + candidate - 1) != sequence) {
+                // Skip ahead faster through data that isn't compressing.
+                pos += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            uint64_t match = candidate - 1;
+            uint64_t matchLength = MIN_MATCH;
+            while (pos + matchLength < matchLimit &&
+                   in[match + matchLength] == in[pos + matchLength]) {
+                ++matchLength;
+            }
+            out = writeSequence(out, in + anchor, pos - anchor,
+                                pos - match, matchLength);
+            pos += matchLength;
+            anchor = pos;
+        }
+    }
+    out = writeSequence(out, in + anchor, length - anchor, 0, 0);
+    return uint64_t(out - outStart);
+}
+
+bool
+decompress(const void* data, uint64_t length,
+           void* output, uint64_t outputLength)
+{
+    const uint8_t* in = static_cast<const uint8_t*>(data);
+    const uint8_t* const inEnd = in + length;
+    uint8_t* const outStart = static_cast<uint8_t*>(output);
+    uint8_t* out = outStart;
+    uint8_t* const outEnd = out + outputLength;
+    while (true) {
+        if (in == inEnd)
+            return false;
+        uint8_t token = *in++;
+
+        uint64_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(in, inEnd, literalLength))
+            return false;
+        if (literalLength > uint64_t(inEnd - in) ||
+            literalLength > uint64_t(outEnd - out)) {
+            return false;
+        }
+        memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+        if (in == inEnd) // the last sequence has no match
+            break;
+
+        if (inEnd - in < 2)
+            return false;
+        uint64_t offset = uint64_t(in[0]) | (uint64_t(in[1]) << 8);
+        in += 2;
+        if (offset == 0 || offset > uint64_t(out - outStart))
+            return false;
+        uint64_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(in, inEnd, matchLength))
+            return false;
+        matchLength += MIN_MATCH;
+        if (matchLength > uint64_t(outEnd - out))
+            return false;
+        const uint8_t* match = out - offset;
+        if (offset >= matchLength) {
+            memcpy(out, match, matchLength);
+            out += matchLength;
+        } else {
+            // The match overlaps the bytes it produces (a repeating pattern).
+            for (uint64_t i = 0; i < matchLength; ++i)
+                *out++ = *match++;
+        }
+    }
+    return out == outEnd;
+}
+
+} // namespace LogCabin::Core::LZ4
+} // namespace LogCabin::Core
+} // namespace LogCabin
@@ -0,0 +1,80 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file
+ * A small, self-contained implementation of the LZ4 block format, a fast
+ * byte-oriented LZ77 codec. Data compressed here can be decompressed by the
+ * reference LZ4 library (LZ4_decompress_safe) and vice versa. It favors
+ * simplicity over the last bit of speed: the compressor is a plain greedy
+ * matcher with a single hash table.
+ */
+
+#include <cinttypes>
+#include <cstddef>
+
+#ifndef LOGCABIN_CORE_LZ4_H
+#define LOGCABIN_CORE_LZ4_H
+
+namespace LogCabin {
+namespace Core {
+namespace LZ4 {
+
+/**
+ * Return the largest number of bytes that compress() may produce for an input
+ * of the given length (incompressible data grows slightly).
+ */
+uint64_t
+maxCompressedLength(uint64_t length);
+
+/**
+ * Compress a buffer into a single LZ4 block.
+ * \param data
+ *      The first byte of the data to compress.
+ * \param length
+ *      The number of bytes to compress. Must be less than 2^32.
+ * \param[out] output
+ *      Where to place the compressed block. Must have room for at least
+ *      maxCompressedLength(length) bytes.
+ * \return
+ *      The number of bytes placed in 'output'.
+ */
+uint64_t
+compress(const void* data, uint64_t length, void* output);
+
+/**
+ * Decompress a single LZ4 block. This checks all bounds, so it is safe to
+ * call on corrupt or malicious input.
+ * \param data
+ *      The first byte of the compressed block.
+ * \param length
+ *      The number of bytes in the compressed block.
+ * \param[out] output
+ *      Where to place the decompressed data.
+ * \param outputLength
+ *      The exact number of bytes the block decompresses to.
+ * \return
+ *      True if the block was well-formed and decompressed to exactly
+ *      'outputLength' bytes; false otherwise.
+ */
+bool
+decompress(const void* data, uint64_t length,
+           void* output, uint64_t outputLength);
+
+} // namespace LogCabin::Core::LZ4
+} // namespace LogCabin::Core
+} // namespace LogCabin
+
+#endif /* LOGCABIN_CORE_LZ4_H */
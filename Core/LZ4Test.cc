@@ -0,0 +1,118 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "Core/LZ4.h"
+#include "Core/Random.h"
+#include "Core/StringUtil.h"
+
+namespace LogCabin {
+namespace Core {
+namespace LZ4 {
+namespace {
+
+std::string
+compressString(const std::string& s)
+{
+    std::string out(maxCompressedLength(s.size()), '\0');
+    out.resize(compress(s.data(), s.size(), &out[0]));
+    return out;
+}
+
+std::string
+roundTrip(const std::string& s)
+{
+    std::string compressed = compressString(s);
+    std::string out(s.size(), '\0');
+    EXPECT_TRUE(decompress(compressed.data(), compressed.size(),
+                           &out[0], out.size()));
+    return out;
+}
+
+TEST(CoreLZ4Test, compress_knownBlock)
+{
+    // 32 a's: a literal, a 26-byte match at distance 1, then 5 literals.
+    EXPECT_EQ(std::string("\x1f" "a" "\x01\x00" "\x07"
+                          "\x50" "aaaaa", 11),
+              compressString(std::string(32, 'a')));
+}
+
+TEST(CoreLZ4Test, compress_short)
+{
+    EXPECT_EQ(std::string("\x00", 1), compressString(""));
+    EXPECT_EQ(std::string("\x30" "abc"), compressString("abc"));
+}
+
+TEST(CoreLZ4Test, roundTrip)
+{
+    EXPECT_EQ("", roundTrip(""));
+    EXPECT_EQ("hello", roundTrip("hello"));
+    std::string text;
+    for (uint64_t i = 0; i < 10000; ++i)
+        text += StringUtil::format("/path/to/file%lu: value %lu\n", i, i % 7);
+    EXPECT_EQ(text, roundTrip(text));
+    EXPECT_GT(text.size() / 3, compressString(text).size());
+
+    std::string random;
+    for (uint64_t i = 0; i < 100000; ++i)
+        random.push_back(char(Random::random8()));
+    std::string compressed = compressString(random);
+    EXPECT_GE(maxCompressedLength(random.size()), compressed.size());
+    EXPECT_EQ(random, roundTrip(random));
+
+    std::string longLiteralsThenRun = random.substr(0, 300) +
+                                      std::string(1000, 'z');
+    EXPECT_EQ(longLiteralsThenRun, roundTrip(longLiteralsThenRun));
+}
+
+TEST(CoreLZ4Test, compress_reusesHashTable)
+{
+    // Entries left over from a large input must not leak into a smaller one.
+    std::string large;
+    for (uint64_t i = 0; i < 10000; ++i)
+        large += StringUtil::format("entry %lu\n", i % 13);
+    EXPECT_EQ(large, roundTrip(large));
+    std::string small = large.substr(0, 200);
+    EXPECT_EQ(small, roundTrip(small));
+    EXPECT_EQ(large, roundTrip(large));
+}
+
+TEST(CoreLZ4Test, decompress_corrupt)
+{
+    std::string out(32, '\0');
+    std::string good("\x1f" "a" "\x01\x00" "\x07" "\x50" "aaaaa", 11);
+    EXPECT_TRUE(decompress(good.data(), good.size(), &out[0], 32));
+    EXPECT_EQ(std::string(32, 'a'), out);
+    // wrong output length
+    EXPECT_FALSE(decompress(good.data(), good.size(), &out[0], 31));
+    EXPECT_FALSE(decompress(good.data(), good.size(), &out[0], 33));
+    // truncated
+    for (uint64_t i = 0; i < good.size(); ++i)
+        EXPECT_FALSE(decompress(good.data(), i, &out[0], 32)) << i;
+    // offset reaching before the start of the output
+    std::string badOffset("\x1f" "a" "\x02\x00" "\x07" "\x50" "aaaaa", 11);
+    EXPECT_FALSE(decompress(badOffset.data(), badOffset.size(),
+                            &out[0], 32));
+    std::string zeroOffset("\x1f" "a" "\x00\x00" "\x07" "\x50" "aaaaa", 11);
+    EXPECT_FALSE(decompress(zeroOffset.data(), zeroOffset.size(),
+                            &out[0], 32));
+}
+
+} // namespace LogCabin::Core::LZ4::<anonymous>
+} // namespace LogCabin::Core::LZ4
+} // namespace LogCabin::Core
+} // namespace LogCabin
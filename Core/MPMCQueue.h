@@ -0,0 +1,211 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cinttypes>
+#include <cstddef>
+#include <memory>
+
+#include "Core/CompatAtomic.h"
+
+#ifndef LOGCABIN_CORE_MPMCQUEUE_H
+#define LOGCABIN_CORE_MPMCQUEUE_H
+
+namespace LogCabin {
+namespace Core {
+
+/**
+ * A bounded, lock-free queue that any number of threads may push onto and pop
+ * from concurrently. It's a ring of cells, each with a sequence number that
+ * says whether the cell is ready to be written or read in the current lap
+ * around the ring (this is Dmitry Vyukov's well-known design). Producers and
+ * consumers only contend on their own position counter, and never block each
+ * other: when the queue is full or empty, the operations simply fail.
+ *
+ * T must be default-constructible and move-assignable.
+ */
+template<typename T>
+class MPMCQueue {
+  public:
+    /**
+     * Constructor.
+     * \param minCapacity
+     *      The queue will be able to hold at least this many elements (it
+     *      rounds this up to a power of two). Must be at least 1.
+     */
+    explicit MPMCQueue(uint64_t minCapacity)
+        : capacity(roundUpToPowerOfTwo(minCapacity))
+        , cells(new Cell[capacity])
+        , padding0()
+        , pushPosition(0)
+        , padding1()
+        , popPosition(0)
+        , padding2()
+    {
+        for (uint64_t i = 0; i < capacity; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /**
+     * Try to append an element to the back of the queue.
+     * \param value
+     *      The element to add. It's moved from if this succeeds, and left
+     *      untouched otherwise.
+     * \return
+     *      True if the element was added; false if the queue was full.
+     */
+    bool tryPush(T& value) {
+        uint64_t position = pushPosition.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & (capacity - 1)];
+            uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+            int64_t lap = int64_t(sequence - position);
+            if (lap == 0) {
+                // The cell is free in this lap; try to claim it.
+                if (pushPosition.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1,
+                                        std::memory_order_release);
+                    return true;
+                }
+                // 'position' was reloaded by compare_exchange_weak.
+            } else if (lap < 0) {
+                // The cell still holds an element from the previous lap.
+                return false;
+            } else {
+                // Another producer got here first.
+                position = pushPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Try to remove the element at the front of the queue.
+     * \param[out] value
+     *      Set to the removed element if this succeeds.
+     * \return
+     *      True if an element was removed; false if the queue was empty.
+     */
+    bool tryPop(T& value) {
+        uint64_t position = popPosition.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & (capacity - 1)];
+            uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+            int64_t lap = int64_t(sequence - (position + 1));
+            if (lap == 0) {
+                // The cell is full in this lap; try to claim it.
+                if (popPosition.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.value = T();
+                    cell.sequence.store(position + capacity,
+                                        std::memory_order_release);
+                    return true;
+                }
+                // 'position' was reloaded by compare_exchange_weak.
+            } else if (lap < 0) {
+                // No producer has filled this cell yet.
+                return false;
+            } else {
+                // Another consumer got here first.
+                position = popPosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Return the number of elements in the queue. This is only a snapshot
+     * when other threads are using the queue concurrently.
+     */
+    uint64_t size() const {
+        uint64_t popped = popPosition.load(std::memory_order_relaxed);
+        uint64_t pushed = pushPosition.load(std::memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    }
+
+    /**
+     * The maximum number of elements the queue can hold.
+     */
+    const uint64_t capacity;
+
+  private:
+    /**
+     * Return the smallest power of two that is at least 'n' (and at least 1).
+     */
+    static uint64_t roundUpToPowerOfTwo(uint64_t n) {
+        uint64_t power = 1;
+        while (power < n)
+            power *= 2;
+        return power;
+    }
+
+    /**
+     * A slot in the ring.
+     */
+    struct Cell {
+        Cell()
+            : sequence(0)
+            , value()
+        {
+        }
+        /**
+         * If equal to the position of a push, the cell is free for that
+         * push; if equal to the position of a pop plus 1, it holds the
+         * element for that pop.
+         */
+        std::atomic<uint64_t> sequence;
+        /**
+         * The element, valid while the cell is full.
+         */
+        T value;
+    };
+
+    /**
+     * Avoids false sharing between the position counters, which are written
+     * by different sets of threads.
+     */
+    enum { CACHE_LINE_BYTES = 64 };
+
+    /**
+     * The ring of 'capacity' cells.
+     */
+    std::unique_ptr<Cell[]> cells;
+
+    char padding0[CACHE_LINE_BYTES];
+
+    /**
+     * The position at which the next element will be pushed. The cell used
+     * is this value modulo 'capacity'.
+     */
+    std::atomic<uint64_t> pushPosition;
+
+    char padding1[CACHE_LINE_BYTES];
+
+    /**
+     * The position from which the next element will be popped.
+     */
+    std::atomic<uint64_t> popPosition;
+
+    char padding2[CACHE_LINE_BYTES];
+
+    // MPMCQueue is non-copyable.
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+}; // class MPMCQueue
+
+} // namespace LogCabin::Core
+} // namespace LogCabin
+
+#endif /* LOGCABIN_CORE_MPMCQUEUE_H */
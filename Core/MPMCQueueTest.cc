@@ -0,0 +1,103 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Core/MPMCQueue.h"
+
+namespace LogCabin {
+namespace Core {
+namespace {
+
+TEST(CoreMPMCQueueTest, constructor) {
+    EXPECT_EQ(1U, MPMCQueue<int>(0).capacity);
+    EXPECT_EQ(1U, MPMCQueue<int>(1).capacity);
+    EXPECT_EQ(8U, MPMCQueue<int>(5).capacity);
+    EXPECT_EQ(8U, MPMCQueue<int>(8).capacity);
+}
+
+TEST(CoreMPMCQueueTest, pushPop) {
+    MPMCQueue<std::unique_ptr<int>> queue(4);
+    std::unique_ptr<int> value;
+    EXPECT_FALSE(queue.tryPop(value));
+    for (int i = 0; i < 4; ++i) {
+        value.reset(new int(i));
+        EXPECT_TRUE(queue.tryPush(value));
+        EXPECT_FALSE(value);
+    }
+    EXPECT_EQ(4U, queue.size());
+    value.reset(new int(4));
+    EXPECT_FALSE(queue.tryPush(value));
+    EXPECT_EQ(4, *value);
+
+    // wraps around the ring in FIFO order
+    for (int i = 0; i < 10; ++i) {
+        std::unique_ptr<int> front;
+        EXPECT_TRUE(queue.tryPop(front));
+        EXPECT_EQ(i, *front);
+        value.reset(new int(i + 4));
+        EXPECT_TRUE(queue.tryPush(value));
+    }
+    EXPECT_EQ(4U, queue.size());
+    for (int i = 10; i < 14; ++i) {
+        EXPECT_TRUE(queue.tryPop(value));
+        EXPECT_EQ(i, *value);
+    }
+    EXPECT_FALSE(queue.tryPop(value));
+    EXPECT_EQ(0U, queue.size());
+}
+
+TEST(CoreMPMCQueueTest, concurrent) {
+    MPMCQueue<uint64_t> queue(16);
+    const uint64_t perProducer = 20000;
+    const uint64_t numThreads = 4;
+    std::vector<std::thread> threads;
+    std::vector<uint64_t> sums(numThreads, 0);
+    std::vector<uint64_t> counts(numThreads, 0);
+    for (uint64_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&queue, perProducer, t] () {
+            for (uint64_t i = 1; i <= perProducer; ++i) {
+                uint64_t value = i;
+                while (!queue.tryPush(value))
+                    std::this_thread::yield();
+            }
+        });
+        threads.emplace_back([&queue, &sums, &counts, perProducer, t] () {
+            while (counts.at(t) < perProducer) {
+                uint64_t value;
+                if (queue.tryPop(value)) {
+                    sums.at(t) += value;
+                    ++counts.at(t);
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    uint64_t total = 0;
+    for (uint64_t t = 0; t < numThreads; ++t)
+        total += sums.at(t);
+    EXPECT_EQ(numThreads * perProducer * (perProducer + 1) / 2, total);
+    EXPECT_EQ(0U, queue.size());
+}
+
+} // namespace LogCabin::Core::<anonymous>
+} // namespace LogCabin::Core
+} // namespace LogCabin
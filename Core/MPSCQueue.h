@@ -0,0 +1,166 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstddef>
+
+#include "Core/CompatAtomic.h"
+
+#ifndef LOGCABIN_CORE_MPSCQUEUE_H
+#define LOGCABIN_CORE_MPSCQUEUE_H
+
+namespace LogCabin {
+namespace Core {
+
+/**
+ * An unbounded, lock-free queue that any number of threads may push onto, but
+ * only one thread at a time may pop from. It's a singly linked list of nodes
+ * (this is Dmitry Vyukov's well-known design): a push is a single atomic
+ * exchange on the back of the list followed by a store to link the previous
+ * node, so producers never wait for each other or for the consumer.
+ *
+ * The catch is that a push is briefly half-done between those two steps, and
+ * the consumer can't see past that point until it completes. tryPop() returns
+ * false in that case, so callers that need every element must have some other
+ * way to find out that a push has completed (see Event::Loop::post()).
+ *
+ * T must be default-constructible and move-assignable.
+ */
+template<typename T>
+class MPSCQueue {
+  public:
+    /**
+     * Constructor.
+     */
+    MPSCQueue()
+        : stub()
+        , back(&stub)
+        , front(&stub)
+    {
+    }
+
+    /**
+     * Destructor. Elements still in the queue are destroyed. No pushes may be
+     * in progress.
+     */
+    ~MPSCQueue() {
+        T value;
+        while (tryPop(value)) {
+        }
+    }
+
+    /**
+     * Append an element to the back of the queue. Safe to call from any
+     * thread.
+     */
+    void push(T value) {
+        pushNode(new Node(std::move(value)));
+    }
+
+    /**
+     * Try to remove the element at the front of the queue. Only one thread
+     * may call this at a time.
+     * \param[out] value
+     *      Set to the removed element if this succeeds.
+     * \return
+     *      True if an element was removed; false if the queue was empty or
+     *      the push of the next element hasn't completed yet.
+     */
+    bool tryPop(T& value) {
+        Node* first = front;
+        Node* next = first->next.load(std::memory_order_acquire);
+        if (first == &stub) {
+            // Skip over the stub, which holds no element.
+            if (next == NULL)
+                return false;
+            front = next;
+            first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next == NULL) {
+            // 'first' is the last node, unless a push is half-done.
+            if (first != back.load(std::memory_order_acquire))
+                return false;
+            // Put the stub behind 'first' so that 'first' can be removed.
+            pushNode(&stub);
+            next = first->next.load(std::memory_order_acquire);
+            if (next == NULL)
+                return false;
+        }
+        front = next;
+        value = std::move(first->value);
+        delete first;
+        return true;
+    }
+
+  private:
+    /**
+     * An element in the list.
+     */
+    struct Node {
+        Node()
+            : next(NULL)
+            , value()
+        {
+        }
+        explicit Node(T value)
+            : next(NULL)
+            , value(std::move(value))
+        {
+        }
+        /**
+         * The node behind this one, or NULL if this is the last node (or the
+         * push of the next node is half-done).
+         */
+        std::atomic<Node*> next;
+        /**
+         * The element.
+         */
+        T value;
+    };
+
+    /**
+     * Append a node to the back of the list.
+     */
+    void pushNode(Node* node) {
+        node->next.store(NULL, std::memory_order_relaxed);
+        Node* prev = back.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /**
+     * A node without an element, which keeps the list from ever being empty.
+     * It's put back on the list whenever the consumer removes the last node.
+     */
+    Node stub;
+
+    /**
+     * The last node in the list, swapped in by producers.
+     */
+    std::atomic<Node*> back;
+
+    /**
+     * The first node in the list, only accessed by the consumer.
+     */
+    Node* front;
+
+    // MPSCQueue is non-copyable.
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+}; // class MPSCQueue
+
+} // namespace LogCabin::Core
+} // namespace LogCabin
+
+#endif /* LOGCABIN_CORE_MPSCQUEUE_H */
@@ -0,0 +1,94 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Core/MPSCQueue.h"
+
+namespace LogCabin {
+namespace Core {
+namespace {
+
+TEST(CoreMPSCQueueTest, pushPop) {
+    MPSCQueue<std::unique_ptr<int>> queue;
+    std::unique_ptr<int> value;
+    EXPECT_FALSE(queue.tryPop(value));
+    for (int i = 0; i < 3; ++i)
+        queue.push(std::unique_ptr<int>(new int(i)));
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_TRUE(queue.tryPop(value));
+        EXPECT_EQ(i, *value);
+    }
+    // the last element is removed by way of the stub
+    queue.push(std::unique_ptr<int>(new int(3)));
+    for (int i = 2; i < 4; ++i) {
+        EXPECT_TRUE(queue.tryPop(value));
+        EXPECT_EQ(i, *value);
+    }
+    EXPECT_FALSE(queue.tryPop(value));
+    queue.push(std::unique_ptr<int>(new int(4)));
+    EXPECT_TRUE(queue.tryPop(value));
+    EXPECT_EQ(4, *value);
+    EXPECT_FALSE(queue.tryPop(value));
+}
+
+TEST(CoreMPSCQueueTest, destructor) {
+    std::shared_ptr<int> counted(new int(0));
+    {
+        MPSCQueue<std::shared_ptr<int>> queue;
+        queue.push(counted);
+        queue.push(counted);
+        EXPECT_EQ(3, counted.use_count());
+    }
+    EXPECT_EQ(1, counted.use_count());
+}
+
+TEST(CoreMPSCQueueTest, concurrent) {
+    MPSCQueue<uint64_t> queue;
+    const uint64_t perProducer = 20000;
+    const uint64_t numProducers = 4;
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < numProducers; ++t) {
+        threads.emplace_back([&queue, perProducer, t] () {
+            for (uint64_t i = 0; i < perProducer; ++i)
+                queue.push(t * perProducer + i);
+        });
+    }
+    // Each producer's elements come out in the order it pushed them.
+    std::vector<uint64_t> next(numProducers, 0);
+    uint64_t count = 0;
+    while (count < numProducers * perProducer) {
+        uint64_t value;
+        if (queue.tryPop(value)) {
+            uint64_t t = value / perProducer;
+            EXPECT_EQ(next.at(t), value % perProducer);
+            next.at(t) = value % perProducer + 1;
+            ++count;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    uint64_t value;
+    EXPECT_FALSE(queue.tryPop(value));
+}
+
+} // namespace LogCabin::Core::<anonymous>
+} // namespace LogCabin::Core
+} // namespace LogCabin
@@ -13,10 +13,14 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <endian.h>
 #include <google/protobuf/text_format.h>
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <sstream>
 
+#include "Core/BufferPool.h"
 #include "Core/Debug.h"
 #include "Core/ProtoBuf.h"
 #include "Core/StringUtil.h"
@@ -167,9 +171,69 @@ serialize(const google::protobuf::Message& from,
               dumpString(from).c_str());
     }
     uint32_t length = uint32_t(from.ByteSize());
-    char* data = new char[skipBytes + length];
+    BufferPool::allocate(to, skipBytes + length);
+    char* data = static_cast<char*>(to.getData());
     from.SerializeToArray(data + skipBytes, int(length));
-    to.setData(data, skipBytes + length, Core::Buffer::deleteArrayFn<char>);
+}
+
+MemoryInputStream::MemoryInputStream(const void* data, uint64_t length)
+    : data(static_cast<const char*>(data))
+    , length(length)
+    , bytesRead(0)
+{
+}
+
+uint64_t
+MemoryInputStream::getBytesRead() const
+{
+    return bytesRead;
+}
+
+std::string
+MemoryInputStream::readMessage(google::protobuf::Message& message)
+{
+    uint32_t messageLength = 0;
+    uint64_t r = readRaw(&messageLength, sizeof(messageLength));
+    if (r < sizeof(messageLength)) {
+        return StringUtil::format("Could only read %lu bytes of %lu-byte "
+                                  "length field (at offset %lu of %lu)",
+                                  r, sizeof(messageLength),
+                                  bytesRead - r, length);
+    }
+    messageLength = be32toh(messageLength);
+    if (length - bytesRead < messageLength) {
+        return StringUtil::format("ProtoBuf is %u bytes long but there are "
+                                  "only %lu bytes remaining (at offset %lu)",
+                                  messageLength, length - bytesRead,
+                                  bytesRead);
+    }
+    const Core::Buffer buf(const_cast<char*>(data + bytesRead),
+                           messageLength, NULL);
+    bytesRead += messageLength;
+    if (!parse(buf, message)) {
+        return StringUtil::format("Could not parse ProtoBuf at bytes %lu-%lu "
+                                  "(inclusive)",
+                                  bytesRead - messageLength,
+                                  bytesRead - 1);
+    }
+    return "";
+}
+
+uint64_t
+MemoryInputStream::readRaw(void* out, uint64_t maxLength)
+{
+    uint64_t r = std::min(maxLength, length - bytesRead);
+    memcpy(out, data + bytesRead, r);
+    bytesRead += r;
+    return r;
+}
+
+uint64_t
+MemoryInputStream::skip(uint64_t maxLength)
+{
+    uint64_t r = std::min(maxLength, length - bytesRead);
+    bytesRead += r;
+    return r;
 }
 
 
@@ -197,6 +197,48 @@ struct OutputStream {
     virtual void writeRaw(const void* data, uint64_t length) = 0;
 };
 
+/**
+ * An InputStream that reads from bytes in memory, in the format that
+ * Storage::SnapshotFile writes: each message is preceded by its length as a
+ * 4-byte big-endian integer.
+ */
+class MemoryInputStream : public InputStream {
+  public:
+    /**
+     * Constructor.
+     * \param data
+     *      The bytes to read, which must remain valid for the lifetime of this
+     *      object.
+     * \param length
+     *      The number of bytes at 'data'.
+     */
+    MemoryInputStream(const void* data, uint64_t length);
+    // See InputStream.
+    uint64_t getBytesRead() const;
+    // See InputStream.
+    std::string readMessage(google::protobuf::Message& message);
+    // See InputStream.
+    uint64_t readRaw(void* data, uint64_t length);
+    /**
+     * Advance past some bytes without reading them.
+     * \return
+     *      The number of bytes skipped before the end of the stream was
+     *      reached, up to 'length'.
+     */
+    uint64_t skip(uint64_t length);
+  private:
+    /// The bytes to read.
+    const char* data;
+    /// The number of bytes at 'data'.
+    uint64_t length;
+    /// The number of bytes read or skipped so far.
+    uint64_t bytesRead;
+
+    // MemoryInputStream is not copyable.
+    MemoryInputStream(const MemoryInputStream&) = delete;
+    MemoryInputStream& operator=(const MemoryInputStream&) = delete;
+};
+
 } // namespace LogCabin::Core::ProtoBuf
 } // namespace LogCabin::Core
 } // namespace LogCabin
@@ -114,6 +114,36 @@ TEST(CoreProtoBufTest, serialize) {
     EXPECT_EQ("field_a: 3 field_b: 5", m.ShortDebugString());
 }
 
+TEST(CoreProtoBufTest, MemoryInputStream) {
+    TestMessage m;
+    m.set_field_a(3);
+    m.set_field_b(5);
+    std::string bytes = m.SerializeAsString();
+    uint32_t length = htobe32(uint32_t(bytes.size()));
+    std::string data(reinterpret_cast<char*>(&length), sizeof(length));
+    data += bytes + "xyz";
+    data += std::string(reinterpret_cast<char*>(&length), sizeof(length));
+    data += bytes.substr(1);
+
+    MemoryInputStream stream(data.data(), data.size());
+    TestMessage out;
+    EXPECT_EQ("", stream.readMessage(out));
+    EXPECT_EQ(m, out);
+    EXPECT_EQ(4 + bytes.size(), stream.getBytesRead());
+    char c = '\0';
+    EXPECT_EQ(1U, stream.readRaw(&c, 1));
+    EXPECT_EQ('x', c);
+    EXPECT_EQ(2U, stream.skip(2));
+    EXPECT_EQ("ProtoBuf is 4 bytes long but there are only 3 bytes remaining "
+              "(at offset 15)",
+              stream.readMessage(out));
+    EXPECT_EQ(3U, stream.skip(100));
+    EXPECT_EQ(0U, stream.readRaw(&c, 1));
+    EXPECT_EQ("Could only read 0 bytes of 4-byte length field (at offset 18 "
+              "of 18)",
+              stream.readMessage(out));
+}
+
 // See https://github.com/logcabin/logcabin/issues/89:
 //
 // If we have a required enum field, an unknown value will cause the field to
@@ -0,0 +1,94 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <thread>
+
+#include "Core/RateLimiter.h"
+
+namespace LogCabin {
+namespace Core {
+
+RateLimiter::RateLimiter(uint64_t unitsPerSecond, uint64_t burst)
+    : unitsPerSecond(unitsPerSecond)
+    , burstTime(timeFor(burst))
+    , earnedAt(TimePoint::min())
+    , throttledTime(0)
+{
+}
+
+bool
+RateLimiter::isLimited() const
+{
+    return unitsPerSecond > 0;
+}
+
+RateLimiter::TimePoint
+RateLimiter::reserve(uint64_t units)
+{
+    TimePoint now = Clock::now();
+    if (!isLimited())
+        return now;
+    earnedAt = std::max(earnedAt, now) + timeFor(units);
+    TimePoint usableAt = earnedAt - burstTime;
+    if (usableAt <= now)
+        return now;
+    throttledTime += usableAt - now;
+    return usableAt;
+}
+
+bool
+RateLimiter::tryReserve(uint64_t units)
+{
+    TimePoint now = Clock::now();
+    if (!isLimited())
+        return true;
+    TimePoint newEarnedAt = std::max(earnedAt, now) + timeFor(units);
+    if (newEarnedAt - burstTime > now)
+        return false;
+    earnedAt = newEarnedAt;
+    return true;
+}
+
+void
+RateLimiter::acquire(uint64_t units)
+{
+    TimePoint usableAt = reserve(units);
+    TimePoint now = Clock::now();
+    if (usableAt > now)
+        std::this_thread::sleep_for(usableAt - now);
+}
+
+std::chrono::nanoseconds
+RateLimiter::getThrottledTime() const
+{
+    return throttledTime;
+}
+
+std::chrono::nanoseconds
+RateLimiter::timeFor(uint64_t units) const
+{
+    if (!isLimited())
+        return std::chrono::nanoseconds::zero();
+    // Split up the division to avoid overflowing for large 'units'.
+    uint64_t seconds = units / unitsPerSecond;
+    uint64_t remainder = units % unitsPerSecond;
+    return (std::chrono::seconds(seconds) +
+            std::chrono::nanoseconds(remainder * 1000000000UL /
+                                     unitsPerSecond));
+}
+
+} // namespace LogCabin::Core
+} // namespace LogCabin
@@ -0,0 +1,119 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <chrono>
+#include <cinttypes>
+
+#include "Core/Time.h"
+
+#ifndef LOGCABIN_CORE_RATELIMITER_H
+#define LOGCABIN_CORE_RATELIMITER_H
+
+namespace LogCabin {
+namespace Core {
+
+/**
+ * A token bucket that limits some activity, such as bytes written to a disk,
+ * to an average number of units per second. Up to 'burst' units may be used
+ * at once after a quiet period; beyond that, callers are told how long to
+ * wait. Callers take units out before using them and may go into debt, which
+ * later callers then wait out.
+ *
+ * This class is not thread-safe.
+ */
+class RateLimiter {
+  public:
+    /**
+     * Clock used to measure time.
+     */
+    typedef Core::Time::SteadyClock Clock;
+    /**
+     * Point in time of Clock.
+     */
+    typedef Clock::time_point TimePoint;
+
+    /**
+     * Constructor.
+     * \param unitsPerSecond
+     *      The average rate to allow, or 0 for no limit.
+     * \param burst
+     *      The number of units that may be used at once without waiting.
+     */
+    RateLimiter(uint64_t unitsPerSecond, uint64_t burst);
+
+    /**
+     * Return true if this limits anything (unitsPerSecond is not 0).
+     */
+    bool isLimited() const;
+
+    /**
+     * Take 'units' out of the bucket and return the time at which they may be
+     * used. This is now, unless the bucket is in debt.
+     */
+    TimePoint reserve(uint64_t units);
+
+    /**
+     * Take 'units' out of the bucket only if they may be used now.
+     * \return
+     *      True if the units were taken; false if the caller would have to
+     *      wait (nothing is taken).
+     */
+    bool tryReserve(uint64_t units);
+
+    /**
+     * Take 'units' out of the bucket and sleep until they may be used.
+     */
+    void acquire(uint64_t units);
+
+    /**
+     * Return the total time that reserve() and acquire() have asked callers
+     * to wait.
+     */
+    std::chrono::nanoseconds getThrottledTime() const;
+
+    /**
+     * The average rate allowed, or 0 for no limit.
+     */
+    const uint64_t unitsPerSecond;
+
+  private:
+    /**
+     * How long it takes to earn 'units' at 'unitsPerSecond'.
+     */
+    std::chrono::nanoseconds timeFor(uint64_t units) const;
+
+    /**
+     * How long it takes to earn 'burst' units: callers may run this far
+     * ahead of the average rate before waiting.
+     */
+    const std::chrono::nanoseconds burstTime;
+
+    /**
+     * The time at which everything taken so far would have been earned at
+     * the average rate. Units may be used once this is no more than
+     * 'burstTime' in the future.
+     */
+    TimePoint earnedAt;
+
+    /**
+     * See getThrottledTime().
+     */
+    std::chrono::nanoseconds throttledTime;
+};
+
+} // namespace LogCabin::Core
+} // namespace LogCabin
+
+#endif /* LOGCABIN_CORE_RATELIMITER_H */
@@ -0,0 +1,82 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "Core/RateLimiter.h"
+
+namespace LogCabin {
+namespace Core {
+namespace {
+
+typedef RateLimiter::Clock Clock;
+using std::chrono::milliseconds;
+
+TEST(CoreRateLimiterTest, unlimited)
+{
+    Clock::Mocker mocker;
+    RateLimiter limiter(0, 0);
+    EXPECT_FALSE(limiter.isLimited());
+    EXPECT_EQ(Clock::mockValue, limiter.reserve(1000000));
+    EXPECT_TRUE(limiter.tryReserve(1000000));
+    limiter.acquire(1000000);
+    EXPECT_EQ(0, limiter.getThrottledTime().count());
+}
+
+TEST(CoreRateLimiterTest, reserve)
+{
+    Clock::Mocker mocker;
+    RateLimiter limiter(1000, 100);
+    EXPECT_TRUE(limiter.isLimited());
+    // the burst is free
+    EXPECT_EQ(Clock::mockValue, limiter.reserve(100));
+    // then 1 ms per unit
+    EXPECT_EQ(Clock::mockValue + milliseconds(50), limiter.reserve(50));
+    EXPECT_EQ(Clock::mockValue + milliseconds(60), limiter.reserve(10));
+    EXPECT_EQ(milliseconds(110), limiter.getThrottledTime());
+    // the debt is paid off over time
+    Clock::mockValue += milliseconds(60);
+    EXPECT_EQ(Clock::mockValue, limiter.reserve(0));
+    Clock::mockValue += milliseconds(1000);
+    EXPECT_EQ(Clock::mockValue, limiter.reserve(100));
+    EXPECT_EQ(milliseconds(110), limiter.getThrottledTime());
+}
+
+TEST(CoreRateLimiterTest, tryReserve)
+{
+    Clock::Mocker mocker;
+    RateLimiter limiter(1000, 100);
+    EXPECT_TRUE(limiter.tryReserve(60));
+    EXPECT_FALSE(limiter.tryReserve(60));
+    EXPECT_TRUE(limiter.tryReserve(40));
+    EXPECT_FALSE(limiter.tryReserve(1));
+    Clock::mockValue += milliseconds(10);
+    EXPECT_TRUE(limiter.tryReserve(10));
+    EXPECT_EQ(0, limiter.getThrottledTime().count());
+}
+
+TEST(CoreRateLimiterTest, timeFor)
+{
+    RateLimiter limiter(3, 0);
+    EXPECT_EQ(std::chrono::nanoseconds(333333333), limiter.timeFor(1));
+    EXPECT_EQ(std::chrono::nanoseconds(3333333333333UL),
+              limiter.timeFor(10000));
+    EXPECT_EQ(std::chrono::hours(24 * 365 * 1000),
+              limiter.timeFor(3UL * 3600 * 24 * 365 * 1000));
+}
+
+} // namespace LogCabin::Core::<anonymous>
+} // namespace LogCabin::Core
+} // namespace LogCabin
@@ -17,8 +17,10 @@
 #include <cassert>
 #include <cstring>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
+#include <vector>
 
 #include "Core/Debug.h"
 #include "Core/ThreadId.h"
@@ -41,6 +43,26 @@ createEpollFd()
     return epollfd;
 }
 
+/// Helper for Loop::PostFile constructor.
+int
+createEventFd()
+{
+    int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (fd < 0)
+        PANIC("Could not create eventfd: %s", strerror(errno));
+    return fd;
+}
+
+/// Helper for Loop::TimerFile constructor.
+int
+createTimerFd()
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (fd < 0)
+        PANIC("Could not create timerfd: %s", strerror(errno));
+    return fd;
+}
+
 } // anonymous namespace
 
 ////////// Loop::Lock //////////
@@ -56,7 +78,7 @@ Loop::Lock::Lock(Event::Loop& eventLoop)
         // This is an actual lock: we're not running inside the event loop, and
         //                         we're not recursively locking.
         if (eventLoop.runningThread != Core::ThreadId::NONE)
-            eventLoop.breakTimer.schedule(0);
+            eventLoop.interrupt();
         while (eventLoop.runningThread != Core::ThreadId::NONE ||
                eventLoop.lockOwner != Core::ThreadId::NONE) {
             eventLoop.safeToLock.wait(lockGuard);
@@ -84,19 +106,50 @@ Loop::Lock::~Lock()
     }
 }
 
-////////// Loop::NullTimer //////////
+////////// Loop::PostFile //////////
+
+Loop::PostFile::PostFile()
+    : Event::File(createEventFd())
+{
+}
 
 void
-Loop::NullTimer::handleTimerEvent()
+Loop::PostFile::handleFileEvent(uint32_t events)
+{
+    // Reset the eventfd's counter. runForever() calls the functions next.
+    uint64_t count;
+    ssize_t r = read(fd, &count, sizeof(count));
+    if (r < 0 && errno != EAGAIN)
+        PANIC("Could not read eventfd %d: %s", fd, strerror(errno));
+}
+
+////////// Loop::TimerFile //////////
+
+Loop::TimerFile::TimerFile(Event::Loop& eventLoop)
+    : Event::File(createTimerFd())
+    , eventLoop(eventLoop)
 {
-    // do nothing
+}
+
+void
+Loop::TimerFile::handleFileEvent(uint32_t events)
+{
+    eventLoop.handleTimers();
 }
 
 ////////// Loop //////////
 
+const uint64_t Loop::TICK_NANOS;
+
 Loop::Loop()
     : epollfd(createEpollFd())
-    , breakTimer()
+    , posted()
+    , postedWakeupPending(false)
+    , postFile()
+    , timerFile(*this)
+    , timerMutex()
+    , wheel(nowTick())
+    , armedTick(TimerWheel::NONE)
     , shouldExit(false)
     , mutex()
     , runningThread(Core::ThreadId::NONE)
@@ -106,13 +159,15 @@ Loop::Loop()
     , safeToLock()
     , unlocked()
     , extraMutexToSatisfyRaceDetector()
-    , breakTimerMonitor(*this, breakTimer)
+    , timerFileMonitor(*this, timerFile, EPOLLIN|EPOLLET)
+    , postFileMonitor(*this, postFile, EPOLLIN)
 {
 }
 
 Loop::~Loop()
 {
-    breakTimerMonitor.disableForever();
+    postFileMonitor.disableForever();
+    timerFileMonitor.disableForever();
     if (epollfd >= 0) {
         int r = close(epollfd);
         if (r != 0)
@@ -161,6 +216,7 @@ Loop::runForever()
             Event::File& file = *static_cast<Event::File*>(events[i].data.ptr);
             file.handleFileEvent(events[i].events);
         }
+        runPosted();
     }
 }
 
@@ -171,5 +227,145 @@ Loop::exit()
     shouldExit = true;
 }
 
+void
+Loop::post(std::function<void()> function)
+{
+    posted.push(std::move(function));
+    if (!postedWakeupPending.exchange(true)) {
+        uint64_t one = 1;
+        ssize_t r = write(postFile.fd, &one, sizeof(one));
+        if (r < 0)
+            PANIC("Could not write eventfd %d: %s",
+                  postFile.fd, strerror(errno));
+    }
+}
+
+void
+Loop::runPosted()
+{
+    if (!postedWakeupPending.load(std::memory_order_relaxed))
+        return;
+    // Clear the flag before looking at the queue: a post() that completes
+    // after this point sets it again and writes to postFile, so its function
+    // can't be missed even if it isn't visible below yet.
+    postedWakeupPending.exchange(false);
+    // Only call as many functions as were queued so far, so that a function
+    // that keeps posting itself can't keep the loop from returning to
+    // epoll_wait.
+    std::vector<std::function<void()>> batch;
+    std::function<void()> function;
+    while (posted.tryPop(function))
+        batch.push_back(std::move(function));
+    for (auto it = batch.begin(); it != batch.end(); ++it)
+        (*it)();
+}
+
+uint64_t
+Loop::deadlineTick(Core::Time::SteadyClock::time_point when)
+{
+    static_assert(Core::Time::STEADY_CLOCK_ID == CLOCK_MONOTONIC,
+                  "Timers assume SteadyClock uses CLOCK_MONOTONIC");
+    int64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        when.time_since_epoch()).count();
+    if (nanos <= 0)
+        return 0;
+    // A deadline that has already passed expires now, rather than at the next
+    // tick.
+    if (when <= Core::Time::SteadyClock::BaseClock::now())
+        return 0;
+    uint64_t n = uint64_t(nanos);
+    return n / TICK_NANOS + (n % TICK_NANOS == 0 ? 0 : 1);
+}
+
+uint64_t
+Loop::nowTick()
+{
+    struct timespec now;
+    int r = clock_gettime(CLOCK_MONOTONIC, &now);
+    if (r != 0)
+        PANIC("clock_gettime failed: %s", strerror(errno));
+    return (uint64_t(now.tv_sec) * 1000 * 1000 * 1000 +
+            uint64_t(now.tv_nsec)) / TICK_NANOS;
+}
+
+void
+Loop::scheduleTimer(Timer& timer, uint64_t tick)
+{
+    std::lock_guard<std::mutex> lockGuard(timerMutex);
+    wheel.insert(timer, tick);
+    if (tick < armedTick)
+        armTimerFile(tick);
+}
+
+void
+Loop::descheduleTimer(Timer& timer)
+{
+    std::lock_guard<std::mutex> lockGuard(timerMutex);
+    // Leave timerFile armed: waking up for nothing is harmless.
+    wheel.remove(timer);
+}
+
+void
+Loop::interrupt()
+{
+    std::lock_guard<std::mutex> lockGuard(timerMutex);
+    armTimerFile(0);
+}
+
+void
+Loop::armTimerFile(uint64_t tick)
+{
+    const uint64_t nanosPerSecond = 1000 * 1000 * 1000;
+    struct itimerspec newValue;
+    memset(&newValue, 0, sizeof(newValue));
+    if (tick == 0) {
+        // A time of 0 would disarm the timer; this one's in the past.
+        newValue.it_value.tv_nsec = 1;
+    } else {
+        uint64_t nanos = tick * TICK_NANOS;
+        newValue.it_value.tv_sec = time_t(nanos / nanosPerSecond);
+        newValue.it_value.tv_nsec = long(nanos % nanosPerSecond);
+    }
+    int r = timerfd_settime(timerFile.fd, TFD_TIMER_ABSTIME, &newValue, NULL);
+    if (r != 0) {
+        PANIC("Could not set timer to %ld.%09ld: %s",
+              newValue.it_value.tv_sec,
+              newValue.it_value.tv_nsec,
+              strerror(errno));
+    }
+    armedTick = tick;
+}
+
+void
+Loop::handleTimers()
+{
+    uint64_t numExpired;
+    {
+        std::lock_guard<std::mutex> lockGuard(timerMutex);
+        // timerFile is one-shot, so it's no longer armed.
+        armedTick = TimerWheel::NONE;
+        wheel.advance(nowTick());
+        numExpired = wheel.numExpired();
+    }
+    // Only fire the Timers that had expired so far, so that a Timer that keeps
+    // rescheduling itself for right away can't keep the loop from returning
+    // to epoll_wait.
+    for (uint64_t i = 0; i < numExpired; ++i) {
+        Timer* timer;
+        {
+            std::lock_guard<std::mutex> lockGuard(timerMutex);
+            TimerWheel::Node* node = wheel.popExpired();
+            if (node == NULL) // handlers may deschedule other Timers
+                break;
+            timer = static_cast<Timer*>(node);
+        }
+        timer->handleTimerEvent();
+    }
+    std::lock_guard<std::mutex> lockGuard(timerMutex);
+    uint64_t next = wheel.nextTick();
+    if (next < armedTick)
+        armTimerFile(next);
+}
+
 } // namespace LogCabin::Event
 } // namespace LogCabin
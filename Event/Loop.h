@@ -18,26 +18,37 @@
 #define LOGCABIN_EVENT_LOOP_H
 
 #include <cinttypes>
+#include <functional>
 #include <memory>
 
+#include "Core/CompatAtomic.h"
 #include "Core/ConditionVariable.h"
+#include "Core/MPSCQueue.h"
 #include "Core/Mutex.h"
+#include "Event/File.h"
 #include "Event/Timer.h"
+#include "Event/TimerWheel.h"
 
 namespace LogCabin {
 namespace Event {
 
-// forward declarations
-class File;
-
 /**
  * This class contains an event loop based on Linux's epoll interface.
  * It keeps track of interesting events such as timers and socket activity, and
  * arranges for callbacks to be invoked when the events happen.
+ *
+ * All of the Event::Timers are kept in a timer wheel, and a single timerfd is
+ * armed for the earliest tick the wheel might need.
  */
 class Loop {
   public:
 
+    /**
+     * The resolution of Event::Timers, in nanoseconds. Timers are rounded up
+     * to a whole number of ticks.
+     */
+    static const uint64_t TICK_NANOS = 1000 * 1000;
+
     /**
      * Lock objects are used to synchronize between the Event::Loop thread and
      * other threads.  As long as a Lock object exists the following guarantees
@@ -92,26 +103,140 @@ class Loop {
      */
     void exit();
 
+    /**
+     * Arrange for a function to be called on the event loop thread, without
+     * waiting for it. Unlike a Lock, this doesn't stop the event loop: the
+     * function is queued and will be called after the event handler that's
+     * currently running (if any), with the same guarantees that event
+     * handlers have. Functions are called in the order they were posted from
+     * any one thread.
+     *
+     * Functions posted from an event handler are called before runForever()
+     * returns. Otherwise, functions posted while the event loop is not running
+     * are called once it runs again, or by runPosted(). Functions still queued
+     * when the Loop is destroyed are destroyed without being called.
+     *
+     * This may be called from an event handler or from any thread.
+     */
+    void post(std::function<void()> function);
+
+    /**
+     * Call the functions that have been posted so far. This is how functions
+     * posted to an event loop that isn't running get called; it's also useful
+     * before destroying an object that posted functions may refer to.
+     * The caller must be running on the event loop thread or hold a Lock.
+     */
+    void runPosted();
+
   private:
 
     /**
-     * Used in breakTimer, whose purpose is not to handle events but to break
-     * runForever() out of epoll_wait.
+     * The timerfd that wakes up runForever() when Timers may have expired,
+     * and when Event::Loop::Lock needs to break it out of epoll_wait.
      */
-    class NullTimer : public Event::Timer {
+    class TimerFile : public Event::File {
       public:
-        void handleTimerEvent();
+        explicit TimerFile(Event::Loop& eventLoop);
+        void handleFileEvent(uint32_t events);
+        Event::Loop& eventLoop;
     };
 
+    /**
+     * The eventfd that wakes up runForever() when functions have been posted.
+     * The functions themselves are called by runForever() after each event.
+     */
+    class PostFile : public Event::File {
+      public:
+        PostFile();
+        void handleFileEvent(uint32_t events);
+    };
+
+    /**
+     * Return the tick at which a Timer set for the given time should fire.
+     * This rounds up, so Timers never fire early. Times that have already
+     * passed return 0, which is always expired.
+     */
+    static uint64_t deadlineTick(Core::Time::SteadyClock::time_point when);
+
+    /**
+     * Return the current tick, according to CLOCK_MONOTONIC.
+     */
+    static uint64_t nowTick();
+
+    /**
+     * Add a Timer to the wheel, or move it if it's already there, and make
+     * sure #timerFile will go off in time for it.
+     */
+    void scheduleTimer(Timer& timer, uint64_t tick);
+
+    /**
+     * Remove a Timer from the wheel, if it's there.
+     */
+    void descheduleTimer(Timer& timer);
+
+    /**
+     * Make runForever() return from epoll_wait right away. Used by
+     * Event::Loop::Lock.
+     */
+    void interrupt();
+
+    /**
+     * Arm #timerFile to go off at the given tick (0 means right away).
+     * #timerMutex must be held.
+     */
+    void armTimerFile(uint64_t tick);
+
+    /**
+     * Called when #timerFile goes off. Fires the Timers that have expired and
+     * arms #timerFile for the next ones.
+     */
+    void handleTimers();
+
     /**
      * The file descriptor used in epoll calls to monitor other files.
      */
     int epollfd;
 
     /**
-     * Used by Event::Loop::Lock to break runForever() out of epoll_wait.
+     * Functions queued by post(), to be called by runPosted().
+     */
+    Core::MPSCQueue<std::function<void()>> posted;
+
+    /**
+     * Set when functions have been posted since runPosted() last looked, and
+     * #postFile has been (or is about to be) written to. Only the post() that
+     * sets this writes to #postFile, so a burst of posts costs one wakeup.
+     */
+    std::atomic<bool> postedWakeupPending;
+
+    /**
+     * Written to by post() to break runForever() out of epoll_wait.
      */
-    NullTimer breakTimer;
+    PostFile postFile;
+
+    /**
+     * Goes off when it's time to look at #wheel, or when Event::Loop::Lock
+     * needs to break runForever() out of epoll_wait.
+     */
+    TimerFile timerFile;
+
+    /**
+     * Protects #wheel and #armedTick. Timer::mutex and #mutex are acquired
+     * before this one if needed.
+     */
+    std::mutex timerMutex;
+
+    /**
+     * Holds every Timer that's scheduled and has a Monitor on this Loop.
+     */
+    TimerWheel wheel;
+
+    /**
+     * The tick for which #timerFile is armed, or TimerWheel::NONE if it isn't
+     * armed. Scheduling a Timer only needs to touch #timerFile if it expires
+     * earlier than this.
+     */
+    uint64_t armedTick;
 
     /**
      * This is a flag to runForever() to exit, set by exit().
@@ -121,7 +246,7 @@ class Loop {
 
     /**
      * This mutex protects all of the members of this class defined below this
-     * point, except breakTimerMonitor.
+     * point, except timerFileMonitor and postFileMonitor.
      */
     std::mutex mutex;
 
@@ -187,11 +312,17 @@ class Loop {
 #endif
 
     /**
-     * Watches breakTimer for events.
+     * Watches timerFile for events.
+     */
+    Event::File::Monitor timerFileMonitor;
+
+    /**
+     * Watches postFile for events.
      */
-    Event::Timer::Monitor breakTimerMonitor;
+    Event::File::Monitor postFileMonitor;
 
     friend class Event::File;
+    friend class Event::Timer;
 
     // Loop is not copyable.
     Loop(const Loop&) = delete;
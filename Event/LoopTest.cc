@@ -14,7 +14,10 @@
  */
 
 #include <gtest/gtest.h>
+#include <functional>
+#include <memory>
 #include <thread>
+#include <vector>
 
 #include "Event/Loop.h"
 #include "Event/Timer.h"
@@ -143,6 +146,86 @@ TEST(EventLoopTest, exit) {
     thread.join();
 }
 
+TEST(EventLoopTest, post) {
+    Loop loop;
+    std::vector<int> calls;
+    // from another thread while the loop is running
+    std::thread thread(&Loop::runForever, &loop);
+    loop.post([&calls] () { calls.push_back(1); });
+    loop.post([&calls, &loop] () {
+        calls.push_back(2);
+        loop.exit();
+    });
+    thread.join();
+    EXPECT_EQ((std::vector<int> {1, 2}), calls);
+}
+
+TEST(EventLoopTest, post_fromHandler) {
+    Loop loop;
+    bool called = false;
+    struct Poster : public Event::Timer {
+        Poster(Loop& loop, bool& called)
+            : loop(loop)
+            , called(called)
+        {
+        }
+        void handleTimerEvent() {
+            loop.post([this] () { called = true; });
+            loop.exit();
+        }
+        Loop& loop;
+        bool& called;
+    } poster(loop, called);
+    Timer::Monitor posterMonitor(loop, poster);
+    poster.schedule(0);
+    loop.runForever();
+    // called before runForever() returned
+    EXPECT_TRUE(called);
+}
+
+TEST(EventLoopTest, runPosted) {
+    Loop loop;
+    uint64_t calls = 0;
+    loop.post([&calls] () { ++calls; });
+    loop.post([&calls] () { ++calls; });
+    EXPECT_EQ(0U, calls);
+    {
+        Loop::Lock lock(loop);
+        loop.runPosted();
+    }
+    EXPECT_EQ(2U, calls);
+    // nothing left for the loop to call
+    loop.exit();
+    loop.runForever();
+    EXPECT_EQ(2U, calls);
+}
+
+TEST(EventLoopTest, runPosted_selfPosting) {
+    Loop loop;
+    uint64_t calls = 0;
+    std::function<void()> again = [&] () {
+        ++calls;
+        loop.post(again);
+    };
+    loop.post(again);
+    Loop::Lock lock(loop);
+    // Functions posted by the functions being called wait for the next time.
+    loop.runPosted();
+    EXPECT_EQ(1U, calls);
+    loop.runPosted();
+    EXPECT_EQ(2U, calls);
+}
+
+TEST(EventLoopTest, destructor_discardsPosted) {
+    std::shared_ptr<int> counted(new int(0));
+    {
+        Loop loop;
+        loop.post([counted] () { FAIL(); });
+        EXPECT_EQ(2, counted.use_count());
+    }
+    EXPECT_EQ(1, counted.use_count());
+}
+
 } // namespace LogCabin::Event::<anonymous>
 } // namespace LogCabin::Event
 } // namespace LogCabin
@@ -14,10 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <cstring>
-#include <sys/epoll.h>
-#include <sys/timerfd.h>
-#include <unistd.h>
+#include <chrono>
 
 #include "Core/Debug.h"
 #include "Event/Loop.h"
@@ -26,36 +23,57 @@
 namespace LogCabin {
 namespace Event {
 
-namespace {
+//// class Timer::Monitor ////
 
-/// Helper for constructor.
-int
-createTimerFd()
+Timer::Monitor::Monitor(Event::Loop& eventLoop, Timer& timer)
+    : eventLoop(eventLoop)
+    , mutex()
+    , timer(&timer)
 {
-    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
-    if (fd < 0) {
-        PANIC("Could not create timerfd: %s", strerror(errno));
+    std::lock_guard<std::mutex> lockGuard(timer.mutex);
+    if (timer.loop != NULL)
+        PANIC("Timer already has a Monitor");
+    timer.loop = &eventLoop;
+    if (timer.pending) {
+        timer.pending = false;
+        eventLoop.scheduleTimer(timer, timer.pendingTick);
     }
-    return fd;
 }
 
-} // anonymous namespace
-
-//// class Timer::Monitor ////
-
-Timer::Monitor::Monitor(Event::Loop& eventLoop, Timer& timer)
-    : File::Monitor(eventLoop, timer, EPOLLIN|EPOLLET)
+Timer::Monitor::~Monitor()
 {
+    disableForever();
 }
 
-Timer::Monitor::~Monitor()
+void
+Timer::Monitor::disableForever()
 {
+    std::lock_guard<std::mutex> mutexGuard(mutex);
+    if (timer == NULL)
+        return;
+    // Wait for the timer's handler to finish, if it's running.
+    Event::Loop::Lock lock(eventLoop);
+    std::lock_guard<std::mutex> timerGuard(timer->mutex);
+    {
+        std::lock_guard<std::mutex> wheelGuard(eventLoop.timerMutex);
+        if (timer->isLinked()) {
+            timer->pending = true;
+            timer->pendingTick = timer->expiresTick;
+            eventLoop.wheel.remove(*timer);
+        }
+    }
+    timer->loop = NULL;
+    timer = NULL;
 }
 
 //// class Timer ////
 
 Timer::Timer()
-    : Event::File(createTimerFd())
+    : TimerWheel::Node()
+    , mutex()
+    , loop(NULL)
+    , pending(false)
+    , pendingTick(0)
 {
 }
 
@@ -66,78 +84,46 @@ Timer::~Timer()
 void
 Timer::schedule(uint64_t nanoseconds)
 {
-    // avoid accidental de-schedules: epoll's semantics are that a timer for 0
-    // seconds and 0 nanoseconds will never fire.
-    if (nanoseconds == 0)
-        nanoseconds = 1;
-
-    const uint64_t nanosPerSecond = 1000 * 1000 * 1000;
-    struct itimerspec newValue;
-    memset(&newValue, 0, sizeof(newValue));
-    newValue.it_value.tv_sec  = nanoseconds / nanosPerSecond;
-    newValue.it_value.tv_nsec = nanoseconds % nanosPerSecond;
-    int r = timerfd_settime(fd, 0, &newValue, NULL);
-    if (r != 0) {
-        PANIC("Could not set timer to +%luns: %s",
-              nanoseconds,
-              strerror(errno));
-    }
+    scheduleTick(Loop::deadlineTick(
+        Core::Time::SteadyClock::BaseClock::now() +
+        std::chrono::nanoseconds(nanoseconds)));
 }
 
 void
 Timer::scheduleAbsolute(Core::Time::SteadyClock::time_point timeout)
 {
-    static_assert(Core::Time::STEADY_CLOCK_ID == CLOCK_MONOTONIC,
-                  "scheduleAbsolute assumes SteadyClock uses CLOCK_MONOTONIC");
-    struct itimerspec newValue;
-    memset(&newValue, 0, sizeof(newValue));
-    newValue.it_value = Core::Time::makeTimeSpec(timeout);
-    // Will get EINVAL on negative times, might as well use 0.000000001.
-    if (newValue.it_value.tv_sec < 0) {
-        newValue.it_value.tv_sec = 0;
-        newValue.it_value.tv_nsec = 1;
-    }
-    // avoid accidental de-schedules: epoll's semantics are that a timer for 0
-    // seconds and 0 nanoseconds will never fire.
-    if (newValue.it_value.tv_sec == 0 && newValue.it_value.tv_nsec == 0)
-        newValue.it_value.tv_nsec = 1;
-
-    int r = timerfd_settime(fd, TFD_TIMER_ABSTIME, &newValue, NULL);
-    if (r != 0) {
-        PANIC("Could not set timer to %ld.%09ld: %s",
-              newValue.it_value.tv_sec,
-              newValue.it_value.tv_nsec,
-              strerror(errno));
-    }
+    scheduleTick(Loop::deadlineTick(timeout));
 }
 
 void
 Timer::deschedule()
 {
-    struct itimerspec newValue;
-    memset(&newValue, 0, sizeof(newValue));
-    int r = timerfd_settime(fd, 0, &newValue, NULL);
-    if (r != 0)
-        PANIC("Could not deschedule timer: %s", strerror(errno));
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    pending = false;
+    if (loop != NULL)
+        loop->descheduleTimer(*this);
 }
 
 bool
 Timer::isScheduled() const
 {
-    // Unfortunately, timerfd_gettime seems to return 0 when an absolute time
-    // has already elapsed. See note on isScheduled() in header file.
-    struct itimerspec currentValue;
-    int r = timerfd_gettime(fd, &currentValue);
-    if (r != 0)
-        PANIC("Could not get timer: %s", strerror(errno));
-    return (currentValue.it_value.tv_sec != 0 ||
-            currentValue.it_value.tv_nsec != 0);
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    if (loop == NULL)
+        return pending;
+    std::lock_guard<std::mutex> wheelGuard(loop->timerMutex);
+    return isLinked();
 }
 
 void
-Timer::handleFileEvent(uint32_t events)
+Timer::scheduleTick(uint64_t tick)
 {
-    handleTimerEvent();
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    if (loop != NULL) {
+        loop->scheduleTimer(*this, tick);
+    } else {
+        pending = true;
+        pendingTick = tick;
+    }
 }
 
 } // namespace LogCabin::Event
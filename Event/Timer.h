@@ -17,8 +17,10 @@
 #ifndef LOGCABIN_EVENT_TIMER_H
 #define LOGCABIN_EVENT_TIMER_H
 
+#include <mutex>
+
 #include "Core/Time.h"
-#include "Event/File.h"
+#include "Event/TimerWheel.h"
 
 namespace LogCabin {
 namespace Event {
@@ -33,8 +35,16 @@ class Loop;
  *
  * Timers can be added and scheduled from any thread, but they will always fire
  * on the thread running the Event::Loop.
+ *
+ * Rather than each having a timerfd of their own, all of the Timers for an
+ * Event::Loop share its timer wheel, so scheduling and descheduling them makes
+ * no system calls (except to wake the Event::Loop up sooner). Timers have a
+ * resolution of Loop::TICK_NANOS (1 ms): deadlines in the future are rounded
+ * up to the next tick, so a timer never fires early but may fire up to a tick
+ * late. Deadlines that have already passed, including schedule(0), expire
+ * right away instead of waiting for the next tick.
  */
-class Timer : private File {
+class Timer : private TimerWheel::Node {
   public:
 
     /**
@@ -45,14 +55,45 @@ class Timer : private File {
      * This object must be destroyed or disableForever() called BEFORE the
      * Timer object can be destroyed safely.
      */
-    class Monitor : private File::Monitor {
+    class Monitor {
       public:
-        /// See File::Monitor::Monitor.
+        /**
+         * Constructor. If the timer was already scheduled, it's added to the
+         * Event::Loop's timer wheel.
+         * \param eventLoop
+         *      Event::Loop that will fire the timer.
+         * \param timer
+         *      The timer to monitor. It must not already have a Monitor.
+         */
         Monitor(Event::Loop& eventLoop, Timer& timer);
-        /// See File::Monitor::~Monitor.
+        /**
+         * Destructor. Calls disableForever().
+         */
         ~Monitor();
-        /// See File::Monitor::disableForever.
-        using File::Monitor::disableForever;
+        /**
+         * Stop the Event::Loop from firing the timer. Once this returns, the
+         * timer's handler is not running and will not be called again (from
+         * this Monitor), so the Timer may be safely destroyed. If the timer
+         * was scheduled, it remains so, and will be added to the timer wheel
+         * of any Monitor created for it later.
+         */
+        void disableForever();
+      private:
+        /**
+         * Event::Loop that fires the timer.
+         */
+        Event::Loop& eventLoop;
+        /**
+         * Protects #timer from concurrent disableForever() calls.
+         */
+        std::mutex mutex;
+        /**
+         * The timer being monitored, or NULL after disableForever().
+         */
+        Timer* timer;
+        // Monitor is not copyable.
+        Monitor(const Monitor&) = delete;
+        Monitor& operator=(const Monitor&) = delete;
     };
 
     /**
@@ -77,7 +118,9 @@ class Timer : private File {
     /**
      * Start the timer.
      * \param nanoseconds
-     *     The timer will trigger once this number of nanoseconds have elapsed.
+     *     The timer will trigger once this number of nanoseconds have elapsed,
+     *     rounded up to a whole Loop::TICK_NANOS; 0 triggers it immediately
+     *     once the event loop runs.
      *     If the timer was already scheduled, the old time is forgotten.
      */
     void schedule(uint64_t nanoseconds);
@@ -86,7 +129,8 @@ class Timer : private File {
      * Start the timer for an absolute point in time. If the timeout is in the
      * past, the timer will trigger immediately once the event loop runs.
      * \param timeout
-     *     The timer will trigger once this timeout has past.
+     *     The timer will trigger once this timeout has past, rounded up to a
+     *     whole Loop::TICK_NANOS.
      *     If the timer was already scheduled, the old time is forgotten.
      */
     void scheduleAbsolute(Core::Time::SteadyClock::time_point timeout);
@@ -112,11 +156,8 @@ class Timer : private File {
      * Returns true if the timer has been scheduled and has not yet fired.
      * \warning
      *      This is prone to races; it's primarily useful for unit tests.
-     *      It also improperly returns false after scheduleAbsolute() is called
-     *      with a time that has expired. It's marked as private so it can't be
-     *      accessed from normal (non-test) code.
-     *      TODO(ongaro): remove entirely or add additional state to this
-     *      class to make this work correctly?
+     *      It's marked as private so it can't be accessed from normal
+     *      (non-test) code.
      * \return
      *      True if the timer has been scheduled and will eventually call
      *      handleTimerEvent().
@@ -126,9 +167,36 @@ class Timer : private File {
     bool isScheduled() const;
 
     /**
-     * Generic event handler for files. Calls handleTimerEvent().
+     * Set the timer to expire at the given tick: add it to the Event::Loop's
+     * timer wheel if it has a Monitor, or remember the tick until it gets
+     * one. Used by schedule() and scheduleAbsolute().
+     */
+    void scheduleTick(uint64_t tick);
+
+    /**
+     * Protects #loop, #pending, and #pendingTick. The timer's place in the
+     * wheel is protected by the Event::Loop's timerMutex instead, which is
+     * acquired after this one.
+     */
+    mutable std::mutex mutex;
+
+    /**
+     * The Event::Loop whose wheel this timer goes into, set while the timer
+     * has a Monitor, or NULL otherwise.
      */
-    void handleFileEvent(uint32_t events);
+    Event::Loop* loop;
+
+    /**
+     * Set if the timer was scheduled while it had no Monitor.
+     */
+    bool pending;
+
+    /**
+     * If #pending, the tick at which the timer expires.
+     */
+    uint64_t pendingTick;
+
+    friend class Loop;
 
     // Timer is not copyable.
     Timer(const Timer&) = delete;
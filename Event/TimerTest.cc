@@ -70,6 +70,20 @@ TEST_F(EventTimerTest, schedule_immediate) {
     EXPECT_FALSE(timer1.isScheduled());
 }
 
+TEST_F(EventTimerTest, schedule_pastExpiresNow) {
+    // Timers in the past go straight to the expired list instead of waiting
+    // for the next tick.
+    timer1.schedule(0);
+    EXPECT_EQ(1U, loop.wheel.numExpired());
+    timer1.schedule(1000);
+    EXPECT_EQ(0U, loop.wheel.numExpired());
+    timer1.scheduleAbsolute(Core::Time::SteadyClock::now() -
+                            std::chrono::nanoseconds(3));
+    EXPECT_EQ(1U, loop.wheel.numExpired());
+    timer1.deschedule();
+    EXPECT_EQ(0U, loop.wheel.numExpired());
+}
+
 typedef Core::Time::SystemClock Clock;
 typedef Clock::time_point TimePoint;
 
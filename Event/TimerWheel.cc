@@ -0,0 +1,292 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "Event/TimerWheel.h"
+
+namespace LogCabin {
+namespace Event {
+
+namespace {
+
+/**
+ * Nodes this many ticks or more in the future are parked in the top level.
+ */
+const uint64_t MAX_DELTA = 1UL << 32;
+
+/**
+ * Round 'tick' up to a multiple of 2^shift.
+ */
+uint64_t
+roundUp(uint64_t tick, uint32_t shift)
+{
+    uint64_t mask = (1UL << shift) - 1;
+    return (tick + mask) & ~mask;
+}
+
+} // anonymous namespace
+
+const uint64_t TimerWheel::NONE;
+
+////////// TimerWheel::Node //////////
+
+TimerWheel::Node::Node()
+    : expiresTick(0)
+    , prev(this)
+    , next(this)
+    , slot(0)
+{
+}
+
+TimerWheel::Node::~Node()
+{
+    assert(!isLinked());
+}
+
+void
+TimerWheel::Node::linkBefore(Node& head)
+{
+    prev = head.prev;
+    next = &head;
+    head.prev->next = this;
+    head.prev = this;
+}
+
+void
+TimerWheel::Node::unlink()
+{
+    prev->next = next;
+    next->prev = prev;
+    prev = this;
+    next = this;
+}
+
+////////// TimerWheel //////////
+
+TimerWheel::TimerWheel(uint64_t now)
+    : current(now + 1)
+    , numNodes(0)
+    , numPending(0)
+    , slots()
+    , occupied()
+    , expired()
+{
+    memset(occupied, 0, sizeof(occupied));
+}
+
+TimerWheel::~TimerWheel()
+{
+    for (uint32_t i = 0; i < NUM_SLOTS; ++i) {
+        while (slots[i].isLinked())
+            slots[i].next->unlink();
+    }
+    while (expired.isLinked())
+        expired.next->unlink();
+}
+
+void
+TimerWheel::insert(Node& node, uint64_t expiresTick)
+{
+    remove(node);
+    node.expiresTick = expiresTick;
+    place(node);
+    ++numNodes;
+}
+
+void
+TimerWheel::remove(Node& node)
+{
+    if (!node.isLinked())
+        return;
+    --numNodes;
+    if (node.slot != EXPIRED_SLOT) {
+        --numPending;
+        if (node.next == node.prev) { // the node is alone in its slot
+            occupied[node.slot / 64] &= ~(1UL << (node.slot % 64));
+        }
+    }
+    node.unlink();
+}
+
+void
+TimerWheel::advance(uint64_t now)
+{
+    while (current <= now) {
+        // Skip ahead to the next tick that has nodes or needs a cascade, but
+        // not past 'now', since later ticks may still get new nodes.
+        current = std::min(nextPendingTick(), now + 1);
+        if (current > now)
+            break;
+        uint64_t tick = current;
+        if (tick % LEVEL0_SLOTS == 0) {
+            // The first level has come around again: bring down the nodes
+            // that fall into its next lap from the levels above.
+            for (uint32_t level = 1; level < NUM_LEVELS; ++level) {
+                uint32_t shift = levelShift(level);
+                if (tick % (1UL << shift) != 0)
+                    break;
+                cascade(levelStart(level) +
+                        uint32_t((tick >> shift) % LEVELN_SLOTS));
+            }
+        }
+        uint32_t index = uint32_t(tick % LEVEL0_SLOTS);
+        Node& head = slots[index];
+        while (head.isLinked()) {
+            Node& node = *head.next;
+            node.unlink();
+            node.slot = EXPIRED_SLOT;
+            node.linkBefore(expired);
+            --numPending;
+        }
+        occupied[index / 64] &= ~(1UL << (index % 64));
+        current = tick + 1;
+    }
+}
+
+TimerWheel::Node*
+TimerWheel::popExpired()
+{
+    if (!expired.isLinked())
+        return NULL;
+    Node* node = expired.next;
+    node->unlink();
+    --numNodes;
+    return node;
+}
+
+uint64_t
+TimerWheel::nextTick() const
+{
+    if (expired.isLinked())
+        return 0;
+    return nextPendingTick();
+}
+
+uint32_t
+TimerWheel::levelShift(uint32_t level)
+{
+    // 8 bits for the first level, 6 for each one after that
+    return level == 0 ? 0 : 8 + 6 * (level - 1);
+}
+
+uint32_t
+TimerWheel::levelStart(uint32_t level)
+{
+    return level == 0 ? 0 : LEVEL0_SLOTS + LEVELN_SLOTS * (level - 1);
+}
+
+uint32_t
+TimerWheel::levelSlots(uint32_t level)
+{
+    return level == 0 ? LEVEL0_SLOTS : LEVELN_SLOTS;
+}
+
+uint64_t
+TimerWheel::nextPendingTick() const
+{
+    if (numPending == 0)
+        return NONE;
+    uint32_t index = uint32_t(current % LEVEL0_SLOTS);
+    uint32_t found = findSlot(0, index);
+    if (found < LEVEL0_SLOTS)
+        return current - index + found;
+    // Anything left in the first level is for its next lap.
+    uint64_t best = NONE;
+    if (findSlot(0, 0) < LEVEL0_SLOTS)
+        best = roundUp(current, levelShift(1));
+    for (uint32_t level = 1; level < NUM_LEVELS; ++level) {
+        uint32_t shift = levelShift(level);
+        uint64_t boundary = roundUp(current, shift);
+        uint32_t first = uint32_t((boundary >> shift) % LEVELN_SLOTS);
+        if (findSlot(level, 0) == LEVELN_SLOTS)
+            continue;
+        // Slots before 'first' are for the level's next lap, which starts
+        // at or after the point where slot LEVELN_SLOTS would be.
+        uint32_t slot = std::min(findSlot(level, first),
+                                 uint32_t(LEVELN_SLOTS));
+        best = std::min(best, boundary + (uint64_t(slot - first) << shift));
+    }
+    return best;
+}
+
+void
+TimerWheel::place(Node& node)
+{
+    if (node.expiresTick < current) {
+        node.slot = EXPIRED_SLOT;
+        node.linkBefore(expired);
+        return;
+    }
+    uint64_t expiresTick = node.expiresTick;
+    if (expiresTick - current >= MAX_DELTA)
+        expiresTick = current + MAX_DELTA - 1;
+    uint64_t delta = expiresTick - current;
+    uint32_t level = 0;
+    while (delta >> (levelShift(level + 1)) != 0)
+        ++level;
+    uint32_t slot = levelStart(level) +
+                    uint32_t((expiresTick >> levelShift(level)) %
+                             levelSlots(level));
+    node.slot = slot;
+    node.linkBefore(slots[slot]);
+    occupied[slot / 64] |= 1UL << (slot % 64);
+    ++numPending;
+}
+
+void
+TimerWheel::cascade(uint32_t slot)
+{
+    Node& head = slots[slot];
+    occupied[slot / 64] &= ~(1UL << (slot % 64));
+    // Detach the whole list first, since place() may append to other slots.
+    Node list;
+    if (head.isLinked()) {
+        list.next = head.next;
+        list.prev = head.prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head.next = &head;
+        head.prev = &head;
+    }
+    while (list.isLinked()) {
+        Node& node = *list.next;
+        node.unlink();
+        --numPending;
+        place(node);
+    }
+}
+
+uint32_t
+TimerWheel::findSlot(uint32_t level, uint32_t from) const
+{
+    uint32_t start = levelStart(level);
+    uint32_t end = start + levelSlots(level);
+    uint32_t i = start + from;
+    while (i < end) {
+        uint64_t word = occupied[i / 64] >> (i % 64);
+        if (word != 0) {
+            i += uint32_t(__builtin_ctzl(word));
+            return std::min(i, end) - start;
+        }
+        i = (i / 64 + 1) * 64;
+    }
+    return levelSlots(level);
+}
+
+} // namespace LogCabin::Event
+} // namespace LogCabin
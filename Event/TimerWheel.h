@@ -0,0 +1,242 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cinttypes>
+
+#ifndef LOGCABIN_EVENT_TIMERWHEEL_H
+#define LOGCABIN_EVENT_TIMERWHEEL_H
+
+namespace LogCabin {
+namespace Event {
+
+/**
+ * A hierarchical timer wheel, which Event::Loop uses to keep track of all of
+ * its Timers. Time is measured in ticks, and a node expires once the wheel has
+ * advanced to or past its tick.
+ *
+ * The first level has 256 slots of one tick each; each of the higher levels
+ * has 64 slots, each spanning all of the level below it. A node is placed in
+ * the lowest level that reaches its tick, and it moves down a level (cascades)
+ * when the wheel reaches its slot. Inserting and removing nodes takes
+ * constant time. Nodes more than 2^32 ticks out are parked in the top level
+ * and re-placed as the wheel advances.
+ *
+ * This class does no locking of its own.
+ */
+class TimerWheel {
+  public:
+    /**
+     * Returned by nextTick() when there's nothing in the wheel.
+     */
+    static const uint64_t NONE = ~0UL;
+
+    /**
+     * An entry in the wheel. Event::Timer derives from this. Nodes link into
+     * circular lists; slots and the list of expired nodes are headed by
+     * (unused) nodes of their own.
+     */
+    class Node {
+      public:
+        /// Constructor. The node starts off unlinked.
+        Node();
+        /// Destructor. The node must not be linked into a wheel.
+        ~Node();
+        /**
+         * Return true if the node is in a wheel (including in its list of
+         * expired nodes), false otherwise.
+         */
+        bool isLinked() const { return next != this; }
+        /**
+         * The tick at which this node expires. Only valid while it's linked.
+         */
+        uint64_t expiresTick;
+      private:
+        /// Add this node to the end of the list headed by 'head'.
+        void linkBefore(Node& head);
+        /// Remove this node from its list. It must be linked.
+        void unlink();
+        /// Previous node in the list.
+        Node* prev;
+        /// Next node in the list, or this node if it's not linked.
+        Node* next;
+        /**
+         * Index into TimerWheel::slots of the slot this node is in, or
+         * EXPIRED_SLOT if it's in TimerWheel::expired.
+         */
+        uint32_t slot;
+        friend class TimerWheel;
+        // Node is not copyable.
+        Node(const Node&) = delete;
+        Node& operator=(const Node&) = delete;
+    };
+
+    /**
+     * Constructor.
+     * \param now
+     *      The current tick. Nodes for this tick or earlier are expired
+     *      right away.
+     */
+    explicit TimerWheel(uint64_t now);
+
+    /**
+     * Destructor. Nodes still in the wheel are unlinked.
+     */
+    ~TimerWheel();
+
+    /**
+     * Add a node to the wheel.
+     * \param node
+     *      Node to add. If it's already in a wheel, it's moved.
+     * \param expiresTick
+     *      The tick at which the node expires. If the wheel has already
+     *      advanced past this, the node goes straight to the expired list.
+     */
+    void insert(Node& node, uint64_t expiresTick);
+
+    /**
+     * Remove a node from the wheel, if it's in it.
+     */
+    void remove(Node& node);
+
+    /**
+     * Move every node that expires at or before the given tick onto the
+     * expired list, to be collected with popExpired().
+     * \param now
+     *      The current tick. Ticks earlier than the last call are ignored.
+     */
+    void advance(uint64_t now);
+
+    /**
+     * Remove and return the oldest node on the expired list.
+     * \return
+     *      The node, or NULL if no nodes have expired.
+     */
+    Node* popExpired();
+
+    /**
+     * Return the earliest tick at which advance() might have something to do,
+     * or NONE if the wheel is empty. This is exact for nodes expiring within
+     * 256 ticks; for nodes further out, it's the tick at which they next
+     * cascade, which may be earlier than their expiry. If there are expired
+     * nodes waiting to be popped, this returns a tick that's already passed.
+     */
+    uint64_t nextTick() const;
+
+    /**
+     * Return the number of nodes in the wheel, including expired ones.
+     */
+    uint64_t size() const { return numNodes; }
+
+    /**
+     * Return the number of nodes on the expired list.
+     */
+    uint64_t numExpired() const { return numNodes - numPending; }
+
+  private:
+    /**
+     * The number of levels in the wheel.
+     */
+    enum { NUM_LEVELS = 5 };
+
+    /**
+     * The number of slots in the first level and in the other levels.
+     */
+    enum { LEVEL0_SLOTS = 256, LEVELN_SLOTS = 64 };
+
+    /**
+     * Total number of slots across all levels.
+     */
+    enum { NUM_SLOTS = LEVEL0_SLOTS + (NUM_LEVELS - 1) * LEVELN_SLOTS };
+
+    /**
+     * Node::slot value for nodes on the expired list.
+     */
+    enum { EXPIRED_SLOT = NUM_SLOTS };
+
+    /**
+     * Return log2 of the number of ticks spanned by each slot in the level.
+     */
+    static uint32_t levelShift(uint32_t level);
+
+    /**
+     * Return the index into #slots of the first slot in the level.
+     */
+    static uint32_t levelStart(uint32_t level);
+
+    /**
+     * Return the number of slots in the level.
+     */
+    static uint32_t levelSlots(uint32_t level);
+
+    /**
+     * Like nextTick(), but ignores the expired list.
+     */
+    uint64_t nextPendingTick() const;
+
+    /**
+     * Place a node into the slot for its expiresTick, relative to #current.
+     */
+    void place(Node& node);
+
+    /**
+     * Re-place all the nodes of one slot, which the wheel has just reached.
+     */
+    void cascade(uint32_t slot);
+
+    /**
+     * Return the smallest slot index of the level at or after 'from' that
+     * holds nodes, or levelSlots(level) if there is none.
+     */
+    uint32_t findSlot(uint32_t level, uint32_t from) const;
+
+    /**
+     * The next tick that advance() has yet to process.
+     */
+    uint64_t current;
+
+    /**
+     * The number of nodes in the wheel, including expired ones.
+     */
+    uint64_t numNodes;
+
+    /**
+     * The number of nodes in #slots (not counting expired ones).
+     */
+    uint64_t numPending;
+
+    /**
+     * The list heads for all of the slots of all of the levels.
+     */
+    Node slots[NUM_SLOTS];
+
+    /**
+     * One bit per slot, set if the slot is non-empty.
+     */
+    uint64_t occupied[NUM_SLOTS / 64];
+
+    /**
+     * The list head for expired nodes, oldest first.
+     */
+    Node expired;
+
+    // TimerWheel is not copyable.
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+};
+
+} // namespace LogCabin::Event
+} // namespace LogCabin
+
+#endif /* LOGCABIN_EVENT_TIMERWHEEL_H */
@@ -0,0 +1,239 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include "Event/TimerWheel.h"
+
+namespace LogCabin {
+namespace Event {
+namespace {
+
+typedef TimerWheel::Node Node;
+
+/**
+ * Advance the wheel one nextTick() at a time until 'node' expires, checking
+ * that nextTick() never overshoots it. Returns the tick at which it expired.
+ */
+uint64_t
+advanceUntilExpired(TimerWheel& wheel, Node& node)
+{
+    uint64_t expiresTick = node.expiresTick;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        uint64_t next = wheel.nextTick();
+        EXPECT_LE(next, expiresTick);
+        wheel.advance(next);
+        Node* popped = wheel.popExpired();
+        if (popped != NULL) {
+            EXPECT_EQ(&node, popped);
+            return next;
+        }
+    }
+    ADD_FAILURE() << "node never expired";
+    return 0;
+}
+
+TEST(EventTimerWheelTest, constructor) {
+    TimerWheel wheel(10);
+    EXPECT_EQ(0U, wheel.size());
+    EXPECT_EQ(TimerWheel::NONE, wheel.nextTick());
+    EXPECT_TRUE(wheel.popExpired() == NULL);
+}
+
+TEST(EventTimerWheelTest, destructor) {
+    Node node;
+    {
+        TimerWheel wheel(0);
+        wheel.insert(node, 5);
+        EXPECT_TRUE(node.isLinked());
+    }
+    EXPECT_FALSE(node.isLinked());
+}
+
+TEST(EventTimerWheelTest, insert) {
+    TimerWheel wheel(0);
+    Node node;
+    EXPECT_FALSE(node.isLinked());
+    wheel.insert(node, 5);
+    EXPECT_TRUE(node.isLinked());
+    EXPECT_EQ(1U, wheel.size());
+    EXPECT_EQ(5U, wheel.nextTick());
+    // moves the node
+    wheel.insert(node, 7);
+    EXPECT_EQ(1U, wheel.size());
+    EXPECT_EQ(7U, wheel.nextTick());
+    wheel.advance(6);
+    EXPECT_TRUE(wheel.popExpired() == NULL);
+    wheel.advance(7);
+    EXPECT_EQ(&node, wheel.popExpired());
+    EXPECT_FALSE(node.isLinked());
+    EXPECT_EQ(0U, wheel.size());
+}
+
+TEST(EventTimerWheelTest, insert_past) {
+    TimerWheel wheel(100);
+    Node node1;
+    Node node2;
+    wheel.insert(node1, 100);
+    wheel.insert(node2, 3);
+    EXPECT_EQ(2U, wheel.size());
+    EXPECT_EQ(2U, wheel.numExpired());
+    EXPECT_GT(100U, wheel.nextTick());
+    EXPECT_EQ(&node1, wheel.popExpired());
+    EXPECT_EQ(&node2, wheel.popExpired());
+    EXPECT_TRUE(wheel.popExpired() == NULL);
+}
+
+TEST(EventTimerWheelTest, remove) {
+    TimerWheel wheel(0);
+    Node node1;
+    Node node2;
+    Node node3;
+    wheel.insert(node1, 5);
+    wheel.insert(node2, 5);
+    wheel.insert(node3, 0);
+    wheel.remove(node1);
+    wheel.remove(node3);
+    EXPECT_FALSE(node1.isLinked());
+    EXPECT_FALSE(node3.isLinked());
+    EXPECT_EQ(1U, wheel.size());
+    EXPECT_EQ(0U, wheel.numExpired());
+    // ok to remove nodes that aren't in the wheel
+    wheel.remove(node1);
+    EXPECT_EQ(5U, wheel.nextTick());
+    wheel.remove(node2);
+    EXPECT_EQ(TimerWheel::NONE, wheel.nextTick());
+    wheel.advance(10);
+    EXPECT_TRUE(wheel.popExpired() == NULL);
+}
+
+TEST(EventTimerWheelTest, advance_order) {
+    TimerWheel wheel(0);
+    Node node1;
+    Node node2;
+    Node node3;
+    wheel.insert(node3, 300);
+    wheel.insert(node2, 20);
+    wheel.insert(node1, 10);
+    wheel.advance(400);
+    EXPECT_EQ(3U, wheel.numExpired());
+    EXPECT_EQ(&node1, wheel.popExpired());
+    EXPECT_EQ(&node2, wheel.popExpired());
+    EXPECT_EQ(&node3, wheel.popExpired());
+}
+
+TEST(EventTimerWheelTest, advance_empty) {
+    TimerWheel wheel(0);
+    wheel.advance(1000000);
+    Node node1;
+    Node node2;
+    wheel.insert(node1, 1000000);
+    wheel.insert(node2, 1000001);
+    EXPECT_EQ(&node1, wheel.popExpired());
+    EXPECT_TRUE(wheel.popExpired() == NULL);
+    wheel.advance(1000001);
+    EXPECT_EQ(&node2, wheel.popExpired());
+}
+
+TEST(EventTimerWheelTest, advance_cascade) {
+    uint64_t deltas[] = {
+        255, 256, 257, 1000,
+        (1UL << 14) - 1, 1UL << 14, (1UL << 14) + 1,
+        (1UL << 20) + 5, (1UL << 26) + 7,
+        (1UL << 32) - 1, (1UL << 32) + 3, 1UL << 40,
+    };
+    for (uint64_t start = 0; start < 2; ++start) {
+        for (auto it = std::begin(deltas); it != std::end(deltas); ++it) {
+            // start one tick in, and also just shy of a boundary
+            uint64_t now = start == 0 ? 1 : (1UL << 20) - 3;
+            TimerWheel wheel(now);
+            Node node;
+            wheel.insert(node, now + *it);
+            wheel.advance(now + *it - 1);
+            EXPECT_TRUE(wheel.popExpired() == NULL) << *it;
+            wheel.advance(now + *it);
+            EXPECT_EQ(&node, wheel.popExpired()) << *it;
+        }
+    }
+}
+
+TEST(EventTimerWheelTest, nextTick) {
+    uint64_t deltas[] = {
+        1, 200, 255, 256, 1000, 1UL << 14, (1UL << 20) + 5,
+        (1UL << 26) + 7, (1UL << 32) + 3, 1UL << 36,
+    };
+    for (auto it = std::begin(deltas); it != std::end(deltas); ++it) {
+        uint64_t now = 12345;
+        TimerWheel wheel(now);
+        Node node;
+        wheel.insert(node, now + *it);
+        EXPECT_EQ(now + *it, advanceUntilExpired(wheel, node)) << *it;
+    }
+}
+
+TEST(EventTimerWheelTest, nextTick_lowestLevelWrapped) {
+    TimerWheel wheel(250);
+    Node node;
+    wheel.insert(node, 260);
+    // The node's slot comes before the current one in the first level.
+    uint64_t next = wheel.nextTick();
+    EXPECT_LE(251U, next);
+    EXPECT_LE(next, 260U);
+    EXPECT_EQ(260U, advanceUntilExpired(wheel, node));
+}
+
+TEST(EventTimerWheelTest, many) {
+    // A deterministic mix of nodes, checked against their expiry ticks as the
+    // wheel advances by uneven steps.
+    TimerWheel wheel(0);
+    std::vector<std::unique_ptr<Node>> nodes;
+    uint64_t seed = 1;
+    for (uint32_t i = 0; i < 2000; ++i) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        uint64_t delta = (seed >> 33) % (1UL << (4 + (i % 24)));
+        nodes.emplace_back(new Node());
+        wheel.insert(*nodes.back(), delta);
+    }
+    // move some of them and remove others
+    for (uint32_t i = 0; i < nodes.size(); i += 7)
+        wheel.insert(*nodes.at(i), nodes.at(i)->expiresTick / 2 + 100);
+    for (uint32_t i = 3; i < nodes.size(); i += 11)
+        wheel.remove(*nodes.at(i));
+    uint64_t now = 0;
+    while (wheel.size() > 0) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        uint64_t next = wheel.nextTick();
+        if (seed % 3 == 0)
+            next = std::max(now, next) + (seed >> 40) % 5000;
+        ASSERT_NE(TimerWheel::NONE, next);
+        now = std::max(now, next);
+        wheel.advance(now);
+        while (Node* node = wheel.popExpired())
+            EXPECT_LE(node->expiresTick, now);
+        for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+            if ((*it)->isLinked()) {
+                ASSERT_GT((*it)->expiresTick, now);
+            }
+        }
+    }
+}
+
+} // namespace LogCabin::Event::<anonymous>
+} // namespace LogCabin::Event
+} // namespace LogCabin
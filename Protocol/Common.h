@@ -56,7 +56,13 @@ enum {
  */
 namespace VersionMessage {
 struct Request {
-    // empty
+    /**
+     * The largest version of the MessageSocket framing protocol that the
+     * client understands. Big endian. Clients older than version 2 send an
+     * empty request instead, so servers must treat a request that's too
+     * short to hold this field as coming from a version 1 client.
+     */
+    uint16_t maxVersionSupported;
 } __attribute__((packed));
 
 struct Response {
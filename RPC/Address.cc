@@ -17,8 +17,10 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/ip.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include <sstream>
 #include <vector>
@@ -32,6 +34,8 @@
 namespace LogCabin {
 namespace RPC {
 
+const char Address::UNIX_PREFIX[] = "unix:";
+
 Address::Address(const std::string& str, uint16_t defaultPort)
     : originalString(str)
     , hosts()
@@ -47,6 +51,11 @@ Address::Address(const std::string& str, uint16_t defaultPort)
         if (host.empty())
             continue;
 
+        if (isUnixString(host)) {
+            hosts.push_back({host, ""});
+            continue;
+        }
+
         size_t lastColon = host.rfind(':');
         if (lastColon != host.npos &&
             host.find(']', lastColon) == host.npos) {
@@ -95,6 +104,12 @@ Address::operator=(const Address& other)
     return *this;
 }
 
+bool
+Address::isUnixString(const std::string& str)
+{
+    return Core::StringUtil::startsWith(str, UNIX_PREFIX);
+}
+
 bool
 Address::isValid() const
 {
@@ -141,6 +156,13 @@ Address::getResolvedString() const
             ret << be16toh(addr->sin6_port);
             break;
         }
+        case AF_UNIX: {
+            const sockaddr_un* addr =
+                reinterpret_cast<const sockaddr_un*>(getSockAddr());
+            ret << UNIX_PREFIX;
+            ret << addr->sun_path;
+            break;
+        }
         default:
             return "Unknown protocol";
     }
@@ -168,6 +190,27 @@ Address::refresh(TimePoint timeout)
     size_t hostIdx = Core::Random::random32() % hosts.size();
     const std::string& host = hosts.at(hostIdx).first;
     const std::string& port = hosts.at(hostIdx).second;
+
+    if (isUnixString(host)) {
+        // No lookup needed: the path is the address.
+        std::string path = host.substr(strlen(UNIX_PREFIX));
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        if (path.empty() || path.length() >= sizeof(addr.sun_path)) {
+            WARNING("Invalid Unix domain socket path '%s' (must be 1 to %lu "
+                    "bytes long)",
+                    path.c_str(), sizeof(addr.sun_path) - 1);
+            return;
+        }
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.data(), path.length());
+        memset(&storage, 0, sizeof(storage));
+        memcpy(&storage, &addr, sizeof(addr));
+        len = socklen_t(offsetof(sockaddr_un, sun_path) + path.length() + 1);
+        VERBOSE("Result: %s", toString().c_str());
+        return;
+    }
+
     VERBOSE("Running getaddrinfo for host %s with port %s",
             host.c_str(), port.c_str());
 
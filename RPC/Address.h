@@ -49,6 +49,7 @@ class Address {
      *          - IPv4Address
      *          - [IPv6Address]:port
      *          - [IPv6Address]
+     *          - unix:/path/to/socket (a Unix domain socket on this host)
      *      Or a comma-delimited list of these to represent multiple hosts.
      * \param defaultPort
      *      The port number to use if none is specified in str.
@@ -72,6 +73,17 @@ class Address {
      */
     bool isValid() const;
 
+    /**
+     * Return true if the string given to the constructor is a Unix domain
+     * socket address (starting with UNIX_PREFIX), false otherwise.
+     */
+    static bool isUnixString(const std::string& str);
+
+    /**
+     * Addresses starting with this string name Unix domain sockets.
+     */
+    static const char UNIX_PREFIX[];
+
     /**
      * Return a sockaddr that may be used to connect a socket to this Address.
      * \return
@@ -130,6 +142,8 @@ class Address {
      * - Second component: an ASCII representation of the port number to use.
      *   It is stored in string form because that's sometimes how it comes into
      *   the constructor and always what refresh() needs to call getaddrinfo().
+     * For Unix domain sockets, the first component is the full
+     * "unix:/path" string and the second is empty.
      */
     std::vector<std::pair<std::string, std::string>> hosts;
 
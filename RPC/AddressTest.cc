@@ -218,6 +218,40 @@ TEST(RPCAddressTest, refresh_IPv6) {
               << "any address. " << disclaimer;
 }
 
+TEST(RPCAddressTest, constructor_unix) {
+    Address a("unix:/tmp/logcabin.sock,127.0.0.1:80", 90);
+    ASSERT_EQ(2U, a.hosts.size());
+    EXPECT_EQ("unix:/tmp/logcabin.sock", a.hosts.at(0).first);
+    EXPECT_EQ("", a.hosts.at(0).second);
+    EXPECT_EQ("127.0.0.1", a.hosts.at(1).first);
+    EXPECT_EQ("80", a.hosts.at(1).second);
+}
+
+TEST(RPCAddressTest, isUnixString) {
+    EXPECT_TRUE(Address::isUnixString("unix:/tmp/logcabin.sock"));
+    EXPECT_FALSE(Address::isUnixString("127.0.0.1:5254"));
+    EXPECT_FALSE(Address::isUnixString("unixhost:5254"));
+}
+
+TEST(RPCAddressTest, refresh_unix) {
+    Address a("unix:/tmp/logcabin.sock", 90);
+    a.refresh(TimePoint::max());
+    EXPECT_TRUE(a.isValid());
+    EXPECT_EQ(AF_UNIX, a.getSockAddr()->sa_family);
+    EXPECT_EQ("unix:/tmp/logcabin.sock", a.getResolvedString());
+    EXPECT_EQ("unix:/tmp/logcabin.sock (resolved to unix:/tmp/logcabin.sock)",
+              a.toString());
+
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    Address empty("unix:", 90);
+    empty.refresh(TimePoint::max());
+    EXPECT_FALSE(empty.isValid());
+
+    Address tooLong("unix:/" + std::string(200, 'x'), 90);
+    tooLong.refresh(TimePoint::max());
+    EXPECT_FALSE(tooLong.isValid());
+}
+
 } // namespace LogCabin::RPC::<anonymous>
 } // namespace LogCabin::RPC
 } // namespace LogCabin
@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 #include "Core/Debug.h"
+#include "Core/Endian.h"
 #include "Core/StringUtil.h"
 #include "Event/File.h"
 #include "Event/Loop.h"
@@ -100,6 +101,25 @@ ClientSession::MessageSocketHandler::handleReceivedMessage(
         return;
     }
 
+    if (messageId == Protocol::Common::VERSION_MESSAGE_ID) {
+        using Protocol::Common::VersionMessage::Response;
+        if (message.getLength() < sizeof(Response)) {
+            WARNING("Received a version response from the server that is "
+                    "too short (%lu bytes). Not compressing requests.",
+                    message.getLength());
+            return;
+        }
+        const Response* response =
+            static_cast<const Response*>(message.getData());
+        uint16_t serverVersion = be16toh(response->maxVersionSupported);
+        VERBOSE("Server supports max version %u", serverVersion);
+        if (serverVersion >= 2 && session.messageSocket) {
+            session.messageSocket->enableCompression(
+                session.COMPRESSION_MIN_BYTES);
+        }
+        return;
+    }
+
     auto it = session.responses.find(messageId);
     if (it == session.responses.end()) {
         VERBOSE("Received an unexpected response with message ID %lu. "
@@ -226,6 +246,8 @@ ClientSession::ClientSession(Event::Loop& eventLoop,
     : self() // makeSession will fill this in shortly
     , PING_TIMEOUT_NS(config.read<uint64_t>(
         "tcpHeartbeatTimeoutMilliseconds", 500) * 1000 * 1000)
+    , COMPRESSION_MIN_BYTES(config.read<uint32_t>(
+        "rpcCompressionThreshold", 8192))
     , eventLoop(eventLoop)
     , address(address)
     , messageSocketHandler(*this)
@@ -260,7 +282,8 @@ ClientSession::ClientSession(Event::Loop& eventLoop,
     // Setting NONBLOCK here makes connect return right away with EINPROGRESS.
     // Then we can monitor the fd until it's writable to know when it's done,
     // along with a timeout. See man page for connect under EINPROGRESS.
-    int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+    int fd = socket(address.getSockAddr()->sa_family,
+                    SOCK_STREAM|SOCK_NONBLOCK, 0);
     if (fd < 0) {
         errorMessage = "Failed to create socket";
         return;
@@ -329,6 +352,19 @@ ClientSession::ClientSession(Event::Loop& eventLoop,
 
     messageSocket.reset(new MessageSocket(
         messageSocketHandler, eventLoop, fd, maxMessageLength));
+
+    // Ask whether the server understands compressed messages. Older servers
+    // ignore the contents of this request and reply with version 1.
+    if (COMPRESSION_MIN_BYTES > 0) {
+        using Protocol::Common::VersionMessage::Request;
+        Request* request = new Request();
+        request->maxVersionSupported =
+            htobe16(MessageSocket::MAX_VERSION_SUPPORTED);
+        messageSocket->sendMessage(
+            Protocol::Common::VERSION_MESSAGE_ID,
+            Core::Buffer(request, sizeof(*request),
+                         Core::Buffer::deleteObjectFn<Request*>));
+    }
 }
 
 std::shared_ptr<ClientSession>
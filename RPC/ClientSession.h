@@ -266,6 +266,13 @@ class ClientSession {
      */
     const uint64_t PING_TIMEOUT_NS;
 
+    /**
+     * Requests with payloads of at least this many bytes are compressed, if
+     * the server supports it (checked with a version message right after
+     * connecting). 0 disables compression.
+     */
+    const uint32_t COMPRESSION_MIN_BYTES;
+
     /**
      * The event loop that is used for non-blocking I/O.
      */
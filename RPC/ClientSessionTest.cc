@@ -22,6 +22,7 @@
 
 #include "Core/CompatAtomic.h"
 #include "Core/Debug.h"
+#include "Core/Endian.h"
 #include "Event/Loop.h"
 #include "Event/Timer.h"
 #include "Protocol/Common.h"
@@ -124,6 +125,31 @@ TEST_F(RPCClientSessionTest, handleReceivedMessage_ping) {
     EXPECT_TRUE(session->timer.isScheduled());
 }
 
+TEST_F(RPCClientSessionTest, handleReceivedMessage_version) {
+    using Protocol::Common::VersionMessage::Response;
+    Response response;
+
+    // old server
+    response.maxVersionSupported = htobe16(1);
+    session->messageSocket->handler.handleReceivedMessage(
+        Protocol::Common::VERSION_MESSAGE_ID,
+        Core::Buffer(&response, sizeof(response), NULL));
+    EXPECT_EQ(0U, session->messageSocket->compressionMinBytes);
+
+    // too short
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    session->messageSocket->handler.handleReceivedMessage(
+        Protocol::Common::VERSION_MESSAGE_ID, Core::Buffer());
+    EXPECT_EQ(0U, session->messageSocket->compressionMinBytes);
+
+    response.maxVersionSupported = htobe16(2);
+    session->messageSocket->handler.handleReceivedMessage(
+        Protocol::Common::VERSION_MESSAGE_ID,
+        Core::Buffer(&response, sizeof(response), NULL));
+    EXPECT_EQ(8192U, session->messageSocket->compressionMinBytes);
+    EXPECT_EQ(0U, session->responses.size());
+}
+
 TEST_F(RPCClientSessionTest, handleDisconnect) {
     session->messageSocket->handler.handleDisconnect();
     EXPECT_EQ("Disconnected from server 127.0.0.1 (resolved to 127.0.0.1:0)",
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <errno.h>
 #include <netinet/in.h>
@@ -24,8 +25,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "Core/BufferPool.h"
 #include "Core/Debug.h"
 #include "Core/Endian.h"
+#include "Core/LZ4.h"
 #include "Event/Loop.h"
 #include "RPC/MessageSocket.h"
 
@@ -44,6 +47,67 @@ dupOrPanic(int oldfd)
     return newfd;
 }
 
+/**
+ * The default size of each MessageSocket::ReceiveChunk. Most RPCs are much
+ * smaller than this, so a single recv() usually picks up several of them.
+ */
+const size_t RECEIVE_CHUNK_BYTES = 64 * 1024;
+
+/**
+ * Set TCP_NODELAY on the socket, unless it's a Unix domain socket (which
+ * doesn't delay small writes to begin with).
+ * \param fd
+ *      The socket.
+ * \param direction
+ *      "sending" or "receiving", for the log message.
+ */
+void
+setNoDelay(int fd, const char* direction)
+{
+    sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addrLen) == 0 &&
+        addr.ss_family == AF_UNIX) {
+        return;
+    }
+    int flag = 1;
+    int r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (r < 0) {
+        // This should be a warning, but some unit tests pass weird types of
+        // file descriptors in here. It's not very important, anyhow.
+        NOTICE("Could not set TCP_NODELAY flag on %s socket %d: %s",
+               direction, fd, strerror(errno));
+    }
+}
+
+/**
+ * Compress a payload for a version 2 message (see MessageSocket::Header).
+ * \param[in,out] contents
+ *      The payload to compress. This is replaced with the compressed form
+ *      only if that turns out smaller.
+ * \return
+ *      True if 'contents' was replaced, false otherwise.
+ */
+bool
+compressPayload(Core::Buffer& contents)
+{
+    uint64_t length = contents.getLength();
+    char* compressed = static_cast<char*>(
+        Core::BufferPool::allocate(sizeof(uint32_t) +
+                                   Core::LZ4::maxCompressedLength(length)));
+    uint32_t beLength = htobe32(uint32_t(length));
+    memcpy(compressed, &beLength, sizeof(beLength));
+    uint64_t compressedLength = sizeof(uint32_t) +
+        Core::LZ4::compress(contents.getData(), length,
+                            compressed + sizeof(uint32_t));
+    if (compressedLength >= length) {
+        Core::BufferPool::release(compressed);
+        return false;
+    }
+    contents.setData(compressed, compressedLength, Core::BufferPool::release);
+    return true;
+}
+
 } // anonymous namespace
 
 ////////// MessageSocket::SendSocket //////////
@@ -53,14 +117,7 @@ MessageSocket::SendSocket::SendSocket(int fd,
     : Event::File(fd)
     , messageSocket(messageSocket)
 {
-    int flag = 1;
-    int r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
-    if (r < 0) {
-        // This should be a warning, but some unit tests pass weird types of
-        // file descriptors in here. It's not very important, anyhow.
-        NOTICE("Could not set TCP_NODELAY flag on sending socket %d: %s",
-               fd, strerror(errno));
-    }
+    setNoDelay(fd, "sending");
 }
 
 MessageSocket::SendSocket::~SendSocket()
@@ -82,14 +139,7 @@ MessageSocket::ReceiveSocket::ReceiveSocket(int fd,
 {
     // I don't know that TCP_NODELAY has any effect if we're only reading from
     // this file descriptor, but I guess it can't hurt.
-    int flag = 1;
-    int r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
-    if (r < 0) {
-        // This should be a warning, but some unit tests pass weird types of
-        // file descriptors in here. It's not very important, anyhow.
-        NOTICE("Could not set TCP_NODELAY flag on receiving socket %d: %s",
-                fd, strerror(errno));
-    }
+    setNoDelay(fd, "receiving");
 }
 
 MessageSocket::ReceiveSocket::~ReceiveSocket()
@@ -122,6 +172,27 @@ MessageSocket::Header::toBigEndian()
     messageId = htobe64(messageId);
 }
 
+////////// MessageSocket::ReceiveChunk //////////
+
+MessageSocket::ReceiveChunk::ReceiveChunk(size_t capacity)
+    : refCount(1)
+    , capacity(capacity)
+    , data(static_cast<char*>(Core::BufferPool::allocate(capacity)))
+{
+}
+
+MessageSocket::ReceiveChunk::~ReceiveChunk()
+{
+    Core::BufferPool::release(data);
+}
+
+void
+MessageSocket::ReceiveChunk::release(ReceiveChunk* chunk)
+{
+    if (--chunk->refCount == 0)
+        delete chunk;
+}
+
 ////////// MessageSocket::Inbound //////////
 
 MessageSocket::Inbound::Inbound()
@@ -148,13 +219,14 @@ MessageSocket::Outbound::Outbound(Outbound&& other)
 }
 
 MessageSocket::Outbound::Outbound(MessageId messageId,
-                                  Core::Buffer message)
+                                  Core::Buffer message,
+                                  uint16_t version)
     : bytesSent(0)
     , header()
     , message(std::move(message))
 {
     header.fixed = 0xdaf4;
-    header.version = 1;
+    header.version = version;
     header.payloadLength = uint32_t(this->message.getLength());
     header.messageId = messageId;
     header.toBigEndian();
@@ -176,10 +248,19 @@ MessageSocket::MessageSocket(Handler& handler,
                              uint32_t maxMessageLength)
     : maxMessageLength(maxMessageLength)
     , handler(handler)
+    , compressionMinBytes(0)
     , eventLoop(eventLoop)
     , inbound()
+    , receiveChunkBytes(RECEIVE_CHUNK_BYTES)
+    , receiveChunk(NULL)
+    , receiveOffset(0)
     , outboundQueueMutex()
     , outboundQueue()
+    , numSendCalls(0)
+    , numMessagesSent(0)
+    , numCompressed(0)
+    , bytesBeforeCompression(0)
+    , bytesAfterCompression(0)
     , receiveSocket(dupOrPanic(fd), *this)
     , sendSocket(fd, *this)
     , receiveSocketMonitor(eventLoop, receiveSocket, EPOLLIN)
@@ -189,6 +270,18 @@ MessageSocket::MessageSocket(Handler& handler,
 
 MessageSocket::~MessageSocket()
 {
+    if (numSendCalls > 0) {
+        VERBOSE("Sent %lu messages in %lu sendmsg calls on socket %d",
+                numMessagesSent, numSendCalls, sendSocket.fd);
+    }
+    if (numCompressed > 0) {
+        VERBOSE("Compressed %lu messages from %lu to %lu bytes on socket %d",
+                numCompressed, bytesBeforeCompression, bytesAfterCompression,
+                sendSocket.fd);
+    }
+    // Payloads already handed out keep the chunk alive as long as needed.
+    if (receiveChunk != NULL)
+        ReceiveChunk::release(receiveChunk);
 }
 
 void
@@ -213,17 +306,38 @@ MessageSocket::sendMessage(MessageId messageId, Core::Buffer contents)
               contents.getLength(), maxMessageLength);
     }
 
+    // Compress the message here, on the caller's thread, rather than on the
+    // event loop thread.
+    uint16_t version = 1;
+    uint64_t uncompressedLength = contents.getLength();
+    uint32_t minBytes = compressionMinBytes.load(std::memory_order_relaxed);
+    if (minBytes > 0 && uncompressedLength >= minBytes &&
+        compressPayload(contents)) {
+        version = 2;
+    }
+
     bool kick;
     { // Place the message on the outbound queue.
         std::lock_guard<Core::Mutex> lock(outboundQueueMutex);
+        if (version == 2) {
+            ++numCompressed;
+            bytesBeforeCompression += uncompressedLength;
+            bytesAfterCompression += contents.getLength();
+        }
         kick = outboundQueue.empty();
-        outboundQueue.emplace_back(messageId, std::move(contents));
+        outboundQueue.emplace_back(messageId, std::move(contents), version);
     }
     // Make sure the SendSocket is set up to call writable().
     if (kick)
         sendSocketMonitor.setEvents(EPOLLOUT|EPOLLONESHOT);
 }
 
+void
+MessageSocket::enableCompression(uint32_t minBytes)
+{
+    compressionMinBytes.store(minBytes, std::memory_order_relaxed);
+}
+
 void
 MessageSocket::disconnect()
 {
@@ -239,53 +353,9 @@ MessageSocket::readable()
 {
     // Try to read data from the kernel until there is no more left.
     while (true) {
-        if (inbound.bytesRead < sizeof(Header)) {
-            // Receiving header
-            ssize_t bytesRead = read(
-                reinterpret_cast<char*>(&inbound.header) + inbound.bytesRead,
-                sizeof(Header) - inbound.bytesRead);
-            if (bytesRead == -1) {
-                disconnect();
-                return;
-            }
-            inbound.bytesRead += size_t(bytesRead);
-            if (inbound.bytesRead < sizeof(Header))
-                return;
-            // Transition to receiving data
-            inbound.header.fromBigEndian();
-            if (inbound.header.fixed != 0xdaf4) {
-                WARNING("Disconnecting since message doesn't start with magic "
-                        "0xdaf4 (first two bytes are 0x%02x)",
-                        inbound.header.fixed);
-                disconnect();
-                return;
-            }
-            if (inbound.header.version != 1) {
-                WARNING("Disconnecting since message uses version %u, but "
-                        "this code only understands version 1",
-                        inbound.header.version);
-                disconnect();
-                return;
-            }
-            if (inbound.header.payloadLength > maxMessageLength) {
-                WARNING("Disconnecting since message is too long to receive "
-                        "(message is %u bytes, limit is %u bytes)",
-                        inbound.header.payloadLength, maxMessageLength);
-                disconnect();
-                return;
-            }
-            inbound.message.setData(new char[inbound.header.payloadLength],
-                                    inbound.header.payloadLength,
-                                    Core::Buffer::deleteArrayFn<char>);
-        }
-        // Don't use 'else' here; we want to check this branch for two reasons:
-        // First, if there is a header with a length of 0, the socket won't be
-        // readable, but we still need to process the message. Second, most of
-        // the time the header will arrive with at least some data. It makes
-        // sense to go ahead and try a non-blocking read, rather than going
-        // back to the event loop.
-        if (inbound.bytesRead >= sizeof(Header)) {
-            // Receiving data
+        if (inbound.message.getData() != NULL) {
+            // Receiving a message that's too large for a ReceiveChunk
+            // directly into its own buffer.
             size_t payloadBytesRead = inbound.bytesRead - sizeof(Header);
             ssize_t bytesRead = read(
                 (static_cast<char*>(inbound.message.getData()) +
@@ -300,12 +370,186 @@ MessageSocket::readable()
                                      inbound.header.payloadLength)) {
                 return;
             }
-            handler.handleReceivedMessage(inbound.header.messageId,
-                                          std::move(inbound.message));
-            // Transition to receiving header
+            // Transition to receiving into the chunk
             inbound.bytesRead = 0;
+            if (!deliver(inbound.header, std::move(inbound.message)))
+                return;
+            continue;
+        }
+
+        // Receive as much as fits into the chunk with a single recv(), then
+        // deliver every message that's now complete.
+        prepareReceiveChunk();
+        size_t end = receiveOffset + inbound.bytesRead;
+        size_t room = receiveChunk->capacity - end;
+        ssize_t bytesRead = read(receiveChunk->data + end, room);
+        if (bytesRead == -1) {
+            disconnect();
+            return;
+        }
+        inbound.bytesRead += size_t(bytesRead);
+        if (!deliverReceived())
+            return;
+        // If the kernel had less data than we had room for, it's drained.
+        // The socket is level-triggered, so more data arriving later will
+        // call readable() again.
+        if (size_t(bytesRead) < room)
+            return;
+    }
+}
+
+bool
+MessageSocket::deliverReceived()
+{
+    static_assert(sizeof(Header) >= sizeof(ReceiveChunk*),
+                  "releasePayload() needs room before the payload");
+    while (inbound.bytesRead >= sizeof(Header)) {
+        char* start = receiveChunk->data + receiveOffset;
+        Header header;
+        memcpy(&header, start, sizeof(Header));
+        header.fromBigEndian();
+        if (header.fixed != 0xdaf4) {
+            WARNING("Disconnecting since message doesn't start with magic "
+                    "0xdaf4 (first two bytes are 0x%02x)",
+                    header.fixed);
+            disconnect();
+            return false;
+        }
+        if (header.version < 1 || header.version > MAX_VERSION_SUPPORTED) {
+            WARNING("Disconnecting since message uses version %u, but "
+                    "this code only understands versions 1 through %u",
+                    header.version, MAX_VERSION_SUPPORTED);
+            disconnect();
+            return false;
+        }
+        if (header.payloadLength > maxMessageLength) {
+            WARNING("Disconnecting since message is too long to receive "
+                    "(message is %u bytes, limit is %u bytes)",
+                    header.payloadLength, maxMessageLength);
+            disconnect();
+            return false;
+        }
+        size_t length = sizeof(Header) + header.payloadLength;
+        if (length > receiveChunk->capacity) {
+            // Transition to receiving into a buffer of its own, starting with
+            // the part of the payload that's already arrived.
+            inbound.header = header;
+            Core::BufferPool::allocate(inbound.message,
+                                       header.payloadLength);
+            memcpy(inbound.message.getData(), start + sizeof(Header),
+                   inbound.bytesRead - sizeof(Header));
+            receiveOffset += inbound.bytesRead;
+            return true;
+        }
+        if (inbound.bytesRead < length)
+            break;
+        // Hand out the payload in place. The header is no longer needed, so
+        // the end of it remembers which chunk the payload belongs to.
+        char* payload = start + sizeof(Header);
+        ReceiveChunk* chunk = receiveChunk;
+        ++chunk->refCount;
+        memcpy(payload - sizeof(chunk), &chunk, sizeof(chunk));
+        receiveOffset += length;
+        inbound.bytesRead -= length;
+        if (!deliver(header, Core::Buffer(payload,
+                                          header.payloadLength,
+                                          releasePayload))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+MessageSocket::deliver(const Header& header, Core::Buffer payload)
+{
+    if (header.version == 2) {
+        uint32_t length = 0;
+        if (payload.getLength() >= sizeof(length)) {
+            memcpy(&length, payload.getData(), sizeof(length));
+            length = be32toh(length);
+        }
+        if (length > maxMessageLength) {
+            WARNING("Disconnecting since compressed message is too long to "
+                    "receive (message is %u bytes, limit is %u bytes)",
+                    length, maxMessageLength);
+            disconnect();
+            return false;
+        }
+        Core::Buffer contents;
+        Core::BufferPool::allocate(contents, length);
+        if (payload.getLength() < sizeof(length) ||
+            !Core::LZ4::decompress(
+                static_cast<const char*>(payload.getData()) + sizeof(length),
+                payload.getLength() - sizeof(length),
+                contents.getData(), length)) {
+            WARNING("Disconnecting since compressed message with ID %lu is "
+                    "corrupt",
+                    header.messageId);
+            disconnect();
+            return false;
         }
+        payload = std::move(contents);
+    }
+    handler.handleReceivedMessage(header.messageId, std::move(payload));
+    return true;
+}
+
+void
+MessageSocket::prepareReceiveChunk()
+{
+    if (receiveChunk == NULL) {
+        receiveChunk = new ReceiveChunk(receiveChunkBytes);
+        receiveOffset = 0;
+        return;
+    }
+    if (inbound.bytesRead == 0 && receiveChunk->refCount == 1) {
+        // Nobody else is using the chunk: start over at the beginning.
+        receiveOffset = 0;
+        return;
+    }
+    // Keep going while there's a reasonable amount of room left. A message
+    // that starts at offset 0 always fits, since larger ones are received
+    // into their own buffer.
+    size_t room = receiveChunk->capacity - receiveOffset - inbound.bytesRead;
+    if (receiveOffset == 0 ||
+        (room > 0 && room >= receiveChunk->capacity / 16)) {
+        return;
     }
+    // Move the partially received message to the start of a chunk. The
+    // current one can be reused only if no payloads still point into it.
+    if (receiveChunk->refCount == 1) {
+        memmove(receiveChunk->data,
+                receiveChunk->data + receiveOffset,
+                inbound.bytesRead);
+    } else {
+        ReceiveChunk* chunk = new ReceiveChunk(receiveChunkBytes);
+        memcpy(chunk->data,
+               receiveChunk->data + receiveOffset,
+               inbound.bytesRead);
+        ReceiveChunk::release(receiveChunk);
+        receiveChunk = chunk;
+    }
+    receiveOffset = 0;
+}
+
+void
+MessageSocket::unsharePayload(Core::Buffer& payload)
+{
+    if (payload.getDeleter() != releasePayload)
+        return;
+    Core::Buffer copy;
+    Core::BufferPool::allocate(copy, payload.getLength());
+    memcpy(copy.getData(), payload.getData(), payload.getLength());
+    payload = std::move(copy);
+}
+
+void
+MessageSocket::releasePayload(void* payload)
+{
+    ReceiveChunk* chunk;
+    memcpy(&chunk, static_cast<char*>(payload) - sizeof(chunk), sizeof(chunk));
+    ReceiveChunk::release(chunk);
 }
 
 ssize_t
@@ -326,35 +570,41 @@ MessageSocket::read(void* buf, size_t maxBytes)
 void
 MessageSocket::writable()
 {
-    // Each iteration of this loop tries to write one message
-    // from outboundQueue.
+    // Each iteration of this loop tries to write a batch of messages
+    // from outboundQueue with a single kernel call.
     while (true) {
 
-        // Get the next outbound message.
-        Outbound outbound;
+        // Find the next outbound messages. Only this thread pops from the
+        // queue, and sendMessage() only pushes onto its back, so these
+        // pointers remain valid after the lock is released.
+        Outbound* batch[MAX_SEND_BATCH];
+        size_t batchSize;
         int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
         {
             std::lock_guard<Core::Mutex> lock(outboundQueueMutex);
             if (outboundQueue.empty())
                 return;
-            outbound = std::move(outboundQueue.front());
-            outboundQueue.pop_front();
-            if (!outboundQueue.empty())
+            batchSize = std::min(outboundQueue.size(),
+                                 size_t(MAX_SEND_BATCH));
+            for (size_t i = 0; i < batchSize; ++i)
+                batch[i] = &outboundQueue[i];
+            if (outboundQueue.size() > batchSize)
                 flags |= MSG_MORE;
         }
 
-        // Use an iovec to send everything in one kernel call: one iov for the
-        // header, another for the payload.
-        enum { IOV_LEN = 2 };
-        struct iovec iov[IOV_LEN];
-        iov[0].iov_base = &outbound.header;
-        iov[0].iov_len = sizeof(Header);
-        iov[1].iov_base = outbound.message.getData();
-        iov[1].iov_len = outbound.message.getLength();
-
-        { // Skip the parts of the iovec that have already been sent.
-            size_t bytesSent = outbound.bytesSent;
-            for (uint32_t i = 0; i < IOV_LEN; ++i) {
+        // Use an iovec to send everything in one kernel call: one iov for
+        // each header, another for each payload.
+        struct iovec iov[MAX_SEND_BATCH * 2];
+        for (size_t i = 0; i < batchSize; ++i) {
+            iov[i * 2].iov_base = &batch[i]->header;
+            iov[i * 2].iov_len = sizeof(Header);
+            iov[i * 2 + 1].iov_base = batch[i]->message.getData();
+            iov[i * 2 + 1].iov_len = batch[i]->message.getLength();
+        }
+
+        { // Skip the parts of the first message that have already been sent.
+            size_t bytesSent = batch[0]->bytesSent;
+            for (uint32_t i = 0; i < 2; ++i) {
                 iov[i].iov_base = (static_cast<char*>(iov[i].iov_base) +
                                    bytesSent);
                 if (bytesSent < iov[i].iov_len) {
@@ -370,7 +620,7 @@ MessageSocket::writable()
         struct msghdr msg;
         memset(&msg, 0, sizeof(msg));
         msg.msg_iov = iov;
-        msg.msg_iovlen = IOV_LEN;
+        msg.msg_iovlen = batchSize * 2;
 
         // Do the actual send
         ssize_t bytesSent = sendmsg(sendSocket.fd, &msg, flags);
@@ -389,15 +639,34 @@ MessageSocket::writable()
                 PANIC("Error while writing to socket %d: %s",
                       sendSocket.fd, strerror(errno));
             }
+        } else {
+            ++numSendCalls;
         }
 
-        // Sent successfully.
-        outbound.bytesSent += size_t(bytesSent);
-        if (outbound.bytesSent != (sizeof(Header) +
-                                   outbound.message.getLength())) {
-            sendSocketMonitor.setEvents(EPOLLOUT|EPOLLONESHOT);
+        // Sent successfully. Find out how many messages were sent
+        // completely; the next one may have been sent partially.
+        size_t unaccounted = size_t(bytesSent);
+        size_t numDone = 0;
+        while (numDone < batchSize) {
+            Outbound& outbound = *batch[numDone];
+            size_t remaining = (sizeof(Header) +
+                                outbound.message.getLength() -
+                                outbound.bytesSent);
+            if (unaccounted < remaining) {
+                outbound.bytesSent += unaccounted;
+                break;
+            }
+            unaccounted -= remaining;
+            ++numDone;
+        }
+        numMessagesSent += numDone;
+        {
             std::lock_guard<Core::Mutex> lockGuard(outboundQueueMutex);
-            outboundQueue.emplace_front(std::move(outbound));
+            for (size_t i = 0; i < numDone; ++i)
+                outboundQueue.pop_front();
+        }
+        if (numDone < batchSize) {
+            sendSocketMonitor.setEvents(EPOLLOUT|EPOLLONESHOT);
             return;
         }
     }
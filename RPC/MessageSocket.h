@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <atomic>
+#include <climits>
 #include <deque>
 #include <vector>
 
@@ -43,6 +45,9 @@ namespace RPC {
  *     | 0xdaf4 | version | length | messageId |
  * See Header for more details. Following the header, the data is sent as an
  * opaque binary string.
+ *
+ * Once both sides have shown that they understand version 2 of the framing
+ * protocol (see enableCompression()), large payloads may be compressed.
  */
 class MessageSocket {
   public:
@@ -55,8 +60,9 @@ class MessageSocket {
 
     /**
      * Largest version of the framing protocol supported by this code.
+     * Version 2 adds compressed payloads; see Header::version.
      */
-    enum { MAX_VERSION_SUPPORTED = 1 };
+    enum { MAX_VERSION_SUPPORTED = 2 };
 
     /**
      * An interface for handling events generated by a MessageSocket.
@@ -140,6 +146,25 @@ class MessageSocket {
      */
     void sendMessage(MessageId messageId, Core::Buffer contents);
 
+    /**
+     * Start compressing outgoing messages with large payloads, where that
+     * makes them smaller. Only call this once the other side has shown that
+     * it understands version 2 of the framing protocol; compressed messages
+     * are always accepted on receive.
+     * This method is safe to call from any thread.
+     * \param minBytes
+     *      The smallest payload to compress, or 0 to stop compressing.
+     */
+    void enableCompression(uint32_t minBytes);
+
+    /**
+     * If 'payload' is a received message that points into the memory the
+     * socket received it into, replace it with a copy of its own. Received
+     * messages share that memory with each other, so one that's held for a
+     * long time would keep all of it allocated. Other Buffers are left as is.
+     */
+    static void unsharePayload(Core::Buffer& payload);
+
   private:
 
     /**
@@ -195,7 +220,11 @@ class MessageSocket {
         uint16_t fixed;
 
         /**
-         * Currently only version 1 is defined and supported. Big endian.
+         * In version 1, the payload is the message's contents. In version 2,
+         * the payload is compressed: it's the length of the message's
+         * contents as a 4-byte big endian integer followed by the contents
+         * as an LZ4 block (see Core/LZ4.h). Uncompressed messages are always
+         * sent as version 1. Big endian.
          */
         uint16_t version;
 
@@ -211,6 +240,40 @@ class MessageSocket {
         uint64_t messageId;
     } __attribute__((packed));
 
+    /**
+     * A reference-counted block of memory that the socket receives into.
+     * Received payloads are handed out as Core::Buffers pointing into the
+     * chunk, so that small messages need neither their own allocation nor
+     * their own recv() call. The chunk is freed once the socket and all of
+     * those Buffers are done with it.
+     */
+    struct ReceiveChunk {
+        /// Constructor. The new chunk has a reference count of 1.
+        explicit ReceiveChunk(size_t capacity);
+        /// Destructor.
+        ~ReceiveChunk();
+        /**
+         * Drop a reference to the chunk, deleting it if that was the last.
+         */
+        static void release(ReceiveChunk* chunk);
+        /**
+         * The number of references to this chunk: one for the socket while
+         * it's receiving into the chunk, plus one per payload handed out.
+         */
+        std::atomic<uint64_t> refCount;
+        /**
+         * The size of #data in bytes.
+         */
+        const size_t capacity;
+        /**
+         * The memory that messages are received into.
+         */
+        char* const data;
+        // ReceiveChunk is non-copyable.
+        ReceiveChunk(const ReceiveChunk&) = delete;
+        ReceiveChunk& operator=(const ReceiveChunk&) = delete;
+    };
+
     /**
      * This class stages a message while it is being received.
      */
@@ -222,13 +285,15 @@ class MessageSocket {
          */
         size_t bytesRead;
         /**
-         * If bytesRead >= sizeof(header), the header has been fully received
-         * and its fields are in host order. Otherwise, the header is still
-         * being received here.
+         * Only used for messages that don't fit in a ReceiveChunk: the header
+         * of the message, in host order. Smaller messages are parsed in place
+         * from #receiveChunk.
          */
         Header header;
         /**
-         * The contents of the message (after the header) are staged here.
+         * Only used for messages that don't fit in a ReceiveChunk: the
+         * contents of the message (after the header) are staged here. It is
+         * empty otherwise.
          */
         Core::Buffer message;
     };
@@ -242,7 +307,7 @@ class MessageSocket {
         /// Move constructor.
         Outbound(Outbound&& other);
         /// Constructor.
-        Outbound(MessageId messageId, Core::Buffer message);
+        Outbound(MessageId messageId, Core::Buffer message, uint16_t version);
         /// Move assignment.
         Outbound& operator=(Outbound&& other);
         /**
@@ -271,6 +336,45 @@ class MessageSocket {
      */
     void readable();
 
+    /**
+     * Hand every complete message in #receiveChunk to the handler. If the
+     * message being received is too large for a ReceiveChunk, this moves
+     * it into #inbound's own buffer instead. Used by readable().
+     * \return
+     *      True normally, false if the socket was disconnected because of a
+     *      malformed header, in which case the caller must immediately
+     *      return.
+     */
+    bool deliverReceived();
+
+    /**
+     * Decompress a received payload if needed and hand it to the handler.
+     * Used by readable() and deliverReceived().
+     * \param header
+     *      The message's header, in host order.
+     * \param payload
+     *      The message's payload as received.
+     * \return
+     *      True normally, false if the socket was disconnected because the
+     *      payload could not be decompressed, in which case the caller must
+     *      immediately return.
+     */
+    bool deliver(const Header& header, Core::Buffer payload);
+
+    /**
+     * Make sure #receiveChunk has free space at its end to receive into,
+     * moving the partially received message to the start of a chunk if
+     * needed. Used by readable().
+     */
+    void prepareReceiveChunk();
+
+    /**
+     * Core::Buffer deleter for payloads that point into a ReceiveChunk. The
+     * chunk's address is stored just before the payload, in space that held
+     * the message's header.
+     */
+    static void releasePayload(void* payload);
+
     /**
      * Wrapper around recv(); used by readable().
      * \param buf
@@ -286,10 +390,18 @@ class MessageSocket {
     ssize_t read(void* buf, size_t maxBytes);
 
     /**
-     * Called when the socket may be written to without blocking.
+     * Called when the socket may be written to without blocking. This sends
+     * as many queued messages as it can, gathering up to #MAX_SEND_BATCH of
+     * them into each sendmsg() call.
      */
     void writable();
 
+    /**
+     * The largest number of messages writable() passes to a single sendmsg()
+     * call. Each takes two iovecs: one for the header, one for the payload.
+     */
+    enum { MAX_SEND_BATCH = IOV_MAX / 2 };
+
     /**
      * The maximum number of bytes of payload to allow per message. This exists
      * to limit the amount of buffer space a single socket can use.
@@ -301,6 +413,12 @@ class MessageSocket {
      */
     Handler& handler;
 
+    /**
+     * Outgoing payloads of at least this many bytes are compressed, or none
+     * are if this is 0. See enableCompression().
+     */
+    std::atomic<uint32_t> compressionMinBytes;
+
     /**
      * Used to find out when the socket is readable or writable.
      */
@@ -311,6 +429,26 @@ class MessageSocket {
      */
     Inbound inbound;
 
+    /**
+     * The size of each ReceiveChunk in bytes. Messages (with their headers)
+     * larger than this are received into their own buffer. This is only
+     * changed by unit tests.
+     */
+    size_t receiveChunkBytes;
+
+    /**
+     * The chunk that data is currently received into, or NULL if nothing has
+     * been received yet. The socket holds one reference to it.
+     */
+    ReceiveChunk* receiveChunk;
+
+    /**
+     * The offset in #receiveChunk where the message currently being received
+     * starts. Its first inbound.bytesRead bytes have been received there
+     * (unless the message is too large for the chunk, see Inbound).
+     */
+    size_t receiveOffset;
+
     /**
      * Protects #outboundQueue only from concurrent modification.
      */
@@ -322,13 +460,43 @@ class MessageSocket {
      * queue is protected from concurrent modifications by #outboundQueueMutex.
      *
      * It's important that this remains a std::deque (or std::queue) because
-     * writable() holds a pointer to the first element without the lock, while
+     * writable() holds pointers to the first elements without the lock, while
      * sendMessage() may concurrently push onto the queue. std::deques are
      * guaranteed not to invalidate pointers while elements are pushed and
      * popped from the ends.
      */
     std::deque<Outbound> outboundQueue;
 
+    /**
+     * The number of sendmsg() calls that have sent data on this socket. Only
+     * accessed from writable().
+     */
+    uint64_t numSendCalls;
+
+    /**
+     * The number of messages that have been completely sent on this socket.
+     * Together with #numSendCalls, this shows how well writable() is able to
+     * batch messages. Only accessed from writable().
+     */
+    uint64_t numMessagesSent;
+
+    /**
+     * The number of messages that sendMessage() has compressed. Protected by
+     * #outboundQueueMutex.
+     */
+    uint64_t numCompressed;
+
+    /**
+     * The total size of the payloads counted in #numCompressed, before and
+     * after compression. Protected by #outboundQueueMutex.
+     */
+    uint64_t bytesBeforeCompression;
+
+    /**
+     * See #bytesBeforeCompression.
+     */
+    uint64_t bytesAfterCompression;
+
     /**
      * Notifies MessageSocket when the socket can be read from without
      * blocking.
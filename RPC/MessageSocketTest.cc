@@ -15,12 +15,14 @@
  */
 
 #include <memory>
+#include <string>
 #include <gtest/gtest.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
 #include "Core/Debug.h"
+#include "Core/Endian.h"
 #include "Event/Loop.h"
 #include "RPC/MessageSocket.h"
 
@@ -37,10 +39,12 @@ class MyMessageSocketHandler : public MessageSocket::Handler {
     MyMessageSocketHandler()
         : lastReceivedId(~0UL)
         , lastReceivedPayload()
+        , numReceived(0)
         , disconnected(false)
     {
     }
     void handleReceivedMessage(MessageId messageId, Buffer message) {
+        ++numReceived;
         lastReceivedId = messageId;
         lastReceivedPayload = std::move(message);
     }
@@ -50,6 +54,7 @@ class MyMessageSocketHandler : public MessageSocket::Handler {
     }
     MessageId lastReceivedId;
     Buffer lastReceivedPayload;
+    uint64_t numReceived;
     bool disconnected;
 };
 
@@ -70,6 +75,48 @@ class RPCMessageSocketTest : public ::testing::Test {
     {
         closeRemote();
     }
+    /**
+     * Format a message as it appears on the wire, with the first
+     * 'payloadLength' bytes of 'payload' as its contents.
+     */
+    std::string
+    frame(MessageSocket::MessageId messageId, uint32_t payloadLength,
+          uint16_t version = 1)
+    {
+        MessageSocket::Header header;
+        header.fixed = 0xdaf4;
+        header.version = version;
+        header.payloadLength = payloadLength;
+        header.messageId = messageId;
+        header.toBigEndian();
+        std::string wire(reinterpret_cast<const char*>(&header),
+                         sizeof(header));
+        for (uint32_t i = 0; i < payloadLength; ++i)
+            wire.push_back(payload[i % 64]);
+        return wire;
+    }
+
+    /**
+     * Send bytes [start, end) of 'wire' from the remote end.
+     */
+    void
+    sendRemote(const std::string& wire, size_t start, size_t end)
+    {
+        EXPECT_EQ(ssize_t(end - start),
+                  send(remote, wire.data() + start, end - start, 0));
+    }
+
+    /**
+     * Return the contents of the last message received as a string.
+     */
+    std::string
+    lastPayload()
+    {
+        return std::string(static_cast<const char*>(
+                               handler.lastReceivedPayload.getData()),
+                           handler.lastReceivedPayload.getLength());
+    }
+
     void
     closeRemote()
     {
@@ -108,6 +155,100 @@ TEST_F(RPCMessageSocketTest, sendMessage) {
     EXPECT_EQ(3U, outbound.message.getLength());
 }
 
+TEST_F(RPCMessageSocketTest, sendMessage_compressed) {
+    char repetitive[64];
+    memset(repetitive, 'x', sizeof(repetitive));
+
+    // not enabled
+    msgSocket->sendMessage(1, Buffer(repetitive, 64, NULL));
+    // too short
+    msgSocket->enableCompression(32);
+    msgSocket->sendMessage(2, Buffer(repetitive, 31, NULL));
+    // doesn't get smaller
+    msgSocket->sendMessage(3, Buffer(const_cast<char*>(payload), 64, NULL));
+    // compressed
+    msgSocket->sendMessage(4, Buffer(repetitive, 64, NULL));
+
+    ASSERT_EQ(4U, msgSocket->outboundQueue.size());
+    for (uint32_t i = 0; i < 3; ++i) {
+        MessageSocket::Outbound& outbound = msgSocket->outboundQueue.at(i);
+        outbound.header.fromBigEndian();
+        EXPECT_EQ(1U, outbound.header.version) << i;
+    }
+    MessageSocket::Outbound& outbound = msgSocket->outboundQueue.at(3);
+    outbound.header.fromBigEndian();
+    EXPECT_EQ(2U, outbound.header.version);
+    EXPECT_GT(64U, outbound.header.payloadLength);
+    EXPECT_EQ(outbound.header.payloadLength, outbound.message.getLength());
+    EXPECT_EQ(1U, msgSocket->numCompressed);
+    EXPECT_EQ(64U, msgSocket->bytesBeforeCompression);
+    EXPECT_EQ(outbound.message.getLength(), msgSocket->bytesAfterCompression);
+}
+
+TEST_F(RPCMessageSocketTest, readableCompressed) {
+    // Loop a compressed message back through the remote end.
+    char repetitive[64];
+    memset(repetitive, 'x', sizeof(repetitive));
+    msgSocket->enableCompression(1);
+    msgSocket->sendMessage(5, Buffer(repetitive, 64, NULL));
+    msgSocket->writable();
+    ASSERT_FALSE(handler.disconnected);
+    char wire[sizeof(MessageSocket::Header) + 64];
+    ssize_t length = recv(remote, wire, sizeof(wire), 0);
+    ASSERT_LT(ssize_t(sizeof(MessageSocket::Header)), length);
+    ASSERT_GT(ssize_t(sizeof(wire)), length);
+    sendRemote(std::string(wire, size_t(length)), 0, size_t(length));
+    msgSocket->readable();
+    ASSERT_FALSE(handler.disconnected);
+    EXPECT_EQ(5U, handler.lastReceivedId);
+    EXPECT_EQ(std::string(repetitive, 64), lastPayload());
+}
+
+TEST_F(RPCMessageSocketTest, readableCompressedTooLong) {
+    std::string wire = frame(0, 8, 2);
+    uint32_t length = htobe32(65);
+    wire.replace(sizeof(MessageSocket::Header), sizeof(length),
+                 reinterpret_cast<const char*>(&length), sizeof(length));
+    sendRemote(wire, 0, wire.size());
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+    EXPECT_EQ(0U, handler.numReceived);
+}
+
+TEST_F(RPCMessageSocketTest, readableCompressedCorrupt) {
+    // a valid length followed by a block that claims more literals than it
+    // has
+    std::string wire = frame(0, 8, 2);
+    uint32_t length = htobe32(10);
+    wire.replace(sizeof(MessageSocket::Header), sizeof(length),
+                 reinterpret_cast<const char*>(&length), sizeof(length));
+    wire.at(sizeof(MessageSocket::Header) + sizeof(length)) = '\xa0';
+    sendRemote(wire, 0, wire.size());
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+    EXPECT_EQ(0U, handler.numReceived);
+}
+
+TEST_F(RPCMessageSocketTest, readableCompressedTooShort) {
+    std::string wire = frame(0, 2, 2);
+    sendRemote(wire, 0, wire.size());
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+    EXPECT_EQ(0U, handler.numReceived);
+}
+
+TEST_F(RPCMessageSocketTest, readableBadVersion) {
+    std::string wire = frame(0, 2, 3);
+    sendRemote(wire, 0, wire.size());
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+    EXPECT_EQ(0U, handler.numReceived);
+}
+
 TEST_F(RPCMessageSocketTest, readableSpurious) {
     msgSocket->readable();
     EXPECT_FALSE(handler.disconnected);
@@ -184,10 +325,10 @@ TEST_F(RPCMessageSocketTest, readableAllAtOnce) {
     header.fromBigEndian();
     strncpy(buf + sizeof(header), payload, 64);
     EXPECT_EQ(ssize_t(sizeof(buf)), send(remote, buf, sizeof(buf), 0));
-    // will do one read for the header
+    // will do one read for the whole message
     msgSocket->readable();
     ASSERT_FALSE(handler.disconnected);
-    // and a second read for the data
+    // and a second read finds nothing more
     msgSocket->readable();
     ASSERT_FALSE(handler.disconnected);
     EXPECT_EQ(header.messageId, handler.lastReceivedId);
@@ -232,6 +373,132 @@ TEST_F(RPCMessageSocketTest, readableBytewise) {
     EXPECT_EQ(1U, msgSocket->inbound.bytesRead);
 }
 
+TEST_F(RPCMessageSocketTest, readableSeveralAtOnce) {
+    std::string wire = frame(1, 0) + frame(2, 3) + frame(3, 64);
+    sendRemote(wire, 0, wire.size());
+    msgSocket->readable();
+    ASSERT_FALSE(handler.disconnected);
+    EXPECT_EQ(3U, handler.numReceived);
+    EXPECT_EQ(3U, handler.lastReceivedId);
+    EXPECT_EQ(payload, lastPayload());
+    EXPECT_EQ(0U, msgSocket->inbound.bytesRead);
+    // the socket and the last payload share the chunk
+    EXPECT_EQ(2U, msgSocket->receiveChunk->refCount);
+    handler.lastReceivedPayload.reset();
+    EXPECT_EQ(1U, msgSocket->receiveChunk->refCount);
+}
+
+TEST_F(RPCMessageSocketTest, readablePayloadOutlivesSocket) {
+    std::string wire = frame(1, 64);
+    sendRemote(wire, 0, wire.size());
+    msgSocket->readable();
+    ASSERT_EQ(1U, handler.numReceived);
+    msgSocket.reset();
+    EXPECT_EQ(payload, lastPayload());
+}
+
+TEST_F(RPCMessageSocketTest, readableMoveToNewChunk) {
+    msgSocket->receiveChunkBytes = 100;
+    std::string wire = frame(1, 64) + frame(2, 64);
+    sendRemote(wire, 0, 90);
+    msgSocket->readable();
+    ASSERT_EQ(1U, handler.numReceived);
+    EXPECT_EQ(10U, msgSocket->inbound.bytesRead);
+    EXPECT_EQ(80U, msgSocket->receiveOffset);
+    MessageSocket::ReceiveChunk* first = msgSocket->receiveChunk;
+    const char* firstPayload = static_cast<const char*>(
+        handler.lastReceivedPayload.getData());
+
+    // The first payload is still held, so the rest of the second message
+    // can't go into the same chunk.
+    sendRemote(wire, 90, wire.size());
+    msgSocket->readable();
+    ASSERT_FALSE(handler.disconnected);
+    EXPECT_EQ(2U, handler.numReceived);
+    EXPECT_EQ(2U, handler.lastReceivedId);
+    EXPECT_EQ(payload, lastPayload());
+    EXPECT_NE(first, msgSocket->receiveChunk);
+    EXPECT_NE(firstPayload, handler.lastReceivedPayload.getData());
+    EXPECT_EQ(0U, msgSocket->inbound.bytesRead);
+}
+
+TEST_F(RPCMessageSocketTest, readableReuseChunk) {
+    msgSocket->receiveChunkBytes = 100;
+    std::string wire = frame(1, 64) + frame(2, 64);
+    sendRemote(wire, 0, 90);
+    msgSocket->readable();
+    ASSERT_EQ(1U, handler.numReceived);
+    MessageSocket::ReceiveChunk* first = msgSocket->receiveChunk;
+    handler.lastReceivedPayload.reset();
+
+    // Nothing points into the chunk anymore, so the partial message is moved
+    // to its start.
+    sendRemote(wire, 90, wire.size());
+    msgSocket->readable();
+    ASSERT_FALSE(handler.disconnected);
+    EXPECT_EQ(2U, handler.numReceived);
+    EXPECT_EQ(payload, lastPayload());
+    EXPECT_EQ(first, msgSocket->receiveChunk);
+    EXPECT_EQ(first->data + sizeof(MessageSocket::Header),
+              handler.lastReceivedPayload.getData());
+}
+
+TEST_F(RPCMessageSocketTest, readableLargerThanChunk) {
+    msgSocket->receiveChunkBytes = 32;
+    std::string wire = frame(1, 64);
+    sendRemote(wire, 0, 40);
+    msgSocket->readable();
+    ASSERT_FALSE(handler.disconnected);
+    EXPECT_EQ(0U, handler.numReceived);
+    EXPECT_EQ(40U, msgSocket->inbound.bytesRead);
+    EXPECT_EQ(64U, msgSocket->inbound.message.getLength());
+
+    sendRemote(wire, 40, wire.size());
+    msgSocket->readable();
+    ASSERT_FALSE(handler.disconnected);
+    EXPECT_EQ(1U, handler.numReceived);
+    EXPECT_EQ(payload, lastPayload());
+    EXPECT_TRUE(msgSocket->inbound.message.getData() == NULL);
+
+    // small messages go back to the chunk
+    wire = frame(2, 3);
+    sendRemote(wire, 0, wire.size());
+    msgSocket->readable();
+    EXPECT_EQ(2U, handler.numReceived);
+    EXPECT_EQ("abc", lastPayload());
+    EXPECT_EQ(msgSocket->receiveChunk->data + sizeof(MessageSocket::Header),
+              handler.lastReceivedPayload.getData());
+}
+
+TEST_F(RPCMessageSocketTest, unsharePayload) {
+    std::string wire = frame(1, 64);
+    sendRemote(wire, 0, wire.size());
+    msgSocket->readable();
+    ASSERT_EQ(1U, handler.numReceived);
+    EXPECT_EQ(2U, msgSocket->receiveChunk->refCount);
+    MessageSocket::unsharePayload(handler.lastReceivedPayload);
+    EXPECT_EQ(1U, msgSocket->receiveChunk->refCount);
+    EXPECT_EQ(payload, lastPayload());
+    EXPECT_NE(msgSocket->receiveChunk->data + sizeof(MessageSocket::Header),
+              handler.lastReceivedPayload.getData());
+}
+
+TEST_F(RPCMessageSocketTest, unsharePayload_notShared) {
+    msgSocket->receiveChunkBytes = 32;
+    std::string wire = frame(1, 64);
+    sendRemote(wire, 0, wire.size());
+    msgSocket->readable();
+    ASSERT_EQ(1U, handler.numReceived);
+    const void* data = handler.lastReceivedPayload.getData();
+    MessageSocket::unsharePayload(handler.lastReceivedPayload);
+    EXPECT_EQ(data, handler.lastReceivedPayload.getData());
+    EXPECT_EQ(payload, lastPayload());
+
+    Buffer empty;
+    MessageSocket::unsharePayload(empty);
+    EXPECT_TRUE(empty.getData() == NULL);
+}
+
 TEST_F(RPCMessageSocketTest, writableSpurious) {
     msgSocket->writable();
 }
@@ -275,6 +542,52 @@ TEST_F(RPCMessageSocketTest, writableNormal) {
     }
 }
 
+TEST_F(RPCMessageSocketTest, writableBatch) {
+    std::string expected;
+    for (uint32_t i = 0; i < 3; ++i) {
+        msgSocket->sendMessage(i,
+                               Buffer(const_cast<char*>(payload), 64, NULL));
+        expected += frame(i, 64);
+    }
+    // skip part of the first message's payload
+    msgSocket->outboundQueue.front().bytesSent = 20;
+    expected.erase(0, 20);
+    msgSocket->writable();
+    ASSERT_FALSE(handler.disconnected);
+    EXPECT_EQ(0U, msgSocket->outboundQueue.size());
+    EXPECT_EQ(1U, msgSocket->numSendCalls);
+    EXPECT_EQ(3U, msgSocket->numMessagesSent);
+    char buf[1024];
+    ASSERT_EQ(ssize_t(expected.size()), recv(remote, buf, sizeof(buf), 0));
+    EXPECT_EQ(expected, std::string(buf, expected.size()));
+}
+
+TEST_F(RPCMessageSocketTest, writablePartialBatch) {
+    int sendBufferSize = 4096;
+    ASSERT_EQ(0, setsockopt(msgSocket->sendSocket.fd, SOL_SOCKET, SO_SNDBUF,
+                            &sendBufferSize, sizeof(sendBufferSize)));
+    std::string expected;
+    uint32_t numMessages = MessageSocket::MAX_SEND_BATCH * 3;
+    for (uint32_t i = 0; i < numMessages; ++i) {
+        msgSocket->sendMessage(i,
+                               Buffer(const_cast<char*>(payload), 64, NULL));
+        expected += frame(i, 64);
+    }
+    std::string actual;
+    for (uint32_t i = 0; i < 10000 && actual.size() < expected.size(); ++i) {
+        msgSocket->writable();
+        ASSERT_FALSE(handler.disconnected);
+        char buf[4096];
+        ssize_t bytesRead = recv(remote, buf, sizeof(buf), 0);
+        if (bytesRead > 0)
+            actual.append(buf, size_t(bytesRead));
+    }
+    EXPECT_EQ(0U, msgSocket->outboundQueue.size());
+    EXPECT_EQ(numMessages, msgSocket->numMessagesSent);
+    EXPECT_LT(1U, msgSocket->numSendCalls);
+    EXPECT_TRUE(expected == actual);
+}
+
 } // namespace LogCabin::RPC::<anonymous>
 } // namespace LogCabin::RPC
 } // namespace LogCabin
@@ -19,9 +19,11 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "Core/Debug.h"
+#include "Core/Endian.h"
 #include "Event/Loop.h"
 #include "Protocol/Common.h"
 #include "RPC/Address.h"
@@ -31,6 +33,41 @@
 namespace LogCabin {
 namespace RPC {
 
+namespace {
+
+/**
+ * If the Unix domain socket file at the given address was left behind by a
+ * server that's no longer running, remove it. This is called after bind()
+ * fails with EADDRINUSE.
+ * \return
+ *      True if the file was removed, so that bind() may be retried; false if
+ *      some process is still accepting connections on it (or it couldn't be
+ *      removed).
+ */
+bool
+removeStaleUnixSocket(const Address& address)
+{
+    const sockaddr_un* addr =
+        reinterpret_cast<const sockaddr_un*>(address.getSockAddr());
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        PANIC("Could not create new Unix domain socket");
+    int r = connect(fd, address.getSockAddr(), address.getSockAddrLen());
+    bool stale = (r != 0 && errno == ECONNREFUSED);
+    close(fd);
+    if (!stale)
+        return false;
+    NOTICE("Removing stale Unix domain socket file %s", addr->sun_path);
+    if (unlink(addr->sun_path) != 0) {
+        WARNING("Could not remove stale socket file %s: %s",
+                addr->sun_path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+} // anonymous namespace
+
 
 ////////// OpaqueServer::MessageSocketHandler //////////
 
@@ -63,6 +100,19 @@ OpaqueServer::MessageSocketHandler::handleReceivedMessage(
                 VERBOSE("Responding to version request "
                         "(this server supports max version %u)",
                         MessageSocket::MAX_VERSION_SUPPORTED);
+                // Compress responses if the client understands them.
+                using Protocol::Common::VersionMessage::Request;
+                uint16_t clientVersion = 1;
+                if (message.getLength() >= sizeof(Request)) {
+                    const Request* request = static_cast<const Request*>(
+                        message.getData());
+                    clientVersion = be16toh(request->maxVersionSupported);
+                }
+                if (clientVersion >= 2) {
+                    socketRef->monitor.enableCompression(
+                        server->compressionMinBytes.load(
+                            std::memory_order_relaxed));
+                }
                 using Protocol::Common::VersionMessage::Response;
                 Response* response = new Response();
                 response->maxVersionSupported =
@@ -91,7 +141,10 @@ OpaqueServer::MessageSocketHandler::handleDisconnect()
         // This drops the reference count on the socket. It may cause the
         // SocketWithHandler object (which includes this object) to be
         // destroyed when 'socketRef' goes out of scope.
-        server->sockets.erase(socketRef);
+        {
+            std::lock_guard<Core::Mutex> lockGuard(server->socketsMutex);
+            server->sockets.erase(socketRef);
+        }
         server = NULL;
     }
 }
@@ -100,19 +153,24 @@ OpaqueServer::MessageSocketHandler::handleDisconnect()
 ////////// OpaqueServer::SocketWithHandler //////////
 
 std::shared_ptr<OpaqueServer::SocketWithHandler>
-OpaqueServer::SocketWithHandler::make(OpaqueServer* server, int fd)
+OpaqueServer::SocketWithHandler::make(OpaqueServer* server,
+                                      int fd,
+                                      size_t loopIndex)
 {
     std::shared_ptr<SocketWithHandler> socket(
-        new SocketWithHandler(server, fd));
+        new SocketWithHandler(server, fd, loopIndex));
     socket->handler.self = socket;
     return socket;
 }
 
 OpaqueServer::SocketWithHandler::SocketWithHandler(
         OpaqueServer* server,
-        int fd)
-    : handler(server)
-    , monitor(handler, server->eventLoop, fd, server->maxMessageLength)
+        int fd,
+        size_t loopIndex)
+    : loopIndex(loopIndex)
+    , handler(server)
+    , monitor(handler, *server->socketLoops.at(loopIndex), fd,
+              server->maxMessageLength)
 {
 }
 
@@ -143,7 +201,7 @@ OpaqueServer::BoundListener::handleFileEvent(uint32_t events)
               fd, strerror(errno));
     }
 
-    server.sockets.insert(SocketWithHandler::make(&server, clientfd));
+    server.addSocket(clientfd);
 }
 
 
@@ -167,13 +225,28 @@ OpaqueServer::BoundListenerWithMonitor::~BoundListenerWithMonitor()
 OpaqueServer::OpaqueServer(Handler& handler,
                            Event::Loop& eventLoop,
                            uint32_t maxMessageLength)
+    : OpaqueServer(handler, eventLoop, {&eventLoop}, maxMessageLength)
+{
+}
+
+OpaqueServer::OpaqueServer(Handler& handler,
+                           Event::Loop& eventLoop,
+                           const std::vector<Event::Loop*>& socketLoops,
+                           uint32_t maxMessageLength)
     : rpcHandler(handler)
     , eventLoop(eventLoop)
+    , socketLoops(socketLoops)
     , maxMessageLength(maxMessageLength)
+    , compressionMinBytes(0)
     , sockets()
+    , socketsMutex()
+    , nextSocketLoop(0)
+    , numPendingSockets(socketLoops.size(), 0)
     , boundListenersMutex()
     , boundListeners()
 {
+    if (socketLoops.empty())
+        PANIC("OpaqueServer needs at least one event loop for its sockets");
 }
 
 OpaqueServer::~OpaqueServer()
@@ -187,15 +260,53 @@ OpaqueServer::~OpaqueServer()
     // Stop the socket objects from handling new RPCs and accessing the
     // 'sockets' set. They may continue to process existing RPCs, though
     // idle sockets will be destroyed here.
+    for (size_t i = 0; i < socketLoops.size(); ++i) {
+        // Block the sockets' event loop to operate on them safely.
+        Event::Loop::Lock loopGuard(*socketLoops.at(i));
+        // Create any sockets still queued up by addSocket(), so that they're
+        // dropped below rather than referring to this object later.
+        socketLoops.at(i)->runPosted();
+        std::lock_guard<Core::Mutex> lockGuard(socketsMutex);
+        for (auto it = sockets.begin(); it != sockets.end(); ) {
+            if ((*it)->loopIndex == i) {
+                (*it)->handler.server = NULL;
+                it = sockets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+void
+OpaqueServer::addSocket(int fd)
+{
+    size_t loopIndex = 0;
     {
-        // Block the event loop to operate on 'sockets' safely.
-        Event::Loop::Lock lockGuard(eventLoop);
-        for (auto it = sockets.begin(); it != sockets.end(); ++it) {
-            std::shared_ptr<SocketWithHandler> socket = *it;
-            socket->handler.server = NULL;
+        std::lock_guard<Core::Mutex> lockGuard(socketsMutex);
+        if (socketLoops.size() > 1) {
+            std::vector<uint64_t> numSockets(numPendingSockets);
+            for (auto it = sockets.begin(); it != sockets.end(); ++it)
+                ++numSockets.at((*it)->loopIndex);
+            loopIndex = nextSocketLoop;
+            for (size_t i = 1; i < socketLoops.size(); ++i) {
+                size_t j = (nextSocketLoop + i) % socketLoops.size();
+                if (numSockets.at(j) < numSockets.at(loopIndex))
+                    loopIndex = j;
+            }
+            nextSocketLoop = (loopIndex + 1) % socketLoops.size();
         }
-        sockets.clear();
+        ++numPendingSockets.at(loopIndex);
     }
+
+    // Have the socket's event loop create it, rather than stopping that loop
+    // with an Event::Loop::Lock. Either way, the loop can't handle any events
+    // for the socket until it's fully constructed and in 'sockets'.
+    socketLoops.at(loopIndex)->post([this, fd, loopIndex] () {
+        std::lock_guard<Core::Mutex> lockGuard(socketsMutex);
+        --numPendingSockets.at(loopIndex);
+        sockets.insert(SocketWithHandler::make(this, fd, loopIndex));
+    });
 }
 
 std::string
@@ -208,9 +319,10 @@ OpaqueServer::bind(const Address& listenAddress)
                       listenAddress.toString().c_str());
     }
 
-    int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    int family = listenAddress.getSockAddr()->sa_family;
+    int fd = socket(family, SOCK_STREAM|SOCK_CLOEXEC, 0);
     if (fd < 0)
-        PANIC("Could not create new TCP socket");
+        PANIC("Could not create new socket: %s", strerror(errno));
 
     int flag = 1;
     int r = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
@@ -223,6 +335,11 @@ OpaqueServer::bind(const Address& listenAddress)
 
     r = ::bind(fd, listenAddress.getSockAddr(),
                    listenAddress.getSockAddrLen());
+    if (r != 0 && errno == EADDRINUSE && family == AF_UNIX &&
+        removeStaleUnixSocket(listenAddress)) {
+        r = ::bind(fd, listenAddress.getSockAddr(),
+                       listenAddress.getSockAddrLen());
+    }
     if (r != 0) {
         std::string msg =
             format("Could not bind to address %s: %s%s",
@@ -250,5 +367,11 @@ OpaqueServer::bind(const Address& listenAddress)
     return "";
 }
 
+void
+OpaqueServer::enableCompression(uint32_t minBytes)
+{
+    compressionMinBytes.store(minBytes, std::memory_order_relaxed);
+}
+
 } // namespace LogCabin::RPC
 } // namespace LogCabin
@@ -18,6 +18,7 @@
 #include <memory>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 #include "Core/CompatHash.h"
 #include "RPC/MessageSocket.h"
@@ -46,7 +47,7 @@ class OpaqueServerRPC;
 /**
  * An OpaqueServer listens for incoming RPCs over TCP connections.
  * OpaqueServers can be created from any thread, but they will always run on
- * the thread running the Event::Loop.
+ * the threads running their Event::Loops.
  */
 class OpaqueServer {
   public:
@@ -89,6 +90,29 @@ class OpaqueServer {
                  Event::Loop& eventLoop,
                  uint32_t maxMessageLength);
 
+    /**
+     * Constructor that spreads accepted connections across several event
+     * loops, each presumably run by its own thread. Each new connection is
+     * assigned to the loop with the fewest open connections (taking turns
+     * when there's a tie), and it stays on that loop until it's closed.
+     * \param handler
+     *      Handles inbound RPCs. Note that it will be called from the threads
+     *      of all of the 'socketLoops'.
+     * \param eventLoop
+     *      Event::Loop that will be used to find out when new connections
+     *      arrive.
+     * \param socketLoops
+     *      Event::Loops that will be used to find out when accepted sockets
+     *      may be read from or written to without blocking. This may include
+     *      'eventLoop'. Must not be empty.
+     * \param maxMessageLength
+     *      See the other constructor.
+     */
+    OpaqueServer(Handler& handler,
+                 Event::Loop& eventLoop,
+                 const std::vector<Event::Loop*>& socketLoops,
+                 uint32_t maxMessageLength);
+
     /**
      * Destructor. OpaqueServerRPC objects originating from this OpaqueServer
      * may be kept around after this destructor returns; however, they won't
@@ -110,6 +134,16 @@ class OpaqueServer {
      */
     std::string bind(const Address& listenAddress);
 
+    /**
+     * Compress large responses on connections whose clients support it
+     * (see MessageSocket::enableCompression()). This applies to connections
+     * whose clients check the server's version from now on.
+     * This method is thread-safe.
+     * \param minBytes
+     *      The smallest response payload to compress, or 0 to compress none.
+     */
+    void enableCompression(uint32_t minBytes);
+
   private:
 
     // forward declaration
@@ -130,9 +164,9 @@ class OpaqueServer {
          * server's rpcHandler when receiving an RPC request, or to drop the
          * server's reference to this socket when disconnecting.
          *
-         * May only be accessed with an Event::Loop::Lock or from the event
-         * loop, since the OpaqueServer may set this to NULL under the same
-         * rules.
+         * May only be accessed with an Event::Loop::Lock on the socket's
+         * event loop or from that event loop, since the OpaqueServer may set
+         * this to NULL under the same rules.
          */
         OpaqueServer* server;
 
@@ -166,16 +200,24 @@ class OpaqueServer {
          *      Server that owns this object. Held by MessageSocketHandler.
          * \param fd
          *      TCP connection with client for MessageSocket.
+         * \param loopIndex
+         *      Index into the server's socketLoops of the event loop that
+         *      will handle this socket.
          */
         static std::shared_ptr<SocketWithHandler>
-        make(OpaqueServer* server, int fd);
+        make(OpaqueServer* server, int fd, size_t loopIndex);
 
         ~SocketWithHandler();
+        /**
+         * Index into OpaqueServer::socketLoops of the event loop that handles
+         * this socket.
+         */
+        const size_t loopIndex;
         MessageSocketHandler handler;
         MessageSocket monitor;
 
       private:
-        SocketWithHandler(OpaqueServer* server, int fd);
+        SocketWithHandler(OpaqueServer* server, int fd, size_t loopIndex);
     };
 
     /**
@@ -225,15 +267,36 @@ class OpaqueServer {
     Handler& rpcHandler;
 
     /**
-     * The event loop that is used for non-blocking I/O.
+     * Accept a new connection, placing it on the event loop in #socketLoops
+     * with the fewest connections. The socket is created on that loop's
+     * thread soon after this returns (see Event::Loop::post()). Called by
+     * BoundListener.
+     * \param fd
+     *      The accepted socket.
+     */
+    void addSocket(int fd);
+
+    /**
+     * The event loop that is used for the listening sockets.
      */
     Event::Loop& eventLoop;
 
+    /**
+     * The event loops that are used for non-blocking I/O on accepted sockets.
+     * Never empty, and not modified after construction.
+     */
+    const std::vector<Event::Loop*> socketLoops;
+
     /**
      * The maximum number of bytes to allow per request/response.
      */
     const uint32_t maxMessageLength;
 
+    /**
+     * See enableCompression(). Read by the sockets' event loop threads.
+     */
+    std::atomic<uint32_t> compressionMinBytes;
+
     /**
      * Every open socket is referenced here so that it can be cleaned up when
      * this OpaqueServer is destroyed. These are reference-counted: the
@@ -241,13 +304,32 @@ class OpaqueServer {
      * OpaqueServer if it is being actively used to send out a OpaqueServerRPC
      * response when the OpaqueServer is destroyed.
      *
-     * This may only be accessed from the Event::Loop or while holding an
-     * Event::Loop::Lock (it's almost entirely accessed from event handlers, so
-     * it's convenient to rely on the Event::Loop::Lock for mutual exclusion
-     * during OpauqeServer's destructor as well).
+     * Since sockets may be spread across several event loops, this is
+     * protected by #socketsMutex. Sockets are created and destroyed on their
+     * own loop's thread or while holding an Event::Loop::Lock on their own
+     * loop, which is acquired before #socketsMutex.
      */
     std::unordered_set<std::shared_ptr<SocketWithHandler>> sockets;
 
+    /**
+     * Protects #sockets, #nextSocketLoop, and #numPendingSockets from
+     * concurrent access.
+     */
+    Core::Mutex socketsMutex;
+
+    /**
+     * The index into #socketLoops at which addSocket() starts looking for the
+     * least loaded loop, so that loops take turns when they tie.
+     */
+    size_t nextSocketLoop;
+
+    /**
+     * For each loop in #socketLoops, the number of sockets that addSocket()
+     * has posted to the loop but that the loop hasn't yet created. These
+     * count toward the loop's load.
+     */
+    std::vector<uint64_t> numPendingSockets;
+
     /**
      * Lock to prevent concurrent modification of #boundListeners.
      */
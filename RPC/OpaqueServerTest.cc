@@ -15,9 +15,15 @@
  */
 
 #include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iterator>
 #include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include "Core/Debug.h"
+#include "Core/StringUtil.h"
 #include "Event/Loop.h"
 #include "Protocol/Common.h"
 #include "RPC/Address.h"
@@ -70,7 +76,7 @@ class RPCOpaqueServerTest : public ::testing::Test {
 };
 
 TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleReceivedMessage) {
-    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
+    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1, 0);
     server.sockets.insert(socket);
     fd1 = -1;
     socket->handler.handleReceivedMessage(1, Core::Buffer(NULL, 3, NULL));
@@ -82,7 +88,7 @@ TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleReceivedMessage) {
 }
 
 TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleReceivedMessage_ping) {
-    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
+    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1, 0);
     server.sockets.insert(socket);
     fd1 = -1;
     socket->handler.handleReceivedMessage(
@@ -95,7 +101,7 @@ TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleReceivedMessage_ping) {
 
 TEST_F(RPCOpaqueServerTest,
        MessageSocketHandler_handleReceivedMessage_version) {
-    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
+    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1, 0);
     server.sockets.insert(socket);
     fd1 = -1;
     socket->handler.handleReceivedMessage(
@@ -106,12 +112,35 @@ TEST_F(RPCOpaqueServerTest,
     using Protocol::Common::VersionMessage::Response;
     EXPECT_EQ(sizeof(Response), buf.getLength());
     Response* response = static_cast<Response*>(buf.getData());
-    EXPECT_EQ(1U, be16toh(response->maxVersionSupported));
+    EXPECT_EQ(2U, be16toh(response->maxVersionSupported));
+    // old clients send an empty request and don't get compressed responses
+    EXPECT_EQ(0U, socket->monitor.compressionMinBytes);
+}
+
+TEST_F(RPCOpaqueServerTest,
+       MessageSocketHandler_handleReceivedMessage_versionCompression) {
+    server.enableCompression(100);
+    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1, 0);
+    server.sockets.insert(socket);
+    fd1 = -1;
+    using Protocol::Common::VersionMessage::Request;
+    Request request;
+    request.maxVersionSupported = htobe16(1);
+    socket->handler.handleReceivedMessage(
+        Protocol::Common::VERSION_MESSAGE_ID,
+        Core::Buffer(&request, sizeof(request), NULL));
+    EXPECT_EQ(0U, socket->monitor.compressionMinBytes);
+    request.maxVersionSupported = htobe16(2);
+    socket->handler.handleReceivedMessage(
+        Protocol::Common::VERSION_MESSAGE_ID,
+        Core::Buffer(&request, sizeof(request), NULL));
+    EXPECT_EQ(100U, socket->monitor.compressionMinBytes);
+    EXPECT_EQ(2U, socket->monitor.outboundQueue.size());
 }
 
 
 TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleDisconnect) {
-    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
+    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1, 0);
     server.sockets.insert(socket);
     fd1 = -1;
     socket->handler.handleDisconnect();
@@ -145,6 +174,77 @@ TEST_F(RPCOpaqueServerTest, BoundListener_handleFileEvent) {
     close(clientFd);
 }
 
+TEST_F(RPCOpaqueServerTest, addSocket_posted) {
+    int fds[2];
+    EXPECT_EQ(0, pipe(fds));
+    EXPECT_EQ(0, close(fds[1]));
+    server.addSocket(fds[0]);
+    EXPECT_EQ(0U, server.sockets.size());
+    EXPECT_EQ(1U, server.numPendingSockets.at(0));
+    {
+        Event::Loop::Lock lock(loop);
+        loop.runPosted();
+    }
+    EXPECT_EQ(1U, server.sockets.size());
+    EXPECT_EQ(0U, server.numPendingSockets.at(0));
+}
+
+TEST_F(RPCOpaqueServerTest, destructor_createsPostedSockets) {
+    {
+        OpaqueServer server2(rpcHandler, loop, {&loop}, 1024);
+        int fds[2];
+        EXPECT_EQ(0, pipe(fds));
+        EXPECT_EQ(0, close(fds[1]));
+        server2.addSocket(fds[0]);
+    }
+    // The socket was created and dropped by the destructor, so there's
+    // nothing left to refer to server2.
+    Event::Loop::Lock lock(loop);
+    loop.runPosted();
+}
+
+TEST_F(RPCOpaqueServerTest, addSocket_leastLoaded) {
+    Event::Loop loop2;
+    Event::Loop loop3;
+    OpaqueServer server2(rpcHandler, loop, {&loop, &loop2, &loop3}, 1024);
+    std::vector<std::shared_ptr<OpaqueServer::SocketWithHandler>> added;
+    auto addSocket = [&] () -> size_t {
+        int fds[2];
+        EXPECT_EQ(0, pipe(fds));
+        EXPECT_EQ(0, close(fds[1]));
+        std::unordered_set<std::shared_ptr<OpaqueServer::SocketWithHandler>>
+            before = server2.sockets;
+        server2.addSocket(fds[0]);
+        // The chosen loop creates the socket.
+        Event::Loop* loops[] = {&loop, &loop2, &loop3};
+        for (auto it = std::begin(loops); it != std::end(loops); ++it) {
+            Event::Loop::Lock lock(**it);
+            (*it)->runPosted();
+        }
+        for (auto it = server2.sockets.begin();
+             it != server2.sockets.end();
+             ++it) {
+            if (before.count(*it) == 0)
+                added.push_back(*it);
+        }
+        return added.back()->loopIndex;
+    };
+    // loops take turns while they tie
+    EXPECT_EQ(0U, addSocket());
+    EXPECT_EQ(1U, addSocket());
+    EXPECT_EQ(2U, addSocket());
+    EXPECT_EQ(0U, addSocket());
+    EXPECT_EQ(&loop, &added.at(3)->monitor.eventLoop);
+    // then the least loaded one is chosen
+    added.at(2)->handler.handleDisconnect();
+    added.at(2)->monitor.close();
+    EXPECT_EQ(3U, server2.sockets.size());
+    EXPECT_EQ(2U, addSocket());
+    EXPECT_EQ(&loop3, &added.at(4)->monitor.eventLoop);
+    EXPECT_EQ(1U, addSocket());
+    added.clear();
+}
+
 TEST_F(RPCOpaqueServerTest, bind_good) {
     Address address2("127.0.0.1", 5253);
     address2.refresh(Address::TimePoint::max());
@@ -170,6 +270,30 @@ TEST_F(RPCOpaqueServerTest, bind_portTaken) {
         << error;
 }
 
+TEST_F(RPCOpaqueServerTest, bind_unix) {
+    std::string path = Core::StringUtil::format(
+        "/tmp/logcabin-OpaqueServerTest-%d.sock", getpid());
+    unlink(path.c_str());
+    Address address2("unix:" + path, 0);
+    address2.refresh(Address::TimePoint::max());
+    EXPECT_EQ("", server.bind(address2));
+    struct stat st;
+    EXPECT_EQ(0, stat(path.c_str(), &st));
+    EXPECT_TRUE(S_ISSOCK(st.st_mode));
+
+    // A live socket is not replaced.
+    OpaqueServer server2(rpcHandler, loop, 1024);
+    std::string error = server2.bind(address2);
+    EXPECT_TRUE(error.find("in use") != error.npos)
+        << error;
+
+    // A stale socket file left behind by a dead server is replaced.
+    server.boundListeners.pop_back();
+    EXPECT_EQ(0, stat(path.c_str(), &st));
+    EXPECT_EQ("", server2.bind(address2));
+    EXPECT_EQ(0, unlink(path.c_str()));
+}
+
 } // namespace LogCabin::RPC::<anonymous>
 } // namespace LogCabin::RPC
 } // namespace LogCabin
@@ -13,6 +13,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "build/Protocol/ServerStats.pb.h"
 #include "RPC/OpaqueServerRPC.h"
 #include "RPC/Server.h"
 #include "RPC/ServerRPC.h"
@@ -42,7 +43,7 @@ Server::RPCHandler::handleRPC(OpaqueServerRPC opaqueRPC)
         // further action.
         return;
     }
-    std::shared_ptr<Service> service;
+    std::shared_ptr<ThreadDispatchService> service;
     {
         std::lock_guard<std::mutex> lockGuard(server.mutex);
         auto it = server.services.find(rpc.getService());
@@ -65,6 +66,16 @@ Server::Server(Event::Loop& eventLoop, uint32_t maxMessageLength)
 {
 }
 
+Server::Server(Event::Loop& eventLoop,
+               const std::vector<Event::Loop*>& socketLoops,
+               uint32_t maxMessageLength)
+    : mutex()
+    , services()
+    , rpcHandler(*this)
+    , opaqueServer(rpcHandler, eventLoop, socketLoops, maxMessageLength)
+{
+}
+
 Server::~Server()
 {
 }
@@ -75,6 +86,12 @@ Server::bind(const Address& listenAddress)
     return opaqueServer.bind(listenAddress);
 }
 
+void
+Server::enableCompression(uint32_t minBytes)
+{
+    opaqueServer.enableCompression(minBytes);
+}
+
 void
 Server::registerService(uint16_t serviceId,
                         std::shared_ptr<Service> service,
@@ -85,5 +102,17 @@ Server::registerService(uint16_t serviceId,
         std::make_shared<ThreadDispatchService>(service, 0, maxThreads);
 }
 
+void
+Server::updateServerStats(LogCabin::Protocol::ServerStats& serverStats)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    for (auto it = services.begin(); it != services.end(); ++it) {
+        LogCabin::Protocol::ServerStats::RPCService& stats =
+            *serverStats.add_rpc_service();
+        stats.set_service_id(it->first);
+        it->second->updateServerStats(stats);
+    }
+}
+
 } // namespace LogCabin::RPC
 } // namespace LogCabin
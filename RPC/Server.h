@@ -18,6 +18,7 @@
 #include <memory>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include "RPC/OpaqueServer.h"
 #include "RPC/Service.h"
@@ -26,14 +27,23 @@
 #define LOGCABIN_RPC_SERVER_H
 
 namespace LogCabin {
+
+// forward declaration
+namespace Protocol {
+class ServerStats;
+}
+namespace RPC {
+class ThreadDispatchService;
+}
+
 namespace RPC {
 
 /**
  * A Server listens for incoming RPCs over TCP connections and dispatches these
  * to Services.
  * Servers can be created from any thread, but they will always run on
- * the thread running the Event::Loop. Services will always run on a thread
- * pool.
+ * the threads running their Event::Loops. Services will always run on a
+ * thread pool.
  */
 class Server {
   public:
@@ -51,6 +61,23 @@ class Server {
      */
     Server(Event::Loop& eventLoop, uint32_t maxMessageLength);
 
+    /**
+     * Constructor that spreads accepted connections across several event
+     * loops. See the corresponding OpaqueServer constructor.
+     * \param eventLoop
+     *      Event::Loop that will be used to find out when new connections
+     *      arrive.
+     * \param socketLoops
+     *      Event::Loops that will be used to find out when accepted sockets
+     *      may be read from or written to without blocking. Must not be
+     *      empty.
+     * \param maxMessageLength
+     *      See the other constructor.
+     */
+    Server(Event::Loop& eventLoop,
+           const std::vector<Event::Loop*>& socketLoops,
+           uint32_t maxMessageLength);
+
     /**
      * Destructor. ServerRPC objects originating from this Server may be kept
      * around after this destructor returns; however, they won't actually send
@@ -63,6 +90,11 @@ class Server {
      */
     std::string bind(const Address& listenAddress);
 
+    /**
+     * See OpaqueServer::enableCompression().
+     */
+    void enableCompression(uint32_t minBytes);
+
     /**
      * Register a Service to receive RPCs from clients. If a service has
      * already been registered for this service ID, this will replace it. This
@@ -80,6 +112,11 @@ class Server {
                          std::shared_ptr<Service> service,
                          uint32_t maxThreads);
 
+    /**
+     * Add stats about each registered service's thread pool.
+     */
+    void updateServerStats(LogCabin::Protocol::ServerStats& serverStats);
+
   private:
     /**
      * Services RPCs.
@@ -105,7 +142,8 @@ class Server {
      * Maps from service IDs to ThreadDispatchService instances.
      * Protected by #mutex.
      */
-    std::unordered_map<uint16_t, std::shared_ptr<Service>> services;
+    std::unordered_map<uint16_t,
+                       std::shared_ptr<ThreadDispatchService>> services;
 
     /**
      * Deals with RPCs created by #opaqueServer.
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "Core/BufferPool.h"
 #include "Core/ProtoBuf.h"
 #include "RPC/ServerRPC.h"
 
@@ -118,9 +119,7 @@ ServerRPC::getRequest(Core::Buffer& buffer) const
     uint64_t bytes = opaqueRPC.request.getLength();
     assert(bytes >= sizeof(RequestHeaderVersion1));
     bytes -= sizeof(RequestHeaderVersion1);
-    buffer.setData(new char[bytes],
-                   bytes,
-                   Core::Buffer::deleteArrayFn<char>);
+    Core::BufferPool::allocate(buffer, bytes);
     memcpy(buffer.getData(),
            (static_cast<const char*>(opaqueRPC.request.getData()) +
             sizeof(RequestHeaderVersion1)),
@@ -179,6 +178,12 @@ ServerRPC::closeSession()
     opaqueRPC.closeSession();
 }
 
+void
+ServerRPC::park()
+{
+    MessageSocket::unsharePayload(opaqueRPC.request);
+}
+
 void
 ServerRPC::reject(RPC::Protocol::Status status)
 {
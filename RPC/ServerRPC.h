@@ -152,6 +152,14 @@ class ServerRPC {
      */
     void closeSession();
 
+    /**
+     * Call this before holding on to the RPC for a long time without
+     * replying, such as while it waits for some event. The request's bytes
+     * are copied out of the memory shared with other messages received on
+     * the same connection, so that they don't keep it all allocated.
+     */
+    void park();
+
   private:
     /**
      * Reject the RPC.
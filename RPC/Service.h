@@ -46,6 +46,16 @@ class Service {
      */
     virtual void handleRPC(ServerRPC serverRPC) = 0;
 
+    /**
+     * Return true if the given RPC is cheap enough to handle directly on the
+     * thread that received it, skipping the thread pool. Such RPCs must not
+     * block, and the service must be safe to call from that thread. The
+     * default implementation returns false.
+     */
+    virtual bool isInline(const ServerRPC&) const {
+        return false;
+    }
+
     /**
      * Return a short name for this service which can be used in things like
      * log messages.
@@ -14,7 +14,9 @@
  */
 
 #include <assert.h>
+#include <algorithm>
 
+#include "build/Protocol/ServerStats.pb.h"
 #include "Core/StringUtil.h"
 #include "Core/ThreadId.h"
 #include "RPC/ThreadDispatchService.h"
@@ -22,56 +24,147 @@
 namespace LogCabin {
 namespace RPC {
 
+namespace {
+
+/**
+ * Size of the lock-free queue of RPCs. RPCs that arrive while it's full go to
+ * a slower, mutex-protected queue instead.
+ */
+const uint64_t RPC_QUEUE_CAPACITY = 1024;
+
+/**
+ * Each worker records how long one in this many of the RPCs it processes
+ * waited in the queue. Recording takes a mutex shared by all workers.
+ */
+const uint64_t QUEUE_WAIT_SAMPLE_INTERVAL = 16;
+
+} // anonymous namespace
+
+////////// ThreadDispatchService::QueuedRPC //////////
+
+ThreadDispatchService::QueuedRPC::QueuedRPC()
+    : rpc()
+    , queuedAt()
+{
+}
+
+ThreadDispatchService::QueuedRPC::QueuedRPC(ServerRPC rpc)
+    : rpc(std::move(rpc))
+    , queuedAt(Clock::now())
+{
+}
+
+ThreadDispatchService::QueuedRPC::QueuedRPC(QueuedRPC&& other)
+    : rpc(std::move(other.rpc))
+    , queuedAt(other.queuedAt)
+{
+}
+
+ThreadDispatchService::QueuedRPC&
+ThreadDispatchService::QueuedRPC::operator=(QueuedRPC&& other)
+{
+    rpc = std::move(other.rpc);
+    queuedAt = other.queuedAt;
+    return *this;
+}
+
+////////// ThreadDispatchService //////////
+
 ThreadDispatchService::ThreadDispatchService(
         std::shared_ptr<Service> threadSafeService,
         uint32_t minThreads,
         uint32_t maxThreads)
     : threadSafeService(threadSafeService)
+    , minThreads(minThreads)
     , maxThreads(maxThreads)
+    , spinDuration(std::chrono::microseconds(20))
+    , idleTimeout(std::chrono::seconds(10))
+    , rpcQueue(RPC_QUEUE_CAPACITY)
+    , numOverflowed(0)
+    , numFreeWorkers(0)
+    , numSleepingWorkers(0)
+    , numThreads(0)
+    , overflowMutex()
+    , overflowQueue()
+    , statsMutex()
+    , queueWaitNanos()
+    , numInline(0)
+    , numDispatched(0)
+    , numRetired(0)
     , mutex()
     , threads()
-    , numFreeWorkers(0)
+    , retiredThreads()
     , conditionVariable()
     , exit(false)
-    , rpcQueue()
 {
     assert(minThreads <= maxThreads);
     assert(0 < maxThreads);
+    std::lock_guard<std::mutex> lockGuard(mutex);
     for (uint32_t i = 0; i < minThreads; ++i)
-        threads.emplace_back(&ThreadDispatchService::workerMain, this);
+        spawnWorker();
 }
 
 ThreadDispatchService::~ThreadDispatchService()
 {
-    // Signal the threads to exit.
+    // Signal the threads to exit. Once 'exit' is set, workers no longer
+    // retire themselves, so 'threads' and 'retiredThreads' stop changing.
+    std::vector<std::thread> toJoin;
     {
         std::lock_guard<std::mutex> lockGuard(mutex);
         exit = true;
         conditionVariable.notify_all();
+        toJoin.swap(threads);
+        for (auto it = retiredThreads.begin();
+             it != retiredThreads.end();
+             ++it) {
+            toJoin.push_back(std::move(*it));
+        }
+        retiredThreads.clear();
     }
 
     // Join the threads.
-    while (!threads.empty()) {
-        threads.back().join();
-        threads.pop_back();
+    while (!toJoin.empty()) {
+        toJoin.back().join();
+        toJoin.pop_back();
     }
 
     // Close the sessions of any remaining RPCs that didn't get processed.
-    while (!rpcQueue.empty()) {
-        rpcQueue.front().closeSession();
-        rpcQueue.pop();
-    }
+    QueuedRPC queued;
+    while (tryDequeue(queued))
+        queued.rpc.closeSession();
 }
 
 void
 ThreadDispatchService::handleRPC(ServerRPC serverRPC)
 {
-    std::lock_guard<std::mutex> lockGuard(mutex);
-    assert(!exit);
-    rpcQueue.push(std::move(serverRPC));
-    if (numFreeWorkers == 0 && threads.size() < maxThreads)
-        threads.emplace_back(&ThreadDispatchService::workerMain, this);
-    conditionVariable.notify_one();
+    if (threadSafeService->isInline(serverRPC)) {
+        ++numInline;
+        threadSafeService->handleRPC(std::move(serverRPC));
+        return;
+    }
+
+    QueuedRPC queued(std::move(serverRPC));
+    if (numOverflowed.load() > 0 || !rpcQueue.tryPush(queued)) {
+        std::lock_guard<std::mutex> lockGuard(overflowMutex);
+        overflowQueue.push(std::move(queued));
+        ++numOverflowed;
+    }
+    ++numDispatched;
+
+    // Wake up a sleeping worker if there is one. Otherwise, a free worker
+    // that's spinning will find this RPC, or else a new worker is needed. The
+    // fence pairs with those in getWork().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (numSleepingWorkers.load() > 0) {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        conditionVariable.notify_one();
+    } else if (numFreeWorkers.load() == 0 &&
+               numThreads.load() < maxThreads) {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        assert(!exit);
+        if (numThreads.load() < maxThreads)
+            spawnWorker();
+    }
 }
 
 std::string
@@ -80,6 +173,117 @@ ThreadDispatchService::getName() const
     return threadSafeService->getName();
 }
 
+void
+ThreadDispatchService::updateServerStats(
+        LogCabin::Protocol::ServerStats_RPCService& stats) const
+{
+    stats.set_name(getName());
+    stats.set_queue_depth(rpcQueue.size() + numOverflowed.load());
+    stats.set_num_threads(numThreads.load());
+    stats.set_num_free_threads(numFreeWorkers.load());
+    stats.set_num_threads_retired(numRetired.load());
+    stats.set_num_rpcs_inline(numInline.load());
+    stats.set_num_rpcs_dispatched(numDispatched.load());
+    std::lock_guard<std::mutex> lockGuard(statsMutex);
+    queueWaitNanos.updateProtoBuf(*stats.mutable_queue_wait_nanos());
+}
+
+bool
+ThreadDispatchService::tryDequeue(QueuedRPC& queued)
+{
+    if (rpcQueue.tryPop(queued))
+        return true;
+    if (numOverflowed.load() == 0)
+        return false;
+    std::lock_guard<std::mutex> lockGuard(overflowMutex);
+    if (overflowQueue.empty())
+        return false;
+    queued = std::move(overflowQueue.front());
+    overflowQueue.pop();
+    --numOverflowed;
+    return true;
+}
+
+bool
+ThreadDispatchService::getWork(QueuedRPC& queued)
+{
+    // While counted in numFreeWorkers, this worker promises to check the
+    // queue again before it stops waiting, so handleRPC() need not take any
+    // action for RPCs that it'll find.
+    ++numFreeWorkers;
+
+    // Spin briefly: another RPC will often show up soon.
+    Clock::time_point spinUntil = Clock::now() + spinDuration;
+    do {
+        if (tryDequeue(queued)) {
+            --numFreeWorkers;
+            return true;
+        }
+        std::this_thread::yield();
+    } while (Clock::now() < spinUntil);
+
+    // Go to sleep.
+    std::unique_lock<std::mutex> lockGuard(mutex);
+    Clock::time_point retireAt = Clock::now() + idleTimeout;
+    while (true) {
+        if (exit) {
+            --numFreeWorkers;
+            return false;
+        }
+        // Pairs with the fence in handleRPC(): either this worker sees the
+        // new RPC in the queue, or handleRPC() sees this worker sleeping.
+        ++numSleepingWorkers;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (tryDequeue(queued)) {
+            --numSleepingWorkers;
+            --numFreeWorkers;
+            return true;
+        }
+        if (threads.size() <= minThreads) {
+            // This worker is needed regardless, so there's no use in timing
+            // out.
+            conditionVariable.wait(lockGuard);
+        } else if (Clock::now() < retireAt) {
+            conditionVariable.wait_until(lockGuard, retireAt);
+        } else {
+            // Similarly, either this worker sees a new RPC, or handleRPC()
+            // sees that there's no free worker and spawns one.
+            --numSleepingWorkers;
+            --numFreeWorkers;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (tryDequeue(queued))
+                return true;
+            break;
+        }
+        --numSleepingWorkers;
+    }
+
+    // Retire this worker. It can't join itself, so it hands its std::thread
+    // to whichever thread next spawns a worker or destroys this object.
+    std::thread::id self = std::this_thread::get_id();
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+        if (it->get_id() == self) {
+            retiredThreads.push_back(std::move(*it));
+            threads.erase(it);
+            break;
+        }
+    }
+    --numThreads;
+    ++numRetired;
+    return false;
+}
+
+void
+ThreadDispatchService::spawnWorker()
+{
+    while (!retiredThreads.empty()) {
+        retiredThreads.back().join();
+        retiredThreads.pop_back();
+    }
+    ++numThreads;
+    threads.emplace_back(&ThreadDispatchService::workerMain, this);
+}
+
 void
 ThreadDispatchService::workerMain()
 {
@@ -87,21 +291,20 @@ ThreadDispatchService::workerMain()
         Core::StringUtil::format("%s(%lu)",
                                  threadSafeService->getName().c_str(),
                                  Core::ThreadId::getId()));
+    uint64_t numProcessed = 0;
     while (true) {
-        ServerRPC rpc;
-        { // find an RPC to process
-            std::unique_lock<std::mutex> lockGuard(mutex);
-            ++numFreeWorkers;
-            while (!exit && rpcQueue.empty())
-                conditionVariable.wait(lockGuard);
-            --numFreeWorkers;
-            if (exit)
-                return;
-            rpc = std::move(rpcQueue.front());
-            rpcQueue.pop();
+        QueuedRPC queued;
+        if (!getWork(queued))
+            return;
+        if (numProcessed % QUEUE_WAIT_SAMPLE_INTERVAL == 0) {
+            std::lock_guard<std::mutex> lockGuard(statsMutex);
+            queueWaitNanos.push(uint64_t(
+                std::chrono::nanoseconds(
+                    Clock::now() - queued.queuedAt).count()));
         }
+        ++numProcessed;
         // execute RPC handler
-        threadSafeService->handleRPC(std::move(rpc));
+        threadSafeService->handleRPC(std::move(queued.rpc));
     }
 }
 
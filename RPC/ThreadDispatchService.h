@@ -19,7 +19,11 @@
 #include <thread>
 #include <vector>
 
+#include "Core/CompatAtomic.h"
 #include "Core/ConditionVariable.h"
+#include "Core/MPMCQueue.h"
+#include "Core/RollingStat.h"
+#include "Core/Time.h"
 #include "RPC/ServerRPC.h"
 #include "RPC/Service.h"
 
@@ -27,6 +31,12 @@
 #define LOGCABIN_RPC_THREADDISPATCHSERVICE_H
 
 namespace LogCabin {
+
+// forward declaration
+namespace Protocol {
+class ServerStats_RPCService;
+}
+
 namespace RPC {
 
 /**
@@ -35,6 +45,11 @@ namespace RPC {
  * Event::Loop thread. You provide it with another Service on the constructor,
  * and the job of this class is to manage a thread pool on which to call
  * your Service's handleRPC() method.
+ *
+ * RPCs are handed to the workers through a lock-free queue. Idle workers spin
+ * on it briefly before going to sleep, and workers beyond 'minThreads' exit
+ * after being idle for a while. RPCs for which the service's isInline()
+ * returns true skip the thread pool entirely.
  */
 class ThreadDispatchService : public Service {
   public:
@@ -45,7 +60,8 @@ class ThreadDispatchService : public Service {
      *      threads spawned by this class.
      * \param minThreads
      *      The number of threads with which to start the thread pool.
-     *      These will be created in the constructor.
+     *      These will be created in the constructor, and the pool will not
+     *      shrink below this size.
      * \param maxThreads
      *      The maximum number of threads this class is allowed to use for its
      *      thread pool. The thread pool dynamically grows as needed up until
@@ -64,7 +80,64 @@ class ThreadDispatchService : public Service {
     void handleRPC(ServerRPC serverRPC);
     std::string getName() const;
 
+    /**
+     * Fill in statistics about the thread pool and its queue.
+     */
+    void updateServerStats(
+        LogCabin::Protocol::ServerStats_RPCService& stats) const;
+
   private:
+    /**
+     * The clock used to time spinning, idleness, and queueing. This reads the
+     * real time even when unit tests mock out Core::Time::SteadyClock, so
+     * that workers don't spin forever while the time is frozen.
+     */
+    typedef Core::Time::SteadyClock::BaseClock Clock;
+
+    /**
+     * An RPC waiting in the queue.
+     */
+    struct QueuedRPC {
+        /// Default constructor.
+        QueuedRPC();
+        /// Constructor.
+        explicit QueuedRPC(ServerRPC rpc);
+        /// Move constructor.
+        QueuedRPC(QueuedRPC&& other);
+        /// Move assignment.
+        QueuedRPC& operator=(QueuedRPC&& other);
+        /**
+         * The RPC to process.
+         */
+        ServerRPC rpc;
+        /**
+         * When the RPC was queued, used to measure how long RPCs wait.
+         */
+        Clock::time_point queuedAt;
+    };
+
+    /**
+     * Take the next RPC off #rpcQueue or #overflowQueue, if any.
+     * \return
+     *      True if 'queued' was set to an RPC; false if both were empty.
+     */
+    bool tryDequeue(QueuedRPC& queued);
+
+    /**
+     * Called by workers to get their next RPC. This spins for up to
+     * #spinDuration, then sleeps until an RPC arrives.
+     * \return
+     *      True if 'queued' was set to an RPC to process; false if the worker
+     *      should exit, either because the service is being destroyed or
+     *      because the worker was idle for #idleTimeout and isn't needed.
+     */
+    bool getWork(QueuedRPC& queued);
+
+    /**
+     * Launch a new worker thread. Must be called with #mutex held.
+     */
+    void spawnWorker();
+
     /**
      * The main loop executed in workers.
      */
@@ -76,12 +149,99 @@ class ThreadDispatchService : public Service {
      */
     std::shared_ptr<Service> threadSafeService;
 
+    /**
+     * The minimum number of threads to keep in the thread pool.
+     */
+    const uint32_t minThreads;
+
     /**
      * The maximum number of threads this class is allowed to use for its
      * thread pool.
      */
     const uint32_t maxThreads;
 
+    /**
+     * How long an idle worker keeps polling #rpcQueue before going to sleep.
+     * When RPCs arrive in quick succession, this avoids the cost of putting
+     * a thread to sleep and waking it back up. Only changed by unit tests.
+     */
+    std::chrono::nanoseconds spinDuration;
+
+    /**
+     * How long a worker may sleep without receiving any work before it
+     * exits (as long as at least #minThreads remain). Only changed by unit
+     * tests.
+     */
+    std::chrono::nanoseconds idleTimeout;
+
+    /**
+     * The queue of work that worker threads pull from. This doesn't need
+     * #mutex.
+     */
+    Core::MPMCQueue<QueuedRPC> rpcQueue;
+
+    /**
+     * The number of RPCs in #overflowQueue. While nonzero, new RPCs also go
+     * to #overflowQueue, so that RPCs are still processed roughly in order.
+     */
+    std::atomic<uint64_t> numOverflowed;
+
+    /**
+     * The number of workers that are idle: spinning or sleeping while
+     * waiting for work. This is used to dynamically launch new workers when
+     * necessary.
+     */
+    std::atomic<uint32_t> numFreeWorkers;
+
+    /**
+     * The number of workers that are sleeping on #conditionVariable. RPCs
+     * only need to take #mutex to wake up a worker when this is nonzero.
+     */
+    std::atomic<uint32_t> numSleepingWorkers;
+
+    /**
+     * The number of threads in #threads, readable without #mutex.
+     */
+    std::atomic<uint32_t> numThreads;
+
+    /**
+     * Protects #overflowQueue.
+     */
+    std::mutex overflowMutex;
+
+    /**
+     * RPCs that arrived while #rpcQueue was full.
+     */
+    std::queue<QueuedRPC> overflowQueue;
+
+    /**
+     * Protects #queueWaitNanos.
+     */
+    mutable std::mutex statsMutex;
+
+    /**
+     * How long a sample of the RPCs spent in the queue before a worker picked
+     * them up. Each worker records one in QUEUE_WAIT_SAMPLE_INTERVAL of the
+     * RPCs it processes, so that workers rarely take #statsMutex.
+     */
+    Core::RollingStat queueWaitNanos;
+
+    /**
+     * The number of RPCs that were handled directly on the calling thread
+     * because the service said they were quick.
+     */
+    std::atomic<uint64_t> numInline;
+
+    /**
+     * The number of RPCs that were handed to the thread pool.
+     */
+    std::atomic<uint64_t> numDispatched;
+
+    /**
+     * The number of workers that exited after being idle for too long.
+     */
+    std::atomic<uint64_t> numRetired;
+
     /**
      * This mutex protects all of the members of this class defined below this
      * point.
@@ -94,15 +254,14 @@ class ThreadDispatchService : public Service {
     std::vector<std::thread> threads;
 
     /**
-     * The number of workers that are waiting for work (on the condition
-     * variable). This is used to dynamically launch new workers when
-     * necessary.
+     * Workers that have exited after being idle for too long, but haven't
+     * been joined yet.
      */
-    uint32_t numFreeWorkers;
+    std::vector<std::thread> retiredThreads;
 
     /**
-     * Notifies workers that there are available RPCs to process or #exit has
-     * been set. To wait on this, one needs to hold #mutex.
+     * Notifies sleeping workers that there are available RPCs to process or
+     * #exit has been set. To wait on this, one needs to hold #mutex.
      */
     Core::ConditionVariable conditionVariable;
 
@@ -111,11 +270,6 @@ class ThreadDispatchService : public Service {
      */
     bool exit;
 
-    /**
-     * The queue of work that worker threads pull from.
-     */
-    std::queue<ServerRPC> rpcQueue;
-
     // ThreadDispatchService is non-copyable.
     ThreadDispatchService(const ThreadDispatchService&) = delete;
     ThreadDispatchService& operator=(const ThreadDispatchService&) = delete;
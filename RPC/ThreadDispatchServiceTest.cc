@@ -16,6 +16,7 @@
 #include <gtest/gtest.h>
 #include <unistd.h>
 
+#include "build/Protocol/ServerStats.pb.h"
 #include "Core/CompatAtomic.h"
 #include "RPC/ThreadDispatchService.h"
 
@@ -27,17 +28,28 @@ class EchoService : public RPC::Service {
     EchoService()
         : sleepMicros(0)
         , count(0)
+        , inlineAll(false)
+        , gate()
     {
     }
     void handleRPC(RPC::ServerRPC serverRPC) {
+        std::lock_guard<std::mutex> lockGuard(gate);
         usleep(sleepMicros);
         ++count;
     }
+    bool isInline(const RPC::ServerRPC& serverRPC) const {
+        return inlineAll;
+    }
     std::string getName() const {
         return "EchoService";
     }
     std::atomic<uint32_t> sleepMicros;
     std::atomic<uint32_t> count;
+    std::atomic<bool> inlineAll;
+    /**
+     * Held by tests to keep handleRPC from returning.
+     */
+    std::mutex gate;
 };
 
 
@@ -91,9 +103,127 @@ TEST_F(RPCThreadDispatchServiceTest, handleRPC)
     EXPECT_EQ(2U, dispatchService.threads.size());
 }
 
+TEST_F(RPCThreadDispatchServiceTest, handleRPC_inline)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          0, 2);
+    echoService->inlineAll = true;
+    dispatchService.handleRPC(ServerRPC());
+    EXPECT_EQ(1U, echoService->count);
+    EXPECT_EQ(0U, dispatchService.threads.size());
+    EXPECT_EQ(1U, dispatchService.numInline);
+    EXPECT_EQ(0U, dispatchService.numDispatched);
+}
+
+TEST_F(RPCThreadDispatchServiceTest, handleRPC_overflow)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          0, 1);
+    uint32_t numRPCs = uint32_t(dispatchService.rpcQueue.capacity) + 100;
+    {
+        std::lock_guard<std::mutex> lockGuard(echoService->gate);
+        for (uint32_t i = 0; i < numRPCs; ++i)
+            dispatchService.handleRPC(ServerRPC());
+        // The worker can have taken at most one RPC off the queue.
+        EXPECT_LE(99U, dispatchService.numOverflowed.load());
+    }
+    while (echoService->count < numRPCs)
+        usleep(1000);
+    EXPECT_EQ(0U, dispatchService.numOverflowed.load());
+    EXPECT_EQ(0U, dispatchService.rpcQueue.size());
+}
+
+TEST_F(RPCThreadDispatchServiceTest, getWork_retire)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          0, 2);
+    dispatchService.spinDuration = std::chrono::nanoseconds(0);
+    dispatchService.idleTimeout = std::chrono::milliseconds(1);
+    {
+        std::lock_guard<std::mutex> lockGuard(echoService->gate);
+        dispatchService.handleRPC(ServerRPC());
+        // once the first worker is busy, the second RPC needs another one
+        while (dispatchService.rpcQueue.size() > 0)
+            usleep(1000);
+        dispatchService.handleRPC(ServerRPC());
+    }
+    for (uint32_t i = 0; i < 1000; ++i) {
+        {
+            std::lock_guard<std::mutex> lockGuard(dispatchService.mutex);
+            if (dispatchService.threads.empty())
+                break;
+        }
+        usleep(1000);
+    }
+    {
+        std::lock_guard<std::mutex> lockGuard(dispatchService.mutex);
+        EXPECT_EQ(2U, echoService->count);
+        EXPECT_EQ(0U, dispatchService.threads.size());
+        EXPECT_EQ(2U, dispatchService.retiredThreads.size());
+        EXPECT_EQ(0U, dispatchService.numThreads.load());
+    }
+    EXPECT_EQ(2U, dispatchService.numRetired);
+
+    // spawning a new worker joins the retired ones
+    dispatchService.handleRPC(ServerRPC());
+    std::lock_guard<std::mutex> lockGuard(dispatchService.mutex);
+    EXPECT_EQ(1U, dispatchService.threads.size());
+    EXPECT_EQ(0U, dispatchService.retiredThreads.size());
+}
+
+TEST_F(RPCThreadDispatchServiceTest, getWork_keepMinThreads)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          1, 2);
+    {
+        std::lock_guard<std::mutex> lockGuard(dispatchService.mutex);
+        dispatchService.idleTimeout = std::chrono::milliseconds(1);
+    }
+    // wait for the worker to go to sleep, so that no new worker is spawned
+    while (dispatchService.numSleepingWorkers == 0)
+        usleep(1000);
+    // wake up the worker so that it picks up the new timeout
+    dispatchService.handleRPC(ServerRPC());
+    while (echoService->count < 1)
+        usleep(1000);
+    usleep(20000);
+    std::lock_guard<std::mutex> lockGuard(dispatchService.mutex);
+    EXPECT_EQ(1U, dispatchService.threads.size());
+    EXPECT_EQ(0U, dispatchService.retiredThreads.size());
+}
+
+TEST_F(RPCThreadDispatchServiceTest, updateServerStats)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          0, 2);
+    dispatchService.handleRPC(ServerRPC());
+    while (echoService->count < 1)
+        usleep(1000);
+    echoService->inlineAll = true;
+    dispatchService.handleRPC(ServerRPC());
+    LogCabin::Protocol::ServerStats::RPCService stats;
+    dispatchService.updateServerStats(stats);
+    EXPECT_EQ("EchoService", stats.name());
+    EXPECT_EQ(0U, stats.queue_depth());
+    EXPECT_EQ(1U, stats.num_threads());
+    EXPECT_EQ(1U, stats.num_rpcs_inline());
+    EXPECT_EQ(1U, stats.num_rpcs_dispatched());
+    EXPECT_EQ(1U, stats.queue_wait_nanos().count());
+}
+
 TEST_F(RPCThreadDispatchServiceTest, workerMain)
 {
     // most of this is tested already in the other tests
+    ThreadDispatchService dispatchService(echoService,
+                                          1, 1);
+    for (uint32_t i = 0; i < 17; ++i)
+        dispatchService.handleRPC(ServerRPC());
+    while (echoService->count < 17)
+        usleep(1000);
+    EXPECT_EQ(17U, dispatchService.numDispatched);
+    // The worker sampled the first and the 17th RPC.
+    std::lock_guard<std::mutex> lockGuard(dispatchService.statsMutex);
+    EXPECT_EQ(2U, dispatchService.queueWaitNanos.getCount());
 }
 
 } // namespace LogCabin::RPC::<anonymous>
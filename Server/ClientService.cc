@@ -33,6 +33,7 @@ typedef RaftConsensus::ClientResult Result;
 
 ClientService::ClientService(Globals& globals)
     : globals(globals)
+    , inlineQuickRPCs(globals.config.read<bool>("inlineQuickRPCs", false))
 {
 }
 
@@ -73,6 +74,21 @@ ClientService::handleRPC(RPC::ServerRPC rpc)
     }
 }
 
+bool
+ClientService::isInline(const RPC::ServerRPC& rpc) const
+{
+    using Protocol::Client::OpCode;
+    if (!inlineQuickRPCs)
+        return false;
+    switch (rpc.getOpCode()) {
+        case OpCode::GET_SERVER_INFO:
+        case OpCode::VERIFY_RECIPIENT:
+            return true;
+        default:
+            return false;
+    }
+}
+
 std::string
 ClientService::getName() const
 {
@@ -154,8 +170,28 @@ ClientService::stateMachineCommand(RPC::ServerRPC rpc)
     PRELUDE(StateMachineCommand);
     Core::Buffer cmdBuffer;
     rpc.getRequest(cmdBuffer);
-    std::pair<Result, uint64_t> result = globals.raft->replicate(cmdBuffer);
-    if (result.first == Result::RETRY || result.first == Result::NOT_LEADER) {
+    uint64_t logIndex = 0;
+    uint64_t term = 0;
+    Result result = Result::SUCCESS;
+    if (!globals.stateMachine->isSupported(request)) {
+        // Servers running older code can't apply this command the same way,
+        // so it must not reach the log before the cluster has upgraded. This
+        // server's state machine may just be behind, though, so check again
+        // once it has caught up with the leader's commit index.
+        std::pair<Result, uint64_t> commit =
+            globals.raft->getLastCommitIndex();
+        result = commit.first;
+        if (result == Result::SUCCESS) {
+            globals.stateMachine->wait(commit.second);
+            if (!globals.stateMachine->isSupported(request)) {
+                rpc.rejectInvalidRequest();
+                return;
+            }
+        }
+    }
+    if (result == Result::SUCCESS)
+        result = globals.raft->replicateAsync(cmdBuffer, logIndex, term);
+    if (result == Result::RETRY || result == Result::NOT_LEADER) {
         Protocol::Client::Error error;
         error.set_error_code(Protocol::Client::Error::NOT_LEADER);
         std::string leaderHint = globals.raft->getLeaderHint();
@@ -164,13 +200,11 @@ ClientService::stateMachineCommand(RPC::ServerRPC rpc)
         rpc.returnError(error);
         return;
     }
-    assert(result.first == Result::SUCCESS);
-    uint64_t logIndex = result.second;
-    if (!globals.stateMachine->waitForResponse(logIndex, request, response)) {
-        rpc.rejectInvalidRequest();
-        return;
-    }
-    rpc.reply(response);
+    assert(result == Result::SUCCESS);
+    // The state machine replies once the entry is applied (or once it's clear
+    // that it won't be), so this thread is free to handle other requests.
+    globals.stateMachine->respondWhenApplied(logIndex, term, request,
+                                             std::move(rpc));
 }
 
 void
@@ -190,6 +224,12 @@ ClientService::stateMachineQuery(RPC::ServerRPC rpc)
     assert(result.first == Result::SUCCESS);
     uint64_t logIndex = result.second;
     globals.stateMachine->wait(logIndex);
+    if (request.has_watch()) {
+        // The state machine replies once the watch is triggered or times
+        // out, so that this thread need not block in the meantime.
+        globals.stateMachine->watch(request.watch(), std::move(rpc));
+        return;
+    }
     if (!globals.stateMachine->query(request, response))
         rpc.rejectInvalidRequest();
     rpc.reply(response);
@@ -47,6 +47,7 @@ class ClientService : public RPC::Service {
     ~ClientService();
 
     void handleRPC(RPC::ServerRPC rpc);
+    bool isInline(const RPC::ServerRPC& rpc) const;
     std::string getName() const;
 
   private:
@@ -64,6 +65,14 @@ class ClientService : public RPC::Service {
      */
     Globals& globals;
 
+    /**
+     * If true, GET_SERVER_INFO and VERIFY_RECIPIENT RPCs, which only read
+     * fields that don't change after startup and never block, are handled
+     * directly on the event loop thread rather than on the thread pool. Set
+     * by the 'inlineQuickRPCs' config option.
+     */
+    const bool inlineQuickRPCs;
+
     // ClientService is non-copyable.
     ClientService(const ClientService&) = delete;
     ClientService& operator=(const ClientService&) = delete;
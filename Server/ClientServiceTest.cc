@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <deque>
 #include <gtest/gtest.h>
 #include <thread>
 
@@ -24,11 +25,18 @@
 #include "Protocol/Common.h"
 #include "RPC/ClientRPC.h"
 #include "RPC/ClientSession.h"
+#include "RPC/OpaqueServerRPC.h"
+#include "RPC/Protocol.h"
+#include "Server/ClientService.h"
 #include "Server/Globals.h"
+#include "Server/RaftConsensus.h"
+#include "Server/StateMachine.h"
 #include "Storage/FilesystemUtil.h"
+#include "Storage/MemoryLog.h"
 
 namespace LogCabin {
 namespace Server {
+extern bool stateMachineSuppressThreads;
 namespace {
 
 using Protocol::Client::OpCode;
@@ -159,6 +167,158 @@ TEST_F(ServerClientServiceTest, verifyRecipient) {
               response);
 }
 
+/**
+ * Calls ClientService's handlers directly on a single-server cluster whose
+ * threads don't run, so that its state machine version can be controlled.
+ */
+class ServerClientServiceCommandTest : public ::testing::Test {
+    ServerClientServiceCommandTest()
+        : globals()
+        , service()
+        , responses()
+    {
+        RaftConsensusInternal::startThreads = false;
+        globals.raft.reset(new RaftConsensus(globals));
+        RaftConsensus& raft = *globals.raft;
+        raft.serverId = 1;
+        raft.log.reset(new Storage::MemoryLog());
+        raft.storageLayout.initTemporary();
+
+        Storage::Log::Entry entry;
+        entry.set_term(1);
+        entry.set_type(Protocol::Raft::EntryType::CONFIGURATION);
+        *entry.mutable_configuration() =
+            Core::ProtoBuf::fromString<Protocol::Raft::Configuration>(
+                "prev_configuration {"
+                "    servers { server_id: 1, addresses: '127.0.0.1:5254' }"
+                "}");
+        raft.init();
+        raft.append({&entry});
+        raft.startNewElection();
+        raft.configuration->localServer->lastSyncedIndex =
+            raft.log->getLastLogIndex();
+        raft.advanceCommitIndex();
+
+        stateMachineSuppressThreads = true;
+        globals.stateMachine.reset(new StateMachine(globals.raft,
+                                                    globals.config,
+                                                    globals));
+        // The state machine is caught up with the leader but still runs
+        // version 2.
+        globals.stateMachine->lastApplied = raft.commitIndex;
+        globals.stateMachine->versionHistory.insert({1, 2});
+        service.reset(new ClientService(globals));
+    }
+    ~ServerClientServiceCommandTest()
+    {
+        stateMachineSuppressThreads = false;
+        RaftConsensusInternal::startThreads = true;
+    }
+
+    /**
+     * Send the given read-write tree command to
+     * ClientService::stateMachineCommand.
+     * 
+eturn
+     *      The status of the RPC, or OK if it was parked to be replied to
+     *      once the command is applied.
+     */
+    RPC::Protocol::Status
+    command(const std::string& tree)
+    {
+        typedef RPC::Protocol::RequestHeaderVersion1 Header;
+        Protocol::Client::StateMachineCommand::Request request;
+        *request.mutable_tree() = Core::ProtoBuf::fromString<
+            Protocol::Client::ReadWriteTree::Request>(tree);
+        RPC::OpaqueServerRPC opaqueRPC;
+        Core::ProtoBuf::serialize(request, opaqueRPC.request, sizeof(Header));
+        Header& header = *static_cast<Header*>(opaqueRPC.request.getData());
+        header.prefix.version = 1;
+        header.prefix.toBigEndian();
+        header.toBigEndian();
+        // Parked RPCs reply later, so the response must outlive this call.
+        responses.emplace_back();
+        Core::Buffer& response = responses.back();
+        opaqueRPC.responseTarget = &response;
+        service->stateMachineCommand(RPC::ServerRPC(std::move(opaqueRPC)));
+        if (response.getLength() == 0)
+            return RPC::Protocol::Status::OK;
+        RPC::Protocol::ResponseHeaderVersion1 responseHeader =
+            *static_cast<const RPC::Protocol::ResponseHeaderVersion1*>(
+                response.getData());
+        responseHeader.prefix.fromBigEndian();
+        return responseHeader.prefix.status;
+    }
+
+    uint64_t
+    lastLogIndex()
+    {
+        return globals.raft->log->getLastLogIndex();
+    }
+
+    Globals globals;
+    std::unique_ptr<ClientService> service;
+    std::deque<Core::Buffer> responses;
+};
+
+TEST_F(ServerClientServiceCommandTest, stateMachineCommand_writeOffset) {
+    uint64_t last = lastLogIndex();
+    EXPECT_EQ(RPC::Protocol::Status::INVALID_REQUEST,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 1 } "
+                      "write { path: '/a', contents: 'b', offset: 3 }"));
+    EXPECT_EQ(last, lastLogIndex());
+
+    // Writes without an offset have been around since version 1.
+    EXPECT_EQ(RPC::Protocol::Status::OK,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 1 } "
+                      "write { path: '/a', contents: 'b' }"));
+    EXPECT_EQ(last + 1, lastLogIndex());
+
+    globals.stateMachine->versionHistory[
+        globals.stateMachine->lastApplied] = 3;
+    EXPECT_EQ(RPC::Protocol::Status::OK,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 2 } "
+                      "write { path: '/a', contents: 'b', offset: 3 }"));
+    EXPECT_EQ(last + 2, lastLogIndex());
+}
+
+TEST_F(ServerClientServiceCommandTest, stateMachineCommand_newCommands) {
+    // Older servers would PANIC on these, so they must stay out of the log.
+    uint64_t last = lastLogIndex();
+    EXPECT_EQ(RPC::Protocol::Status::INVALID_REQUEST,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 1 } "
+                      "increment { path: '/a', delta: 1 }"));
+    EXPECT_EQ(RPC::Protocol::Status::INVALID_REQUEST,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 2 } "
+                      "append { path: '/a', contents: 'b' }"));
+    EXPECT_EQ(RPC::Protocol::Status::INVALID_REQUEST,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 3 } "
+                      "create_sequential { path: '/q/', contents: 'b' }"));
+    EXPECT_EQ(last, lastLogIndex());
+
+    globals.stateMachine->versionHistory[
+        globals.stateMachine->lastApplied] = 3;
+    EXPECT_EQ(RPC::Protocol::Status::OK,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 4 } "
+                      "increment { path: '/a', delta: 1 }"));
+    EXPECT_EQ(RPC::Protocol::Status::OK,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 5 } "
+                      "append { path: '/a', contents: 'b' }"));
+    EXPECT_EQ(RPC::Protocol::Status::OK,
+              command("exactly_once { client_id: 1, "
+                      "  first_outstanding_rpc: 1, rpc_number: 6 } "
+                      "create_sequential { path: '/q/', contents: 'b' }"));
+    EXPECT_EQ(last + 3, lastLogIndex());
+}
+
 } // namespace LogCabin::Server::<anonymous>
 } // namespace LogCabin::Server
 } // namespace LogCabin
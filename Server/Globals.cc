@@ -14,10 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <signal.h>
 
 #include "Core/Debug.h"
 #include "Core/StringUtil.h"
+#include "Core/ThreadId.h"
 #include "Protocol/Common.h"
 #include "RPC/Server.h"
 #include "Server/ClientService.h"
@@ -74,6 +76,9 @@ Globals::Globals()
     : config()
     , serverStats(*this)
     , eventLoop()
+    , extraEventLoops()
+    , extraEventLoopThreads()
+    , peerEventLoop(&eventLoop)
     , sigIntBlocker(SIGINT)
     , sigTermBlocker(SIGTERM)
     , sigUsr1Blocker(SIGUSR1)
@@ -98,6 +103,13 @@ Globals::Globals()
 Globals::~Globals()
 {
     serverStats.exit();
+    for (auto it = extraEventLoops.begin(); it != extraEventLoops.end(); ++it)
+        it->exit();
+    for (auto it = extraEventLoopThreads.begin();
+         it != extraEventLoopThreads.end();
+         ++it) {
+        it->join();
+    }
 }
 
 void
@@ -112,6 +124,19 @@ Globals::init()
         ServerStats::Lock serverStatsLock(serverStats);
         serverStatsLock->set_server_id(serverId);
     }
+    if (extraEventLoopThreads.empty()) {
+        // Spread accepted connections over this many event loops (including
+        // the main one), each with its own thread.
+        uint64_t numSocketLoops = std::max(1UL,
+            config.read<uint64_t>("eventLoopThreads", 1));
+        for (uint64_t i = 1; i < numSocketLoops; ++i)
+            startExtraEventLoop(Core::StringUtil::format("EventLoop%lu", i));
+        if (config.read<bool>("peerEventLoop", false)) {
+            startExtraEventLoop("PeerEventLoop");
+            peerEventLoop = &extraEventLoops.back();
+        }
+    }
+
     if (!raft) {
         raft.reset(new RaftConsensus(*this));
         raft->serverId = serverId;
@@ -130,9 +155,20 @@ Globals::init()
     }
 
     if (!rpcServer) {
+        std::vector<Event::Loop*> socketLoops = {&eventLoop};
+        for (auto it = extraEventLoops.begin();
+             it != extraEventLoops.end();
+             ++it) {
+            if (&*it != peerEventLoop)
+                socketLoops.push_back(&*it);
+        }
         rpcServer.reset(new RPC::Server(eventLoop,
+                                        socketLoops,
                                         Protocol::Common::MAX_MESSAGE_LENGTH));
 
+        rpcServer->enableCompression(
+            config.read<uint32_t>("rpcCompressionThreshold", 8192));
+
         uint32_t maxThreads = config.read<uint16_t>("maxThreads", 16);
         namespace ServiceId = Protocol::Common::ServiceId;
         rpcServer->registerService(ServiceId::CONTROL_SERVICE,
@@ -171,7 +207,20 @@ Globals::init()
             NOTICE("Serving on %s",
                    address.toString().c_str());
         }
-        raft->serverAddresses = listenAddressesStr;
+        // Other servers can only reach this one through a Unix domain socket
+        // if they're on the same host, so those addresses are left out of
+        // the ones given to other servers, unless there's nothing else.
+        std::vector<std::string> peerAddresses;
+        for (auto it = listenAddresses.begin();
+             it != listenAddresses.end();
+             ++it) {
+            if (!RPC::Address::isUnixString(*it))
+                peerAddresses.push_back(*it);
+        }
+        if (peerAddresses.empty())
+            raft->serverAddresses = listenAddressesStr;
+        else
+            raft->serverAddresses = Core::StringUtil::join(peerAddresses, ",");
         raft->init();
     }
 
@@ -197,6 +246,23 @@ Globals::run()
     eventLoop.runForever();
 }
 
+Event::Loop&
+Globals::getPeerEventLoop()
+{
+    return *peerEventLoop;
+}
+
+void
+Globals::startExtraEventLoop(const std::string& threadName)
+{
+    extraEventLoops.emplace_back();
+    Event::Loop* loop = &extraEventLoops.back();
+    extraEventLoopThreads.emplace_back([loop, threadName] () {
+        Core::ThreadId::setName(threadName);
+        loop->runForever();
+    });
+}
+
 void
 Globals::unblockAllSignals()
 {
@@ -14,7 +14,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <deque>
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "Client/SessionManager.h"
 #include "Core/Config.h"
@@ -106,6 +110,14 @@ class Globals {
      */
     void run();
 
+    /**
+     * Return the event loop that RaftConsensus should use for its sessions
+     * with the other servers. This is #eventLoop unless the peerEventLoop
+     * config option gave the peers a loop and thread of their own, so that
+     * client traffic can't delay heartbeats.
+     */
+    Event::Loop& getPeerEventLoop();
+
     /**
      * Enable asynchronous signal delivery for all signals that this class is
      * in charge of. This should be called in a child process after invoking
@@ -130,6 +142,31 @@ class Globals {
     Event::Loop eventLoop;
 
   private:
+    /**
+     * Add an event loop to #extraEventLoops and start a thread to run it.
+     * \param threadName
+     *      Name for the new thread, used in log messages.
+     */
+    void startExtraEventLoop(const std::string& threadName);
+
+    /**
+     * Additional event loops, each run by a thread in #extraEventLoopThreads.
+     * These serve some of the accepted connections (see the eventLoopThreads
+     * config option) and possibly the Raft peers' sessions (see
+     * #peerEventLoop). std::deque is used since Event::Loop can't be moved.
+     */
+    std::deque<Event::Loop> extraEventLoops;
+
+    /**
+     * Threads running #extraEventLoops, exited and joined in the destructor.
+     */
+    std::vector<std::thread> extraEventLoopThreads;
+
+    /**
+     * The event loop used for Raft peers' sessions. See getPeerEventLoop().
+     */
+    Event::Loop* peerEventLoop;
+
     /**
      * Block SIGINT, which is handled by sigIntHandler.
      * Signals are blocked early on in the startup process so that newly
@@ -229,6 +266,9 @@ class Globals {
      */
     std::unique_ptr<RPC::Server> rpcServer;
 
+    // ServerStats collects stats from #rpcServer.
+    friend class ServerStats;
+
     // Globals is non-copyable.
     Globals(const Globals&) = delete;
     Globals& operator=(const Globals&) = delete;
@@ -19,6 +19,7 @@
 #include "RPC/Address.h"
 #include "RPC/Server.h"
 #include "Server/Globals.h"
+#include "Server/RaftConsensus.h"
 
 namespace LogCabin {
 namespace Server {
@@ -36,6 +37,32 @@ TEST(ServerGlobalsTest, basics) {
     globals.run();
 }
 
+TEST(ServerGlobalsTest, init_eventLoops) {
+    Globals globals;
+    globals.config.set("storageModule", "Memory");
+    globals.config.set("uuid", "my-fake-uuid-123");
+    globals.config.set("listenAddresses", "127.0.0.1");
+    globals.config.set("serverId", "1");
+    globals.config.set("use-temporary-storage", "true");
+    EXPECT_EQ(&globals.eventLoop, &globals.getPeerEventLoop());
+    globals.config.set("eventLoopThreads", "3");
+    globals.config.set("peerEventLoop", "true");
+    globals.init();
+    ASSERT_EQ(3U, globals.extraEventLoops.size());
+    EXPECT_EQ(3U, globals.extraEventLoopThreads.size());
+    EXPECT_EQ(&globals.extraEventLoops.back(), &globals.getPeerEventLoop());
+    EXPECT_EQ(&globals.getPeerEventLoop(),
+              &globals.raft->sessionManager.eventLoop);
+    const std::vector<Event::Loop*>& socketLoops =
+        globals.rpcServer->opaqueServer.socketLoops;
+    ASSERT_EQ(3U, socketLoops.size());
+    EXPECT_EQ(&globals.eventLoop, socketLoops.at(0));
+    EXPECT_EQ(&globals.extraEventLoops.at(0), socketLoops.at(1));
+    EXPECT_EQ(&globals.extraEventLoops.at(1), socketLoops.at(2));
+    globals.eventLoop.exit();
+    globals.run();
+}
+
 TEST(ServerGlobalsTest, initNoServers) {
     Globals globals;
     globals.config.set("storageModule", "Memory");
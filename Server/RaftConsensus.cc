@@ -162,7 +162,7 @@ LocalServer::updatePeerStats(Protocol::ServerStats::Raft::Peer& peerStats,
 Peer::Peer(uint64_t serverId, RaftConsensus& consensus)
     : Server(serverId)
     , consensus(consensus)
-    , eventLoop(consensus.globals.eventLoop)
+    , eventLoop(consensus.globals.getPeerEventLoop())
     , exiting(false)
     , requestVoteDone(false)
     , haveVote_(false)
@@ -184,7 +184,9 @@ Peer::Peer(uint64_t serverId, RaftConsensus& consensus)
     , isCaughtUp_(false)
     , snapshotFile()
     , snapshotFileOffset(0)
+    , snapshotSendOffset(0)
     , lastSnapshotIndex(0)
+    , snapshotChunksInFlight()
     , session()
     , rpc()
 {
@@ -209,7 +211,10 @@ Peer::beginLeadership()
     suppressBulkData = true;
     snapshotFile.reset();
     snapshotFileOffset = 0;
+    snapshotSendOffset = 0;
     lastSnapshotIndex = 0;
+    // snapshotChunksInFlight may be in use by the peer thread; it discards
+    // them when it opens the next snapshot file.
 }
 
 void
@@ -248,6 +253,11 @@ void
 Peer::interrupt()
 {
     rpc.cancel();
+    for (auto it = snapshotChunksInFlight.begin();
+         it != snapshotChunksInFlight.end();
+         ++it) {
+        it->rpc.cancel();
+    }
 }
 
 bool
@@ -267,16 +277,32 @@ Peer::callRPC(Protocol::Raft::OpCode opCode,
               const google::protobuf::Message& request,
               google::protobuf::Message& response,
               std::unique_lock<Mutex>& lockGuard)
+{
+    rpc = startRPC(opCode, request, lockGuard);
+    return waitForRPC(rpc, response, lockGuard);
+}
+
+RPC::ClientRPC
+Peer::startRPC(Protocol::Raft::OpCode opCode,
+               const google::protobuf::Message& request,
+               std::unique_lock<Mutex>& lockGuard)
+{
+    return RPC::ClientRPC(getSession(lockGuard),
+                          Protocol::Common::ServiceId::RAFT_SERVICE,
+                          /* serviceSpecificErrorVersion = */ 0,
+                          opCode,
+                          request);
+}
+
+Peer::CallStatus
+Peer::waitForRPC(RPC::ClientRPC& call,
+                 google::protobuf::Message& response,
+                 std::unique_lock<Mutex>& lockGuard)
 {
     typedef RPC::ClientRPC::Status RPCStatus;
-    rpc = RPC::ClientRPC(getSession(lockGuard),
-                         Protocol::Common::ServiceId::RAFT_SERVICE,
-                         /* serviceSpecificErrorVersion = */ 0,
-                         opCode,
-                         request);
     // release lock for concurrency
     Core::MutexUnlock<Mutex> unlockGuard(lockGuard);
-    switch (rpc.waitForReply(&response, NULL, TimePoint::max())) {
+    switch (call.waitForReply(&response, NULL, TimePoint::max())) {
         case RPCStatus::OK:
             if (rpcFailuresSinceLastWarning > 0) {
                 WARNING("RPC to server succeeded after %lu failures",
@@ -292,11 +318,11 @@ Peer::callRPC(Protocol::Raft::OpCode opCode,
             ++rpcFailuresSinceLastWarning;
             if (rpcFailuresSinceLastWarning == 1) {
                 WARNING("RPC to server failed: %s",
-                        rpc.getErrorMessage().c_str());
+                        call.getErrorMessage().c_str());
             } else if (rpcFailuresSinceLastWarning % 100 == 0) {
                 WARNING("Last %lu RPCs to server failed. This failure: %s",
                         rpcFailuresSinceLastWarning,
-                        rpc.getErrorMessage().c_str());
+                        call.getErrorMessage().c_str());
             }
             return CallStatus::FAILED;
         case RPCStatus::RPC_CANCELED:
@@ -908,6 +934,7 @@ struct StateMachineVersionIntersection {
 
 RaftConsensus::Entry::Entry()
     : index(0)
+    , term(0)
     , type(SKIP)
     , command()
     , snapshotReader()
@@ -917,6 +944,7 @@ RaftConsensus::Entry::Entry()
 
 RaftConsensus::Entry::Entry(Entry&& other)
     : index(other.index)
+    , term(other.term)
     , type(other.type)
     , command(std::move(other.command))
     , snapshotReader(std::move(other.snapshotReader))
@@ -959,12 +987,24 @@ RaftConsensus::RaftConsensus(Globals& globals)
             globals.config.read<uint64_t>(
                 "stateMachineUpdaterBackoffMilliseconds",
                 10000)))
+    , STREAM_SNAPSHOTS(
+        globals.config.read<bool>(
+            "snapshotStreamInstall",
+            false))
+    , STREAM_SNAPSHOT_BUFFER_BYTES(
+        globals.config.read<uint64_t>(
+            "snapshotStreamBufferBytes",
+            64 * 1024 * 1024))
     , SOFT_RPC_SIZE_LIMIT(Protocol::Common::MAX_MESSAGE_LENGTH - 1024)
+    , SNAPSHOT_CHUNKS_IN_FLIGHT(
+        std::max(1UL, globals.config.read<uint64_t>(
+            "snapshotChunksInFlight",
+            8)))
     , serverId(0)
     , serverAddresses()
     , globals(globals)
     , storageLayout()
-    , sessionManager(globals.eventLoop,
+    , sessionManager(globals.getPeerEventLoop(),
                      globals.config)
     , mutex()
     , stateChanged()
@@ -983,6 +1023,11 @@ RaftConsensus::RaftConsensus(Globals& globals)
     , lastSnapshotBytes(0)
     , snapshotReader()
     , snapshotWriter()
+    , incomingSnapshot()
+    , incomingSnapshotClaimed(false)
+    , snapshotSendLimiter(
+        globals.config.read<uint64_t>("snapshotSendBytesPerSecond", 0),
+        Protocol::Common::MAX_MESSAGE_LENGTH)
     , commitIndex(0)
     , leaderId(0)
     , votedFor(0)
@@ -1124,6 +1169,10 @@ RaftConsensus::exit()
     exiting = true;
     if (configuration)
         configuration->forEach(&Server::exit);
+    if (incomingSnapshot) {
+        incomingSnapshot->abort();
+        incomingSnapshot.reset();
+    }
     interruptAll();
 }
 
@@ -1221,11 +1270,13 @@ RaftConsensus::getNextEntry(uint64_t lastIndex) const
                     entry.snapshotReader = std::move(snapshotReader);
                 }
                 entry.index = lastSnapshotIndex;
+                entry.term = lastSnapshotTerm;
                 entry.clusterTime = lastSnapshotClusterTime;
             } else {
                 // not a snapshot
                 const Log::Entry& logEntry = log->getEntry(nextIndex);
                 entry.index = nextIndex;
+                entry.term = logEntry.term();
                 if (logEntry.type() == Protocol::Raft::EntryType::DATA) {
                     entry.type = Entry::DATA;
                     const std::string& s = logEntry.data();
@@ -1244,6 +1295,21 @@ RaftConsensus::getNextEntry(uint64_t lastIndex) const
     }
 }
 
+std::shared_ptr<Storage::SnapshotFile::StreamReader>
+RaftConsensus::getIncomingSnapshot()
+{
+    std::unique_lock<Mutex> lockGuard(mutex);
+    while (true) {
+        if (exiting)
+            throw Core::Util::ThreadInterruptedException();
+        if (incomingSnapshot && !incomingSnapshotClaimed) {
+            incomingSnapshotClaimed = true;
+            return incomingSnapshot;
+        }
+        stateChanged.wait(lockGuard);
+    }
+}
+
 SnapshotStats::SnapshotStats
 RaftConsensus::getSnapshotStats() const
 {
@@ -1466,8 +1532,11 @@ RaftConsensus::handleInstallSnapshot(
     }
 
     if (!snapshotWriter) {
+        // The leader sends the bytes of its snapshot file, which are already
+        // compressed (or not) and must be stored as is.
         snapshotWriter.reset(
-            new Storage::SnapshotFile::Writer(storageLayout));
+            new Storage::SnapshotFile::Writer(storageLayout, globals.config,
+                                              false));
     }
     response.set_bytes_stored(snapshotWriter->getBytesWritten());
 
@@ -1499,7 +1568,29 @@ RaftConsensus::handleInstallSnapshot(
         }
         return;
     }
+    if (STREAM_SNAPSHOTS &&
+        snapshotWriter->getBytesWritten() == 0 &&
+        !request.data().empty() &&
+        request.data().at(0) != Storage::SnapshotFile::COMPRESSED_MAGIC[0]) {
+        // An uncompressed snapshot is starting: let the state machine parse
+        // it as it arrives.
+        incomingSnapshot =
+            std::make_shared<Storage::SnapshotFile::StreamReader>(
+                STREAM_SNAPSHOT_BUFFER_BYTES);
+        incomingSnapshotClaimed = false;
+        stateChanged.notify_all();
+    }
     snapshotWriter->writeRaw(request.data().data(), request.data().length());
+    if (incomingSnapshot &&
+        !incomingSnapshot->append(request.data().data(),
+                                  request.data().length())) {
+        NOTICE("State machine fell more than %lu bytes behind in parsing the "
+               "snapshot being received; it will be loaded from disk once "
+               "it's complete instead",
+               STREAM_SNAPSHOT_BUFFER_BYTES);
+        incomingSnapshot->abort();
+        incomingSnapshot.reset();
+    }
     response.set_bytes_stored(snapshotWriter->getBytesWritten());
 
     if (request.done()) {
@@ -1510,13 +1601,16 @@ RaftConsensus::handleInstallSnapshot(
                     "Discarding the snapshot.",
                     request.last_snapshot_index(),
                     lastSnapshotIndex);
-            snapshotWriter->discard();
-            snapshotWriter.reset();
+            discardIncomingSnapshot();
             return;
         }
         NOTICE("Loading in new snapshot from leader");
         snapshotWriter->save();
         snapshotWriter.reset();
+        if (incomingSnapshot) {
+            incomingSnapshot->close();
+            incomingSnapshot.reset();
+        }
         readSnapshot();
         stateChanged.notify_all();
     }
@@ -1581,14 +1675,43 @@ RaftConsensus::handleRequestVote(
     response.set_log_ok(logIsOk);
 }
 
-std::pair<RaftConsensus::ClientResult, uint64_t>
-RaftConsensus::replicate(const Core::Buffer& operation)
+RaftConsensus::ClientResult
+RaftConsensus::replicateAsync(const Core::Buffer& operation,
+                              uint64_t& index,
+                              uint64_t& term)
 {
-    std::unique_lock<Mutex> lockGuard(mutex);
+    std::lock_guard<Mutex> lockGuard(mutex);
+    if (exiting || state != State::LEADER)
+        return ClientResult::NOT_LEADER;
     Log::Entry entry;
     entry.set_type(Protocol::Raft::EntryType::DATA);
     entry.set_data(operation.getData(), operation.getLength());
-    return replicateEntry(entry, lockGuard);
+    index = appendAsLeader(entry);
+    term = currentTerm;
+    return ClientResult::SUCCESS;
+}
+
+bool
+RaftConsensus::isCommitted(uint64_t index, uint64_t term) const
+{
+    std::lock_guard<Mutex> lockGuard(mutex);
+    if (index > commitIndex ||
+        index < log->getLogStartIndex() ||
+        index > log->getLastLogIndex()) {
+        return false;
+    }
+    return log->getEntry(index).term() == term;
+}
+
+void
+RaftConsensus::waitForNewTerm(uint64_t term) const
+{
+    std::unique_lock<Mutex> lockGuard(mutex);
+    while (currentTerm <= term) {
+        if (exiting)
+            throw Core::Util::ThreadInterruptedException();
+        stateChanged.wait(lockGuard);
+    }
 }
 
 RaftConsensus::ClientResult
@@ -1750,7 +1873,8 @@ RaftConsensus::beginSnapshot(uint64_t lastIncludedIndex)
     NOTICE("Creating new snapshot through log index %lu (inclusive)",
            lastIncludedIndex);
     std::unique_ptr<Storage::SnapshotFile::Writer> writer(
-                new Storage::SnapshotFile::Writer(storageLayout));
+                new Storage::SnapshotFile::Writer(storageLayout,
+                                                  globals.config));
 
     // Only committed entries may be snapshotted.
     // (This check relies on commitIndex monotonically increasing.)
@@ -1810,6 +1934,20 @@ RaftConsensus::beginSnapshot(uint64_t lastIncludedIndex)
     return writer;
 }
 
+std::unique_ptr<Storage::SnapshotFile::Reader>
+RaftConsensus::openSnapshot()
+{
+    std::lock_guard<Mutex> lockGuard(mutex);
+    std::unique_ptr<Storage::SnapshotFile::Reader> reader;
+    if (storageLayout.serverDir.fd != -1) {
+        try {
+            reader.reset(new Storage::SnapshotFile::Reader(storageLayout));
+        } catch (const std::runtime_error& e) { // file not found
+        }
+    }
+    return reader;
+}
+
 void
 RaftConsensus::snapshotDone(
         uint64_t lastIncludedIndex,
@@ -1894,6 +2032,8 @@ RaftConsensus::updateServerStats(Protocol::ServerStats& serverStats) const
     raftStats.set_last_snapshot_term(lastSnapshotTerm);
     raftStats.set_last_snapshot_cluster_time(lastSnapshotClusterTime);
     raftStats.set_last_snapshot_bytes(lastSnapshotBytes);
+    raftStats.set_snapshot_send_throttled_nanos(
+        uint64_t(snapshotSendLimiter.getThrottledTime().count()));
     raftStats.set_num_entries_truncated(numEntriesTruncated);
     raftStats.set_log_start_index(log->getLogStartIndex());
     raftStats.set_log_bytes(log->getSizeBytes());
@@ -2387,12 +2527,6 @@ void
 RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
                                Peer& peer)
 {
-    // Build up request
-    Protocol::Raft::InstallSnapshot::Request request;
-    request.set_server_id(serverId);
-    request.set_term(currentTerm);
-    request.set_version(2);
-
     // Open the latest snapshot if we haven't already. Stash a copy of the
     // lastSnapshotIndex that goes along with the file, since it's possible
     // that this will change while we're transferring chunks).
@@ -2401,40 +2535,104 @@ RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
         peer.snapshotFile.reset(new FS::FileContents(
             FS::openFile(storageLayout.snapshotDir, "snapshot", O_RDONLY)));
         peer.snapshotFileOffset = 0;
+        peer.snapshotSendOffset = 0;
         peer.lastSnapshotIndex = lastSnapshotIndex;
+        peer.snapshotChunksInFlight.clear();
         NOTICE("Beginning to send snapshot of %lu bytes up through index %lu "
                "to follower",
                peer.snapshotFile->getFileLength(),
                lastSnapshotIndex);
     }
-    request.set_last_snapshot_index(peer.lastSnapshotIndex);
-    request.set_byte_offset(peer.snapshotFileOffset);
-    uint64_t numDataBytes = 0;
-    if (!peer.suppressBulkData) {
-        // The amount of data we can send is bounded by the remaining bytes in
-        // the file and the maximum length for RPCs.
-        numDataBytes = std::min(
-            peer.snapshotFile->getFileLength() - peer.snapshotFileOffset,
-            SOFT_RPC_SIZE_LIMIT);
-    }
-    request.set_data(peer.snapshotFile->get<char>(peer.snapshotFileOffset,
-                                                  numDataBytes),
-                     numDataBytes);
-    request.set_done(peer.snapshotFileOffset + numDataBytes ==
-                     peer.snapshotFile->getFileLength());
+    uint64_t fileLength = peer.snapshotFile->getFileLength();
+    uint64_t chunkLimit = SOFT_RPC_SIZE_LIMIT;
+    if (snapshotSendLimiter.isLimited()) {
+        // Keep chunks small enough that waiting to send one doesn't hold up
+        // the heartbeats that the chunks stand in for.
+        uint64_t heartbeatMs = uint64_t(
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                HEARTBEAT_PERIOD).count());
+        chunkLimit = std::min(chunkLimit, std::max(
+            4096UL,
+            snapshotSendLimiter.unitsPerSecond * heartbeatMs / 2000));
+    }
+
+    // Keep up to SNAPSHOT_CHUNKS_IN_FLIGHT chunks outstanding, so that the
+    // transfer isn't limited to one chunk per round trip. While bulk data is
+    // suppressed, send a single empty chunk to find out where the follower
+    // is.
+    uint64_t window = peer.suppressBulkData ? 1 : SNAPSHOT_CHUNKS_IN_FLIGHT;
+    while (peer.snapshotChunksInFlight.size() < window &&
+           (peer.snapshotChunksInFlight.empty() ||
+            peer.snapshotSendOffset < fileLength)) {
+        // Build up request
+        Protocol::Raft::InstallSnapshot::Request request;
+        request.set_server_id(serverId);
+        request.set_term(currentTerm);
+        request.set_version(2);
+        request.set_last_snapshot_index(peer.lastSnapshotIndex);
+        request.set_byte_offset(peer.snapshotSendOffset);
+        uint64_t numDataBytes = 0;
+        if (!peer.suppressBulkData) {
+            // The amount of data we can send is bounded by the remaining
+            // bytes in the file and the maximum length for RPCs.
+            numDataBytes = std::min(fileLength - peer.snapshotSendOffset,
+                                    chunkLimit);
+        }
+        if (numDataBytes > 0 && snapshotSendLimiter.isLimited()) {
+            if (!peer.snapshotChunksInFlight.empty()) {
+                // Rather than waiting here, go process a reply.
+                if (!snapshotSendLimiter.tryReserve(numDataBytes))
+                    break;
+            } else {
+                TimePoint sendAt = snapshotSendLimiter.reserve(numDataBytes);
+                while (Clock::now() < sendAt && !peer.exiting)
+                    stateChanged.wait_until(lockGuard, sendAt);
+                if (peer.exiting || !peer.snapshotFile ||
+                    state != State::LEADER) {
+                    return;
+                }
+            }
+        }
+        request.set_data(peer.snapshotFile->get<char>(peer.snapshotSendOffset,
+                                                      numDataBytes),
+                         numDataBytes);
+        request.set_done(peer.snapshotSendOffset + numDataBytes ==
+                         fileLength);
+        TimePoint start = Clock::now();
+        uint64_t epoch = currentEpoch;
+        RPC::ClientRPC rpc = peer.startRPC(
+                Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                request,
+                lockGuard);
+        peer.snapshotChunksInFlight.emplace_back(std::move(rpc),
+                                                 request.term(),
+                                                 peer.snapshotSendOffset,
+                                                 numDataBytes,
+                                                 start,
+                                                 epoch);
+        peer.snapshotSendOffset += numDataBytes;
+        if (peer.exiting || !peer.snapshotFile)
+            break;
+    }
 
-    // Execute RPC
+    // Execute RPC: wait for the oldest chunk's reply
     Protocol::Raft::InstallSnapshot::Response response;
-    TimePoint start = Clock::now();
-    uint64_t epoch = currentEpoch;
-    Peer::CallStatus status = peer.callRPC(
-                Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
-                request, response,
+    Peer::CallStatus status = peer.waitForRPC(
+                peer.snapshotChunksInFlight.front().rpc,
+                response,
                 lockGuard);
+    uint64_t term = peer.snapshotChunksInFlight.front().term;
+    uint64_t byteOffset = peer.snapshotChunksInFlight.front().byteOffset;
+    uint64_t numDataBytes = peer.snapshotChunksInFlight.front().numDataBytes;
+    TimePoint start = peer.snapshotChunksInFlight.front().start;
+    uint64_t epoch = peer.snapshotChunksInFlight.front().epoch;
+    peer.snapshotChunksInFlight.pop_front();
     switch (status) {
         case Peer::CallStatus::OK:
             break;
         case Peer::CallStatus::FAILED:
+            peer.snapshotChunksInFlight.clear();
+            peer.snapshotSendOffset = peer.snapshotFileOffset;
             peer.suppressBulkData = true;
             peer.backoffUntil = start + RPC_FAILURE_BACKOFF;
             return;
@@ -2445,8 +2643,10 @@ RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
 
     // Process response
 
-    if (currentTerm != request.term() || peer.exiting) {
-        // we don't care about result of RPC
+    if (currentTerm != term || peer.exiting || !peer.snapshotFile) {
+        // we don't care about result of RPC (or the others in flight)
+        peer.snapshotChunksInFlight.clear();
+        peer.snapshotSendOffset = peer.snapshotFileOffset;
         return;
     }
     // Since we were leader in this term before, we must still be leader in
@@ -2472,7 +2672,14 @@ RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
             // appended to the file if the terms matched.
             peer.snapshotFileOffset += numDataBytes;
         }
-        if (peer.snapshotFileOffset == peer.snapshotFile->getFileLength()) {
+        if (peer.snapshotFileOffset != byteOffset + numDataBytes) {
+            // The follower didn't store this chunk where it was meant to go,
+            // so the chunks in flight after it won't line up either. Start
+            // over from where the follower is.
+            peer.snapshotChunksInFlight.clear();
+            peer.snapshotSendOffset = peer.snapshotFileOffset;
+        }
+        if (peer.snapshotFileOffset == fileLength) {
             NOTICE("Done sending snapshot through index %lu to follower",
                    peer.lastSnapshotIndex);
             peer.matchIndex = peer.lastSnapshotIndex;
@@ -2484,7 +2691,9 @@ RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
             advanceCommitIndex();
             peer.snapshotFile.reset();
             peer.snapshotFileOffset = 0;
+            peer.snapshotSendOffset = 0;
             peer.lastSnapshotIndex = 0;
+            peer.snapshotChunksInFlight.clear();
         }
     }
 }
@@ -2546,6 +2755,19 @@ RaftConsensus::discardUnneededEntries()
     }
 }
 
+void
+RaftConsensus::discardIncomingSnapshot()
+{
+    if (snapshotWriter) {
+        snapshotWriter->discard();
+        snapshotWriter.reset();
+    }
+    if (incomingSnapshot) {
+        incomingSnapshot->abort();
+        incomingSnapshot.reset();
+    }
+}
+
 uint64_t
 RaftConsensus::getLastLogTerm() const
 {
@@ -2738,15 +2960,22 @@ RaftConsensus::readSnapshot()
     snapshotReader = std::move(reader);
 }
 
+uint64_t
+RaftConsensus::appendAsLeader(Log::Entry& entry)
+{
+    assert(state == State::LEADER);
+    entry.set_term(currentTerm);
+    entry.set_cluster_time(clusterClock.leaderStamp());
+    append({&entry});
+    return log->getLastLogIndex();
+}
+
 std::pair<RaftConsensus::ClientResult, uint64_t>
 RaftConsensus::replicateEntry(Log::Entry& entry,
                               std::unique_lock<Mutex>& lockGuard)
 {
     if (state == State::LEADER) {
-        entry.set_term(currentTerm);
-        entry.set_cluster_time(clusterClock.leaderStamp());
-        append({&entry});
-        uint64_t index = log->getLastLogIndex();
+        uint64_t index = appendAsLeader(entry);
         while (!exiting && currentTerm == entry.term()) {
             if (commitIndex >= index) {
                 VERBOSE("replicate succeeded");
@@ -2891,10 +3120,7 @@ RaftConsensus::startNewElection()
     printElectionState();
     setElectionTimer();
     configuration->forEach(&Server::beginRequestVote);
-    if (snapshotWriter) {
-        snapshotWriter->discard();
-        snapshotWriter.reset();
-    }
+    discardIncomingSnapshot();
     updateLogMetadata();
     interruptAll();
 
@@ -2914,10 +3140,7 @@ RaftConsensus::stepDown(uint64_t newTerm)
         votedFor = 0;
         updateLogMetadata();
         configuration->resetStagingServers();
-        if (snapshotWriter) {
-            snapshotWriter->discard();
-            snapshotWriter.reset();
-        }
+        discardIncomingSnapshot();
         state = State::FOLLOWER;
         printElectionState();
     } else {
@@ -29,6 +29,7 @@
 #include "Core/CompatAtomic.h"
 #include "Core/ConditionVariable.h"
 #include "Core/Mutex.h"
+#include "Core/RateLimiter.h"
 #include "Core/Time.h"
 #include "RPC/ClientRPC.h"
 #include "Storage/Layout.h"
@@ -320,6 +321,42 @@ class Peer : public Server {
             google::protobuf::Message& response,
             std::unique_lock<Mutex>& lockGuard);
 
+    /**
+     * Send an RPC to the remote server without waiting for its reply. This
+     * lets several RPCs be in flight at once; see waitForRPC().
+     * \param opCode
+     *      The RPC opcode to execute (see Protocol::Raft::OpCode).
+     * \param[in] request
+     *      The request that was received from the other server.
+     * \param[in] lockGuard
+     *      The Raft lock, which may be released internally while connecting.
+     * \return
+     *      The RPC in progress.
+     */
+    RPC::ClientRPC
+    startRPC(Protocol::Raft::OpCode opCode,
+             const google::protobuf::Message& request,
+             std::unique_lock<Mutex>& lockGuard);
+
+    /**
+     * Wait for the reply to an RPC from startRPC(). The RPC must be reachable
+     * from interrupt() (for example, in #snapshotChunksInFlight) and must not
+     * be destroyed until this returns.
+     * \param call
+     *      The RPC in progress.
+     * \param[out] response
+     *      Where the reply should be placed, if status is OK.
+     * \param[in] lockGuard
+     *      The Raft lock, which is released internally to allow for I/O
+     *      concurrency.
+     * \return
+     *      See CallStatus.
+     */
+    CallStatus
+    waitForRPC(RPC::ClientRPC& call,
+               google::protobuf::Message& response,
+               std::unique_lock<Mutex>& lockGuard);
+
     /**
      * Launch this Peer's thread, which should run
      * RaftConsensus::peerThreadMain.
@@ -351,8 +388,8 @@ class Peer : public Server {
     RaftConsensus& consensus;
 
     /**
-     * A reference to the server's event loop, needed to construct new
-     * sessions.
+     * A reference to the event loop for sessions with other servers
+     * (Globals::getPeerEventLoop()), needed to construct new sessions.
      */
     Event::Loop& eventLoop;
 
@@ -424,7 +461,7 @@ class Peer : public Server {
 
     /**
      * Counts RPC failures to issue fewer warnings.
-     * Accessed only from callRPC() without holding the lock.
+     * Accessed only from waitForRPC() without holding the lock.
      */
     uint64_t rpcFailuresSinceLastWarning;
 
@@ -449,6 +486,11 @@ class Peer : public Server {
      * follower already. Send starting here next time.
      */
     uint64_t snapshotFileOffset;
+    /**
+     * The offset in 'snapshotFile' of the next chunk to send. This runs ahead
+     * of 'snapshotFileOffset' while chunks are in flight.
+     */
+    uint64_t snapshotSendOffset;
     /**
      * The last log index that 'snapshotFile' corresponds to. This is used to
      * set the follower's #nextIndex accordingly after we're done sending it
@@ -456,6 +498,47 @@ class Peer : public Server {
      */
     uint64_t lastSnapshotIndex;
 
+    /**
+     * An InstallSnapshot RPC that has been sent to the follower but whose
+     * reply hasn't been processed yet.
+     */
+    struct SnapshotChunk {
+        SnapshotChunk(RPC::ClientRPC rpc,
+                      uint64_t term,
+                      uint64_t byteOffset,
+                      uint64_t numDataBytes,
+                      TimePoint start,
+                      uint64_t epoch)
+            : rpc(std::move(rpc))
+            , term(term)
+            , byteOffset(byteOffset)
+            , numDataBytes(numDataBytes)
+            , start(start)
+            , epoch(epoch)
+        {
+        }
+        /// The RPC in progress.
+        RPC::ClientRPC rpc;
+        /// The term in which the RPC was sent.
+        uint64_t term;
+        /// Where the chunk starts in 'snapshotFile'.
+        uint64_t byteOffset;
+        /// The number of bytes of 'snapshotFile' in the chunk.
+        uint64_t numDataBytes;
+        /// When the RPC was sent.
+        TimePoint start;
+        /// RaftConsensus::currentEpoch when the RPC was sent.
+        uint64_t epoch;
+    };
+
+    /**
+     * InstallSnapshot RPCs in flight to the follower, oldest first. Keeping
+     * several outstanding lets a snapshot cross a high-latency link without
+     * waiting a round trip per chunk. These are only added and removed by
+     * the peer thread, and interrupt() cancels them.
+     */
+    std::deque<SnapshotChunk> snapshotChunksInFlight;
+
   private:
 
     /**
@@ -911,6 +994,12 @@ class RaftConsensus {
          */
         uint64_t index;
 
+        /**
+         * The term in which the entry (or the last one a snapshot covers) was
+         * created.
+         */
+        uint64_t term;
+
         /**
          * The type of the entry.
          */
@@ -1044,6 +1133,20 @@ class RaftConsensus {
      */
     Entry getNextEntry(uint64_t lastIndex) const;
 
+    /**
+     * Wait for the leader to start sending this server a snapshot, then
+     * return a stream of the snapshot's bytes that fills in as they arrive.
+     * This lets the state machine parse the snapshot during the transfer.
+     * Each snapshot is returned only once, and only if STREAM_SNAPSHOTS is set
+     * and the snapshot is uncompressed. The stream is aborted if the transfer
+     * is abandoned. The snapshot is still saved to disk and returned by
+     * getNextEntry() as usual.
+     * \throw Core::Util::ThreadInterruptedException
+     *      Thread should exit.
+     */
+    std::shared_ptr<Storage::SnapshotFile::StreamReader>
+    getIncomingSnapshot();
+
     /**
      * Return statistics that may be useful in deciding when to snapshot.
      */
@@ -1083,16 +1186,38 @@ class RaftConsensus {
                            Protocol::Raft::RequestVote::Response& response);
 
     /**
-     * Submit an operation to the replicated log.
+     * Submit an operation to the replicated log without waiting for it to be
+     * committed. The operation takes effect only if the entry that the state
+     * machine gets for 'index' from getNextEntry() has the same term.
      * \param operation
      *      If the cluster accepts this operation, then it will be added to the
      *      log and the state machine will eventually apply it.
+     * \param[out] index
+     *      If SUCCESS is returned, the log index of the new entry.
+     * \param[out] term
+     *      If SUCCESS is returned, the term of the new entry.
      * \return
-     *      First component is status code. If SUCCESS, second component is the
-     *      log index at which the entry has been committed to the replicated
-     *      log.
+     *      SUCCESS if the entry was added to the log, or NOT_LEADER.
+     */
+    ClientResult replicateAsync(const Core::Buffer& operation,
+                                uint64_t& index,
+                                uint64_t& term);
+
+    /**
+     * Return true if the entry at the given index has the given term and has
+     * been committed. Returns false if it has been discarded from the log
+     * since, even if it was committed, because its term can no longer be
+     * checked.
      */
-    std::pair<ClientResult, uint64_t> replicate(const Core::Buffer& operation);
+    bool isCommitted(uint64_t index, uint64_t term) const;
+
+    /**
+     * Return once the current term is greater than the given one. Entries
+     * from that term that haven't been committed yet may never be.
+     * \throw Core::Util::ThreadInterruptedException
+     *      Thread should exit.
+     */
+    void waitForNewTerm(uint64_t term) const;
 
     /**
      * Change the cluster's configuration.
@@ -1135,6 +1260,16 @@ class RaftConsensus {
     std::unique_ptr<Storage::SnapshotFile::Writer>
     beginSnapshot(uint64_t lastIncludedIndex);
 
+    /**
+     * Open the newest snapshot file on disk for reading, without otherwise
+     * affecting this object. The state machine uses this to copy the parts of
+     * its previous snapshot that haven't changed into a new snapshot.
+     * \return
+     *      The snapshot file, or NULL if there isn't one.
+     */
+    std::unique_ptr<Storage::SnapshotFile::Reader>
+    openSnapshot();
+
     /**
      * Complete taking a snapshot for the log entries in range [1,
      * lastIncludedIndex]. Called by the state machine when it is done taking a
@@ -1294,6 +1429,12 @@ class RaftConsensus {
      */
     void discardUnneededEntries();
 
+    /**
+     * Throw away the partial snapshot received from the leader, if any, and
+     * abort #incomingSnapshot.
+     */
+    void discardIncomingSnapshot();
+
     /**
      * Return the term corresponding to log->getLastLogIndex(). This may come
      * from the log, from the snapshot, or it may be 0.
@@ -1332,6 +1473,14 @@ class RaftConsensus {
      */
     void readSnapshot();
 
+    /**
+     * Stamp an entry with the current term and cluster time and append it to
+     * the log. Must only be called as leader.
+     * \return
+     *      The log index of the new entry.
+     */
+    uint64_t appendAsLeader(Storage::Log::Entry& entry);
+
     /**
      * Append an entry to the log and wait for it to be committed.
      */
@@ -1447,12 +1596,35 @@ class RaftConsensus {
      */
     const std::chrono::nanoseconds STATE_MACHINE_UPDATER_BACKOFF;
 
+    /**
+     * If true, snapshots received from the leader are handed to the state
+     * machine while they're being received (see getIncomingSnapshot()).
+     * Const except for unit tests.
+     */
+    bool STREAM_SNAPSHOTS;
+
+    /**
+     * With STREAM_SNAPSHOTS, the most bytes of a snapshot being received that
+     * may wait in memory for the state machine to parse them. If the state
+     * machine falls further behind, it gives up and loads the snapshot from
+     * disk once the transfer completes.
+     * Const except for unit tests.
+     */
+    uint64_t STREAM_SNAPSHOT_BUFFER_BYTES;
+
     /**
      * Prefer to keep RPC requests under this size.
      * Const except for unit tests.
      */
     uint64_t SOFT_RPC_SIZE_LIMIT;
 
+    /**
+     * The maximum number of InstallSnapshot RPCs to have in flight to a
+     * follower at once.
+     * Const except for unit tests.
+     */
+    uint64_t SNAPSHOT_CHUNKS_IN_FLIGHT;
+
   public:
     /**
      * This server's unique ID. Not available until init() is called.
@@ -1618,6 +1790,27 @@ class RaftConsensus {
      */
     std::unique_ptr<Storage::SnapshotFile::Writer> snapshotWriter;
 
+    /**
+     * With STREAM_SNAPSHOTS, the bytes written to #snapshotWriter are also
+     * appended here for the state machine to read. This is closed and cleared
+     * when the snapshot is complete, and aborted and cleared if it's
+     * discarded.
+     */
+    std::shared_ptr<Storage::SnapshotFile::StreamReader> incomingSnapshot;
+
+    /**
+     * Set once #incomingSnapshot has been returned from
+     * getIncomingSnapshot().
+     */
+    bool incomingSnapshotClaimed;
+
+    /**
+     * Limits the rate at which this server, as leader, sends snapshot data
+     * to all followers combined (see snapshotSendBytesPerSecond in
+     * sample.conf).
+     */
+    Core::RateLimiter snapshotSendLimiter;
+
     /**
      * The largest entry ID for which a quorum is known to have stored the same
      * entry as this server has. Entries 1 through commitIndex as stored in
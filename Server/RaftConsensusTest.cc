@@ -1237,6 +1237,113 @@ TEST_F(ServerRaftConsensusTest, handleInstallSnapshot)
     // TODO(ongaro): Test that the configuration is update accordingly
 }
 
+TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_stream)
+{
+    init();
+    consensus->STREAM_SNAPSHOTS = true;
+    consensus->stepDown(10);
+    consensus->append({&entry1});
+    consensus->commitIndex = 1;
+    std::unique_ptr<Storage::SnapshotFile::Writer> writer =
+        consensus->beginSnapshot(1);
+    writer->save();
+    std::string snapshotContents =
+        readEntireFileAsString(consensus->storageLayout.snapshotDir,
+                               "snapshot");
+
+    Protocol::Raft::InstallSnapshot::Request request;
+    Protocol::Raft::InstallSnapshot::Response response;
+    request.set_server_id(3);
+    request.set_term(10);
+    request.set_last_snapshot_index(1);
+    request.set_byte_offset(0);
+    request.set_data(snapshotContents);
+    request.set_done(false);
+    consensus->handleInstallSnapshot(request, response);
+    std::shared_ptr<Storage::SnapshotFile::StreamReader> stream =
+        consensus->getIncomingSnapshot();
+    ASSERT_TRUE(bool(stream));
+    EXPECT_TRUE(consensus->incomingSnapshotClaimed);
+    std::string streamed(snapshotContents.size(), '\0');
+    EXPECT_EQ(snapshotContents.size(),
+              stream->readRaw(&streamed[0], streamed.size()));
+    EXPECT_EQ(snapshotContents, streamed);
+
+    request.set_byte_offset(snapshotContents.size());
+    request.set_data("hello world!");
+    request.set_done(true);
+    consensus->handleInstallSnapshot(request, response);
+    EXPECT_EQ(1U, consensus->lastSnapshotIndex);
+    EXPECT_FALSE(bool(consensus->incomingSnapshot));
+    char helloWorld[20];
+    EXPECT_EQ(12U, stream->readRaw(helloWorld, sizeof(helloWorld)));
+    EXPECT_EQ("hello world!", std::string(helloWorld, 12));
+
+    // a transfer that's cut short aborts the stream
+    request.set_last_snapshot_index(2);
+    request.set_byte_offset(0);
+    request.set_data(snapshotContents);
+    request.set_done(false);
+    consensus->handleInstallSnapshot(request, response);
+    stream = consensus->getIncomingSnapshot();
+    consensus->stepDown(11);
+    EXPECT_FALSE(bool(consensus->incomingSnapshot));
+    EXPECT_FALSE(bool(consensus->snapshotWriter));
+    EXPECT_EQ(snapshotContents.size(),
+              stream->readRaw(&streamed[0], streamed.size()));
+    EXPECT_THROW(stream->readRaw(helloWorld, 1),
+                 Core::Util::ThreadInterruptedException);
+}
+
+TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_streamFallsBehind)
+{
+    init();
+    consensus->STREAM_SNAPSHOTS = true;
+    consensus->stepDown(10);
+    consensus->append({&entry1});
+    consensus->commitIndex = 1;
+    std::unique_ptr<Storage::SnapshotFile::Writer> writer =
+        consensus->beginSnapshot(1);
+    writer->save();
+    std::string snapshotContents =
+        readEntireFileAsString(consensus->storageLayout.snapshotDir,
+                               "snapshot");
+    consensus->STREAM_SNAPSHOT_BUFFER_BYTES = snapshotContents.size();
+
+    Protocol::Raft::InstallSnapshot::Request request;
+    Protocol::Raft::InstallSnapshot::Response response;
+    request.set_server_id(3);
+    request.set_term(10);
+    request.set_last_snapshot_index(1);
+    request.set_byte_offset(0);
+    request.set_data(snapshotContents);
+    request.set_done(false);
+    consensus->handleInstallSnapshot(request, response);
+    std::shared_ptr<Storage::SnapshotFile::StreamReader> stream =
+        consensus->getIncomingSnapshot();
+
+    // nothing has been read, so the next chunk doesn't fit
+    request.set_byte_offset(snapshotContents.size());
+    request.set_data("hello world!");
+    consensus->handleInstallSnapshot(request, response);
+    EXPECT_FALSE(bool(consensus->incomingSnapshot));
+    EXPECT_EQ(snapshotContents.size() + 12, response.bytes_stored());
+    std::string streamed(snapshotContents.size(), '\0');
+    EXPECT_EQ(snapshotContents.size(),
+              stream->readRaw(&streamed[0], streamed.size()));
+    char c;
+    EXPECT_THROW(stream->readRaw(&c, 1),
+                 Core::Util::ThreadInterruptedException);
+
+    // the snapshot is still saved to disk
+    request.set_byte_offset(snapshotContents.size() + 12);
+    request.set_data("");
+    request.set_done(true);
+    consensus->handleInstallSnapshot(request, response);
+    EXPECT_EQ(1U, consensus->lastSnapshotIndex);
+    EXPECT_TRUE(bool(consensus->snapshotReader));
+}
+
 TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_byteOffsetHigh)
 {
     init();
@@ -1358,8 +1465,6 @@ TEST_F(ServerRaftConsensusTest, handleRequestVote_termStale)
     EXPECT_GT(Clock::mockValue, consensus->startElectionAt);
 }
 
-// TODO(ongardie): low-priority test: replicate
-
 TEST_F(ServerRaftConsensusTest, setConfiguration_notLeader)
 {
     init();
@@ -2486,6 +2591,7 @@ class ServerRaftConsensusPSTest : public ServerRaftConsensusPTest {
         EXPECT_EQ(State::LEADER, consensus->state);
         EXPECT_EQ(5U, consensus->currentTerm);
         peer = getPeerRef(2);
+        consensus->SNAPSHOT_CHUNKS_IN_FLIGHT = 1;
 
         // First create a snapshot file on disk.
         // Note that this one doesn't have a Raft header.
@@ -2632,6 +2738,84 @@ TEST_F(ServerRaftConsensusPSTest, installSnapshot_notAllBytesStored)
     EXPECT_EQ(2U, peer->matchIndex);
 }
 
+TEST_F(ServerRaftConsensusPSTest, installSnapshot_pipelined)
+{
+    peer->suppressBulkData = false;
+    consensus->SOFT_RPC_SIZE_LIMIT = 5;
+    consensus->SNAPSHOT_CHUNKS_IN_FLIGHT = 2;
+    request.set_done(false);
+    request.set_data("hello");
+    response.set_bytes_stored(5);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    request.set_byte_offset(5);
+    request.set_data(", wor");
+    response.set_bytes_stored(10);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    request.set_byte_offset(10);
+    request.set_data("ld!");
+    request.set_done(true);
+    response.set_bytes_stored(13);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(5U, peer->snapshotFileOffset);
+    EXPECT_EQ(10U, peer->snapshotSendOffset);
+    EXPECT_EQ(1U, peer->snapshotChunksInFlight.size());
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(10U, peer->snapshotFileOffset);
+    EXPECT_EQ(13U, peer->snapshotSendOffset);
+    EXPECT_EQ(1U, peer->snapshotChunksInFlight.size());
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(2U, peer->matchIndex);
+    EXPECT_FALSE(peer->snapshotFile);
+    EXPECT_EQ(0U, peer->snapshotChunksInFlight.size());
+}
+
+TEST_F(ServerRaftConsensusPSTest, installSnapshot_pipelinedChunkLost)
+{
+    peer->suppressBulkData = false;
+    consensus->SOFT_RPC_SIZE_LIMIT = 7;
+    consensus->SNAPSHOT_CHUNKS_IN_FLIGHT = 2;
+    // the follower misses the first chunk, so it can't store the second
+    request.set_done(false);
+    request.set_data("hello, ");
+    response.set_bytes_stored(0);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    request.set_byte_offset(7);
+    request.set_data("world!");
+    request.set_done(true);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    // both are sent again
+    request.set_byte_offset(0);
+    request.set_data("hello, ");
+    request.set_done(false);
+    response.set_bytes_stored(7);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    request.set_byte_offset(7);
+    request.set_data("world!");
+    request.set_done(true);
+    response.set_bytes_stored(13);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(0U, peer->snapshotFileOffset);
+    EXPECT_EQ(0U, peer->snapshotSendOffset);
+    EXPECT_EQ(0U, peer->snapshotChunksInFlight.size());
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(7U, peer->snapshotFileOffset);
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(2U, peer->matchIndex);
+}
+
 
 TEST_F(ServerRaftConsensusTest, becomeLeader)
 {
@@ -2909,6 +3093,45 @@ TEST_F(ServerRaftConsensusTest, replicateEntry_termChanged)
               consensus->replicateEntry(entry2, lockGuard).first);
 }
 
+TEST_F(ServerRaftConsensusTest, replicateAsync)
+{
+    init();
+    Core::Buffer operation(const_cast<char*>("hello"), 5, NULL);
+    uint64_t index = 0;
+    uint64_t term = 0;
+    EXPECT_EQ(ClientResult::NOT_LEADER,
+              consensus->replicateAsync(operation, index, term));
+    consensus->stepDown(5);
+    consensus->append({&entry1});
+    consensus->startNewElection();
+    EXPECT_EQ(ClientResult::SUCCESS,
+              consensus->replicateAsync(operation, index, term));
+    // 1: entry1, 2: no-op, 3: hello
+    EXPECT_EQ(3U, index);
+    EXPECT_EQ(6U, term);
+    EXPECT_EQ("hello", consensus->log->getEntry(3).data());
+    EXPECT_FALSE(consensus->isCommitted(3, 6));
+    drainDiskQueue(*consensus);
+    EXPECT_TRUE(consensus->isCommitted(3, 6));
+    EXPECT_FALSE(consensus->isCommitted(3, 5));
+    EXPECT_FALSE(consensus->isCommitted(4, 6));
+}
+
+TEST_F(ServerRaftConsensusTest, waitForNewTerm)
+{
+    init();
+    consensus->stepDown(5);
+    consensus->waitForNewTerm(4);
+    consensus->stateChanged.callback = std::bind(&RaftConsensus::stepDown,
+                                                 consensus.get(), 6);
+    consensus->waitForNewTerm(5);
+    EXPECT_EQ(6U, consensus->currentTerm);
+    consensus->stateChanged.callback = std::bind(&RaftConsensus::exit,
+                                                 consensus.get());
+    EXPECT_THROW(consensus->waitForNewTerm(6),
+                 Core::Util::ThreadInterruptedException);
+}
+
 TEST_F(ServerRaftConsensusPTest, requestVote_rpcFailed)
 {
     init();
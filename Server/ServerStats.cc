@@ -19,6 +19,7 @@
 #include "Core/ThreadId.h"
 #include "Core/Time.h"
 #include "Event/Signal.h"
+#include "RPC/Server.h"
 #include "Server/Globals.h"
 #include "Server/RaftConsensus.h"
 #include "Server/StateMachine.h"
@@ -163,6 +164,8 @@ ServerStats::getCurrent(std::unique_lock<Core::Mutex>& lockGuard) const
         Core::MutexUnlock<Core::Mutex> unlockGuard(lockGuard);
         globals.raft->updateServerStats(copy);
         globals.stateMachine->updateServerStats(copy);
+        if (globals.rpcServer)
+            globals.rpcServer->updateServerStats(copy);
     }
     copy.set_end_at(std::chrono::nanoseconds(
         Core::Time::SystemClock::now().time_since_epoch()).count());
@@ -14,10 +14,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <endian.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include "build/Server/SnapshotMetadata.pb.h"
 #include "Core/Debug.h"
 #include "Core/Mutex.h"
 #include "Core/ProtoBuf.h"
@@ -35,6 +40,260 @@ namespace Server {
 
 namespace PC = LogCabin::Protocol::Client;
 
+namespace {
+
+/**
+ * Once StateMachine::appliedBytes exceeds this, it and
+ * StateMachine::applyTime are halved.
+ */
+const uint64_t APPLY_TIME_DECAY_BYTES = 64UL * 1024 * 1024;
+
+/**
+ * When StateMachine::lazySnapshotSuperseded is set, snapshotThread parses
+ * about this many bytes of the Tree each time it acquires the mutex.
+ */
+const uint64_t LAZY_LOAD_STEP_BYTES = 1024 * 1024;
+
+/**
+ * The log's growth rate is sampled at most this often.
+ */
+const std::chrono::milliseconds LOG_GROWTH_SAMPLE_INTERVAL(100);
+
+/**
+ * The approximate windows of StateMachine::logGrowthRecent and
+ * StateMachine::logGrowthAverage, in seconds.
+ */
+const double LOG_GROWTH_RECENT_SECONDS = 1.0;
+const double LOG_GROWTH_AVERAGE_SECONDS = 60.0;
+
+/**
+ * A sample of the log's growth older than this no longer says anything about
+ * whether the log is growing in a burst now.
+ */
+const std::chrono::seconds LOG_GROWTH_STALE(2);
+
+/**
+ * The log is growing in a burst if its recent growth rate is this many times
+ * its average.
+ */
+const double LOG_BURST_FACTOR = 2.0;
+
+/**
+ * Return the canonical form of a parsed path: slash-delimited, without a
+ * trailing slash (except for "/" itself).
+ */
+std::string
+canonicalPath(const Tree::Internal::Path& path)
+{
+    std::string canonical;
+    if (!path.parents.empty()) {
+        for (auto it = path.parents.begin() + 1;
+             it != path.parents.end();
+             ++it) {
+            canonical += "/" + *it;
+        }
+        canonical += "/" + path.target;
+    } else {
+        canonical = "/";
+    }
+    return canonical;
+}
+
+/**
+ * Return the state machine version that introduced the given read-write tree
+ * command. State machines running older versions ignore the command, and
+ * leaders don't append it to the log until the cluster runs this version.
+ */
+uint16_t
+getVersionIntroduced(const PC::ReadWriteTree::Request& request)
+{
+    if (request.has_increment() ||
+        request.has_append() ||
+        request.has_create_sequential() ||
+        (request.has_write() && request.write().has_offset())) {
+        return 3;
+    }
+    return 1;
+}
+
+/**
+ * Return the canonical path that a successful read-write tree command
+ * modified, or the empty string if it did not modify any path.
+ */
+std::string
+getModifiedPath(const PC::ReadWriteTree::Request& request,
+                const PC::ReadWriteTree::Response& response)
+{
+    std::string symbolic;
+    if (request.has_make_directory())
+        symbolic = request.make_directory().path();
+    else if (request.has_remove_directory())
+        symbolic = request.remove_directory().path();
+    else if (request.has_write())
+        symbolic = request.write().path();
+    else if (request.has_remove_file())
+        symbolic = request.remove_file().path();
+    else if (request.has_increment())
+        symbolic = request.increment().path();
+    else if (request.has_append())
+        symbolic = request.append().path();
+    else if (request.has_create_sequential())
+        symbolic = response.create_sequential().path();
+    else
+        return "";
+    Tree::Internal::Path path(symbolic);
+    if (path.result.status != Tree::Status::OK)
+        return "";
+    return canonicalPath(path);
+}
+
+/**
+ * Return the canonical path of the parent directory of the given canonical
+ * path (which must not be "/").
+ */
+std::string
+parentPath(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    if (slash == 0)
+        return "/";
+    return path.substr(0, slash);
+}
+
+/**
+ * Return true if 'descendant' is strictly below 'ancestor' in the tree. Both
+ * are canonical paths.
+ */
+bool
+isBelow(const std::string& ancestor, const std::string& descendant)
+{
+    if (ancestor == "/")
+        return descendant != "/";
+    return (descendant.size() > ancestor.size() &&
+            descendant.compare(0, ancestor.size(), ancestor) == 0 &&
+            descendant.at(ancestor.size()) == '/');
+}
+
+/**
+ * Return true if a change to 'changed' should trigger a watch on 'watched'.
+ * Changes to the watched path itself, to its ancestors, and to its direct
+ * children always trigger the watch; changes further below the watched path
+ * trigger it only if it is recursive. All paths are canonical.
+ */
+bool
+watchTriggeredBy(const std::string& watched,
+                 bool recursive,
+                 const std::string& changed)
+{
+    if (watched == changed || isBelow(changed, watched))
+        return true;
+    if (isBelow(watched, changed))
+        return recursive || parentPath(changed) == watched;
+    return false;
+}
+
+/**
+ * Return the ioprio_set() value for the snapshotIOPriority setting, or 0 to
+ * leave the priority alone.
+ */
+int
+parseIOPriority(const std::string& priority)
+{
+    // From linux/ioprio.h, which isn't always installed.
+    const int IOPRIO_CLASS_SHIFT = 13;
+    const int IOPRIO_CLASS_BE = 2;
+    const int IOPRIO_CLASS_IDLE = 3;
+    if (priority == "normal")
+        return 0;
+    if (priority == "low") // the lowest best-effort level
+        return (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7;
+    if (priority == "idle")
+        return IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    PANIC("Unknown snapshotIOPriority setting '%s' (expected 'normal', "
+          "'low', or 'idle')", priority.c_str());
+}
+
+/**
+ * Found at the very end of snapshots that have a SnapshotStateMachine::Footer.
+ */
+const char SNAPSHOT_FOOTER_MAGIC[8] = {'L', 'C', 'F', 'O', 'O', 'T', 'E', 'R'};
+
+/**
+ * Find the SnapshotStateMachine::Footer at the end of a snapshot file and
+ * fill in 'base' from its index.
+ * \param reader
+ *      The snapshot file.
+ * \param[out] lastIncludedIndex
+ *      On success, the last log index that the footer says the snapshot
+ *      covers.
+ * \param[out] base
+ *      On success, its data, length, and subtrees are filled in.
+ * \return
+ *      True if the file has a valid footer, false otherwise.
+ */
+bool
+readSnapshotFooter(Storage::SnapshotFile::Reader& reader,
+                   uint64_t& lastIncludedIndex,
+                   Tree::SnapshotBase& base)
+{
+    uint64_t fileSize = reader.getSizeBytes();
+    uint64_t trailerSize = sizeof(uint64_t) + sizeof(SNAPSHOT_FOOTER_MAGIC);
+    if (reader.isCompressed() || fileSize < trailerSize)
+        return false;
+    uint64_t trailerOffset = fileSize - trailerSize;
+    const char* trailer = reader.getRange(trailerOffset, trailerSize);
+    if (memcmp(trailer + sizeof(uint64_t), SNAPSHOT_FOOTER_MAGIC,
+               sizeof(SNAPSHOT_FOOTER_MAGIC)) != 0) {
+        return false;
+    }
+    uint64_t footerOffset;
+    memcpy(&footerOffset, trailer, sizeof(footerOffset));
+    footerOffset = be64toh(footerOffset);
+    const char* lengthField = reader.getRange(footerOffset, sizeof(uint32_t));
+    if (lengthField == NULL)
+        return false;
+    uint32_t length;
+    memcpy(&length, lengthField, sizeof(length));
+    length = be32toh(length);
+    if (footerOffset + sizeof(length) + length != trailerOffset)
+        return false;
+    SnapshotStateMachine::Footer footer;
+    if (!footer.ParseFromArray(lengthField + sizeof(length), int(length)))
+        return false;
+    lastIncludedIndex = footer.last_included_index();
+    base.data = reader.getRange(0, footerOffset);
+    base.length = footerOffset;
+    base.subtrees.clear();
+    base.values = footer.tree_index().values();
+    for (auto it = footer.tree_index().subtree().begin();
+         it != footer.tree_index().subtree().end();
+         ++it) {
+        if (it->offset() <= footerOffset &&
+            it->length() <= footerOffset - it->offset()) {
+            base.subtrees[it->path()] = {it->offset(), it->length()};
+        }
+    }
+    return true;
+}
+
+/**
+ * A snapshot file that Tree::loadSnapshotLazily() is reading from, along with
+ * its index. The Tree holds on to this until it's done with the file.
+ */
+struct MappedSnapshot {
+    MappedSnapshot()
+        : reader()
+        , layout()
+    {
+    }
+    /// The open snapshot file, which keeps layout.data mapped.
+    std::unique_ptr<Storage::SnapshotFile::Reader> reader;
+    /// The tree's index, which points into the file.
+    Tree::SnapshotBase layout;
+};
+
+} // anonymous namespace
+
 
 // for testing purposes
 bool stateMachineSuppressThreads = false;
@@ -53,8 +312,28 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
             config.read<uint64_t>("snapshotMinLogSize", 64UL * 1024 * 1024))
     , snapshotRatio(
             config.read<uint64_t>("snapshotRatio", 4))
+    , snapshotAdaptive(
+            config.read<bool>("snapshotAdaptive", false))
+    , snapshotMaxLogSize(
+            config.read<uint64_t>("snapshotMaxLogSize", 0))
     , snapshotWatchdogInterval(std::chrono::milliseconds(
             config.read<uint64_t>("snapshotWatchdogMilliseconds", 10000)))
+    , snapshotIncremental(
+            config.read<bool>("snapshotIncremental", false))
+    , snapshotFullInterval(
+            config.read<uint64_t>("snapshotFullInterval", 10))
+    , snapshotIndexMinBytes(
+            config.read<uint64_t>("snapshotIndexMinBytes", 64 * 1024))
+    , snapshotWriteBytesPerSecond(
+            config.read<uint64_t>("snapshotWriteBytesPerSecond", 0))
+    , snapshotIOPriority(parseIOPriority(
+            config.read<std::string>("snapshotIOPriority", "normal")))
+    , snapshotLoadThreads(
+            config.read<uint64_t>("snapshotLoadThreads", 0))
+    , snapshotLoadLazily(
+            config.read<bool>("snapshotLoadLazily", false))
+    , snapshotStreamInstall(
+            config.read<bool>("snapshotStreamInstall", false))
       // TODO(ongaro): This should be configurable, but it must be the same for
       // every server, so it's dangerous to put it in the config file. Need to
       // use the Raft log to agree on this value. Also need to inform clients
@@ -65,11 +344,18 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
     , unknownRequestMessageBackoff(std::chrono::milliseconds(
             config.read<uint64_t>("stateMachineUnknownRequestMessage"
                                   "BackoffMilliseconds", 10000)))
+    , watchHistoryLength(
+            config.read<uint64_t>("watchHistoryLength", 10000))
+    , watchMaxTimeout(std::chrono::milliseconds(
+            config.read<uint64_t>("watchMaxTimeoutMilliseconds", 60000)))
     , mutex()
     , entriesApplied()
     , snapshotSuggested()
     , snapshotStarted()
     , snapshotCompleted()
+    , watchesChanged()
+    , pendingCommandsChanged()
+    , incomingSnapshotChanged()
     , exiting(false)
     , childPid(0)
     , lastApplied(0)
@@ -78,20 +364,51 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
     , numUnknownRequestsSinceLastMessage(0)
     , numSnapshotsAttempted(0)
     , numSnapshotsFailed(0)
+    , snapshotWriteThrottledTime(0)
+    , applyTime(0)
+    , appliedBytes(0)
+    , snapshotWriteTime(0)
+    , snapshotWriteBytes(0)
+    , logGrowthSampleStart(TimePoint::min())
+    , logGrowthSampleBytes(0)
+    , logGrowthRecent(0)
+    , logGrowthAverage(0)
+    , numSnapshotsSinceFull(0)
+    , haveSnapshotBase(false)
+    , snapshotBaseIndex(0)
+    , snapshotBaseEpoch(0)
+    , lazySnapshotSuperseded(false)
     , numRedundantAdvanceVersionEntries(0)
     , numRejectedAdvanceVersionEntries(0)
     , numSuccessfulAdvanceVersionEntries(0)
     , numTotalAdvanceVersionEntries(0)
     , isSnapshotRequested(false)
     , maySnapshotAt(TimePoint::min())
+    , numWatchesTriggered(0)
+    , numWatchesTimedOut(0)
+    , nextWatchId(1)
+    , watchHistoryStart(0)
+    , watchHistory()
+    , watches()
+    , watchesByPath()
+    , watchDeadlines()
+    , pendingCommands()
+    , newestCommandTerm(0)
     , sessions()
     , tree()
+    , incomingSnapshot()
     , versionHistory()
     , writer()
     , applyThread()
     , snapshotThread()
     , snapshotWatchdogThread()
+    , watchThread()
+    , pendingCommandThread()
+    , snapshotStreamThread()
 {
+    if (snapshotLoadThreads == 0)
+        snapshotLoadThreads = std::max(1U, std::thread::hardware_concurrency());
+    tree.setSnapshotDedup(config.read<bool>("snapshotDedup", false));
     versionHistory.insert({0, 1});
     consensus->setSupportedStateMachineVersions(MIN_SUPPORTED_VERSION,
                                                 MAX_SUPPORTED_VERSION);
@@ -100,6 +417,13 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
         snapshotThread = std::thread(&StateMachine::snapshotThreadMain, this);
         snapshotWatchdogThread = std::thread(
                 &StateMachine::snapshotWatchdogThreadMain, this);
+        watchThread = std::thread(&StateMachine::watchThreadMain, this);
+        pendingCommandThread = std::thread(
+                &StateMachine::pendingCommandThreadMain, this);
+        if (snapshotStreamInstall) {
+            snapshotStreamThread = std::thread(
+                    &StateMachine::snapshotStreamThreadMain, this);
+        }
     }
 }
 
@@ -114,7 +438,16 @@ StateMachine::~StateMachine()
         snapshotThread.join();
     if (snapshotWatchdogThread.joinable())
         snapshotWatchdogThread.join();
+    if (watchThread.joinable())
+        watchThread.join();
+    if (pendingCommandThread.joinable())
+        pendingCommandThread.join();
+    if (snapshotStreamThread.joinable())
+        snapshotStreamThread.join();
     NOTICE("Joined with threads");
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    replyToAllWatches(false); // normally done when applyThread exits
+    replyToAllCommands();
 }
 
 bool
@@ -146,6 +479,18 @@ StateMachine::updateServerStats(Protocol::ServerStats& serverStats) const
     smStats.set_num_unknown_requests(numUnknownRequests);
     smStats.set_num_snapshots_attempted(numSnapshotsAttempted);
     smStats.set_num_snapshots_failed(numSnapshotsFailed);
+    smStats.set_snapshot_write_throttled_nanos(
+        uint64_t(snapshotWriteThrottledTime.count()));
+    {
+        SnapshotStats::SnapshotStats stats = consensus->getSnapshotStats();
+        smStats.set_estimated_replay_nanos(uint64_t(
+            estimateReplayTime(stats.log_bytes()).count()));
+        smStats.set_estimated_snapshot_nanos(uint64_t(
+            estimateSnapshotTime(stats.last_snapshot_bytes()).count()));
+    }
+    smStats.set_log_growth_recent_bytes_per_second(uint64_t(logGrowthRecent));
+    smStats.set_log_growth_average_bytes_per_second(
+        uint64_t(logGrowthAverage));
     smStats.set_num_redundant_advance_version_entries(
         numRedundantAdvanceVersionEntries);
     smStats.set_num_rejected_advance_version_entries(
@@ -158,9 +503,83 @@ StateMachine::updateServerStats(Protocol::ServerStats& serverStats) const
     smStats.set_max_supported_version(MAX_SUPPORTED_VERSION);
     smStats.set_running_version(getVersion(lastApplied));
     smStats.set_may_snapshot_at(time.unixNanos(maySnapshotAt));
+    smStats.set_num_watches(watches.size());
+    smStats.set_num_watches_triggered(numWatchesTriggered);
+    smStats.set_num_watches_timed_out(numWatchesTimedOut);
+    smStats.set_num_pending_commands(pendingCommands.size());
     tree.updateServerStats(*smStats.mutable_tree());
 }
 
+void
+StateMachine::watch(const PC::WatchTree::Request& request,
+                    RPC::ServerRPC rpc)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    Query::Response response;
+    PC::WatchTree::Response& watchResponse = *response.mutable_watch();
+
+    Tree::Internal::Path parsed(request.path());
+    if (parsed.result.status != Tree::Status::OK) {
+        watchResponse.set_status(static_cast<PC::Status>(
+                                    parsed.result.status));
+        watchResponse.set_error(parsed.result.error);
+        rpc.reply(response);
+        return;
+    }
+    watchResponse.set_status(PC::Status::OK);
+    std::string path = canonicalPath(parsed);
+    uint64_t afterIndex = request.after_index();
+
+    // The changes after afterIndex are not all known: report a change.
+    if (afterIndex == 0 || afterIndex < watchHistoryStart) {
+        ++numWatchesTriggered;
+        watchResponse.set_index(lastApplied);
+        watchResponse.set_changed(true);
+        rpc.reply(response);
+        return;
+    }
+
+    // Look for a matching change the client hasn't seen yet.
+    auto it = std::upper_bound(
+        watchHistory.begin(), watchHistory.end(),
+        afterIndex,
+        [](uint64_t index, const std::pair<uint64_t, std::string>& change) {
+            return index < change.first;
+        });
+    for (; it != watchHistory.end(); ++it) {
+        if (watchTriggeredBy(path, request.recursive(), it->second)) {
+            ++numWatchesTriggered;
+            watchResponse.set_index(it->first);
+            watchResponse.set_changed(true);
+            rpc.reply(response);
+            return;
+        }
+    }
+
+    std::chrono::milliseconds timeout(request.timeout_ms());
+    if (timeout == std::chrono::milliseconds::zero() ||
+        timeout > watchMaxTimeout) {
+        timeout = watchMaxTimeout;
+    }
+    if (exiting) {
+        watchResponse.set_index(lastApplied);
+        watchResponse.set_changed(false);
+        rpc.reply(response);
+        return;
+    }
+
+    // Park the RPC until a matching change is applied or it times out.
+    uint64_t id = nextWatchId;
+    ++nextWatchId;
+    TimePoint deadline = Clock::now() + timeout;
+    rpc.park();
+    watches.emplace(id, Watch(std::move(rpc), path, request.recursive(),
+                              afterIndex, deadline));
+    watchesByPath.insert({path, id});
+    watchDeadlines.insert({deadline, id});
+    watchesChanged.notify_all();
+}
+
 void
 StateMachine::wait(uint64_t index) const
 {
@@ -170,21 +589,49 @@ StateMachine::wait(uint64_t index) const
 }
 
 bool
-StateMachine::waitForResponse(uint64_t logIndex,
-                              const Command::Request& command,
-                              Command::Response& response) const
+StateMachine::isSupported(const Command::Request& command) const
 {
-    std::unique_lock<Core::Mutex> lockGuard(mutex);
-    while (lastApplied < logIndex)
-        entriesApplied.wait(lockGuard);
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    return (!command.has_tree() ||
+            getVersion(lastApplied) >= getVersionIntroduced(command.tree()));
+}
+
+void
+StateMachine::respondWhenApplied(uint64_t logIndex,
+                                 uint64_t term,
+                                 const Command::Request& command,
+                                 RPC::ServerRPC rpc)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    PendingCommand pending(std::move(rpc), term, command);
+    if (exiting || term < newestCommandTerm) {
+        replyToCommand(logIndex, pending, false);
+        return;
+    }
+    // The entry may have been committed and applied already.
+    if (lastApplied >= logIndex) {
+        replyToCommand(logIndex, pending,
+                       consensus->isCommitted(logIndex, term));
+        return;
+    }
+    pending.rpc.park();
+    pendingCommands.insert({logIndex, std::move(pending)});
+    newestCommandTerm = term;
+    pendingCommandsChanged.notify_all();
+}
 
+bool
+StateMachine::getResponse(uint64_t logIndex,
+                          const Command::Request& command,
+                          Command::Response& response) const
+{
     // Need to check whether we understood the request at the time it
     // was applied using getVersion(logIndex), then reply and return true/false
-    // based on that. Existing commands have been around since version 1, so we
-    // skip this check for now.
+    // based on that.
     uint16_t versionThen = getVersion(logIndex);
 
-    if (command.has_tree()) {
+    if (command.has_tree() &&
+        versionThen >= getVersionIntroduced(command.tree())) {
         const PC::ExactlyOnceRPCInfo& rpcInfo = command.tree().exactly_once();
         auto sessionIt = sessions.find(rpcInfo.client_id());
         if (sessionIt == sessions.end()) {
@@ -306,7 +753,12 @@ StateMachine::apply(const RaftConsensus::Entry& entry)
               entry.index);
     }
     uint16_t runningVersion = getVersion(entry.index - 1);
-    if (command.has_tree()) {
+    if (command.has_tree() &&
+        runningVersion < getVersionIntroduced(command.tree())) {
+        // Command is ignored in older versions.
+        warnUnknownRequest(command, "may not process the given request, "
+                           "which was introduced in a later version");
+    } else if (command.has_tree()) {
         PC::ExactlyOnceRPCInfo rpcInfo = command.tree().exactly_once();
         auto it = sessions.find(rpcInfo.client_id());
         if (it == sessions.end()) {
@@ -322,11 +774,19 @@ StateMachine::apply(const RaftConsensus::Entry& entry)
                                                 {rpcInfo.rpc_number(), {}});
                 if (inserted.second) {
                     // response not found, apply and save it
+                    PC::ReadWriteTree::Response& response =
+                        *inserted.first->second.mutable_tree();
                     Tree::ProtoBuf::readWriteTreeRPC(
                         tree,
                         command.tree(),
-                        *inserted.first->second.mutable_tree());
+                        response);
                     session.lastModified = entry.clusterTime;
+                    if (response.status() == PC::Status::OK) {
+                        std::string path = getModifiedPath(command.tree(),
+                                                           response);
+                        if (!path.empty())
+                            recordChange(entry.index, path);
+                    }
                 } else {
                     // response exists, do not re-apply
                 }
@@ -389,23 +849,58 @@ StateMachine::applyThreadMain()
     try {
         while (true) {
             RaftConsensus::Entry entry = consensus->getNextEntry(lastApplied);
-            std::lock_guard<Core::Mutex> lockGuard(mutex);
+            std::unique_lock<Core::Mutex> lockGuard(mutex);
             switch (entry.type) {
                 case RaftConsensus::Entry::SKIP:
                     break;
-                case RaftConsensus::Entry::DATA:
+                case RaftConsensus::Entry::DATA: {
+                    TimePoint start = Clock::now();
                     apply(entry);
+                    recordApply(entry.command.getLength(),
+                                start, Clock::now());
                     break;
+                }
                 case RaftConsensus::Entry::SNAPSHOT:
                     NOTICE("Loading snapshot through entry %lu into state "
                            "machine", entry.index);
-                    loadSnapshot(*entry.snapshotReader);
+                    if (incomingSnapshot &&
+                        incomingSnapshot->lastIncludedIndex == entry.index) {
+                        // The snapshot is complete, so this shouldn't take
+                        // long.
+                        std::shared_ptr<IncomingSnapshot> incoming =
+                            incomingSnapshot;
+                        incomingSnapshot.reset();
+                        while (!incoming->done)
+                            incomingSnapshotChanged.wait(lockGuard);
+                        if (incoming->loaded) {
+                            NOTICE("Using the snapshot parsed while it was "
+                                   "received");
+                            loadVersionHistory(incoming->header);
+                            loadSessions(incoming->header);
+                            tree.loadContents(incoming->tree);
+                            lazySnapshotSuperseded = false;
+                            entry.snapshotReader.reset();
+                        }
+                    }
+                    if (entry.snapshotReader)
+                        loadSnapshot(std::move(entry.snapshotReader));
                     NOTICE("Done loading snapshot");
+                    // The Tree now matches the snapshot file exactly.
+                    haveSnapshotBase = true;
+                    snapshotBaseIndex = entry.index;
+                    snapshotBaseEpoch = tree.markSnapshot();
+                    // Any path may have changed, and changes before the
+                    // snapshot can no longer be told apart.
+                    watchHistory.clear();
+                    watchHistoryStart = entry.index;
+                    lastApplied = entry.index;
+                    replyToAllWatches(true);
                     break;
             }
             expireSessions(entry.clusterTime);
             lastApplied = entry.index;
             entriesApplied.notify_all();
+            replyToCommandsThrough(entry.index, entry.term);
             if (shouldTakeSnapshot(lastApplied) &&
                 maySnapshotAt <= Clock::now()) {
                 snapshotSuggested.notify_all();
@@ -419,7 +914,199 @@ StateMachine::applyThreadMain()
         snapshotSuggested.notify_all();
         snapshotStarted.notify_all();
         snapshotCompleted.notify_all();
+        watchesChanged.notify_all();
+        pendingCommandsChanged.notify_all();
         killSnapshotProcess(Core::HoldingMutex(lockGuard), SIGTERM);
+        replyToAllWatches(false);
+        replyToAllCommands();
+    }
+}
+
+void
+StateMachine::recordChange(uint64_t index, const std::string& path)
+{
+    watchHistory.emplace_back(index, path);
+    while (watchHistory.size() > watchHistoryLength) {
+        watchHistoryStart = watchHistory.front().first;
+        watchHistory.pop_front();
+    }
+    if (watches.empty())
+        return;
+
+    // Find the triggered watches first, since replying removes them from
+    // watchesByPath.
+    std::vector<uint64_t> triggered;
+    auto addIf = [&](const std::string& watched, bool directChild) {
+        auto range = watchesByPath.equal_range(watched);
+        for (auto it = range.first; it != range.second; ++it) {
+            const Watch& watch = watches.at(it->second);
+            if ((directChild || watch.recursive) && index > watch.afterIndex)
+                triggered.push_back(it->second);
+        }
+    };
+    // watches on the path itself
+    addIf(path, true);
+    // watches on its ancestors
+    if (path != "/") {
+        std::string ancestor = parentPath(path);
+        addIf(ancestor, true);
+        while (ancestor != "/") {
+            ancestor = parentPath(ancestor);
+            addIf(ancestor, false);
+        }
+    }
+    // watches below it (for "/", skipping the ones on the path itself, which
+    // share its prefix and were added above)
+    std::string below = (path == "/" ? "/" : path + "/");
+    for (auto it = watchesByPath.lower_bound(below);
+         it != watchesByPath.end() &&
+         it->first.compare(0, below.size(), below) == 0;
+         ++it) {
+        if (it->first == path)
+            continue;
+        if (index > watches.at(it->second).afterIndex)
+            triggered.push_back(it->second);
+    }
+
+    for (auto it = triggered.begin(); it != triggered.end(); ++it) {
+        ++numWatchesTriggered;
+        replyToWatch(*it, index, true);
+    }
+}
+
+void
+StateMachine::replyToWatch(uint64_t id, uint64_t index, bool changed)
+{
+    auto it = watches.find(id);
+    if (it == watches.end())
+        return;
+    Watch& watch = it->second;
+    auto range = watchesByPath.equal_range(watch.path);
+    for (auto it2 = range.first; it2 != range.second; ++it2) {
+        if (it2->second == id) {
+            watchesByPath.erase(it2);
+            break;
+        }
+    }
+    watchDeadlines.erase({watch.deadline, id});
+
+    Query::Response response;
+    PC::WatchTree::Response& watchResponse = *response.mutable_watch();
+    watchResponse.set_status(PC::Status::OK);
+    watchResponse.set_index(index);
+    watchResponse.set_changed(changed);
+    watch.rpc.reply(response);
+    watches.erase(it);
+}
+
+void
+StateMachine::replyToAllWatches(bool changed)
+{
+    while (!watches.empty()) {
+        if (changed)
+            ++numWatchesTriggered;
+        replyToWatch(watches.begin()->first, lastApplied, changed);
+    }
+}
+
+void
+StateMachine::watchThreadMain()
+{
+    Core::ThreadId::setName("StateMachineWatches");
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    while (!exiting) {
+        TimePoint now = Clock::now();
+        while (!watchDeadlines.empty() &&
+               watchDeadlines.begin()->first <= now) {
+            ++numWatchesTimedOut;
+            replyToWatch(watchDeadlines.begin()->second, lastApplied, false);
+        }
+        if (watchDeadlines.empty())
+            watchesChanged.wait(lockGuard);
+        else
+            watchesChanged.wait_until(lockGuard,
+                                      watchDeadlines.begin()->first);
+    }
+}
+
+void
+StateMachine::replyToCommand(uint64_t logIndex,
+                             PendingCommand& pending,
+                             bool applied)
+{
+    if (applied) {
+        Command::Response response;
+        if (getResponse(logIndex, pending.command, response))
+            pending.rpc.reply(response);
+        else
+            pending.rpc.rejectInvalidRequest();
+        return;
+    }
+    PC::Error error;
+    error.set_error_code(PC::Error::NOT_LEADER);
+    std::string leaderHint = consensus->getLeaderHint();
+    if (!leaderHint.empty())
+        error.set_leader_hint(leaderHint);
+    pending.rpc.returnError(error);
+}
+
+void
+StateMachine::replyToCommandsThrough(uint64_t index, uint64_t term)
+{
+    while (!pendingCommands.empty() &&
+           pendingCommands.begin()->first <= index) {
+        auto it = pendingCommands.begin();
+        replyToCommand(it->first, it->second,
+                       it->first == index && it->second.term == term);
+        pendingCommands.erase(it);
+    }
+}
+
+void
+StateMachine::replyToAllCommands()
+{
+    while (!pendingCommands.empty()) {
+        auto it = pendingCommands.begin();
+        replyToCommand(it->first, it->second, false);
+        pendingCommands.erase(it);
+    }
+}
+
+void
+StateMachine::pendingCommandThreadMain()
+{
+    Core::ThreadId::setName("StateMachineCommands");
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    try {
+        while (!exiting) {
+            if (pendingCommands.empty()) {
+                pendingCommandsChanged.wait(lockGuard);
+                continue;
+            }
+            uint64_t oldestTerm = newestCommandTerm;
+            for (auto it = pendingCommands.begin();
+                 it != pendingCommands.end();
+                 ++it) {
+                oldestTerm = std::min(oldestTerm, it->second.term);
+            }
+            {
+                Core::MutexUnlock<Core::Mutex> unlockGuard(lockGuard);
+                consensus->waitForNewTerm(oldestTerm);
+            }
+            // Entries from that term that haven't been applied yet might
+            // never be. The clients will retry them with the new leader.
+            auto it = pendingCommands.begin();
+            while (it != pendingCommands.end()) {
+                if (it->second.term <= oldestTerm) {
+                    replyToCommand(it->first, it->second, false);
+                    it = pendingCommands.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    } catch (const Core::Util::ThreadInterruptedException&) {
+        // applyThread replies to the remaining commands as it exits
     }
 }
 
@@ -501,6 +1188,46 @@ StateMachine::killSnapshotProcess(Core::HoldingMutex holdingMutex,
     }
 }
 
+void
+StateMachine::loadIncomingSnapshot(Storage::SnapshotFile::StreamReader& stream)
+{
+    std::shared_ptr<IncomingSnapshot> incoming =
+        std::make_shared<IncomingSnapshot>();
+    try {
+        // The Raft module's header says which index the snapshot covers.
+        uint8_t formatVersion = 0;
+        stream.readRaw(&formatVersion, sizeof(formatVersion));
+        SnapshotMetadata::Header metadata;
+        if (formatVersion != 1 || !stream.readMessage(metadata).empty()) {
+            WARNING("Couldn't parse header of snapshot being received; "
+                    "it will be loaded from disk once it's complete");
+            return;
+        }
+        incoming->lastIncludedIndex = metadata.last_included_index();
+        {
+            std::lock_guard<Core::Mutex> lockGuard(mutex);
+            incomingSnapshot = incoming;
+        }
+        NOTICE("Parsing snapshot through entry %lu while it's received",
+               incoming->lastIncludedIndex);
+
+        formatVersion = 0;
+        stream.readRaw(&formatVersion, sizeof(formatVersion));
+        if (formatVersion == 1 &&
+            stream.readMessage(incoming->header).empty()) {
+            incoming->tree.loadSnapshot(stream);
+            incoming->loaded = true;
+            NOTICE("Done parsing snapshot through entry %lu",
+                   incoming->lastIncludedIndex);
+        }
+    } catch (const Core::Util::ThreadInterruptedException&) {
+        NOTICE("Snapshot being received was abandoned");
+    }
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    incoming->done = true;
+    incomingSnapshotChanged.notify_all();
+}
+
 void
 StateMachine::loadSessions(const SnapshotStateMachine::Header& header)
 {
@@ -521,8 +1248,10 @@ StateMachine::loadSessions(const SnapshotStateMachine::Header& header)
 }
 
 void
-StateMachine::loadSnapshot(Core::ProtoBuf::InputStream& stream)
+StateMachine::loadSnapshot(
+        std::unique_ptr<Storage::SnapshotFile::Reader> reader)
 {
+    Storage::SnapshotFile::Reader& stream = *reader;
     // Check that this snapshot uses format version 1
     uint8_t formatVersion = 0;
     uint64_t bytesRead = stream.readRaw(&formatVersion, sizeof(formatVersion));
@@ -548,7 +1277,24 @@ StateMachine::loadSnapshot(Core::ProtoBuf::InputStream& stream)
     }
 
     // Load the tree's state
-    tree.loadSnapshot(stream);
+    lazySnapshotSuperseded = false;
+    std::shared_ptr<MappedSnapshot> mapped =
+        std::make_shared<MappedSnapshot>();
+    Tree::SnapshotBase& layout = mapped->layout;
+    uint64_t footerIndex = 0;
+    bool indexed = ((snapshotLoadLazily || snapshotLoadThreads > 1) &&
+                    readSnapshotFooter(stream, footerIndex, layout));
+    if (indexed && snapshotLoadLazily) {
+        uint64_t offset = stream.getBytesRead();
+        mapped->reader = std::move(reader);
+        tree.loadSnapshotLazily(
+            std::shared_ptr<const Tree::SnapshotBase>(mapped, &layout),
+            offset);
+    } else if (indexed) {
+        tree.loadSnapshot(layout, stream.getBytesRead(), snapshotLoadThreads);
+    } else {
+        tree.loadSnapshot(stream);
+    }
 }
 
 void
@@ -610,15 +1356,85 @@ StateMachine::shouldTakeSnapshot(uint64_t lastIncludedIndex) const
 
     if (stats.log_bytes() < snapshotMinLogSize)
         return false;
-    if (stats.log_bytes() < stats.last_snapshot_bytes() * snapshotRatio)
-        return false;
     if (lastIncludedIndex < stats.last_snapshot_index())
         return false;
     if (lastIncludedIndex < stats.last_log_index() * 3 / 4)
         return false;
+    if (snapshotAdaptive && snapshotWriteBytes > 0) {
+        if (snapshotMaxLogSize > 0 && stats.log_bytes() >= snapshotMaxLogSize)
+            return true;
+        // Taking a snapshot pays off once it costs less than replaying the
+        // log it replaces would (this is the classic rent-or-buy trade-off:
+        // it never spends more than twice the best schedule in hindsight).
+        if (estimateReplayTime(stats.log_bytes()) <
+            estimateSnapshotTime(stats.last_snapshot_bytes())) {
+            return false;
+        }
+        return !isLogBursting();
+    }
+    if (stats.log_bytes() < stats.last_snapshot_bytes() * snapshotRatio)
+        return false;
     return true;
 }
 
+void
+StateMachine::recordApply(uint64_t bytes, TimePoint start, TimePoint end)
+{
+    applyTime += end - start;
+    appliedBytes += bytes;
+    if (appliedBytes > APPLY_TIME_DECAY_BYTES) {
+        applyTime /= 2;
+        appliedBytes /= 2;
+    }
+
+    if (logGrowthSampleStart == TimePoint::min())
+        logGrowthSampleStart = start;
+    logGrowthSampleBytes += bytes;
+    std::chrono::nanoseconds elapsed = end - logGrowthSampleStart;
+    if (elapsed < LOG_GROWTH_SAMPLE_INTERVAL)
+        return;
+    double seconds = double(elapsed.count()) / 1e9;
+    double rate = double(logGrowthSampleBytes) / seconds;
+    logGrowthRecent += ((rate - logGrowthRecent) *
+                        std::min(1.0, seconds / LOG_GROWTH_RECENT_SECONDS));
+    logGrowthAverage += ((rate - logGrowthAverage) *
+                         std::min(1.0, seconds / LOG_GROWTH_AVERAGE_SECONDS));
+    logGrowthSampleStart = end;
+    logGrowthSampleBytes = 0;
+}
+
+std::chrono::nanoseconds
+StateMachine::estimateReplayTime(uint64_t logBytes) const
+{
+    if (appliedBytes == 0)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds(uint64_t(
+        double(applyTime.count()) * double(logBytes) / double(appliedBytes)));
+}
+
+std::chrono::nanoseconds
+StateMachine::estimateSnapshotTime(uint64_t snapshotBytes) const
+{
+    if (snapshotWriteBytes == 0)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds(uint64_t(
+        double(snapshotWriteTime.count()) * double(snapshotBytes) /
+        double(snapshotWriteBytes)));
+}
+
+bool
+StateMachine::isLogBursting() const
+{
+    // A burst that has since stopped leaves logGrowthRecent high until the
+    // next command is applied, so ignore stale samples.
+    if (logGrowthSampleStart == TimePoint::min() ||
+        Clock::now() - logGrowthSampleStart > LOG_GROWTH_STALE) {
+        return false;
+    }
+    return (logGrowthAverage > 0 &&
+            logGrowthRecent > LOG_BURST_FACTOR * logGrowthAverage);
+}
+
 void
 StateMachine::snapshotThreadMain()
 {
@@ -644,10 +1460,36 @@ StateMachine::snapshotThreadMain()
             continue;
         }
 
+        if (lazySnapshotSuperseded) {
+            lazySnapshotSuperseded =
+                tree.loadPlaceholders(LAZY_LOAD_STEP_BYTES);
+            if (!lazySnapshotSuperseded)
+                NOTICE("Done loading the Tree from its old snapshot");
+            // Let other threads at the Tree between steps.
+            Core::MutexUnlock<Core::Mutex> unlockGuard(lockGuard);
+            std::this_thread::yield();
+            continue;
+        }
+
         snapshotSuggested.wait_until(lockGuard, waitUntil);
     }
 }
 
+void
+StateMachine::snapshotStreamThreadMain()
+{
+    Core::ThreadId::setName("SnapshotStreamStateMachine");
+    try {
+        while (true) {
+            std::shared_ptr<Storage::SnapshotFile::StreamReader> stream =
+                consensus->getIncomingSnapshot();
+            loadIncomingSnapshot(*stream);
+        }
+    } catch (const Core::Util::ThreadInterruptedException&) {
+        NOTICE("exiting");
+    }
+}
+
 void
 StateMachine::snapshotWatchdogThreadMain()
 {
@@ -659,7 +1501,9 @@ StateMachine::snapshotWatchdogThreadMain()
     // numSnapshotsAttempted. If set to ~0UL, this thread is not currently
     // tracking a snapshot process.
     uint64_t tracking = ~0UL;
-    // The value of writer->sharedBytesWritten at the "start" time.
+    // The value of writer->sharedBytesWritten plus
+    // writer->sharedNanosThrottled at the "start" time (a child that's
+    // waiting on snapshotWriteBytesPerSecond is making progress).
     uint64_t startProgress = 0;
     // The time at the "start" time.
     TimePoint startTime = TimePoint::min();
@@ -671,7 +1515,8 @@ StateMachine::snapshotWatchdogThreadMain()
         TimePoint now = Clock::now();
 
         if (childPid > 0) { // there is some child process
-            uint64_t currentProgress = *writer->sharedBytesWritten.value;
+            uint64_t currentProgress = (*writer->sharedBytesWritten.value +
+                                        *writer->sharedNanosThrottled.value);
             if (tracking == numSnapshotsAttempted) { // tracking current child
                 if (snapshotWatchdogInterval != zero &&
                     now >= startTime + snapshotWatchdogInterval) { // check
@@ -728,9 +1573,25 @@ StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
     // aren't somehow double-flushed later.
     writer->flushToOS();
 
+    // The index records offsets in the file, which compressed files don't
+    // have.
+    bool indexed = !writer->isCompressed();
+    std::unique_ptr<Storage::SnapshotFile::Reader> previous;
+    if (indexed && snapshotIncremental) {
+        ++numSnapshotsSinceFull;
+        if (snapshotFullInterval > 0 &&
+            numSnapshotsSinceFull >= snapshotFullInterval) {
+            numSnapshotsSinceFull = 0;
+        } else if (haveSnapshotBase) {
+            previous = consensus->openSnapshot();
+        }
+    }
+    uint64_t epoch = tree.markSnapshot();
+
     ++numSnapshotsAttempted;
     snapshotStarted.notify_all();
 
+    TimePoint start = Clock::now();
     pid_t pid = fork();
     if (pid == -1) { // error
         PANIC("Couldn't fork: %s", strerror(errno));
@@ -738,6 +1599,16 @@ StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
         Core::Debug::processName += "-child";
         globals.unblockAllSignals();
         usleep(stateMachineChildSleepMs * 1000); // for testing purposes
+        if (snapshotIOPriority != 0) {
+            // Yield the disk to the log (ioprio_set has no glibc wrapper).
+            if (syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0,
+                        snapshotIOPriority) != 0) {
+                WARNING("Couldn't lower I/O priority of snapshot process: %s",
+                        strerror(errno));
+            }
+        }
+        if (snapshotIOPriority != 0 || snapshotWriteBytesPerSecond > 0)
+            writer->setBackground(snapshotWriteBytesPerSecond);
         if (snapshotBlockPercentage > 0) { // for testing purposes
             if (Core::Random::randomRange(0, 100) < snapshotBlockPercentage) {
                 WARNING("Purposely deadlocking child (probability is %lu%%)",
@@ -759,7 +1630,10 @@ StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
             writer->writeMessage(header);
         }
         // Then the Tree itself (this one is potentially large)
-        tree.dumpSnapshot(*writer);
+        if (indexed)
+            dumpTreeWithFooter(lastIncludedIndex, previous.get());
+        else
+            tree.dumpSnapshot(*writer);
 
         // Flush the changes to the snapshot file before exiting.
         writer->flushToOS();
@@ -767,6 +1641,7 @@ StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
     } else { // parent
         assert(childPid == 0);
         childPid = pid;
+        previous.reset();
         int status = 0;
         {
             // release the lock while blocking on the child to allow
@@ -777,11 +1652,27 @@ StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
         childPid = 0;
         if (pid == -1)
             PANIC("Couldn't waitpid: %s", strerror(errno));
+        std::chrono::nanoseconds throttled(
+            *writer->sharedNanosThrottled.value);
+        snapshotWriteThrottledTime += throttled;
         if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
             NOTICE("Child completed writing state machine contents to "
                    "snapshot staging file");
+            snapshotWriteTime = std::max(std::chrono::nanoseconds(0),
+                                         Clock::now() - start - throttled);
+            snapshotWriteBytes = *writer->sharedBytesWritten.value;
+            // Unless a newer snapshot was loaded in the meantime, the next
+            // snapshot may copy from this one.
+            if (indexed &&
+                (!haveSnapshotBase || lastIncludedIndex > snapshotBaseIndex)) {
+                haveSnapshotBase = true;
+                snapshotBaseIndex = lastIncludedIndex;
+                snapshotBaseEpoch = epoch;
+            }
             writer->seekToEnd();
             consensus->snapshotDone(lastIncludedIndex, std::move(writer));
+            if (snapshotLoadLazily)
+                lazySnapshotSuperseded = true;
         } else if (exiting &&
                    WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM) {
             writer->discard();
@@ -803,6 +1694,34 @@ StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
     }
 }
 
+void
+StateMachine::dumpTreeWithFooter(uint64_t lastIncludedIndex,
+                                 Storage::SnapshotFile::Reader* previous)
+{
+    Tree::SnapshotBase base;
+    base.epoch = snapshotBaseEpoch;
+    uint64_t previousIndex = 0;
+    bool useBase = (previous != NULL &&
+                    readSnapshotFooter(*previous, previousIndex, base) &&
+                    previousIndex == snapshotBaseIndex);
+    if (useBase) {
+        NOTICE("Copying unchanged directories from the snapshot through "
+               "index %lu", snapshotBaseIndex);
+    }
+
+    SnapshotStateMachine::Footer footer;
+    footer.set_last_included_index(lastIncludedIndex);
+    tree.dumpSnapshot(*writer,
+                      useBase ? &base : NULL,
+                      snapshotIndexMinBytes,
+                      *footer.mutable_tree_index());
+
+    uint64_t footerOffset = htobe64(writer->getBytesWritten());
+    writer->writeMessage(footer);
+    writer->writeRaw(&footerOffset, sizeof(footerOffset));
+    writer->writeRaw(SNAPSHOT_FOOTER_MAGIC, sizeof(SNAPSHOT_FOOTER_MAGIC));
+}
+
 void
 StateMachine::warnUnknownRequest(
         const google::protobuf::Message& request,
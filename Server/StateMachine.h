@@ -14,8 +14,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <thread>
 #include <unordered_map>
 
@@ -25,6 +28,7 @@
 #include "Core/Config.h"
 #include "Core/Mutex.h"
 #include "Core/Time.h"
+#include "RPC/ServerRPC.h"
 #include "Tree/Tree.h"
 
 #ifndef LOGCABIN_SERVER_STATEMACHINE_H
@@ -45,6 +49,8 @@ class RaftConsensus;
  * - Version 1 of the State Machine shipped with LogCabin v1.0.0.
  * - Version 2 added the CloseSession command, which clients can use when they
  *   gracefully shut down.
+ * - Version 3 added the Increment, Append, and CreateSequential read-write
+ *   tree commands and the offset field of the Write command.
  */
 class StateMachine {
   public:
@@ -61,7 +67,7 @@ class StateMachine {
          * This state machine code can behave like all versions between
          * MIN_SUPPORTED_VERSION and MAX_SUPPORTED_VERSION, inclusive.
          */
-        MAX_SUPPORTED_VERSION = 2,
+        MAX_SUPPORTED_VERSION = 3,
     };
 
 
@@ -84,25 +90,57 @@ class StateMachine {
      */
     void updateServerStats(Protocol::ServerStats& serverStats) const;
 
+    /**
+     * Called by ClientService to wait for a change to a path in the tree.
+     * This replies to the RPC right away if a matching change is already
+     * known; otherwise, it parks the RPC and returns immediately. A parked
+     * RPC is replied to from applyThread once a matching change is applied,
+     * or from watchThread once its timeout elapses, so that no thread blocks
+     * for the duration of the watch.
+     * \param request
+     *      Describes the path to watch; see Protocol::Client::WatchTree.
+     * \param rpc
+     *      The RPC to reply to with a Query::Response containing 'watch'.
+     * \warning
+     *      Be sure to wait() first!
+     */
+    void watch(const Protocol::Client::WatchTree::Request& request,
+               RPC::ServerRPC rpc);
+
     /**
      * Return once the state machine has applied at least the given entry.
      */
     void wait(uint64_t index) const;
 
     /**
-     * Called by ClientService to get a response for a read-write command on
-     * the state machine.
+     * Return whether the state machine version running as of the last
+     * applied entry understands the given read-write command. ClientService
+     * refuses to append commands that aren't, since servers still running
+     * older code may not be able to apply them the same way (or at all).
+     */
+    bool isSupported(const Command::Request& command) const;
+
+    /**
+     * Called by ClientService to reply to a read-write command once it has
+     * been applied. This parks the RPC and returns immediately. A parked RPC
+     * is replied to from applyThread once the entry at 'logIndex' is applied,
+     * or from pendingCommandThread with a NOT_LEADER error once 'term' ends
+     * without the entry being committed, so that no thread blocks while the
+     * command is replicated.
      * \param logIndex
-     *      The index in the log where the command was committed.
+     *      The index in the log where the command was appended (see
+     *      RaftConsensus::replicateAsync()).
+     * \param term
+     *      The term of that entry.
      * \param command
      *      The request.
-     * \param[out] response
-     *      If the return value is true, the response will be filled in here.
-     *      Otherwise, this will be unmodified.
+     * \param rpc
+     *      The RPC to reply to with a Command::Response.
      */
-    bool waitForResponse(uint64_t logIndex,
-                         const Command::Request& command,
-                         Command::Response& response) const;
+    void respondWhenApplied(uint64_t logIndex,
+                            uint64_t term,
+                            const Command::Request& command,
+                            RPC::ServerRPC rpc);
 
     /**
      * Return true if the server is currently taking a snapshot and false
@@ -145,7 +183,9 @@ class StateMachine {
 
 
   private:
-    // forward declaration
+    // forward declarations
+    struct IncomingSnapshot;
+    struct PendingCommand;
     struct Session;
 
     /// Clock used by watchdog timer thread.
@@ -163,6 +203,98 @@ class StateMachine {
      */
     void applyThreadMain();
 
+    /**
+     * Called by apply() after a command modifies the given path. Appends the
+     * change to #watchHistory and replies to the parked watches it triggers.
+     * \param index
+     *      The log index of the command.
+     * \param path
+     *      The canonical path that was modified.
+     */
+    void recordChange(uint64_t index, const std::string& path);
+
+    /**
+     * Remove a parked watch and reply to it.
+     * \param id
+     *      Key into #watches.
+     * \param index
+     *      See Protocol::Client::WatchTree::Response.
+     * \param changed
+     *      See Protocol::Client::WatchTree::Response.
+     */
+    void replyToWatch(uint64_t id, uint64_t index, bool changed);
+
+    /**
+     * Reply to every parked watch. Used when the state machine loads a
+     * snapshot (and can no longer tell which paths changed) and when it
+     * exits.
+     * \param changed
+     *      See Protocol::Client::WatchTree::Response.
+     */
+    void replyToAllWatches(bool changed);
+
+    /**
+     * Main function for thread that replies to watches whose timeouts have
+     * elapsed.
+     */
+    void watchThreadMain();
+
+    /**
+     * Fill in the response to a command that has been applied. The caller
+     * must hold #mutex.
+     * \param logIndex
+     *      The index in the log where the command was committed.
+     * \param command
+     *      The request.
+     * \param[out] response
+     *      If the return value is true, the response will be filled in here.
+     *      Otherwise, this will be unmodified.
+     * \return
+     *      False if the state machine didn't understand the command when it
+     *      was applied; true otherwise.
+     */
+    bool getResponse(uint64_t logIndex,
+                     const Command::Request& command,
+                     Command::Response& response) const;
+
+    /**
+     * Reply to a parked command.
+     * \param logIndex
+     *      The index in the log where the command was appended.
+     * \param command
+     *      The parked command.
+     * \param applied
+     *      True if the command was applied at 'logIndex', in which case its
+     *      response is sent; false if it's not known to have been applied, in
+     *      which case the client is told to retry with the leader.
+     */
+    void replyToCommand(uint64_t logIndex,
+                        PendingCommand& command,
+                        bool applied);
+
+    /**
+     * Reply to the parked commands that the entry just applied (or the
+     * snapshot just loaded) settles. Called by applyThread.
+     * \param index
+     *      The index of the entry, or the last index the snapshot covers.
+     * \param term
+     *      The term of that entry. Commands parked for 'index' with this term
+     *      were applied; all others at or before 'index' weren't.
+     */
+    void replyToCommandsThrough(uint64_t index, uint64_t term);
+
+    /**
+     * Reply to every parked command with a NOT_LEADER error. Used when
+     * exiting.
+     */
+    void replyToAllCommands();
+
+    /**
+     * Main function for thread that replies to parked commands whose terms
+     * have ended.
+     */
+    void pendingCommandThreadMain();
+
     /**
      * Return the #sessions table as a protobuf message for writing into a
      * snapshot.
@@ -199,6 +331,13 @@ class StateMachine {
      */
     void killSnapshotProcess(Core::HoldingMutex holdingMutex, int signum);
 
+    /**
+     * Parse a snapshot from the leader as it arrives into a new
+     * #incomingSnapshot, so that applyThread can install it without reading
+     * the file again. Returns quietly if the stream is abandoned.
+     */
+    void loadIncomingSnapshot(Storage::SnapshotFile::StreamReader& stream);
+
     /**
      * Restore the #sessions table from a snapshot.
      */
@@ -206,9 +345,13 @@ class StateMachine {
 
     /**
      * Read all of the state machine state from a snapshot file
-     * (including version, sessions, and tree).
+     * (including version, sessions, and tree). If the file ends with a
+     * SnapshotStateMachine::Footer, large directories of the tree are loaded
+     * on up to #snapshotLoadThreads threads, or with #snapshotLoadLazily,
+     * left in the file until they're used (in which case the Tree keeps the
+     * reader).
      */
-    void loadSnapshot(Core::ProtoBuf::InputStream& stream);
+    void loadSnapshot(std::unique_ptr<Storage::SnapshotFile::Reader> reader);
 
     /**
      * Restore the #versionHistory table from a snapshot.
@@ -231,11 +374,49 @@ class StateMachine {
      */
     bool shouldTakeSnapshot(uint64_t lastIncludedIndex) const;
 
+    /**
+     * Update the measurements behind #snapshotAdaptive after applying a
+     * command.
+     * \param bytes
+     *      The size of the command.
+     * \param start
+     *      When apply() was called.
+     * \param end
+     *      When apply() returned.
+     */
+    void recordApply(uint64_t bytes, TimePoint start, TimePoint end);
+
+    /**
+     * Return how long it's expected to take to apply a log of the given size
+     * (for example, when this server restarts), based on #applyTime.
+     */
+    std::chrono::nanoseconds estimateReplayTime(uint64_t logBytes) const;
+
+    /**
+     * Return how long it's expected to take to write a snapshot of the given
+     * size, based on #snapshotWriteTime.
+     */
+    std::chrono::nanoseconds estimateSnapshotTime(uint64_t snapshotBytes)
+        const;
+
+    /**
+     * Return true if the log has recently been growing much faster than
+     * usual, in which case #snapshotAdaptive puts off snapshots so that they
+     * don't compete with the burst of commands for the disk.
+     */
+    bool isLogBursting() const;
+
     /**
      * Main function for thread that calls takeSnapshot when appropriate.
      */
     void snapshotThreadMain();
 
+    /**
+     * Main function for thread that parses snapshots from the leader while
+     * they're being received.
+     */
+    void snapshotStreamThreadMain();
+
     /**
      * Main function for thread that checks the progress of the child process.
      */
@@ -247,6 +428,19 @@ class StateMachine {
     void takeSnapshot(uint64_t lastIncludedIndex,
                       std::unique_lock<Core::Mutex>& lockGuard);
 
+    /**
+     * Called in the snapshot child process to write the Tree followed by a
+     * SnapshotStateMachine::Footer indexing the new snapshot. Directories
+     * that haven't changed are copied from the previous snapshot if it's
+     * usable.
+     * \param lastIncludedIndex
+     *      The last log index that the new snapshot covers.
+     * \param previous
+     *      The previous snapshot file, or NULL to serialize the entire Tree.
+     */
+    void dumpTreeWithFooter(uint64_t lastIncludedIndex,
+                            Storage::SnapshotFile::Reader* previous);
+
     /**
      * Called to log a debug message if appropriate when the state machine
      * encounters a query or command that is not understood by the current
@@ -290,6 +484,20 @@ class StateMachine {
      */
     uint64_t snapshotRatio;
 
+    /**
+     * If true, once a snapshot has been timed, shouldTakeSnapshot() replaces
+     * the #snapshotRatio rule with a comparison of the estimated time to
+     * replay the log against the estimated time to take a snapshot, and it
+     * holds off while the log is growing in a burst.
+     */
+    bool snapshotAdaptive;
+
+    /**
+     * With #snapshotAdaptive, a snapshot is taken once the log reaches this
+     * many bytes no matter what the estimates say. 0 means no limit.
+     */
+    uint64_t snapshotMaxLogSize;
+
     /**
      * After this much time has elapsed without any progress, the snapshot
      * watchdog thread will kill the snapshotting process. A special value of 0
@@ -297,6 +505,60 @@ class StateMachine {
      */
     std::chrono::nanoseconds snapshotWatchdogInterval;
 
+    /**
+     * If true, a snapshot copies the directories that haven't changed from
+     * the previous snapshot instead of serializing them again, using the
+     * index at the end of uncompressed snapshots.
+     */
+    bool snapshotIncremental;
+
+    /**
+     * With #snapshotIncremental, every this many snapshots, the entire Tree
+     * is serialized rather than copied from the previous snapshot. 0 means
+     * never.
+     */
+    uint64_t snapshotFullInterval;
+
+    /**
+     * Directories smaller than this many bytes are not indexed, so they are
+     * always serialized again and are never loaded on a thread of their own.
+     */
+    uint64_t snapshotIndexMinBytes;
+
+    /**
+     * The snapshot child process writes to the snapshot file at no more than
+     * this many bytes per second, on average. 0 means no limit.
+     */
+    uint64_t snapshotWriteBytesPerSecond;
+
+    /**
+     * The I/O priority of the snapshot child process, as an ioprio_set()
+     * value, or 0 to leave it alone. If nonzero, the child also drops the
+     * snapshot from the page cache as it's written.
+     */
+    int snapshotIOPriority;
+
+    /**
+     * The maximum number of threads used to load a snapshot's Tree, if the
+     * snapshot has an index.
+     */
+    uint64_t snapshotLoadThreads;
+
+    /**
+     * If true, a snapshot's Tree is not parsed when it's loaded; each large
+     * directory is parsed from the mapped snapshot file when it's first
+     * used instead, so a restarted server can serve requests right away.
+     * Requires the snapshot to have an index.
+     */
+    bool snapshotLoadLazily;
+
+    /**
+     * If true, snapshotStreamThread parses snapshots from the leader while
+     * they're being received, rather than applyThread reading them from disk
+     * once they're complete.
+     */
+    bool snapshotStreamInstall;
+
     /**
      * The time interval after which to remove an inactive client session, in
      * nanoseconds of cluster time.
@@ -311,6 +573,17 @@ class StateMachine {
      */
     std::chrono::milliseconds unknownRequestMessageBackoff;
 
+    /**
+     * The maximum number of changes kept in #watchHistory.
+     */
+    uint64_t watchHistoryLength;
+
+    /**
+     * The longest time that a watch is parked before replying that nothing
+     * changed. Clients may ask for shorter timeouts but not longer ones.
+     */
+    std::chrono::milliseconds watchMaxTimeout;
+
     /**
      * Protects against concurrent access for all members of this class (except
      * 'consensus', which is itself a monitor.
@@ -346,6 +619,23 @@ class StateMachine {
      */
     mutable Core::ConditionVariable snapshotCompleted;
 
+    /**
+     * Notified when a watch is parked, so that watchThread can reconsider
+     * when the earliest watch times out. Also notified upon exiting.
+     */
+    Core::ConditionVariable watchesChanged;
+
+    /**
+     * Notified when a command is parked, so that pendingCommandThread can
+     * start waiting for its term to end. Also notified upon exiting.
+     */
+    Core::ConditionVariable pendingCommandsChanged;
+
+    /**
+     * Notified when #incomingSnapshot is done loading (or failed to).
+     */
+    Core::ConditionVariable incomingSnapshotChanged;
+
     /**
      * applyThread sets this to true to signal that the server is shutting
      * down.
@@ -401,6 +691,94 @@ class StateMachine {
      */
     uint64_t numSnapshotsFailed;
 
+    /**
+     * The total time that snapshot child processes have spent waiting on
+     * #snapshotWriteBytesPerSecond.
+     */
+    std::chrono::nanoseconds snapshotWriteThrottledTime;
+
+    /**
+     * The time spent in apply() for DATA entries, over roughly the last
+     * #appliedBytes bytes of commands. Both are halved whenever
+     * #appliedBytes grows large, so that the estimate follows the workload.
+     */
+    std::chrono::nanoseconds applyTime;
+
+    /**
+     * The number of command bytes that #applyTime covers.
+     */
+    uint64_t appliedBytes;
+
+    /**
+     * The time the last successful snapshot took to write, not counting time
+     * spent waiting on #snapshotWriteBytesPerSecond.
+     */
+    std::chrono::nanoseconds snapshotWriteTime;
+
+    /**
+     * The size of the last successful snapshot, or 0 if this process hasn't
+     * written one yet.
+     */
+    uint64_t snapshotWriteBytes;
+
+    /**
+     * When the current sample of the log's growth began, or TimePoint::min()
+     * before the first command is applied.
+     */
+    TimePoint logGrowthSampleStart;
+
+    /**
+     * The number of command bytes applied since #logGrowthSampleStart.
+     */
+    uint64_t logGrowthSampleBytes;
+
+    /**
+     * A moving average of the log's growth in bytes per second over the last
+     * second or so.
+     */
+    double logGrowthRecent;
+
+    /**
+     * A moving average of the log's growth in bytes per second over the last
+     * minute or so.
+     */
+    double logGrowthAverage;
+
+    /**
+     * The number of snapshots started since the last one that serialized the
+     * entire Tree on purpose (see #snapshotFullInterval).
+     */
+    uint64_t numSnapshotsSinceFull;
+
+    /**
+     * True if #snapshotBaseIndex and #snapshotBaseEpoch describe a snapshot
+     * that incremental snapshots may copy from.
+     */
+    bool haveSnapshotBase;
+
+    /**
+     * The last log index covered by the snapshot that the Tree was last
+     * loaded from or written to. A snapshot file on disk with a footer for
+     * this index holds the same contents as every directory in the Tree
+     * whose lastChanged is at most #snapshotBaseEpoch.
+     */
+    uint64_t snapshotBaseIndex;
+
+    /**
+     * The Tree's epoch (see Tree::markSnapshot()) when it was last loaded
+     * from or written to the snapshot at #snapshotBaseIndex.
+     */
+    uint64_t snapshotBaseEpoch;
+
+    /**
+     * Set when a snapshot is written while the Tree may still be loading
+     * directories lazily from an older snapshot file (see
+     * #snapshotLoadLazily). snapshotThread then loads the rest of the Tree a
+     * piece at a time, so that the older file's mapping and disk space are
+     * released. Cleared once that's done or the Tree is loaded again.
+     */
+    bool lazySnapshotSuperseded;
+
     /**
      * The number of times a log entry was processed to advance the state
      * machine's running version, but the state machine was already at that
@@ -444,6 +822,133 @@ class StateMachine {
      */
     TimePoint maySnapshotAt;
 
+    /**
+     * The number of watches that were replied to because a matching change
+     * was applied (or was found in #watchHistory).
+     */
+    uint64_t numWatchesTriggered;
+
+    /**
+     * The number of parked watches that were replied to because their
+     * timeouts elapsed.
+     */
+    uint64_t numWatchesTimedOut;
+
+    /**
+     * The ID to assign to the next parked watch (key into #watches).
+     */
+    uint64_t nextWatchId;
+
+    /**
+     * The log index after which #watchHistory is complete: every change
+     * applied at an index greater than this one and no greater than
+     * #lastApplied is in #watchHistory. Watches for changes after older
+     * indexes are triggered right away, since the state machine can no
+     * longer tell whether their paths changed.
+     */
+    uint64_t watchHistoryStart;
+
+    /**
+     * Recent changes to the tree, in log order. First component: log index.
+     * Second component: canonical path that was modified. This lets a client
+     * that was briefly disconnected between watches find out about changes it
+     * missed. Holds at most #watchHistoryLength entries.
+     */
+    std::deque<std::pair<uint64_t, std::string>> watchHistory;
+
+    /**
+     * A client's request waiting for a change to a path in the tree.
+     */
+    struct Watch {
+        Watch(RPC::ServerRPC rpc,
+              const std::string& path,
+              bool recursive,
+              uint64_t afterIndex,
+              TimePoint deadline)
+            : rpc(std::move(rpc))
+            , path(path)
+            , recursive(recursive)
+            , afterIndex(afterIndex)
+            , deadline(deadline)
+        {
+        }
+        /**
+         * The RPC to reply to.
+         */
+        RPC::ServerRPC rpc;
+        /**
+         * The canonical path being watched.
+         */
+        std::string path;
+        /**
+         * Whether changes anywhere below #path trigger this watch.
+         */
+        bool recursive;
+        /**
+         * Only changes at log indexes greater than this trigger this watch.
+         */
+        uint64_t afterIndex;
+        /**
+         * When this watch times out.
+         */
+        TimePoint deadline;
+    };
+
+    /**
+     * Parked watches, keyed by ID.
+     */
+    std::map<uint64_t, Watch> watches;
+
+    /**
+     * Index into #watches by path, used to find the watches that a change
+     * triggers without scanning all of them.
+     */
+    std::multimap<std::string, uint64_t> watchesByPath;
+
+    /**
+     * Index into #watches by deadline, used by watchThread.
+     */
+    std::set<std::pair<TimePoint, uint64_t>> watchDeadlines;
+
+    /**
+     * A client's read-write command waiting to be applied.
+     */
+    struct PendingCommand {
+        PendingCommand(RPC::ServerRPC rpc,
+                       uint64_t term,
+                       const Command::Request& command)
+            : rpc(std::move(rpc))
+            , term(term)
+            , command(command)
+        {
+        }
+        /**
+         * The RPC to reply to.
+         */
+        RPC::ServerRPC rpc;
+        /**
+         * The term of the log entry holding the command.
+         */
+        uint64_t term;
+        /**
+         * The command itself, needed to find its response.
+         */
+        Command::Request command;
+    };
+
+    /**
+     * Parked commands, keyed by the log index where they were appended. A
+     * new leader may append a command at an index where a command from an
+     * older term is still parked, so this is a multimap.
+     */
+    std::multimap<uint64_t, PendingCommand> pendingCommands;
+
+    /**
+     * The largest term of any command that was parked. A command from an
+     * older term is replied to right away, since a newer term has started.
+     */
+    uint64_t newestCommandTerm;
+
     /**
      * Tracks state for a particular client.
      * Used to prevent duplicate processing of duplicate RPCs.
@@ -486,6 +991,50 @@ class StateMachine {
      */
     Tree::Tree tree;
 
+    /**
+     * A snapshot from the leader, parsed (or being parsed) by
+     * snapshotStreamThread while it's received.
+     */
+    struct IncomingSnapshot {
+        IncomingSnapshot()
+            : lastIncludedIndex(0)
+            , done(false)
+            , loaded(false)
+            , header()
+            , tree()
+        {
+        }
+        /**
+         * The last log index that the snapshot covers.
+         */
+        uint64_t lastIncludedIndex;
+        /**
+         * Set once snapshotStreamThread is no longer using this. Protected by
+         * #mutex.
+         */
+        bool done;
+        /**
+         * Set along with 'done' if 'header' and 'tree' were loaded
+         * completely.
+         */
+        bool loaded;
+        /**
+         * The state machine header from the snapshot.
+         */
+        SnapshotStateMachine::Header header;
+        /**
+         * The Tree from the snapshot.
+         */
+        Tree::Tree tree;
+    };
+
+    /**
+     * The most recent snapshot that snapshotStreamThread started loading, or
+     * NULL. applyThread uses it in place of the snapshot file if it covers
+     * the same index.
+     */
+    std::shared_ptr<IncomingSnapshot> incomingSnapshot;
+
     /**
      * The log position when the state machine was updated to each new version.
      * First component: log index. Second component: version number.
@@ -526,6 +1075,22 @@ class StateMachine {
      * See https://github.com/logcabin/logcabin/issues/121 for more rationale.
      */
     std::thread snapshotWatchdogThread;
+
+    /**
+     * Replies to parked watches once their timeouts elapse.
+     */
+    std::thread watchThread;
+
+    /**
+     * Replies to parked commands once their terms end.
+     */
+    std::thread pendingCommandThread;
+
+    /**
+     * Parses snapshots from the leader as they arrive, if
+     * #snapshotStreamInstall is set.
+     */
+    std::thread snapshotStreamThread;
 };
 
 } // namespace LogCabin::Server
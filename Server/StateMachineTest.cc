@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <deque>
 #include <fcntl.h>
 #include <gtest/gtest.h>
 #include <sys/stat.h>
@@ -24,6 +25,8 @@
 #include "Core/ProtoBuf.h"
 #include "Core/StringUtil.h"
 #include "Core/STLUtil.h"
+#include "RPC/OpaqueServerRPC.h"
+#include "RPC/Protocol.h"
 #include "Server/Globals.h"
 #include "Server/RaftConsensus.h"
 #include "Server/StateMachine.h"
@@ -40,7 +43,8 @@ namespace {
 class ServerStateMachineTest : public ::testing::Test {
   public:
     ServerStateMachineTest()
-      : globals()
+      : watchResponses()
+      , globals()
       , consensus()
       , stateMachine()
       , timeMocker()
@@ -83,6 +87,114 @@ class ServerStateMachineTest : public ::testing::Test {
         return out;
     }
 
+    /**
+     * Return an RPC whose response will be written into the given buffer.
+     */
+    RPC::ServerRPC
+    makeRPC(Core::Buffer& response) {
+        typedef RPC::Protocol::RequestHeaderVersion1 Header;
+        RPC::OpaqueServerRPC opaqueRPC;
+        opaqueRPC.request.setData(new Header(),
+                                  sizeof(Header),
+                                  Core::Buffer::deleteObjectFn<Header*>);
+        Header& header = *static_cast<Header*>(opaqueRPC.request.getData());
+        header.prefix.version = 1;
+        header.prefix.toBigEndian();
+        header.toBigEndian();
+        opaqueRPC.responseTarget = &response;
+        return RPC::ServerRPC(std::move(opaqueRPC));
+    }
+
+    /**
+     * Parse the watch response out of the given buffer, or return an empty
+     * response if no reply has been sent.
+     */
+    Protocol::Client::WatchTree::Response
+    parseWatch(const Core::Buffer& response) {
+        StateMachine::Query::Response qresponse;
+        if (response.getLength() > 0) {
+            EXPECT_TRUE(Core::ProtoBuf::parse(
+                response, qresponse,
+                sizeof(RPC::Protocol::ResponseHeaderVersion1)));
+        }
+        return qresponse.watch();
+    }
+
+    /**
+     * Register a watch with the state machine.
+     * \return
+     *      The buffer that the watch's response will be written into.
+     */
+    Core::Buffer&
+    watch(const std::string& path,
+          bool recursive,
+          uint64_t afterIndex,
+          uint64_t timeoutMs = 0) {
+        Protocol::Client::WatchTree::Request request;
+        request.set_path(path);
+        request.set_recursive(recursive);
+        request.set_after_index(afterIndex);
+        request.set_timeout_ms(timeoutMs);
+        watchResponses.emplace_back();
+        Core::Buffer& response = watchResponses.back();
+        stateMachine->watch(request, makeRPC(response));
+        return response;
+    }
+
+    /**
+     * Park a command with the state machine.
+     * \return
+     *      The buffer that the command's response will be written into.
+     */
+    Core::Buffer&
+    respondWhenApplied(uint64_t logIndex,
+                       uint64_t term,
+                       const StateMachine::Command::Request& command) {
+        watchResponses.emplace_back();
+        Core::Buffer& response = watchResponses.back();
+        stateMachine->respondWhenApplied(logIndex, term, command,
+                                         makeRPC(response));
+        return response;
+    }
+
+    /**
+     * Return true if the given buffer holds a NOT_LEADER error.
+     */
+    bool
+    isNotLeader(const Core::Buffer& response) {
+        typedef RPC::Protocol::ResponseHeaderVersion1 Header;
+        if (response.getLength() < sizeof(Header))
+            return false;
+        const Header& header =
+            *static_cast<const Header*>(response.getData());
+        if (header.prefix.status !=
+            RPC::Protocol::Status::SERVICE_SPECIFIC_ERROR) {
+            return false;
+        }
+        Protocol::Client::Error error;
+        EXPECT_TRUE(Core::ProtoBuf::parse(response, error, sizeof(Header)));
+        return error.error_code() == Protocol::Client::Error::NOT_LEADER;
+    }
+
+    /**
+     * Parse the command response out of the given buffer.
+     */
+    StateMachine::Command::Response
+    parseCommand(const Core::Buffer& response) {
+        StateMachine::Command::Response cresponse;
+        EXPECT_LT(sizeof(RPC::Protocol::ResponseHeaderVersion1),
+                  response.getLength());
+        EXPECT_TRUE(Core::ProtoBuf::parse(
+            response, cresponse,
+            sizeof(RPC::Protocol::ResponseHeaderVersion1)));
+        return cresponse;
+    }
+
+    /**
+     * Responses to watches and commands. These must outlive the state
+     * machine, which replies to any parked RPCs when it is destroyed.
+     */
+    std::deque<Core::Buffer> watchResponses;
     Globals globals;
     std::shared_ptr<RaftConsensus> consensus;
     std::unique_ptr<StateMachine> stateMachine;
@@ -109,6 +221,75 @@ TEST_F(ServerStateMachineTest, query_unknown)
     EXPECT_FALSE(stateMachine->query(request, response));
 }
 
+TEST_F(ServerStateMachineTest, watch_invalidPath)
+{
+    Core::Buffer& response = watch("foo", false, 3);
+    EXPECT_EQ(Protocol::Client::Status::INVALID_ARGUMENT,
+              parseWatch(response).status());
+    EXPECT_EQ(0U, stateMachine->watches.size());
+}
+
+TEST_F(ServerStateMachineTest, watch_unknownHistory)
+{
+    stateMachine->lastApplied = 10;
+    stateMachine->watchHistoryStart = 5;
+    Core::Buffer& response1 = watch("/a", false, 0);
+    EXPECT_EQ("status: OK index: 10 changed: true",
+              parseWatch(response1));
+    Core::Buffer& response2 = watch("/a", false, 4);
+    EXPECT_EQ("status: OK index: 10 changed: true",
+              parseWatch(response2));
+    Core::Buffer& response3 = watch("/a", false, 5);
+    EXPECT_EQ(0U, response3.getLength());
+    EXPECT_EQ(1U, stateMachine->watches.size());
+}
+
+TEST_F(ServerStateMachineTest, watch_history)
+{
+    stateMachine->recordChange(2, "/a/b/c");
+    stateMachine->recordChange(3, "/a/b");
+    stateMachine->recordChange(4, "/x");
+    stateMachine->lastApplied = 4;
+    Core::Buffer& response1 = watch("/a", true, 1);
+    EXPECT_EQ("status: OK index: 2 changed: true",
+              parseWatch(response1));
+    Core::Buffer& response2 = watch("/a", false, 1);
+    EXPECT_EQ("status: OK index: 3 changed: true",
+              parseWatch(response2));
+    Core::Buffer& response3 = watch("/a", false, 3);
+    EXPECT_EQ(0U, response3.getLength());
+    EXPECT_EQ(1U, stateMachine->watches.size());
+}
+
+TEST_F(ServerStateMachineTest, watch_timeout)
+{
+    Core::Time::SteadyClock::mockValue =
+        Core::Time::SteadyClock::time_point();
+    stateMachine->watchMaxTimeout = std::chrono::milliseconds(100);
+    watch("/a", false, 1, 10);
+    watch("/a", false, 1, 0);
+    watch("/a", false, 1, 1000);
+    ASSERT_EQ(3U, stateMachine->watchDeadlines.size());
+    auto it = stateMachine->watchDeadlines.begin();
+    EXPECT_EQ(std::chrono::milliseconds(10),
+              (it++)->first - Core::Time::SteadyClock::mockValue);
+    EXPECT_EQ(std::chrono::milliseconds(100),
+              (it++)->first - Core::Time::SteadyClock::mockValue);
+    EXPECT_EQ(std::chrono::milliseconds(100),
+              (it++)->first - Core::Time::SteadyClock::mockValue);
+    EXPECT_LT(0U, stateMachine->watchesChanged.notificationCount);
+}
+
+TEST_F(ServerStateMachineTest, watch_exiting)
+{
+    stateMachine->exiting = true;
+    stateMachine->lastApplied = 3;
+    Core::Buffer& response = watch("/a", false, 3);
+    EXPECT_EQ("status: OK index: 3 changed: false",
+              parseWatch(response));
+    EXPECT_EQ(0U, stateMachine->watches.size());
+}
+
 struct WaitHelper {
     explicit WaitHelper(StateMachine& stateMachine)
         : stateMachine(stateMachine)
@@ -137,18 +318,7 @@ TEST_F(ServerStateMachineTest, wait)
     EXPECT_EQ(2U, helper.iter);
 }
 
-TEST_F(ServerStateMachineTest, waitForResponse_wait)
-{
-    StateMachine::Command::Request request;
-    request.mutable_open_session();
-    StateMachine::Command::Response response;
-    WaitHelper helper(*stateMachine);
-    stateMachine->entriesApplied.callback = std::ref(helper);
-    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response));
-    EXPECT_EQ(2U, helper.iter);
-}
-
-TEST_F(ServerStateMachineTest, waitForResponse_tree)
+TEST_F(ServerStateMachineTest, getResponse_tree)
 {
     Core::Debug::setLogPolicy({{"Server/StateMachine.cc", "ERROR"}});
     stateMachine->sessions.insert({1, {}});
@@ -162,14 +332,14 @@ TEST_F(ServerStateMachineTest, waitForResponse_tree)
     auto& exactlyOnce = *request.mutable_tree()->mutable_exactly_once();
     exactlyOnce.set_client_id(2);
     exactlyOnce.set_rpc_number(1);
-    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2));
+    EXPECT_TRUE(stateMachine->getResponse(0, request, r2));
     EXPECT_EQ("tree { "
               "  status: SESSION_EXPIRED "
               "}", r2);
 
     exactlyOnce.set_client_id(1);
     exactlyOnce.set_rpc_number(2);
-    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2));
+    EXPECT_TRUE(stateMachine->getResponse(0, request, r2));
     EXPECT_EQ("tree { "
               "  status: SESSION_EXPIRED "
               "}", r2);
@@ -177,61 +347,139 @@ TEST_F(ServerStateMachineTest, waitForResponse_tree)
     Core::Debug::setLogPolicy({{"", "WARNING"}});
     exactlyOnce.set_client_id(1);
     exactlyOnce.set_rpc_number(1);
-    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2));
+    EXPECT_TRUE(stateMachine->getResponse(0, request, r2));
     EXPECT_EQ(r1, r2);
 }
 
-TEST_F(ServerStateMachineTest, waitForResponse_openSession)
+TEST_F(ServerStateMachineTest, getResponse_openSession)
 {
     StateMachine::Command::Request request;
     request.mutable_open_session();
     StateMachine::Command::Response response;
     stateMachine->lastApplied = 3;
-    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_TRUE(stateMachine->getResponse(3, request, response));
     EXPECT_EQ("open_session { "
               "  client_id: 3 "
               "}",
               response);
 }
 
-TEST_F(ServerStateMachineTest, waitForResponse_closeSession)
+TEST_F(ServerStateMachineTest, getResponse_closeSession)
 {
     stateMachine->lastApplied = 3;
     StateMachine::Command::Request request;
     request.mutable_close_session()->set_client_id(3);
     StateMachine::Command::Response response;
     stateMachine->versionHistory.insert({3, 2});
-    EXPECT_FALSE(stateMachine->waitForResponse(2, request, response));
+    EXPECT_FALSE(stateMachine->getResponse(2, request, response));
     EXPECT_FALSE(response.has_close_session());
-    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_TRUE(stateMachine->getResponse(3, request, response));
     EXPECT_EQ("close_session { "
               "}",
               response);
 }
 
-TEST_F(ServerStateMachineTest, waitForResponse_advanceVersion)
+TEST_F(ServerStateMachineTest, getResponse_advanceVersion)
 {
     StateMachine::Command::Request request;
     request.mutable_advance_version()->
         set_requested_version(90);
     StateMachine::Command::Response response;
     stateMachine->lastApplied = 3;
-    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_TRUE(stateMachine->getResponse(3, request, response));
     EXPECT_EQ("advance_version { "
               "  running_version: 1 "
               "}",
               response);
 }
 
-TEST_F(ServerStateMachineTest, waitForResponse_unknown)
+TEST_F(ServerStateMachineTest, getResponse_unknown)
 {
     StateMachine::Command::Request request; // empty
     StateMachine::Command::Response response;
     stateMachine->lastApplied = 3;
-    EXPECT_FALSE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_FALSE(stateMachine->getResponse(3, request, response));
     EXPECT_EQ("", response);
 }
 
+TEST_F(ServerStateMachineTest, respondWhenApplied)
+{
+    StateMachine::Command::Request command;
+    command.mutable_open_session();
+    uint64_t index = 0;
+    uint64_t term = 0;
+    EXPECT_EQ(RaftConsensus::ClientResult::SUCCESS,
+              consensus->replicateAsync(serialize(command), index, term));
+    EXPECT_EQ(consensus->currentTerm, term);
+    Core::Buffer& response1 = respondWhenApplied(index, term, command);
+    Core::Buffer& response2 = respondWhenApplied(index + 1, term, command);
+    EXPECT_EQ(0U, response1.getLength());
+    EXPECT_EQ(2U, stateMachine->pendingCommands.size());
+    EXPECT_LT(0U, stateMachine->pendingCommandsChanged.notificationCount);
+
+    stateMachine->lastApplied = index;
+    stateMachine->replyToCommandsThrough(index, term);
+    EXPECT_EQ(Core::StringUtil::format("open_session { client_id: %lu }", index),
+              parseCommand(response1));
+    EXPECT_EQ(0U, response2.getLength());
+    EXPECT_EQ(1U, stateMachine->pendingCommands.size());
+
+    // a different entry was committed there
+    stateMachine->replyToCommandsThrough(index + 1, term + 1);
+    EXPECT_TRUE(isNotLeader(response2));
+    EXPECT_EQ(0U, stateMachine->pendingCommands.size());
+}
+
+TEST_F(ServerStateMachineTest, respondWhenApplied_alreadyApplied)
+{
+    StateMachine::Command::Request command;
+    command.mutable_open_session();
+    uint64_t index = 0;
+    uint64_t term = 0;
+    EXPECT_EQ(RaftConsensus::ClientResult::SUCCESS,
+              consensus->replicateAsync(serialize(command), index, term));
+    consensus->configuration->localServer->lastSyncedIndex = index;
+    consensus->advanceCommitIndex();
+    stateMachine->lastApplied = index;
+    Core::Buffer& response1 = respondWhenApplied(index, term, command);
+    EXPECT_EQ(Core::StringUtil::format("open_session { client_id: %lu }", index),
+              parseCommand(response1));
+    Core::Buffer& response2 = respondWhenApplied(index, term - 1, command);
+    EXPECT_TRUE(isNotLeader(response2));
+    EXPECT_EQ(0U, stateMachine->pendingCommands.size());
+}
+
+TEST_F(ServerStateMachineTest, respondWhenApplied_oldTerm)
+{
+    StateMachine::Command::Request command;
+    command.mutable_open_session();
+    respondWhenApplied(10, 5, command);
+    Core::Buffer& response = respondWhenApplied(9, 4, command);
+    EXPECT_TRUE(isNotLeader(response));
+    EXPECT_EQ(1U, stateMachine->pendingCommands.size());
+
+    stateMachine->exiting = true;
+    Core::Buffer& response2 = respondWhenApplied(11, 5, command);
+    EXPECT_TRUE(isNotLeader(response2));
+    EXPECT_EQ(1U, stateMachine->pendingCommands.size());
+}
+
+TEST_F(ServerStateMachineTest, pendingCommandThreadMain)
+{
+    StateMachine::Command::Request command;
+    command.mutable_open_session();
+    uint64_t term = consensus->currentTerm;
+    Core::Buffer& response = respondWhenApplied(10, term, command);
+    consensus->stateChanged.callback = std::bind(&RaftConsensus::stepDown,
+                                                 consensus.get(), term + 1);
+    stateMachine->pendingCommandsChanged.callback = [this]() {
+        stateMachine->exiting = true;
+    };
+    stateMachine->pendingCommandThreadMain();
+    EXPECT_TRUE(isNotLeader(response));
+    EXPECT_EQ(0U, stateMachine->pendingCommands.size());
+}
+
 struct IsTakingSnapshotHelper {
     explicit IsTakingSnapshotHelper(StateMachine& stateMachine)
         : stateMachine(stateMachine)
@@ -443,6 +691,123 @@ TEST_F(ServerStateMachineTest, apply_tree)
     EXPECT_EQ(2U, stateMachine->sessions.at(39).lastModified);
 }
 
+TEST_F(ServerStateMachineTest, apply_tree_watch)
+{
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 1 "
+            " } "
+            " write { "
+            "  path: '/a/b' "
+            "  contents: 'c' "
+            " } "
+            "}");
+    entry.command = serialize(command);
+    stateMachine->sessions.insert({39, {}});
+    Core::Buffer& response = watch("/a/b", false, 5);
+
+    // failed commands don't count as changes
+    stateMachine->apply(entry);
+    EXPECT_EQ(0U, stateMachine->watchHistory.size());
+    EXPECT_EQ(0U, response.getLength());
+
+    stateMachine->tree.makeDirectory("/a");
+    entry.index = 7;
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(2);
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    ASSERT_EQ(1U, stateMachine->watchHistory.size());
+    EXPECT_EQ(7U, stateMachine->watchHistory.front().first);
+    EXPECT_EQ("/a/b", stateMachine->watchHistory.front().second);
+    EXPECT_EQ("status: OK index: 7 changed: true",
+              parseWatch(response));
+}
+
+TEST_F(ServerStateMachineTest, apply_tree_watch_createSequential)
+{
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 1 "
+            " } "
+            " create_sequential { "
+            "  path: '/a/' "
+            "  contents: 'c' "
+            " } "
+            "}");
+    entry.command = serialize(command);
+    stateMachine->sessions.insert({39, {}});
+    stateMachine->versionHistory.insert({1, 3});
+    stateMachine->tree.makeDirectory("/a");
+    Core::Buffer& response = watch("/a", true, 5);
+
+    // the change is recorded under the name the state machine chose
+    stateMachine->apply(entry);
+    ASSERT_EQ(1U, stateMachine->watchHistory.size());
+    EXPECT_EQ("/a/0000000000", stateMachine->watchHistory.front().second);
+    EXPECT_EQ("status: OK index: 6 changed: true",
+              parseWatch(response));
+}
+
+TEST_F(ServerStateMachineTest, apply_tree_version3)
+{
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 1 "
+            " } "
+            " increment { "
+            "  path: '/a' "
+            "  delta: 2 "
+            " } "
+            "}");
+    entry.command = serialize(command);
+    stateMachine->sessions.insert({39, {}});
+    StateMachine::Command::Response response;
+
+    // first apply will have no effect (only warning) because state machine
+    // version 2 does not support the Increment command
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({4, 2});
+    stateMachine->apply(entry);
+    stateMachine->lastApplied = 6;
+    EXPECT_EQ(0U, stateMachine->sessions.at(39).responses.size());
+    EXPECT_FALSE(stateMachine->getResponse(6, command, response));
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+
+    // second apply will work
+    entry.index = 8;
+    stateMachine->versionHistory.insert({7, 3});
+    stateMachine->apply(entry);
+    stateMachine->lastApplied = 8;
+    EXPECT_TRUE(stateMachine->getResponse(8, command, response));
+    EXPECT_EQ("tree { status: OK increment { value: 2 } }", response);
+}
+
 TEST_F(ServerStateMachineTest, apply_openSession)
 {
     stateMachine->sessionTimeoutNanos = 1;
@@ -593,6 +958,132 @@ TEST_F(ServerStateMachineTest, applyThreadMain_exiting_TimingSensitive)
     EXPECT_EQ(0U, consensus->lastSnapshotIndex);
 }
 
+TEST_F(ServerStateMachineTest, recordChange)
+{
+    std::vector<std::string> paths = {
+        "/", "/a", "/a/b", "/a/b/c", "/a/b/c/d", "/a/bc", "/x",
+    };
+    std::vector<Core::Buffer*> responses;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        responses.push_back(&watch(paths.at(i), false, 1));
+        responses.push_back(&watch(paths.at(i), true, 1));
+    }
+    stateMachine->recordChange(2, "/a/b");
+    std::vector<std::string> triggered;
+    for (size_t i = 0; i < responses.size(); ++i) {
+        if (parseWatch(*responses.at(i)).changed()) {
+            EXPECT_EQ(2U, parseWatch(*responses.at(i)).index());
+            triggered.push_back(paths.at(i / 2) +
+                                (i % 2 == 0 ? "" : " (recursive)"));
+        }
+    }
+    EXPECT_EQ((std::vector<std::string>{
+                  "/ (recursive)",
+                  "/a",
+                  "/a (recursive)",
+                  "/a/b",
+                  "/a/b (recursive)",
+                  "/a/b/c",
+                  "/a/b/c (recursive)",
+                  "/a/b/c/d",
+                  "/a/b/c/d (recursive)",
+              }), triggered);
+    EXPECT_EQ(5U, stateMachine->watches.size());
+    EXPECT_EQ(5U, stateMachine->watchesByPath.size());
+    EXPECT_EQ(5U, stateMachine->watchDeadlines.size());
+    EXPECT_EQ(9U, stateMachine->numWatchesTriggered);
+
+    // changes at or before a watch's afterIndex don't trigger it
+    Core::Buffer& response = watch("/y", false, 5);
+    stateMachine->recordChange(5, "/y");
+    EXPECT_EQ(0U, response.getLength());
+    stateMachine->recordChange(6, "/");
+    EXPECT_EQ("status: OK index: 6 changed: true", parseWatch(response));
+    EXPECT_EQ(0U, stateMachine->watches.size());
+}
+
+TEST_F(ServerStateMachineTest, recordChange_root)
+{
+    Core::Buffer& response1 = watch("/", false, 1);
+    Core::Buffer& response2 = watch("/", true, 1);
+    Core::Buffer& response3 = watch("/a", false, 1);
+    stateMachine->recordChange(2, "/");
+    EXPECT_EQ("status: OK index: 2 changed: true", parseWatch(response1));
+    EXPECT_EQ("status: OK index: 2 changed: true", parseWatch(response2));
+    EXPECT_EQ("status: OK index: 2 changed: true", parseWatch(response3));
+    EXPECT_EQ(0U, stateMachine->watches.size());
+    // each watch counts once, even though "/" is also the prefix of the
+    // paths below it
+    EXPECT_EQ(3U, stateMachine->numWatchesTriggered);
+}
+
+TEST_F(ServerStateMachineTest, recordChange_trimHistory)
+{
+    stateMachine->watchHistoryLength = 2;
+    stateMachine->recordChange(3, "/a");
+    stateMachine->recordChange(4, "/b");
+    EXPECT_EQ(0U, stateMachine->watchHistoryStart);
+    stateMachine->recordChange(6, "/c");
+    EXPECT_EQ(3U, stateMachine->watchHistoryStart);
+    ASSERT_EQ(2U, stateMachine->watchHistory.size());
+    EXPECT_EQ(4U, stateMachine->watchHistory.front().first);
+    EXPECT_EQ(6U, stateMachine->watchHistory.back().first);
+}
+
+TEST_F(ServerStateMachineTest, replyToAllWatches)
+{
+    stateMachine->lastApplied = 9;
+    Core::Buffer& response1 = watch("/a", false, 1);
+    Core::Buffer& response2 = watch("/b", true, 1);
+    stateMachine->replyToAllWatches(true);
+    EXPECT_EQ("status: OK index: 9 changed: true", parseWatch(response1));
+    EXPECT_EQ("status: OK index: 9 changed: true", parseWatch(response2));
+    EXPECT_EQ(0U, stateMachine->watches.size());
+    EXPECT_EQ(0U, stateMachine->watchesByPath.size());
+    EXPECT_EQ(0U, stateMachine->watchDeadlines.size());
+}
+
+struct WatchThreadMainHelper {
+    explicit WatchThreadMainHelper(StateMachine& stateMachine)
+        : count(0)
+        , stateMachine(stateMachine)
+    {
+    }
+    void operator()() {
+        if (count == 0) {
+            EXPECT_EQ(2U, stateMachine.watches.size());
+            Core::Time::SteadyClock::mockValue +=
+                std::chrono::milliseconds(15);
+        } else if (count == 1) {
+            EXPECT_EQ(1U, stateMachine.watches.size());
+            Core::Time::SteadyClock::mockValue +=
+                std::chrono::milliseconds(100);
+        } else if (count == 2) {
+            EXPECT_EQ(0U, stateMachine.watches.size());
+            stateMachine.exiting = true;
+        }
+        ++count;
+    }
+    uint64_t count;
+    StateMachine& stateMachine;
+};
+
+TEST_F(ServerStateMachineTest, watchThreadMain)
+{
+    Core::Time::SteadyClock::mockValue =
+        Core::Time::SteadyClock::time_point();
+    stateMachine->lastApplied = 4;
+    Core::Buffer& response1 = watch("/a", false, 4, 10);
+    Core::Buffer& response2 = watch("/a", false, 4, 50);
+    WatchThreadMainHelper helper(*stateMachine);
+    stateMachine->watchesChanged.callback = std::ref(helper);
+    stateMachine->watchThreadMain();
+    EXPECT_EQ(3U, helper.count);
+    EXPECT_EQ("status: OK index: 4 changed: false", parseWatch(response1));
+    EXPECT_EQ("status: OK index: 4 changed: false", parseWatch(response2));
+    EXPECT_EQ(2U, stateMachine->numWatchesTimedOut);
+}
+
 TEST_F(ServerStateMachineTest, serializeSessions)
 {
     StateMachine::Command::Response r1;
@@ -733,7 +1224,8 @@ TEST_F(ServerStateMachineTest, loadSnapshot_empty)
         consensus->beginSnapshot(1);
     writer->save();
     consensus->readSnapshot();
-    EXPECT_DEATH(stateMachine->loadSnapshot(*consensus->snapshotReader),
+    EXPECT_DEATH(stateMachine->loadSnapshot(
+                     std::move(consensus->snapshotReader)),
                  "no format version field");
 }
 
@@ -745,7 +1237,8 @@ TEST_F(ServerStateMachineTest, loadSnapshot_unknownFormatVersion)
     writer->writeRaw(&formatVersion, sizeof(formatVersion));
     writer->save();
     consensus->readSnapshot();
-    EXPECT_DEATH(stateMachine->loadSnapshot(*consensus->snapshotReader),
+    EXPECT_DEATH(stateMachine->loadSnapshot(
+                     std::move(consensus->snapshotReader)),
                  "Snapshot contents format version read was 2, but this code "
                  "can only read version 1");
 }
@@ -755,12 +1248,12 @@ TEST_F(ServerStateMachineTest, loadSnapshot_unknownFormatVersion)
 
 TEST_F(ServerStateMachineTest, loadVersionHistory_unknownVersion)
 {
-    stateMachine->versionHistory.insert({1, 3});
+    stateMachine->versionHistory.insert({1, 4});
     SnapshotStateMachine::Header header;
     stateMachine->serializeVersionHistory(header);
     EXPECT_DEATH(stateMachine->loadVersionHistory(header),
-                 "State machine version read from snapshot was 3, but this "
-                 "code only supports 1 through 2");
+                 "State machine version read from snapshot was 4, but this "
+                 "code only supports 1 through 3");
 }
 
 struct SnapshotThreadMainHelper {
@@ -828,6 +1321,82 @@ struct SnapshotThreadMainHelper {
     uint64_t count;
 };
 
+TEST_F(ServerStateMachineTest, shouldTakeSnapshot_adaptive)
+{
+    uint64_t index = consensus->log->getLastLogIndex();
+    uint64_t logBytes = consensus->log->getSizeBytes();
+    stateMachine->snapshotMinLogSize = 1;
+    stateMachine->snapshotRatio = 1000;
+    consensus->lastSnapshotBytes = 1000;
+    EXPECT_FALSE(stateMachine->shouldTakeSnapshot(index));
+
+    // no snapshot timed yet: falls back on snapshotRatio
+    stateMachine->snapshotAdaptive = true;
+    EXPECT_FALSE(stateMachine->shouldTakeSnapshot(index));
+
+    // replaying is cheaper than snapshotting
+    stateMachine->snapshotWriteTime = std::chrono::milliseconds(1);
+    stateMachine->snapshotWriteBytes = 1000;
+    stateMachine->applyTime = std::chrono::microseconds(500);
+    stateMachine->appliedBytes = logBytes;
+    EXPECT_FALSE(stateMachine->shouldTakeSnapshot(index));
+
+    // replaying is more expensive than snapshotting
+    stateMachine->applyTime = std::chrono::milliseconds(2);
+    EXPECT_TRUE(stateMachine->shouldTakeSnapshot(index));
+
+    // but the log is growing in a burst
+    stateMachine->logGrowthSampleStart =
+        Core::Time::SteadyClock::now();
+    stateMachine->logGrowthRecent = 3000;
+    stateMachine->logGrowthAverage = 1000;
+    EXPECT_FALSE(stateMachine->shouldTakeSnapshot(index));
+
+    // unless the log has reached snapshotMaxLogSize
+    stateMachine->snapshotMaxLogSize = logBytes;
+    EXPECT_TRUE(stateMachine->shouldTakeSnapshot(index));
+}
+
+TEST_F(ServerStateMachineTest, recordApply)
+{
+    Core::Time::SteadyClock::time_point start =
+        Core::Time::SteadyClock::now();
+    stateMachine->recordApply(1000, start,
+                              start + std::chrono::milliseconds(1));
+    EXPECT_EQ(std::chrono::milliseconds(2),
+              stateMachine->estimateReplayTime(2000));
+    EXPECT_DOUBLE_EQ(0, stateMachine->logGrowthRecent);
+    EXPECT_FALSE(stateMachine->isLogBursting());
+
+    // a second's worth of growth at 100 KB/s
+    stateMachine->recordApply(99000,
+                              start + std::chrono::milliseconds(999),
+                              start + std::chrono::seconds(1));
+    EXPECT_DOUBLE_EQ(100000, stateMachine->logGrowthRecent);
+    EXPECT_DOUBLE_EQ(100000.0 / 60, stateMachine->logGrowthAverage);
+    EXPECT_EQ(0U, stateMachine->logGrowthSampleBytes);
+    Core::Time::SteadyClock::mockValue = start + std::chrono::seconds(1);
+    EXPECT_TRUE(stateMachine->isLogBursting());
+    // until the burst is long over
+    Core::Time::SteadyClock::mockValue = start + std::chrono::seconds(10);
+    EXPECT_FALSE(stateMachine->isLogBursting());
+
+    // large amounts of history decay
+    stateMachine->recordApply(64UL * 1024 * 1024, start, start);
+    EXPECT_EQ((64UL * 1024 * 1024 + 100000) / 2,
+              stateMachine->appliedBytes);
+}
+
+TEST_F(ServerStateMachineTest, estimateSnapshotTime)
+{
+    EXPECT_EQ(std::chrono::nanoseconds(0),
+              stateMachine->estimateSnapshotTime(1000));
+    stateMachine->snapshotWriteTime = std::chrono::milliseconds(10);
+    stateMachine->snapshotWriteBytes = 1000;
+    EXPECT_EQ(std::chrono::milliseconds(30),
+              stateMachine->estimateSnapshotTime(3000));
+}
+
 TEST_F(ServerStateMachineTest, snapshotThreadMain)
 {
     // time is mocked
@@ -838,6 +1407,36 @@ TEST_F(ServerStateMachineTest, snapshotThreadMain)
     EXPECT_EQ(4U, helper.count);
 }
 
+TEST_F(ServerStateMachineTest, snapshotThreadMain_lazySnapshotSuperseded)
+{
+    stateMachine->snapshotIndexMinBytes = 1;
+    stateMachine->tree.makeDirectory("/a");
+    stateMachine->tree.write("/a/x", "ax");
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    consensus->readSnapshot();
+    stateMachine->snapshotLoadLazily = true;
+    stateMachine->loadSnapshot(std::move(consensus->snapshotReader));
+    EXPECT_TRUE(stateMachine->tree.superRoot.isLazy());
+
+    stateMachine->lazySnapshotSuperseded = true;
+    stateMachine->snapshotSuggested.callback = [this] () {
+        stateMachine->exiting = true;
+    };
+    stateMachine->snapshotThreadMain();
+    EXPECT_FALSE(stateMachine->lazySnapshotSuperseded);
+    EXPECT_FALSE(stateMachine->tree.superRoot.isLazy());
+    Tree::Internal::Directory* root =
+        stateMachine->tree.superRoot.lookupDirectory("root");
+    EXPECT_FALSE(root->lookupDirectory("a")->isLazy());
+    std::string contents;
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/a/x", contents).status);
+    EXPECT_EQ("ax", contents);
+}
+
 
 struct SnapshotWatchdogThreadMainHelper {
     explicit SnapshotWatchdogThreadMainHelper(StateMachine& stateMachine)
@@ -938,7 +1537,7 @@ TEST_F(ServerStateMachineTest, takeSnapshot)
     EXPECT_EQ(1U, consensus->lastSnapshotIndex);
     consensus->discardUnneededEntries();
     consensus->readSnapshot();
-    stateMachine->loadSnapshot(*consensus->snapshotReader);
+    stateMachine->loadSnapshot(std::move(consensus->snapshotReader));
     std::vector<std::string> children;
     stateMachine->tree.listDirectory("/", children);
     EXPECT_EQ((std::vector<std::string>{"foo/"}), children);
@@ -947,6 +1546,222 @@ TEST_F(ServerStateMachineTest, takeSnapshot)
                   Core::STLUtil::getKeys(stateMachine->sessions)));
 }
 
+TEST_F(ServerStateMachineTest, takeSnapshot_incremental)
+{
+    stateMachine->snapshotIncremental = true;
+    stateMachine->snapshotIndexMinBytes = 1;
+    stateMachine->tree.makeDirectory("/a");
+    stateMachine->tree.makeDirectory("/b");
+    for (uint64_t i = 0; i < 10; ++i) {
+        stateMachine->tree.write(Core::StringUtil::format("/a/%lu", i), "a");
+        stateMachine->tree.write(Core::StringUtil::format("/b/%lu", i), "b");
+    }
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    EXPECT_EQ(1U, consensus->lastSnapshotIndex);
+    EXPECT_TRUE(stateMachine->haveSnapshotBase);
+    EXPECT_EQ(1U, stateMachine->snapshotBaseIndex);
+    EXPECT_EQ(1U, stateMachine->numSnapshotsSinceFull);
+    {
+        std::unique_ptr<Storage::SnapshotFile::Reader> reader =
+            consensus->openSnapshot();
+        ASSERT_TRUE(bool(reader));
+        const char* magic = reader->getRange(reader->getSizeBytes() - 8, 8);
+        ASSERT_TRUE(magic != NULL);
+        EXPECT_EQ("LCFOOTER", std::string(magic, 8));
+    }
+
+    stateMachine->tree.write("/a/3", "changed");
+    Storage::Log::Entry entry;
+    entry.set_term(1);
+    entry.set_type(Protocol::Raft::EntryType::DATA);
+    entry.set_data("hello");
+    consensus->append({&entry});
+    consensus->commitIndex = consensus->log->getLastLogIndex();
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(2, lockGuard);
+    }
+    EXPECT_EQ(2U, consensus->lastSnapshotIndex);
+    EXPECT_EQ(2U, stateMachine->snapshotBaseIndex);
+
+    stateMachine->tree.removeDirectory("/");
+    consensus->discardUnneededEntries();
+    consensus->readSnapshot();
+    stateMachine->loadSnapshot(std::move(consensus->snapshotReader));
+    std::string contents;
+    stateMachine->tree.read("/a/3", contents);
+    EXPECT_EQ("changed", contents);
+    stateMachine->tree.read("/b/9", contents);
+    EXPECT_EQ("b", contents);
+    std::vector<std::string> children;
+    stateMachine->tree.listDirectory("/a", children);
+    EXPECT_EQ(10U, children.size());
+
+    // every snapshotFullInterval snapshots, nothing is copied
+    stateMachine->snapshotFullInterval = 2;
+    consensus->append({&entry});
+    consensus->commitIndex = consensus->log->getLastLogIndex();
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(3, lockGuard);
+    }
+    EXPECT_EQ(0U, stateMachine->numSnapshotsSinceFull);
+    EXPECT_EQ(3U, stateMachine->snapshotBaseIndex);
+}
+
+TEST_F(ServerStateMachineTest, loadSnapshot_parallel)
+{
+    stateMachine->snapshotIndexMinBytes = 1;
+    for (uint64_t i = 0; i < 10; ++i) {
+        std::string dir = Core::StringUtil::format("/%lu", i);
+        stateMachine->tree.makeDirectory(dir);
+        for (uint64_t j = 0; j < 10; ++j) {
+            stateMachine->tree.write(
+                Core::StringUtil::format("%s/%lu", dir.c_str(), j), dir);
+        }
+    }
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    // the index is written even without snapshotIncremental
+    EXPECT_TRUE(stateMachine->haveSnapshotBase);
+    consensus->readSnapshot();
+    ASSERT_TRUE(bool(consensus->snapshotReader));
+    Storage::SnapshotFile::Reader& reader = *consensus->snapshotReader;
+    const char* magic = reader.getRange(reader.getSizeBytes() - 8, 8);
+    ASSERT_TRUE(magic != NULL);
+    EXPECT_EQ("LCFOOTER", std::string(magic, 8));
+
+    stateMachine->tree.removeDirectory("/");
+    stateMachine->snapshotLoadThreads = 4;
+    stateMachine->loadSnapshot(std::move(consensus->snapshotReader));
+    std::vector<std::string> children;
+    stateMachine->tree.listDirectory("/", children);
+    EXPECT_EQ(10U, children.size());
+    std::string contents;
+    stateMachine->tree.read("/7/3", contents);
+    EXPECT_EQ("/7", contents);
+    stateMachine->tree.listDirectory("/9", children);
+    EXPECT_EQ(10U, children.size());
+}
+
+TEST_F(ServerStateMachineTest, loadSnapshot_lazily)
+{
+    stateMachine->snapshotIndexMinBytes = 1;
+    stateMachine->tree.makeDirectory("/a");
+    stateMachine->tree.makeDirectory("/b");
+    stateMachine->tree.write("/a/x", "ax");
+    stateMachine->tree.write("/b/y", "by");
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    stateMachine->tree.removeDirectory("/");
+    consensus->readSnapshot();
+    stateMachine->snapshotLoadLazily = true;
+    stateMachine->loadSnapshot(std::move(consensus->snapshotReader));
+    EXPECT_TRUE(stateMachine->tree.superRoot.isLazy());
+    std::string contents;
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/a/x", contents).status);
+    EXPECT_EQ("ax", contents);
+    Tree::Internal::Directory* root =
+        stateMachine->tree.superRoot.lookupDirectory("root");
+    EXPECT_TRUE(root->lookupDirectory("b")->isLazy());
+
+    // the next snapshot copies /b straight from the file
+    stateMachine->tree.write("/a/x", "changed");
+    Storage::Log::Entry entry;
+    entry.set_term(1);
+    entry.set_type(Protocol::Raft::EntryType::DATA);
+    entry.set_data("hello");
+    consensus->append({&entry});
+    consensus->commitIndex = consensus->log->getLastLogIndex();
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(2, lockGuard);
+    }
+    EXPECT_EQ(2U, consensus->lastSnapshotIndex);
+    EXPECT_TRUE(stateMachine->lazySnapshotSuperseded);
+    stateMachine->tree.removeDirectory("/");
+    consensus->discardUnneededEntries();
+    consensus->readSnapshot();
+    stateMachine->snapshotLoadLazily = false;
+    stateMachine->loadSnapshot(std::move(consensus->snapshotReader));
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/a/x", contents).status);
+    EXPECT_EQ("changed", contents);
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/b/y", contents).status);
+    EXPECT_EQ("by", contents);
+}
+
+TEST_F(ServerStateMachineTest, loadIncomingSnapshot)
+{
+    stateMachine->tree.makeDirectory("/a");
+    stateMachine->tree.write("/a/x", "ax");
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    consensus->readSnapshot();
+    Storage::SnapshotFile::Reader& reader = *consensus->snapshotReader;
+    Storage::SnapshotFile::StreamReader stream(~0UL);
+    stream.append(reader.getRange(0, reader.getSizeBytes()),
+                  reader.getSizeBytes());
+    stream.close();
+    stateMachine->loadIncomingSnapshot(stream);
+    ASSERT_TRUE(bool(stateMachine->incomingSnapshot));
+    StateMachine::IncomingSnapshot& incoming =
+        *stateMachine->incomingSnapshot;
+    EXPECT_EQ(1U, incoming.lastIncludedIndex);
+    EXPECT_TRUE(incoming.done);
+    EXPECT_TRUE(incoming.loaded);
+
+    stateMachine->tree.removeDirectory("/a");
+    stateMachine->tree.loadContents(incoming.tree);
+    std::string contents;
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/a/x", contents).status);
+    EXPECT_EQ("ax", contents);
+    EXPECT_EQ(Tree::Status::LOOKUP_ERROR,
+              incoming.tree.read("/a/x", contents).status);
+}
+
+TEST_F(ServerStateMachineTest, loadIncomingSnapshot_abandoned)
+{
+    for (uint64_t i = 0; i < 100; ++i)
+        stateMachine->tree.write(Core::StringUtil::format("/%lu", i),
+                                 std::string(100, 'x'));
+    {
+        std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+        stateMachine->takeSnapshot(1, lockGuard);
+    }
+    consensus->readSnapshot();
+    Storage::SnapshotFile::Reader& reader = *consensus->snapshotReader;
+    Storage::SnapshotFile::StreamReader stream(~0UL);
+    stream.append(reader.getRange(0, reader.getSizeBytes()),
+                  reader.getSizeBytes() / 2);
+    stream.abort();
+    stateMachine->loadIncomingSnapshot(stream);
+    ASSERT_TRUE(bool(stateMachine->incomingSnapshot));
+    EXPECT_EQ(1U, stateMachine->incomingSnapshot->lastIncludedIndex);
+    EXPECT_TRUE(stateMachine->incomingSnapshot->done);
+    EXPECT_FALSE(stateMachine->incomingSnapshot->loaded);
+
+    // not even a header
+    stateMachine->incomingSnapshot.reset();
+    Storage::SnapshotFile::StreamReader empty(~0UL);
+    empty.close();
+    Core::Debug::setLogPolicy({{"Server/StateMachine.cc", "ERROR"}});
+    stateMachine->loadIncomingSnapshot(empty);
+    EXPECT_FALSE(bool(stateMachine->incomingSnapshot));
+}
+
 } // namespace LogCabin::Server::<anonymous>
 } // namespace LogCabin::Server
 } // namespace LogCabin
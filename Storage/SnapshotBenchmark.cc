@@ -0,0 +1,298 @@
+/* Copyright (c) 2015 Diego Ongaro
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "build/Tree/Snapshot.pb.h"
+#include "Core/Config.h"
+#include "Core/Debug.h"
+#include "Core/StringUtil.h"
+#include "Core/ThreadId.h"
+#include "Core/Time.h"
+#include "Core/Util.h"
+#include "Storage/Layout.h"
+#include "Storage/SnapshotFile.h"
+#include "Tree/Tree.h"
+
+namespace {
+
+using namespace LogCabin;
+using Core::StringUtil::format;
+
+/**
+ * Parses argv for the main function.
+ */
+class OptionParser {
+  public:
+    OptionParser(int& argc, char**& argv)
+        : argc(argc)
+        , argv(argv)
+        , configFilename()
+        , files(1000000)
+        , fileSize(100)
+        , filesPerDirectory(1000)
+        , threads(1)
+    {
+        while (true) {
+            static struct option longOptions[] = {
+               {"config",  required_argument, NULL, 'c'},
+               {"dirsize",  required_argument, NULL, 'd'},
+               {"files",  required_argument, NULL, 'f'},
+               {"help",  no_argument, NULL, 'h'},
+               {"size",  required_argument, NULL, 's'},
+               {"threads",  required_argument, NULL, 't'},
+               {0, 0, 0, 0}
+            };
+            int c = getopt_long(argc, argv, "c:d:f:hs:t:", longOptions, NULL);
+
+            // Detect the end of the options.
+            if (c == -1)
+                break;
+
+            switch (c) {
+                case 'c':
+                    configFilename = optarg;
+                    break;
+                case 'd':
+                    filesPerDirectory = std::max(1UL, parseUInt(optarg));
+                    break;
+                case 'f':
+                    files = parseUInt(optarg);
+                    break;
+                case 'h':
+                    usage();
+                    exit(0);
+                case 's':
+                    fileSize = parseUInt(optarg);
+                    break;
+                case 't':
+                    threads = std::max(1UL, parseUInt(optarg));
+                    break;
+                case '?':
+                default:
+                    // getopt_long already printed an error message.
+                    usage();
+                    exit(1);
+            }
+        }
+
+        // We don't expect any additional command line arguments (not options).
+        if (optind != argc) {
+            usage();
+            exit(1);
+        }
+    }
+
+    uint64_t parseUInt(const char* s) {
+        char* end = NULL;
+        uint64_t value = strtoul(s, &end, 10);
+        if (*s == '\0' || *end != '\0') {
+            std::cerr << "Expected a non-negative integer, got '"
+                      << s << "'" << std::endl;
+            usage();
+            exit(1);
+        }
+        return value;
+    }
+
+    void usage() {
+        std::cout
+            << "Measures how quickly a Tree can be written to and read back "
+            << "from a snapshot"
+            << std::endl
+            << "file. The snapshot settings (snapshotWriteBufferBytes, etc) "
+            << "and storagePath"
+            << std::endl
+            << "are taken from the configuration file, if one is given; "
+            << "otherwise, defaults"
+            << std::endl
+            << "are used and the snapshot is written to a temporary "
+            << "directory."
+            << std::endl
+            << std::endl
+            << "This program is subject to change (it is not part of "
+            << "LogCabin's stable API)."
+            << std::endl
+            << std::endl
+
+            << "Usage: " << argv[0] << " [options]"
+            << std::endl
+            << std::endl
+
+            << "Options:"
+            << std::endl
+
+            << "  -c <file>, --config=<file>   "
+            << "Set the path to the configuration file"
+            << std::endl
+
+            << "  -d <num>, --dirsize=<num>    "
+            << "Number of files per directory [default: 1000]"
+            << std::endl
+
+            << "  -f <num>, --files=<num>      "
+            << "Number of files in the Tree [default: 1000000]"
+            << std::endl
+
+            << "  -h, --help                   "
+            << "Print this usage information"
+            << std::endl
+
+            << "  -s <bytes>, --size=<bytes>   "
+            << "Size of each file's contents [default: 100]"
+            << std::endl
+
+            << "  -t <num>, --threads=<num>    "
+            << "Number of threads to read with [default: 1]"
+            << std::endl;
+    }
+
+    int& argc;
+    char**& argv;
+    std::string configFilename;
+    uint64_t files;
+    uint64_t fileSize;
+    uint64_t filesPerDirectory;
+    uint64_t threads;
+};
+
+/**
+ * Return the number of seconds elapsed since 'start'.
+ */
+double
+secondsSince(Core::Time::SteadyClock::time_point start)
+{
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Core::Time::SteadyClock::now() - start).count()) / 1e9;
+}
+
+/**
+ * Print a line of results.
+ */
+void
+report(const char* what, uint64_t bytes, double seconds)
+{
+    std::cout << format("%s: %lu bytes in %.3f s (%.1f MB/s)",
+                        what,
+                        bytes,
+                        seconds,
+                        double(bytes) / 1e6 / seconds)
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int
+main(int argc, char** argv)
+{
+    using namespace LogCabin;
+
+    try {
+
+        Core::Util::Finally _(google::protobuf::ShutdownProtobufLibrary);
+        Core::ThreadId::setName("main");
+
+        // Parse command line args.
+        OptionParser options(argc, argv);
+
+        Core::Config config;
+        if (!options.configFilename.empty()) {
+            NOTICE("Using config file %s", options.configFilename.c_str());
+            config.readFile(options.configFilename.c_str());
+        }
+        Core::Debug::setLogPolicy(
+            Core::Debug::logPolicyFromString(
+                config.read<std::string>("logPolicy", "NOTICE")));
+
+        Storage::Layout storageLayout;
+        if (config.keyExists("storagePath"))
+            storageLayout.init(config, config.read<uint64_t>("serverId", 1));
+        else
+            storageLayout.initTemporary();
+
+        NOTICE("Building Tree with %lu files of %lu bytes each",
+               options.files, options.fileSize);
+        Tree::Tree tree;
+        {
+            std::string contents(options.fileSize, 'x');
+            for (uint64_t i = 0; i < options.files; ++i) {
+                std::string dir = format("/%lu",
+                                         i / options.filesPerDirectory);
+                if (i % options.filesPerDirectory == 0)
+                    tree.makeDirectory(dir);
+                tree.write(format("%s/%lu", dir.c_str(), i), contents);
+            }
+        }
+
+        uint64_t bytes = 0;
+        Tree::Snapshot::Index index;
+        bool indexed = false;
+        {
+            NOTICE("Writing snapshot to %s",
+                   storageLayout.snapshotDir.path.c_str());
+            Core::Time::SteadyClock::time_point start =
+                Core::Time::SteadyClock::now();
+            Storage::SnapshotFile::Writer writer(storageLayout, config);
+            // Record where the directories are, as the servers do, unless
+            // the offsets would be meaningless.
+            indexed = !writer.isCompressed();
+            if (indexed)
+                tree.dumpSnapshot(writer, NULL, 64 * 1024, index);
+            else
+                tree.dumpSnapshot(writer);
+            writer.flushToOS();
+            double flushed = secondsSince(start);
+            bytes = writer.save();
+            double saved = secondsSince(start);
+            report("Write (to OS)", bytes, flushed);
+            report("Write (incl. fsync)", bytes, saved);
+        }
+
+        {
+            Core::Time::SteadyClock::time_point start =
+                Core::Time::SteadyClock::now();
+            Storage::SnapshotFile::Reader reader(storageLayout);
+            Tree::Tree loaded;
+            if (indexed && options.threads > 1) {
+                Tree::SnapshotBase layout;
+                layout.length = reader.getSizeBytes();
+                layout.data = reader.getRange(0, layout.length);
+                for (auto it = index.subtree().begin();
+                     it != index.subtree().end();
+                     ++it) {
+                    layout.subtrees[it->path()] = {it->offset(),
+                                                   it->length()};
+                }
+                loaded.loadSnapshot(layout, 0, options.threads);
+            } else {
+                loaded.loadSnapshot(reader);
+            }
+            report("Read", bytes, secondsSince(start));
+        }
+
+        return 0;
+
+    } catch (const Core::Config::Exception& e) {
+        ERROR("Fatal exception from config file: %s",
+              e.what());
+        return 1;
+    }
+}
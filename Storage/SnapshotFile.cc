@@ -20,7 +20,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
 #include "Core/Debug.h"
+#include "Core/LZ4.h"
 #include "Core/StringUtil.h"
 #include "Core/Time.h"
 #include "Core/Util.h"
@@ -34,6 +39,44 @@ namespace SnapshotFile {
 namespace FilesystemUtil = Storage::FilesystemUtil;
 using Core::StringUtil::format;
 
+const char COMPRESSED_MAGIC[8] = {'\0', 'L', 'C', 'S', 'N', 'A', 'P', 'Z'};
+
+namespace {
+
+/**
+ * Set in the stored-length field of a compressed file's block header if the
+ * block's contents are stored without compression.
+ */
+const uint32_t BLOCK_STORED_RAW = 1U << 31;
+
+/**
+ * The largest uncompressed block that a compressed file may hold. Writers
+ * make blocks no larger than their buffers, which are capped at this size,
+ * so a reader treats a longer block length as corruption rather than trying
+ * to allocate it.
+ */
+const uint64_t MAX_BLOCK_BYTES = 64 * 1024 * 1024;
+
+/**
+ * Return true if new snapshot files should be compressed, according to the
+ * snapshotCompression setting.
+ */
+bool
+shouldCompress(const Core::Config& config, bool allowCompression)
+{
+    std::string codec = config.read<std::string>("snapshotCompression",
+                                                 "none");
+    if (codec == "none")
+        return false;
+    if (codec != "lz4") {
+        PANIC("Unknown snapshotCompression setting '%s' (expected 'none' or "
+              "'lz4')", codec.c_str());
+    }
+    return allowCompression;
+}
+
+} // anonymous namespace
+
 void
 discardPartialSnapshots(const Storage::Layout& layout)
 {
@@ -53,6 +96,10 @@ Reader::Reader(const Storage::Layout& storageLayout)
     : file()
     , contents()
     , bytesRead(0)
+    , compressed(false)
+    , nextBlockOffset(0)
+    , block()
+    , blockBytesRead(0)
 {
     file = FilesystemUtil::tryOpenFile(storageLayout.snapshotDir,
                                        "snapshot",
@@ -63,6 +110,12 @@ Reader::Reader(const Storage::Layout& storageLayout)
                 storageLayout.snapshotDir.path.c_str()));
     }
     contents.reset(new FilesystemUtil::FileContents(file));
+    char magic[sizeof(COMPRESSED_MAGIC)];
+    if (contents->copyPartial(0, magic, sizeof(magic)) == sizeof(magic) &&
+        memcmp(magic, COMPRESSED_MAGIC, sizeof(magic)) == 0) {
+        compressed = true;
+        nextBlockOffset = sizeof(magic);
+    }
 }
 
 Reader::~Reader()
@@ -75,6 +128,22 @@ Reader::getSizeBytes()
     return contents->getFileLength();
 }
 
+bool
+Reader::isCompressed() const
+{
+    return compressed;
+}
+
+const char*
+Reader::getRange(uint64_t offset, uint64_t length)
+{
+    uint64_t fileLength = getSizeBytes();
+    if (compressed || offset > fileLength || length > fileLength - offset)
+        return NULL;
+    if (length == 0)
+        return "";
+    return contents->get<char>(offset, length);
+}
 
 uint64_t
 Reader::getBytesRead() const
@@ -97,17 +166,39 @@ Reader::readMessage(google::protobuf::Message& message)
                       getSizeBytes());
     }
     length = be32toh(length);
-    if (getSizeBytes() - bytesRead < length) {
-        return format("ProtoBuf is %u bytes long but there are only %lu "
-                      "bytes remaining in file %s (at offset %lu)",
-                      length,
-                      getSizeBytes() - bytesRead,
-                      file.path.c_str(),
-                      bytesRead);
+    const void* data = NULL;
+    std::unique_ptr<char[]> copy;
+    if (!compressed) {
+        if (getSizeBytes() - bytesRead < length) {
+            return format("ProtoBuf is %u bytes long but there are only %lu "
+                          "bytes remaining in file %s (at offset %lu)",
+                          length,
+                          getSizeBytes() - bytesRead,
+                          file.path.c_str(),
+                          bytesRead);
+        }
+        data = contents->get(bytesRead, length);
+    } else if (block.size() - blockBytesRead >= length) {
+        // Common case: the message is within the current block.
+        data = &block[blockBytesRead];
+        blockBytesRead += length;
+    } else {
+        copy.reset(new char[length]);
+        uint64_t before = bytesRead;
+        r = readRaw(copy.get(), length);
+        bytesRead = before;
+        if (r < length) {
+            return format("ProtoBuf is %u bytes long but there are only %lu "
+                          "bytes remaining in compressed file %s (at "
+                          "uncompressed offset %lu)",
+                          length,
+                          r,
+                          file.path.c_str(),
+                          bytesRead);
+        }
+        data = copy.get();
     }
-    const Core::Buffer buf(const_cast<void*>(contents->get(bytesRead, length)),
-                           length,
-                           NULL);
+    const Core::Buffer buf(const_cast<void*>(data), length, NULL);
     std::string error;
     if (!Core::ProtoBuf::parse(buf, message)) {
         error = format("Could not parse ProtoBuf at bytes %lu-%lu (inclusive) "
@@ -118,20 +209,188 @@ Reader::readMessage(google::protobuf::Message& message)
                        getSizeBytes());
     }
     bytesRead += length;
+    if (!compressed)
+        logProgress(bytesRead - length);
+    return error;
+}
+
+uint64_t
+Reader::readRaw(void* data, uint64_t length)
+{
+    if (!compressed) {
+        uint64_t r = contents->copyPartial(bytesRead, data, length);
+        bytesRead += r;
+        return r;
+    }
+    char* out = static_cast<char*>(data);
+    uint64_t r = 0;
+    while (r < length) {
+        if (blockBytesRead == block.size() && !loadBlock())
+            break;
+        uint64_t chunk = std::min(length - r, block.size() - blockBytesRead);
+        memcpy(out + r, &block[blockBytesRead], chunk);
+        blockBytesRead += chunk;
+        r += chunk;
+    }
+    bytesRead += r;
+    return r;
+}
+
+bool
+Reader::loadBlock()
+{
+    uint64_t fileLength = getSizeBytes();
+    uint32_t header[2];
+    if (fileLength - nextBlockOffset < sizeof(header))
+        return false;
+    contents->copy(nextBlockOffset, header, sizeof(header));
+    uint32_t length = be32toh(header[0]);
+    uint32_t storedLength = be32toh(header[1]) & ~BLOCK_STORED_RAW;
+    bool raw = (be32toh(header[1]) & BLOCK_STORED_RAW) != 0;
+    if (fileLength - nextBlockOffset - sizeof(header) < storedLength)
+        return false;
+    if (length > MAX_BLOCK_BYTES) {
+        PANIC("Corrupt block at offset %lu in snapshot %s: %u-byte "
+              "uncompressed length exceeds the %lu-byte maximum",
+              nextBlockOffset, file.path.c_str(), length, MAX_BLOCK_BYTES);
+    }
+    const void* stored = contents->get(nextBlockOffset + sizeof(header),
+                                       storedLength);
+    block.resize(length);
+    blockBytesRead = 0;
+    if (raw) {
+        if (storedLength != length) {
+            PANIC("Corrupt block at offset %lu in snapshot %s: %u bytes "
+                  "stored for %u-byte uncompressed block",
+                  nextBlockOffset, file.path.c_str(), storedLength, length);
+        }
+        memcpy(block.data(), stored, length);
+    } else if (!Core::LZ4::decompress(stored, storedLength,
+                                      block.data(), length)) {
+        PANIC("Corrupt compressed block at offset %lu in snapshot %s",
+              nextBlockOffset, file.path.c_str());
+    }
+    uint64_t before = nextBlockOffset;
+    nextBlockOffset += sizeof(header) + storedLength;
+    logProgress(before);
+    return true;
+}
+
+void
+Reader::logProgress(uint64_t before)
+{
+    uint64_t after = compressed ? nextBlockOffset : bytesRead;
     if (getSizeBytes() > 1024 && // minimum to keep quiet during unit tests
-        10 * bytesRead / getSizeBytes() !=
-        10 * (bytesRead - length) / getSizeBytes()) {
+        10 * after / getSizeBytes() != 10 * before / getSizeBytes()) {
         NOTICE("Read %lu%% of snapshot",
-               100 * bytesRead / getSizeBytes());
+               100 * after / getSizeBytes());
     }
-    return error;
+}
+
+StreamReader::StreamReader(uint64_t maxBufferedBytes)
+    : maxBufferedBytes(maxBufferedBytes)
+    , mutex()
+    , changed()
+    , buffer()
+    , bufferOffset(0)
+    , bytesRead(0)
+    , closed(false)
+    , aborted(false)
+{
+}
+
+StreamReader::~StreamReader()
+{
+}
+
+bool
+StreamReader::append(const void* data, uint64_t length)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    if (buffer.size() - bufferOffset + length > maxBufferedBytes)
+        return false;
+    const char* bytes = static_cast<const char*>(data);
+    buffer.insert(buffer.end(), bytes, bytes + length);
+    changed.notify_all();
+    return true;
+}
+
+void
+StreamReader::close()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    closed = true;
+    changed.notify_all();
+}
+
+void
+StreamReader::abort()
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    aborted = true;
+    changed.notify_all();
 }
 
 uint64_t
-Reader::readRaw(void* data, uint64_t length)
+StreamReader::getBytesRead() const
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    return bytesRead;
+}
+
+std::string
+StreamReader::readMessage(google::protobuf::Message& message)
 {
-    uint64_t r = contents->copyPartial(bytesRead, data, length);
+    uint32_t length = 0;
+    uint64_t r = readRaw(&length, sizeof(length));
+    if (r < sizeof(length)) {
+        return format("Could only read %lu bytes of %lu-byte length field in "
+                      "received snapshot (at offset %lu)",
+                      r,
+                      sizeof(length),
+                      getBytesRead() - r);
+    }
+    length = be32toh(length);
+    std::string bytes(length, '\0');
+    r = readRaw(&bytes[0], length);
+    uint64_t offset = getBytesRead() - r;
+    if (r < length) {
+        return format("ProtoBuf is %u bytes long but the received snapshot "
+                      "ended after %lu more bytes (at offset %lu)",
+                      length,
+                      r,
+                      offset);
+    }
+    const Core::Buffer buf(&bytes[0], length, NULL);
+    if (!Core::ProtoBuf::parse(buf, message)) {
+        return format("Could not parse ProtoBuf at bytes %lu-%lu (inclusive) "
+                      "in received snapshot",
+                      offset,
+                      offset + length - 1);
+    }
+    return "";
+}
+
+uint64_t
+StreamReader::readRaw(void* data, uint64_t length)
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    while (buffer.size() - bufferOffset < length && !closed) {
+        if (aborted)
+            throw Core::Util::ThreadInterruptedException();
+        changed.wait(lockGuard);
+    }
+    uint64_t r = std::min(length, buffer.size() - bufferOffset);
+    memcpy(data, buffer.data() + bufferOffset, r);
+    bufferOffset += r;
     bytesRead += r;
+    // Drop the bytes already read once they make up half the buffer, so that
+    // each byte is shifted at most once on average.
+    if (bufferOffset >= buffer.size() / 2) {
+        buffer.erase(buffer.begin(),
+                     buffer.begin() + static_cast<int64_t>(bufferOffset));
+        bufferOffset = 0;
+    }
     return r;
 }
 
@@ -160,19 +419,58 @@ Writer::SharedMMap<T>::~SharedMMap()
     }
 }
 
-Writer::Writer(const Storage::Layout& storageLayout)
-    : parentDir(FilesystemUtil::dup(storageLayout.snapshotDir))
+const uint64_t Writer::BLOCK_SIZE;
+
+Writer::Writer(const Storage::Layout& storageLayout,
+               const Core::Config& config,
+               bool allowCompression)
+    : bufferSize(std::min(
+          MAX_BLOCK_BYTES,
+          std::max(BLOCK_SIZE,
+                   (config.read<uint64_t>("snapshotWriteBufferBytes",
+                                          1024 * 1024) +
+                    BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)))
+    , directIO(config.read<bool>("snapshotDirectIO", false))
+    , compressed(shouldCompress(config, allowCompression))
+    , syncRangeBytes(config.read<uint64_t>("snapshotSyncRangeBytes",
+                                           8 * 1024 * 1024))
+    , buffer(NULL, free)
+    , bufferedBytes(0)
+    , compressedBlock()
+    , fileOffset(0)
+    , syncStartOffset(0)
+    , syncDoneOffset(0)
+    , parentDir(FilesystemUtil::dup(storageLayout.snapshotDir))
     , stagingName()
     , file()
+    , background(false)
+    , limiter()
     , bytesWritten(0)
     , sharedBytesWritten()
+    , sharedNanosThrottled()
 {
+    void* addr = NULL;
+    int r = posix_memalign(&addr, BLOCK_SIZE, bufferSize);
+    if (r != 0) {
+        PANIC("Could not allocate %lu-byte snapshot buffer: %s",
+              bufferSize, strerror(r));
+    }
+    buffer.reset(static_cast<char*>(addr));
     struct timespec now =
         Core::Time::makeTimeSpec(Core::Time::SystemClock::now());
     stagingName = format("partial.%010lu.%06lu",
                          now.tv_sec, now.tv_nsec / 1000);
+    // Opened for reading too, for seekToEnd() on compressed files.
     file = FilesystemUtil::openFile(parentDir, stagingName,
-                                    O_WRONLY|O_CREAT|O_EXCL);
+                                    O_RDWR|O_CREAT|O_EXCL);
+    if (compressed) {
+        // Compressed blocks are not aligned, so they can't use O_DIRECT.
+        directIO = false;
+        compressedBlock.reset(new char[2 * sizeof(uint32_t) +
+                                       Core::LZ4::maxCompressedLength(
+                                           bufferSize)]);
+        writeToFile(COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC));
+    }
 }
 
 Writer::~Writer()
@@ -188,6 +486,7 @@ Writer::discard()
 {
     if (file.fd < 0)
         PANIC("File already closed");
+    bufferedBytes = 0;
     FilesystemUtil::removeFile(parentDir, stagingName);
     file.close();
 }
@@ -195,16 +494,39 @@ Writer::discard()
 void
 Writer::flushToOS()
 {
-    // Nothing to do.
+    flushBuffer(true);
 }
 
 void
 Writer::seekToEnd()
 {
+    if (bufferedBytes > 0) {
+        PANIC("Seeking with %lu bytes buffered, which would be written after "
+              "the data of other processes (call flushToOS() first)",
+              bufferedBytes);
+    }
     off64_t r = lseek64(file.fd, 0, SEEK_END);
     if (r < 0)
         PANIC("lseek failed: %s", strerror(errno));
-    bytesWritten = Core::Util::downCast<uint64_t>(r);
+    fileOffset = Core::Util::downCast<uint64_t>(r);
+    if (!compressed) {
+        bytesWritten = fileOffset;
+        return;
+    }
+    // Add up the uncompressed lengths of the blocks.
+    bytesWritten = 0;
+    uint64_t offset = sizeof(COMPRESSED_MAGIC);
+    while (offset < fileOffset) {
+        uint32_t header[2];
+        ssize_t n = pread(file.fd, header, sizeof(header), off_t(offset));
+        if (n != ssize_t(sizeof(header))) {
+            PANIC("Could not read block header at offset %lu of %s: %s",
+                  offset, file.path.c_str(),
+                  n < 0 ? strerror(errno) : "file too short");
+        }
+        bytesWritten += be32toh(header[0]);
+        offset += sizeof(header) + (be32toh(header[1]) & ~BLOCK_STORED_RAW);
+    }
 }
 
 uint64_t
@@ -212,8 +534,10 @@ Writer::save()
 {
     if (file.fd < 0)
         PANIC("File already closed");
+    flushBuffer(true);
     FilesystemUtil::fsync(file);
     uint64_t fileSize = FilesystemUtil::getSize(file);
+    dropFromCache(0, fileSize);
     file.close();
     FilesystemUtil::rename(parentDir, stagingName,
                            parentDir, "snapshot");
@@ -221,6 +545,23 @@ Writer::save()
     return fileSize;
 }
 
+void
+Writer::setBackground(uint64_t bytesPerSecond)
+{
+    background = true;
+    // Allow about 100ms worth of writes at once, in whole blocks so that
+    // direct I/O still lines up.
+    uint64_t burst = std::max(BLOCK_SIZE,
+                              bytesPerSecond / 10 / BLOCK_SIZE * BLOCK_SIZE);
+    limiter.reset(new Core::RateLimiter(bytesPerSecond, burst));
+}
+
+bool
+Writer::isCompressed() const
+{
+    return compressed;
+}
+
 uint64_t
 Writer::getBytesWritten() const
 {
@@ -230,33 +571,187 @@ Writer::getBytesWritten() const
 void
 Writer::writeMessage(const google::protobuf::Message& message)
 {
-    Core::Buffer buf;
-    Core::ProtoBuf::serialize(message, buf);
-    uint32_t beSize = htobe32(uint32_t(buf.getLength()));
-    ssize_t r = FilesystemUtil::write(file.fd, {
-                                          {&beSize, sizeof(beSize)},
-                                          {buf.getData(), buf.getLength()},
-                                      });
-    if (r < 0) {
-        PANIC("Could not write ProtoBuf into %s: %s",
-              file.path.c_str(),
-              strerror(errno));
+    uint32_t length = uint32_t(message.ByteSize());
+    uint32_t beSize = htobe32(length);
+    if (sizeof(beSize) + length <= bufferSize - bufferedBytes &&
+        message.IsInitialized()) {
+        // Common case: serialize straight into the buffer, avoiding an
+        // allocation and a copy.
+        char* out = buffer.get() + bufferedBytes;
+        memcpy(out, &beSize, sizeof(beSize));
+        message.SerializeWithCachedSizesToArray(
+            reinterpret_cast<uint8_t*>(out + sizeof(beSize)));
+        bufferedBytes += sizeof(beSize) + length;
+        bytesWritten += sizeof(beSize) + length;
+        *sharedBytesWritten.value += sizeof(beSize) + length;
+        if (bufferedBytes == bufferSize)
+            flushBuffer(false);
+        return;
     }
-    bytesWritten += Core::Util::downCast<uint64_t>(r);
-    *sharedBytesWritten.value += Core::Util::downCast<uint64_t>(r);
+    Core::Buffer buf;
+    Core::ProtoBuf::serialize(message, buf, sizeof(beSize));
+    memcpy(buf.getData(), &beSize, sizeof(beSize));
+    writeRaw(buf.getData(), buf.getLength());
 }
 
 void
 Writer::writeRaw(const void* data, uint64_t length)
 {
-    ssize_t r = FilesystemUtil::write(file.fd, data, length);
-    if (r < 0) {
-        PANIC("Could not write ProtoBuf into %s: %s",
-              file.path.c_str(),
-              strerror(errno));
+    const char* next = static_cast<const char*>(data);
+    while (length > 0) {
+        uint64_t chunk = std::min(length, bufferSize - bufferedBytes);
+        memcpy(buffer.get() + bufferedBytes, next, chunk);
+        next += chunk;
+        length -= chunk;
+        bufferedBytes += chunk;
+        bytesWritten += chunk;
+        *sharedBytesWritten.value += chunk;
+        if (bufferedBytes == bufferSize)
+            flushBuffer(false);
+    }
+}
+
+void
+Writer::flushBuffer(bool all)
+{
+    if (bufferedBytes == 0)
+        return;
+    if (compressed) {
+        // Every flush makes one block, which is at most bufferSize bytes.
+        uint32_t* header = reinterpret_cast<uint32_t*>(compressedBlock.get());
+        char* stored = compressedBlock.get() + 2 * sizeof(uint32_t);
+        uint64_t storedLength = Core::LZ4::compress(buffer.get(), bufferedBytes,
+                                                    stored);
+        uint32_t flags = 0;
+        if (storedLength >= bufferedBytes) {
+            memcpy(stored, buffer.get(), bufferedBytes);
+            storedLength = bufferedBytes;
+            flags = BLOCK_STORED_RAW;
+        }
+        header[0] = htobe32(uint32_t(bufferedBytes));
+        header[1] = htobe32(uint32_t(storedLength) | flags);
+        writeToFile(compressedBlock.get(),
+                    2 * sizeof(uint32_t) + storedLength);
+        bufferedBytes = 0;
+        return;
+    }
+    uint64_t offset = fileOffset;
+    uint64_t length = bufferedBytes;
+    if (directIO) {
+        // Hold back the partial block at the end so that the next write
+        // starts on a block boundary.
+        if (!all)
+            length -= (offset + length) % BLOCK_SIZE;
+        bool direct = (offset % BLOCK_SIZE == 0 &&
+                       length % BLOCK_SIZE == 0);
+        setDirectIO(direct);
+    }
+    writeToFile(buffer.get(), length);
+    bufferedBytes -= length;
+    memmove(buffer.get(), buffer.get() + length, bufferedBytes);
+}
+
+void
+Writer::dropFromCache(uint64_t offset, uint64_t length)
+{
+    if (!background || length == 0)
+        return;
+    int r = posix_fadvise(file.fd, off_t(offset), off_t(length),
+                          POSIX_FADV_DONTNEED);
+    if (r != 0) {
+        WARNING("posix_fadvise failed on %s: %s",
+                file.path.c_str(), strerror(r));
+    }
+}
+
+void
+Writer::writeToFile(const void* data, uint64_t length)
+{
+    const char* next = static_cast<const char*>(data);
+    while (length > 0) {
+        uint64_t chunk = length;
+        if (limiter && limiter->isLimited()) {
+            // Write in pieces of about 100ms each so that the watchdog sees
+            // steady progress. These are whole blocks (except perhaps the
+            // last), so direct I/O is unaffected.
+            chunk = std::min(length, std::max(BLOCK_SIZE,
+                                              limiter->unitsPerSecond / 10 /
+                                              BLOCK_SIZE * BLOCK_SIZE));
+            uint64_t before = uint64_t(limiter->getThrottledTime().count());
+            limiter->acquire(chunk);
+            *sharedNanosThrottled.value +=
+                uint64_t(limiter->getThrottledTime().count()) - before;
+        }
+        ssize_t r = FilesystemUtil::write(file.fd, next, chunk);
+        if (r < 0) {
+            PANIC("Could not write snapshot data into %s: %s",
+                  file.path.c_str(),
+                  strerror(errno));
+        }
+        next += chunk;
+        length -= chunk;
+        fileOffset += chunk;
+        syncRange();
+    }
+}
+
+bool
+Writer::setDirectIO(bool enable)
+{
+    int flags = fcntl(file.fd, F_GETFL);
+    if (flags < 0)
+        PANIC("fcntl(F_GETFL) failed: %s", strerror(errno));
+    if (bool(flags & O_DIRECT) == enable)
+        return true;
+    flags = enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (fcntl(file.fd, F_SETFL, flags) < 0) {
+        if (enable && errno == EINVAL) {
+            WARNING("The filesystem holding %s does not support O_DIRECT; "
+                    "writing the snapshot through the page cache instead",
+                    file.path.c_str());
+            directIO = false;
+            return false;
+        }
+        PANIC("fcntl(F_SETFL) failed: %s", strerror(errno));
+    }
+    return true;
+}
+
+void
+Writer::syncRange()
+{
+    if (syncRangeBytes == 0)
+        return;
+    uint64_t offset = fileOffset;
+    if (offset - syncStartOffset < syncRangeBytes)
+        return;
+    // Wait for the writeback started last time. This bounds the amount of
+    // dirty data in the page cache to about two intervals' worth.
+    if (syncStartOffset > syncDoneOffset) {
+        if (sync_file_range(file.fd,
+                            off64_t(syncDoneOffset),
+                            off64_t(syncStartOffset - syncDoneOffset),
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                            SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+            WARNING("sync_file_range failed on %s (disabling it): %s",
+                    file.path.c_str(), strerror(errno));
+            syncRangeBytes = 0;
+            return;
+        }
+        dropFromCache(syncDoneOffset, syncStartOffset - syncDoneOffset);
+        syncDoneOffset = syncStartOffset;
+    }
+    if (sync_file_range(file.fd,
+                        off64_t(syncStartOffset),
+                        off64_t(offset - syncStartOffset),
+                        SYNC_FILE_RANGE_WRITE) != 0) {
+        WARNING("sync_file_range failed on %s (disabling it): %s",
+                file.path.c_str(), strerror(errno));
+        syncRangeBytes = 0;
+        return;
     }
-    bytesWritten += Core::Util::downCast<uint64_t>(r);
-    *sharedBytesWritten.value += Core::Util::downCast<uint64_t>(r);
+    syncStartOffset = offset;
 }
 
 } // namespace LogCabin::Storage::SnapshotFile
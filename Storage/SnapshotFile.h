@@ -18,9 +18,14 @@
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "Core/CompatAtomic.h"
+#include "Core/ConditionVariable.h"
+#include "Core/Config.h"
+#include "Core/Mutex.h"
 #include "Core/ProtoBuf.h"
+#include "Core/RateLimiter.h"
 #include "Storage/FilesystemUtil.h"
 
 #ifndef LOGCABIN_STORAGE_SNAPSHOTFILE_H
@@ -39,8 +44,23 @@ namespace SnapshotFile {
  */
 void discardPartialSnapshots(const Storage::Layout& storageLayout);
 
+/**
+ * Snapshot files come in two formats:
+ *  - Uncompressed files contain the snapshot bytes as-is. Their first byte is
+ *    always 1 (the format version written by Server/RaftConsensus).
+ *  - Compressed files start with these 8 bytes, followed by a sequence of
+ *    blocks. Each block has a 4-byte big-endian length of its uncompressed
+ *    contents, a 4-byte big-endian length of its stored contents (with the
+ *    high bit set if the contents are stored uncompressed because they did
+ *    not compress), and the stored contents, an LZ4 block (see Core/LZ4.h).
+ * Readers detect the format automatically; writers use the format given by
+ * the snapshotCompression setting.
+ */
+extern const char COMPRESSED_MAGIC[8];
+
 /**
  * Assists in reading snapshot files from the local filesystem.
+ * Compressed snapshot files are decompressed transparently, a block at a time.
  */
 class Reader : public Core::ProtoBuf::InputStream {
   public:
@@ -55,25 +75,154 @@ class Reader : public Core::ProtoBuf::InputStream {
     explicit Reader(const Storage::Layout& storageLayout);
     /// Destructor.
     ~Reader();
-    /// Return the size in bytes for the file.
+    /// Return the size in bytes for the file (compressed, if it is).
     uint64_t getSizeBytes();
-    // See Core::ProtoBuf::InputStream.
+    /// Return true if the file is in the compressed format.
+    bool isCompressed() const;
+    /**
+     * Return a pointer to part of an uncompressed file, without affecting
+     * getBytesRead(). The bytes remain valid until the Reader is destroyed.
+     * \param offset
+     *      The offset in the file of the first byte.
+     * \param length
+     *      The number of bytes needed.
+     * \return
+     *      A pointer to the bytes, or NULL if the file is compressed or the
+     *      range extends past the end of the file.
+     */
+    const char* getRange(uint64_t offset, uint64_t length);
+    // See Core::ProtoBuf::InputStream. For compressed files, this counts
+    // uncompressed bytes.
     uint64_t getBytesRead() const;
     // See Core::ProtoBuf::InputStream.
     std::string readMessage(google::protobuf::Message& message);
     // See Core::ProtoBuf::InputStream.
     uint64_t readRaw(void* data, uint64_t length);
   private:
+    /**
+     * Decompress the next block of a compressed file into 'block'. PANICs if
+     * the block is corrupt.
+     * \return
+     *      False if there are no more complete blocks in the file.
+     */
+    bool loadBlock();
+    /**
+     * Log a message when reading crosses each 10% of the file.
+     * \param before
+     *      The offset in the file before the most recent read.
+     */
+    void logProgress(uint64_t before);
+
     /// Wraps the raw file descriptor; in charge of closing it when done.
     Storage::FilesystemUtil::File file;
     /// Maps the file into memory for reading.
     std::unique_ptr<Storage::FilesystemUtil::FileContents> contents;
-    /// The number of bytes read from the file.
+    /// The number of (uncompressed) bytes read from the file.
     uint64_t bytesRead;
+    /// True if the file is in the compressed format.
+    bool compressed;
+    /// For compressed files, the offset in the file of the next block.
+    uint64_t nextBlockOffset;
+    /// For compressed files, the uncompressed contents of the current block.
+    std::vector<char> block;
+    /// For compressed files, the number of bytes of 'block' already read.
+    uint64_t blockBytesRead;
+};
+
+/**
+ * Reads an uncompressed snapshot while it is still being received, so that it
+ * can be parsed concurrently with the transfer. One thread appends the bytes
+ * as they arrive, and another reads them through the InputStream interface,
+ * blocking until enough bytes have been appended. Bytes are discarded once
+ * they have been read, and the number of bytes waiting to be read is capped
+ * so that a slow reader can't exhaust memory.
+ *
+ * This class is thread-safe.
+ */
+class StreamReader : public Core::ProtoBuf::InputStream {
+  public:
+    /**
+     * Constructor.
+     * \param maxBufferedBytes
+     *      The most bytes that may be appended but not yet read at once (see
+     *      snapshotStreamBufferBytes in sample.conf).
+     */
+    explicit StreamReader(uint64_t maxBufferedBytes);
+    /// Destructor.
+    ~StreamReader();
+    /**
+     * Make more bytes available to the reader. This never blocks.
+     * \return
+     *      True if the bytes were appended; false if that would have left
+     *      more than maxBufferedBytes unread, in which case nothing was
+     *      appended. The caller should then abort() the stream.
+     */
+    bool append(const void* data, uint64_t length);
+    /**
+     * Indicate that all the bytes have been appended. Reads past the end
+     * will then return short counts (or errors) rather than block.
+     */
+    void close();
+    /**
+     * Indicate that the transfer was abandoned. Reads that can't be
+     * satisfied by the bytes already appended will then throw
+     * Core::Util::ThreadInterruptedException rather than block.
+     */
+    void abort();
+    // See Core::ProtoBuf::InputStream.
+    uint64_t getBytesRead() const;
+    // See Core::ProtoBuf::InputStream.
+    std::string readMessage(google::protobuf::Message& message);
+    // See Core::ProtoBuf::InputStream. Blocks until 'length' bytes are
+    // available or the stream is closed.
+    uint64_t readRaw(void* data, uint64_t length);
+
+  private:
+    /**
+     * See constructor.
+     */
+    const uint64_t maxBufferedBytes;
+    /**
+     * Protects all of the following members.
+     */
+    mutable Core::Mutex mutex;
+    /**
+     * Notified when bytes are appended or the stream is closed or aborted.
+     */
+    Core::ConditionVariable changed;
+    /**
+     * Bytes appended but not yet read, starting at 'bufferOffset'.
+     */
+    std::vector<char> buffer;
+    /**
+     * The number of bytes at the start of 'buffer' that have already been
+     * read. These are dropped in batches to avoid shifting the buffer on
+     * every read.
+     */
+    uint64_t bufferOffset;
+    /**
+     * The number of bytes read so far.
+     */
+    uint64_t bytesRead;
+    /**
+     * Set by close().
+     */
+    bool closed;
+    /**
+     * Set by abort().
+     */
+    bool aborted;
 };
 
 /**
  * Assists in writing snapshot files to the local filesystem.
+ *
+ * Snapshots are made of many small messages (one per directory and per file
+ * in the Tree), so the Writer collects them into a large, page-aligned buffer
+ * and writes them out a block at a time. Optionally, full blocks bypass the
+ * page cache (O_DIRECT), and writeback of the file is started periodically
+ * (sync_file_range) so that dirty pages don't pile up and stall the final
+ * fsync or other writers on the same disk.
  */
 class Writer : public Core::ProtoBuf::OutputStream {
   public:
@@ -96,9 +245,18 @@ class Writer : public Core::ProtoBuf::OutputStream {
      * \param storageLayout
      *      The directories in which to create the snapshot (in a file called
      *      "snapshot" in the snapshotDir).
+     * \param config
+     *      Settings for snapshotWriteBufferBytes, snapshotDirectIO,
+     *      snapshotSyncRangeBytes, and snapshotCompression (see sample.conf).
+     * \param allowCompression
+     *      If false, write the bytes given as-is, regardless of
+     *      snapshotCompression. This is used when the bytes are already in
+     *      their final format, such as a snapshot copied from another server.
      * TODO(ongaro): what if it can't be written?
      */
-    explicit Writer(const Storage::Layout& storageLayout);
+    explicit Writer(const Storage::Layout& storageLayout,
+                    const Core::Config& config = Core::Config(),
+                    bool allowCompression = true);
     /**
      * Destructor.
      * If the file hasn't been explicitly saved or discarded, prints a warning
@@ -111,7 +269,8 @@ class Writer : public Core::ProtoBuf::OutputStream {
      */
     void discard();
     /**
-     * Flush changes just down to the operating system's buffer cache.
+     * Flush changes just down to the operating system's buffer cache
+     * (including any bytes still held in this object's buffer).
      * Leave the file open for additional writes.
      *
      * This is useful when forking child processes to write to the file.
@@ -130,7 +289,8 @@ class Writer : public Core::ProtoBuf::OutputStream {
     /**
      * Seek to the end of the file, in case another process has written to it.
      * Subsequent calls to getBytesWritten() will include data written by other
-     * processes.
+     * processes. PANICs if this object's buffer is not empty (flushToOS()
+     * should have been called before forking).
      */
     void seekToEnd();
     /**
@@ -140,7 +300,19 @@ class Writer : public Core::ProtoBuf::OutputStream {
      *      Size in bytes of the file
      */
     uint64_t save();
-    // See Core::ProtoBuf::OutputStream.
+    /**
+     * Have this writer yield to other I/O on the same disk: writes to the
+     * file are limited to an average of 'bytesPerSecond' (0 for no limit),
+     * with the calling thread sleeping as needed, and the file's pages are
+     * dropped from the page cache once they've been written back, so that
+     * the snapshot doesn't push more useful data out of memory. This is meant
+     * for the child process that writes a snapshot in the background.
+     */
+    void setBackground(uint64_t bytesPerSecond);
+    /// Return true if the file is being written in the compressed format.
+    bool isCompressed() const;
+    // See Core::ProtoBuf::OutputStream. For compressed files, this counts
+    // uncompressed bytes.
     uint64_t getBytesWritten() const;
     // See Core::ProtoBuf::OutputStream.
     void writeMessage(const google::protobuf::Message& message);
@@ -148,6 +320,75 @@ class Writer : public Core::ProtoBuf::OutputStream {
     void writeRaw(const void* data, uint64_t length);
 
   private:
+    /**
+     * Write out the buffer to the file.
+     * \param all
+     *      If true, write out every buffered byte. Otherwise, in direct I/O
+     *      mode, write out only as much as ends on a block boundary in the
+     *      file and keep the rest buffered.
+     */
+    void flushBuffer(bool all);
+    /**
+     * Drop the given range of the file from the page cache, if
+     * setBackground() was called. The range must already be on disk.
+     */
+    void dropFromCache(uint64_t offset, uint64_t length);
+    /**
+     * Write bytes to the end of the file, then call syncRange(). Sleeps as
+     * needed to honor the limit given to setBackground().
+     */
+    void writeToFile(const void* data, uint64_t length);
+    /**
+     * Turn O_DIRECT on or off for the file. If the filesystem does not
+     * support O_DIRECT, this prints a warning and leaves direct I/O disabled
+     * for the rest of the Writer's life.
+     * \return
+     *      True if O_DIRECT is now in the requested state.
+     */
+    bool setDirectIO(bool enable);
+    /**
+     * Start writeback of newly written parts of the file to disk, and wait
+     * for previously started writeback to complete. Called after writing to
+     * the file; does nothing unless syncRangeBytes have been written since the
+     * last call that did something.
+     */
+    void syncRange();
+
+    /**
+     * Direct I/O requires the buffer, file offset, and length of each write
+     * to be a multiple of this. The buffer size is also rounded up to it.
+     */
+    static const uint64_t BLOCK_SIZE = 4096;
+    /// See snapshotWriteBufferBytes in sample.conf.
+    const uint64_t bufferSize;
+    /// See snapshotDirectIO in sample.conf. Cleared if unsupported or if
+    /// 'compressed' is set.
+    bool directIO;
+    /// True if the file is in the compressed format (see COMPRESSED_MAGIC).
+    const bool compressed;
+    /// See snapshotSyncRangeBytes in sample.conf. 0 disables.
+    uint64_t syncRangeBytes;
+    /**
+     * Holds bytes that have been accepted but not yet written to the file.
+     * Allocated with BLOCK_SIZE alignment (required for direct I/O), so it's
+     * released with free().
+     */
+    std::unique_ptr<char, void (*)(void*)> buffer;
+    /// The number of bytes in 'buffer' that have yet to be written.
+    uint64_t bufferedBytes;
+    /// If 'compressed' is set, holds one compressed block as it is written.
+    std::unique_ptr<char[]> compressedBlock;
+    /// The size of the file, not counting 'buffer'.
+    uint64_t fileOffset;
+    /**
+     * The file offset through which syncRange() has started writeback.
+     */
+    uint64_t syncStartOffset;
+    /**
+     * The file offset through which syncRange() has waited for writeback
+     * to complete.
+     */
+    uint64_t syncDoneOffset;
     /// A handle to the directory containing the snapshot. Used for renameat on
     /// close.
     Storage::FilesystemUtil::File parentDir;
@@ -155,7 +396,12 @@ class Writer : public Core::ProtoBuf::OutputStream {
     std::string stagingName;
     /// Wraps the raw file descriptor; in charge of closing it when done.
     Storage::FilesystemUtil::File file;
-    /// The number of bytes accumulated in the file so far.
+    /// Set by setBackground().
+    bool background;
+    /// Limits writes to the file. Set by setBackground().
+    std::unique_ptr<Core::RateLimiter> limiter;
+    /// The number of bytes accumulated in the file so far, including those
+    /// still in 'buffer'.
     uint64_t bytesWritten;
   public:
     /**
@@ -165,6 +411,13 @@ class Writer : public Core::ProtoBuf::OutputStream {
      */
     SharedMMap<std::atomic<uint64_t>> sharedBytesWritten;
 
+    /**
+     * The total number of nanoseconds that any process holding this Writer
+     * has slept because of the limit given to setBackground(). The watchdog
+     * counts this as progress too, and it's reported in the server stats.
+     */
+    SharedMMap<std::atomic<uint64_t>> sharedNanosThrottled;
+
 };
 
 } // namespace LogCabin::Storage::SnapshotFile
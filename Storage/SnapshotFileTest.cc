@@ -14,14 +14,20 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <endian.h>
 #include <fcntl.h>
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #include "build/Core/ProtoBufTest.pb.h"
 #include "Core/Debug.h"
+#include "Core/Random.h"
 #include "Core/StringUtil.h"
 #include "Core/STLUtil.h"
+#include "Core/Time.h"
+#include "Core/Util.h"
 #include "Storage/FilesystemUtil.h"
 #include "Storage/Layout.h"
 #include "Storage/SnapshotFile.h"
@@ -289,9 +295,364 @@ TEST_F(StorageSnapshotFileTest, sharedBytesWritten)
 
 }
 
+TEST_F(StorageSnapshotFileTest, writer_buffering)
+{
+    Core::Config config;
+    config.set<uint64_t>("snapshotWriteBufferBytes", 5000);
+    {
+        Writer writer(layout, config);
+        EXPECT_EQ(8192U, writer.bufferSize);
+        for (uint64_t i = 0; i < 5000; ++i)
+            writer.writeMessage(m1);
+        // all but the last partial buffer has reached the file
+        uint64_t onDisk = FilesystemUtil::getSize(writer.file);
+        EXPECT_EQ(0U, onDisk % 8192);
+        EXPECT_LT(0U, onDisk);
+        EXPECT_EQ(writer.getBytesWritten(), onDisk + writer.bufferedBytes);
+        EXPECT_EQ(writer.getBytesWritten(), *writer.sharedBytesWritten.value);
+        writer.flushToOS();
+        EXPECT_EQ(0U, writer.bufferedBytes);
+        EXPECT_EQ(writer.getBytesWritten(),
+                  FilesystemUtil::getSize(writer.file));
+        // large writes span several buffers
+        std::string big(20000, 'x');
+        writer.writeRaw(big.data(), big.size());
+        writer.save();
+    }
+    {
+        Reader reader(layout);
+        for (uint64_t i = 0; i < 5000; ++i) {
+            ProtoBuf::TestMessage m2;
+            EXPECT_EQ("", reader.readMessage(m2));
+            EXPECT_EQ(m1, m2);
+        }
+        std::string big(20000, ' ');
+        EXPECT_EQ(20000U, reader.readRaw(&big[0], big.size()));
+        EXPECT_EQ(std::string(20000, 'x'), big);
+        EXPECT_EQ(reader.getSizeBytes(), reader.getBytesRead());
+    }
+}
+
+TEST_F(StorageSnapshotFileTest, writer_directIO)
+{
+    Core::Debug::setLogPolicy({ // unsupported on some filesystems (tmpfs)
+        {"Storage/SnapshotFile.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    Core::Config config;
+    config.set<uint64_t>("snapshotWriteBufferBytes", 4096);
+    config.set<bool>("snapshotDirectIO", true);
+    std::string data;
+    for (uint64_t i = 0; i < 30000; ++i)
+        data.push_back(char('a' + i % 26));
+    {
+        Writer writer(layout, config);
+        // start unaligned, then write enough for several blocks
+        writer.writeRaw(data.data(), 3);
+        writer.writeRaw(data.data() + 3, data.size() - 3);
+        if (writer.directIO) {
+            // only whole blocks are written, and the rest are held back
+            EXPECT_EQ(0U, FilesystemUtil::getSize(writer.file) % 4096);
+        }
+        writer.save();
+    }
+    {
+        Reader reader(layout);
+        std::string readBack(data.size(), ' ');
+        EXPECT_EQ(data.size(), reader.readRaw(&readBack[0], data.size()));
+        EXPECT_EQ(data, readBack);
+    }
+}
+
+TEST_F(StorageSnapshotFileTest, writer_syncRange)
+{
+    Core::Config config;
+    config.set<uint64_t>("snapshotWriteBufferBytes", 4096);
+    config.set<uint64_t>("snapshotSyncRangeBytes", 8192);
+    Writer writer(layout, config);
+    std::string block(4096, 'x');
+    writer.writeRaw(block.data(), block.size());
+    EXPECT_EQ(0U, writer.syncStartOffset);
+    writer.writeRaw(block.data(), block.size());
+    EXPECT_EQ(8192U, writer.syncStartOffset);
+    EXPECT_EQ(0U, writer.syncDoneOffset);
+    writer.writeRaw(block.data(), block.size());
+    writer.writeRaw(block.data(), block.size());
+    EXPECT_EQ(16384U, writer.syncStartOffset);
+    EXPECT_EQ(8192U, writer.syncDoneOffset);
+    writer.save();
+}
+
+TEST_F(StorageSnapshotFileTest, writer_setBackground)
+{
+    Core::Config config;
+    config.set<uint64_t>("snapshotWriteBufferBytes", 4096);
+    config.set<uint64_t>("snapshotSyncRangeBytes", 8192);
+    Writer writer(layout, config);
+    Core::Time::SteadyClock::Mocker mocker;
+    // each block earns 10ms, and 100ms worth (10 blocks) may be written
+    // right away
+    writer.setBackground(409600);
+    EXPECT_TRUE(writer.background);
+    EXPECT_EQ(40960U, writer.limiter->unitsPerSecond / 10);
+    std::string block(4096, 'x');
+    for (uint64_t i = 0; i < 10; ++i)
+        writer.writeRaw(block.data(), block.size());
+    EXPECT_EQ(0U, *writer.sharedNanosThrottled.value);
+    // only 9ms pass before each of the next blocks, so the writer falls 1ms
+    // further behind with each one: it waits 1ms, then 2ms, 3ms, and 4ms
+    uint64_t expected = 0;
+    for (uint64_t i = 1; i <= 4; ++i) {
+        Core::Time::SteadyClock::mockValue += std::chrono::milliseconds(9);
+        writer.writeRaw(block.data(), block.size());
+        expected += i * 1000000;
+        EXPECT_EQ(expected, *writer.sharedNanosThrottled.value);
+    }
+    EXPECT_EQ(std::chrono::nanoseconds(expected),
+              writer.limiter->getThrottledTime());
+    EXPECT_EQ(14 * 4096U, writer.save());
+    EXPECT_EQ(expected, *writer.sharedNanosThrottled.value);
+    Reader reader(layout);
+    EXPECT_EQ(14 * 4096U, reader.getSizeBytes());
+}
+
+TEST_F(StorageSnapshotFileTest, compressed)
+{
+    Core::Config config;
+    config.set<uint64_t>("snapshotWriteBufferBytes", 4096);
+    config.set<std::string>("snapshotCompression", "lz4");
+    std::string big(20000, 'x');
+    {
+        Writer writer(layout, config);
+        EXPECT_TRUE(writer.compressed);
+        for (uint64_t i = 0; i < 5000; ++i)
+            writer.writeMessage(m1);
+        writer.writeRaw(big.data(), big.size());
+        writer.writeMessage(m1);
+        EXPECT_EQ(5000 * (4 + m1.ByteSize()) + 20000 + 4 + m1.ByteSize(),
+                  writer.getBytesWritten());
+        uint64_t fileSize = writer.save();
+        EXPECT_GT(writer.getBytesWritten() / 10, fileSize);
+    }
+    {
+        Reader reader(layout);
+        EXPECT_TRUE(reader.isCompressed());
+        for (uint64_t i = 0; i < 5000; ++i) {
+            ProtoBuf::TestMessage m2;
+            EXPECT_EQ("", reader.readMessage(m2));
+            EXPECT_EQ(m1, m2);
+        }
+        std::string readBack(big.size(), ' ');
+        EXPECT_EQ(big.size(), reader.readRaw(&readBack[0], big.size()));
+        EXPECT_EQ(big, readBack);
+        ProtoBuf::TestMessage m2;
+        EXPECT_EQ("", reader.readMessage(m2));
+        EXPECT_EQ(m1, m2);
+        uint32_t x;
+        EXPECT_EQ(0U, reader.readRaw(&x, sizeof(x)));
+        EXPECT_NE("", reader.readMessage(m2));
+    }
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_blockTooLong)
+{
+    Core::Config config;
+    config.set<std::string>("snapshotCompression", "lz4");
+    {
+        Writer writer(layout, config);
+        writer.writeMessage(m1);
+        writer.save();
+    }
+    // claim the first block is 1 GB uncompressed
+    FilesystemUtil::File file =
+        FilesystemUtil::openFile(layout.snapshotDir, "snapshot", O_RDWR);
+    uint32_t length = htobe32(1U << 30);
+    ASSERT_EQ(ssize_t(sizeof(length)),
+              pwrite(file.fd, &length, sizeof(length),
+                     sizeof(COMPRESSED_MAGIC)));
+    EXPECT_DEATH({
+            Reader reader(layout);
+            ProtoBuf::TestMessage m2;
+            reader.readMessage(m2);
+        }, "exceeds the 67108864-byte maximum");
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_notAllowed)
+{
+    Core::Config config;
+    config.set<std::string>("snapshotCompression", "lz4");
+    {
+        Writer writer(layout, config, false);
+        EXPECT_FALSE(writer.compressed);
+        writer.writeMessage(m1);
+        writer.save();
+    }
+    Reader reader(layout);
+    EXPECT_FALSE(reader.isCompressed());
+    ProtoBuf::TestMessage m2;
+    EXPECT_EQ("", reader.readMessage(m2));
+    EXPECT_EQ(m1, m2);
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_incompressible)
+{
+    Core::Config config;
+    config.set<uint64_t>("snapshotWriteBufferBytes", 4096);
+    config.set<std::string>("snapshotCompression", "lz4");
+    std::string data;
+    for (uint64_t i = 0; i < 10000; ++i)
+        data.push_back(char(Core::Random::random8()));
+    {
+        Writer writer(layout, config);
+        writer.writeRaw(data.data(), data.size());
+        // blocks that don't shrink are stored as is, after an 8-byte header
+        EXPECT_EQ(8 + 2 * (8 + 4096) + 8 + (10000 - 2 * 4096),
+                  writer.save());
+    }
+    Reader reader(layout);
+    std::string readBack(data.size(), ' ');
+    EXPECT_EQ(data.size(), reader.readRaw(&readBack[0], data.size()));
+    EXPECT_EQ(data, readBack);
+}
+
+TEST_F(StorageSnapshotFileTest, compressed_forking)
+{
+    Core::Config config;
+    config.set<std::string>("snapshotCompression", "lz4");
+    {
+        Writer writer(layout, config);
+        uint32_t d = 482;
+        writer.writeRaw(&d, sizeof(d));
+        writer.flushToOS();
+        pid_t pid = fork();
+        ASSERT_LE(0, pid);
+        if (pid == 0) { // child
+            std::string big(10000, 'y');
+            writer.writeRaw(big.data(), big.size());
+            writer.flushToOS();
+            _exit(0);
+        } else { // parent
+            int status = 0;
+            pid = waitpid(pid, &status, 0);
+            EXPECT_LE(0, pid);
+            EXPECT_TRUE(WIFEXITED(status));
+            EXPECT_EQ(0, WEXITSTATUS(status));
+            writer.seekToEnd();
+            EXPECT_EQ(10004U, writer.getBytesWritten());
+            d = 998;
+            writer.writeRaw(&d, sizeof(d));
+            writer.save();
+        }
+    }
+    {
+        Reader reader(layout);
+        uint32_t x = 0;
+        EXPECT_EQ(sizeof(x), reader.readRaw(&x, sizeof(x)));
+        EXPECT_EQ(482U, x);
+        std::string big(10000, ' ');
+        EXPECT_EQ(big.size(), reader.readRaw(&big[0], big.size()));
+        EXPECT_EQ(std::string(10000, 'y'), big);
+        EXPECT_EQ(sizeof(x), reader.readRaw(&x, sizeof(x)));
+        EXPECT_EQ(998U, x);
+        EXPECT_EQ(10008U, reader.getBytesRead());
+    }
+}
 
 // writeMessage tested with readMessage above
 
+/**
+ * Return a message as SnapshotFile::Writer would write it.
+ */
+std::string
+framed(const google::protobuf::Message& message)
+{
+    std::string bytes = message.SerializeAsString();
+    uint32_t length = htobe32(uint32_t(bytes.size()));
+    return std::string(reinterpret_cast<const char*>(&length),
+                       sizeof(length)) + bytes;
+}
+
+TEST(StorageSnapshotStreamReaderTest, basic)
+{
+    ProtoBuf::TestMessage m;
+    m.set_field_a(3);
+    m.set_field_b(5);
+    std::string bytes = "x" + framed(m) + framed(m);
+    StreamReader stream(1024);
+    stream.append(bytes.data(), 3);
+    stream.append(bytes.data() + 3, bytes.size() - 3);
+    char c = 0;
+    EXPECT_EQ(1U, stream.readRaw(&c, 1));
+    EXPECT_EQ('x', c);
+    ProtoBuf::TestMessage out;
+    EXPECT_EQ("", stream.readMessage(out));
+    EXPECT_EQ(m, out);
+    EXPECT_EQ("", stream.readMessage(out));
+    EXPECT_EQ(bytes.size(), stream.getBytesRead());
+    EXPECT_EQ(0U, stream.bufferOffset);
+    EXPECT_EQ(0U, stream.buffer.size());
+
+    stream.append(bytes.data() + 1, 6);
+    stream.close();
+    EXPECT_EQ("ProtoBuf is 4 bytes long but the received snapshot ended "
+              "after 2 more bytes (at offset 21)",
+              stream.readMessage(out));
+    EXPECT_EQ("Could only read 0 bytes of 4-byte length field in received "
+              "snapshot (at offset 23)",
+              stream.readMessage(out));
+}
+
+TEST(StorageSnapshotStreamReaderTest, append_full)
+{
+    StreamReader stream(4);
+    EXPECT_TRUE(stream.append("abc", 3));
+    EXPECT_FALSE(stream.append("de", 2));
+    EXPECT_TRUE(stream.append("d", 1));
+    char c[2];
+    EXPECT_EQ(2U, stream.readRaw(c, 2));
+    // only unread bytes count against the limit
+    EXPECT_TRUE(stream.append("ef", 2));
+    EXPECT_FALSE(stream.append("g", 1));
+    std::string rest(4, '\0');
+    EXPECT_EQ(4U, stream.readRaw(&rest[0], 4));
+    EXPECT_EQ("cdef", rest);
+}
+
+TEST(StorageSnapshotStreamReaderTest, readRaw_blocks)
+{
+    StreamReader stream(1024);
+    std::thread appender([&stream] () {
+        for (uint64_t i = 0; i < 100; ++i) {
+            usleep(100);
+            stream.append(&i, sizeof(i));
+        }
+        stream.close();
+    });
+    std::vector<uint64_t> values(100);
+    EXPECT_EQ(800U, stream.readRaw(values.data(), 800));
+    for (uint64_t i = 0; i < 100; ++i)
+        EXPECT_EQ(i, values.at(i));
+    char c;
+    EXPECT_EQ(0U, stream.readRaw(&c, 1));
+    appender.join();
+}
+
+TEST(StorageSnapshotStreamReaderTest, abort)
+{
+    StreamReader stream(1024);
+    stream.append("ab", 2);
+    std::thread aborter([&stream] () {
+        usleep(1000);
+        stream.abort();
+    });
+    char c[3];
+    EXPECT_THROW(stream.readRaw(c, 3), Core::Util::ThreadInterruptedException);
+    aborter.join();
+    // bytes already received can still be read
+    EXPECT_EQ(2U, stream.readRaw(c, 2));
+    EXPECT_THROW(stream.readRaw(c, 1), Core::Util::ThreadInterruptedException);
+}
+
 // writeRaw tested with readRaw above
 
 } // namespace LogCabin::Storage::SnapshotFile::<anonymous>
@@ -37,14 +37,28 @@ readOnlyTreeRPC(const Tree& tree,
         // condition does not match, skip
     } else if (request.has_list_directory()) {
         std::vector<std::string> children;
+        bool more = false;
         result = tree.listDirectory(request.list_directory().path(),
-                                    children);
+                                    request.list_directory().prefix(),
+                                    request.list_directory().start_after(),
+                                    request.list_directory().limit(),
+                                    children,
+                                    more);
         for (auto it = children.begin(); it != children.end(); ++it)
             response.mutable_list_directory()->add_child(*it);
+        // Always set, so that clients can tell this server apart from older
+        // ones that ignore prefix, start_after, and limit.
+        response.mutable_list_directory()->set_more(more);
     } else if (request.has_read()) {
         std::string contents;
-        result = tree.read(request.read().path(), contents);
+        uint64_t size = 0;
+        result = tree.read(request.read().path(),
+                           request.read().offset(),
+                           request.read().length(),
+                           contents,
+                           size);
         response.mutable_read()->set_contents(contents);
+        response.mutable_read()->set_size(size);
     } else {
         PANIC("Unexpected request: %s",
               Core::ProtoBuf::dumpString(request).c_str());
@@ -71,10 +85,33 @@ readWriteTreeRPC(Tree& tree,
     } else if (request.has_remove_directory()) {
         result = tree.removeDirectory(request.remove_directory().path());
     } else if (request.has_write()) {
-        result = tree.write(request.write().path(),
-                            request.write().contents());
+        if (request.write().has_offset()) {
+            result = tree.write(request.write().path(),
+                                request.write().offset(),
+                                request.write().contents());
+        } else {
+            result = tree.write(request.write().path(),
+                                request.write().contents());
+        }
     } else if (request.has_remove_file()) {
         result = tree.removeFile(request.remove_file().path());
+    } else if (request.has_increment()) {
+        int64_t value = 0;
+        result = tree.increment(request.increment().path(),
+                                request.increment().delta(),
+                                value);
+        if (result.status == Status::OK)
+            response.mutable_increment()->set_value(value);
+    } else if (request.has_append()) {
+        result = tree.append(request.append().path(),
+                             request.append().contents());
+    } else if (request.has_create_sequential()) {
+        std::string created;
+        result = tree.createSequential(request.create_sequential().path(),
+                                       request.create_sequential().contents(),
+                                       created);
+        if (result.status == Status::OK)
+            response.mutable_create_sequential()->set_path(created);
     } else {
         PANIC("Unexpected request: %s",
               Core::ProtoBuf::dumpString(request).c_str());
@@ -14,7 +14,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <limits>
+#include <thread>
 
 #include "build/Protocol/ServerStats.pb.h"
 #include "build/Tree/Snapshot.pb.h"
@@ -61,39 +65,331 @@ Result::Result()
 {
 }
 
+SnapshotBase::SnapshotBase()
+    : epoch(0)
+    , data(NULL)
+    , length(0)
+    , subtrees()
+    , values(false)
+{
+}
+
 namespace Internal {
 
+////////// struct Value //////////
+
+Value::Value(std::string contents, uint64_t id)
+    : contents(std::move(contents))
+    , id(id)
+{
+}
+
+////////// class ValuePool //////////
+
+const uint64_t ValuePool::MIN_BYTES;
+
+ValuePool::ValuePool()
+    : mutex()
+    , values()
+    , nextId(1)
+    , numBytes(0)
+{
+}
+
+std::shared_ptr<const Value>
+ValuePool::intern(std::string contents, uint64_t id)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    auto it = values.find(&contents);
+    if (it != values.end()) {
+        std::shared_ptr<const Value> existing = it->second.lock();
+        if (existing)
+            return existing;
+        // It's on its way out; release() will notice it's been replaced.
+        numBytes -= it->first->size();
+        values.erase(it);
+    }
+    if (id == 0)
+        id = nextId;
+    nextId = std::max(nextId, id + 1);
+    std::shared_ptr<ValuePool> self = shared_from_this();
+    std::shared_ptr<const Value> value(
+        new Value(std::move(contents), id),
+        [self] (const Value* v) {
+            self->release(v);
+            delete v;
+        });
+    values[&value->contents] = value;
+    numBytes += value->contents.size();
+    return value;
+}
+
+std::vector<std::shared_ptr<const Value>>
+ValuePool::getValues() const
+{
+    std::vector<std::shared_ptr<const Value>> live;
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        live.reserve(values.size());
+        for (auto it = values.begin(); it != values.end(); ++it) {
+            std::shared_ptr<const Value> value = it->second.lock();
+            if (value)
+                live.push_back(std::move(value));
+        }
+    }
+    std::sort(live.begin(), live.end(),
+              [] (const std::shared_ptr<const Value>& a,
+                  const std::shared_ptr<const Value>& b) {
+                  return a->id < b->id;
+              });
+    return live;
+}
+
+uint64_t
+ValuePool::getNumValues() const
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    return values.size();
+}
+
+uint64_t
+ValuePool::getNumBytes() const
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    return numBytes;
+}
+
+void
+ValuePool::release(const Value* value)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    auto it = values.find(&value->contents);
+    if (it != values.end() && it->first == &value->contents) {
+        numBytes -= value->contents.size();
+        values.erase(it);
+    }
+}
+
+size_t
+ValuePool::Hash::operator()(const std::string* key) const
+{
+    return std::hash<std::string>()(*key);
+}
+
+bool
+ValuePool::Equal::operator()(const std::string* a, const std::string* b) const
+{
+    return *a == *b;
+}
+
 ////////// class File //////////
 
 File::File()
     : contents()
+    , value()
 {
 }
 
+const std::string&
+File::getContents() const
+{
+    if (value)
+        return value->contents;
+    return contents;
+}
+
+void
+File::setContents(ValuePool& pool, const std::string& newContents)
+{
+    if (newContents.size() >= ValuePool::MIN_BYTES) {
+        value = pool.intern(newContents);
+        contents.clear();
+    } else {
+        value.reset();
+        contents = newContents;
+    }
+}
+
+std::string&
+File::mutableContents()
+{
+    if (value) {
+        contents = value->contents;
+        value.reset();
+    }
+    return contents;
+}
+
 void
-File::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
+File::dumpSnapshot(Core::ProtoBuf::OutputStream& stream, bool refs) const
 {
     Snapshot::File file;
-    file.set_contents(contents);
+    if (refs && value)
+        file.set_value_id(value->id);
+    else
+        file.set_contents(getContents());
     stream.writeMessage(file);
 }
 
 void
-File::loadSnapshot(Core::ProtoBuf::InputStream& stream)
+File::loadSnapshot(Core::ProtoBuf::InputStream& stream,
+                   ValuePool* pool,
+                   const ValueTable* values)
 {
     Snapshot::File node;
     std::string error = stream.readMessage(node);
     if (!error.empty()) {
         PANIC("Couldn't read snapshot: %s", error.c_str());
     }
-    contents = node.contents();
+    if (node.has_value_id()) {
+        auto it = (values == NULL ? ValueTable::const_iterator()
+                                  : values->find(node.value_id()));
+        if (values == NULL || it == values->end()) {
+            PANIC("Couldn't read snapshot: file refers to value %lu, which "
+                  "the snapshot doesn't list",
+                  node.value_id());
+        }
+        value = it->second;
+        contents.clear();
+    } else if (pool != NULL &&
+               node.contents().size() >= ValuePool::MIN_BYTES) {
+        value = pool->intern(std::move(*node.mutable_contents()));
+        contents.clear();
+    } else {
+        value.reset();
+        contents = node.contents();
+    }
 }
 
 ////////// class Directory //////////
 
+namespace {
+
+/**
+ * Helper for Directory::getChildren() that lists a window of the names in
+ * one of the Directory's maps.
+ * \param map
+ *      Either Directory::directories or Directory::files.
+ * \param prefix
+ *      Only names beginning with this prefix are listed.
+ * \param startAfter
+ *      Only names greater than this one are listed, unless it's empty.
+ * \param suffix
+ *      Appended to each listed name ("/" for directories).
+ * \param limit
+ *      The maximum total size for 'children', or 0 for no limit.
+ * \param[in,out] children
+ *      Listed names are appended here.
+ * \return
+ *      True if 'children' filled up before all matching names were listed.
+ */
+template<typename Map>
+bool
+appendChildren(const Map& map,
+               const std::string& prefix,
+               const std::string& startAfter,
+               const char* suffix,
+               uint64_t limit,
+               std::vector<std::string>& children)
+{
+    auto it = map.lower_bound(prefix);
+    if (!startAfter.empty() && startAfter >= prefix)
+        it = map.upper_bound(startAfter);
+    for (; it != map.end(); ++it) {
+        if (!Core::StringUtil::startsWith(it->first, prefix))
+            break;
+        if (limit > 0 && children.size() >= limit)
+            return true;
+        children.push_back(it->first + suffix);
+    }
+    return false;
+}
+
+/**
+ * Copy the serialized form of a directory from an earlier snapshot into the
+ * stream. Helper for Directory::dumpSnapshot().
+ * \param stream
+ *      Where to write the directory.
+ * \param source
+ *      The earlier snapshot.
+ * \param path
+ *      The path of the directory, its key in source.subtrees.
+ * \param offset
+ *      The offset of the directory's serialized form in source.data.
+ * \param length
+ *      The length of the directory's serialized form.
+ * \param[out] index
+ *      If not NULL, the entries in source.subtrees for the directories below
+ *      this one are added here with their new offsets.
+ */
+void
+copySubtree(Core::ProtoBuf::OutputStream& stream,
+            const SnapshotBase& source,
+            const std::string& path,
+            uint64_t offset,
+            uint64_t length,
+            Snapshot::Index* index)
+{
+    uint64_t start = stream.getBytesWritten();
+    stream.writeRaw(source.data + offset, length);
+    if (index == NULL)
+        return;
+    // The directories below this one sort just after it.
+    std::string prefix = path + "/";
+    for (auto child = source.subtrees.lower_bound(prefix);
+         child != source.subtrees.end() &&
+         Core::StringUtil::startsWith(child->first, prefix);
+         ++child) {
+        Snapshot::Index::Subtree& subtree = *index->add_subtree();
+        subtree.set_path(child->first);
+        subtree.set_offset(start + child->second.first - offset);
+        subtree.set_length(child->second.second);
+    }
+}
+
+/**
+ * Read the shared values that a snapshot lists after its super root's
+ * Directory message. Helper for Directory::loadSnapshot().
+ * \param stream
+ *      Where to read the values from.
+ * \param count
+ *      The number of values to read.
+ * \param pool
+ *      The pool to add the values to, or NULL to use one of their own.
+ * \return
+ *      Map from the values' IDs to the values.
+ */
+std::shared_ptr<const ValueTable>
+readValues(Core::ProtoBuf::InputStream& stream,
+           uint64_t count,
+           ValuePool* pool)
+{
+    std::shared_ptr<ValuePool> ownPool;
+    if (pool == NULL) {
+        ownPool = std::make_shared<ValuePool>();
+        pool = ownPool.get();
+    }
+    std::shared_ptr<ValueTable> table = std::make_shared<ValueTable>();
+    for (uint64_t i = 0; i < count; ++i) {
+        Snapshot::Value node;
+        std::string error = stream.readMessage(node);
+        if (!error.empty()) {
+            PANIC("Couldn't read snapshot: %s", error.c_str());
+        }
+        (*table)[node.id()] = pool->intern(
+            std::move(*node.mutable_contents()), node.id());
+    }
+    return table;
+}
+
+} // anonymous namespace
+
 Directory::Directory()
-    : directories()
+    : lastChanged(0)
+    , directories()
     , files()
+    , nextSequence(0)
+    , lazy()
 {
 }
 
@@ -101,13 +397,30 @@ std::vector<std::string>
 Directory::getChildren() const
 {
     std::vector<std::string> children;
-    for (auto it = directories.begin(); it != directories.end(); ++it)
-        children.push_back(it->first + "/");
-    for (auto it = files.begin(); it != files.end(); ++it)
-        children.push_back(it->first);
+    getChildren("", "", 0, children);
     return children;
 }
 
+bool
+Directory::getChildren(const std::string& prefix,
+                       const std::string& startAfter,
+                       uint64_t limit,
+                       std::vector<std::string>& children) const
+{
+    materialize();
+    children.clear();
+    // Directories are listed before files, so a cursor naming a file means
+    // that all directories have already been listed.
+    if (!startAfter.empty() && !Core::StringUtil::endsWith(startAfter, "/"))
+        return appendChildren(files, prefix, startAfter, "", limit, children);
+    std::string cursor = startAfter;
+    if (!cursor.empty())
+        cursor.erase(cursor.size() - 1); // strip trailing slash
+    if (appendChildren(directories, prefix, cursor, "/", limit, children))
+        return true;
+    return appendChildren(files, prefix, "", "", limit, children);
+}
+
 Directory*
 Directory::lookupDirectory(const std::string& name)
 {
@@ -120,6 +433,7 @@ Directory::lookupDirectory(const std::string& name) const
 {
     assert(!name.empty());
     assert(!Core::StringUtil::endsWith(name, "/"));
+    materialize();
     auto it = directories.find(name);
     if (it == directories.end())
         return NULL;
@@ -142,6 +456,7 @@ Directory::removeDirectory(const std::string& name)
 {
     assert(!name.empty());
     assert(!Core::StringUtil::endsWith(name, "/"));
+    materialize();
     directories.erase(name);
 }
 
@@ -157,6 +472,7 @@ Directory::lookupFile(const std::string& name) const
 {
     assert(!name.empty());
     assert(!Core::StringUtil::endsWith(name, "/"));
+    materialize();
     auto it = files.find(name);
     if (it == files.end())
         return NULL;
@@ -178,11 +494,78 @@ Directory::removeFile(const std::string& name)
 {
     assert(!name.empty());
     assert(!Core::StringUtil::endsWith(name, "/"));
+    materialize();
     return (files.erase(name) > 0);
 }
 
+std::string
+Directory::makeSequentialFile(const std::string& prefix)
+{
+    materialize();
+    std::string name;
+    do {
+        name = prefix + format("%010lu", nextSequence);
+        ++nextSequence;
+    } while (directories.find(name) != directories.end() ||
+             files.find(name) != files.end());
+    files[name];
+    return name;
+}
+
 void
 Directory::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
+{
+    std::string path;
+    dumpSnapshot(stream, path, NULL, 0, NULL, NULL);
+}
+
+void
+Directory::dumpSnapshot(Core::ProtoBuf::OutputStream& stream,
+                        std::string& path,
+                        const SnapshotBase* base,
+                        uint64_t minIndexedBytes,
+                        Snapshot::Index* index,
+                        const ValuePool* pool) const
+{
+    uint64_t start = stream.getBytesWritten();
+    bool copied = false;
+    if (base != NULL && lastChanged <= base->epoch) {
+        auto it = base->subtrees.find(path);
+        if (it != base->subtrees.end()) {
+            copySubtree(stream, *base, path,
+                        it->second.first, it->second.second, index);
+            copied = true;
+        }
+    }
+    // References to shared values can only be copied into a snapshot that
+    // lists the values.
+    if (!copied && lazy && (pool != NULL || !lazy->values)) {
+        // Never loaded, so it's exactly as it was in the snapshot.
+        copySubtree(stream, *lazy->source, lazy->path,
+                    lazy->offset, lazy->length, index);
+        copied = true;
+    }
+    if (!copied) {
+        materialize();
+        serializeChildren(stream, path, base, minIndexedBytes, index, pool);
+    }
+
+    uint64_t length = stream.getBytesWritten() - start;
+    if (index != NULL && length >= minIndexedBytes) {
+        Snapshot::Index::Subtree& subtree = *index->add_subtree();
+        subtree.set_path(path);
+        subtree.set_offset(start);
+        subtree.set_length(length);
+    }
+}
+
+void
+Directory::serializeChildren(Core::ProtoBuf::OutputStream& stream,
+                             std::string& path,
+                             const SnapshotBase* base,
+                             uint64_t minIndexedBytes,
+                             Snapshot::Index* index,
+                             const ValuePool* pool) const
 {
     // create protobuf of this dir, listing all children
     Snapshot::Directory dir;
@@ -190,37 +573,196 @@ Directory::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
         dir.add_directories(it->first);
     for (auto it = files.begin(); it != files.end(); ++it)
         dir.add_files(it->first);
+    if (nextSequence > 0)
+        dir.set_next_sequence(nextSequence);
+    std::vector<std::shared_ptr<const Value>> values;
+    if (pool != NULL && path.empty()) {
+        values = pool->getValues();
+        if (!values.empty())
+            dir.set_num_values(values.size());
+    }
 
-    // write dir into stream
+    // write dir into stream, followed by the shared values
     stream.writeMessage(dir);
+    for (auto it = values.begin(); it != values.end(); ++it) {
+        Snapshot::Value value;
+        value.set_id((*it)->id);
+        value.set_contents((*it)->contents);
+        stream.writeMessage(value);
+    }
 
     // dump children in the same order
-    for (auto it = directories.begin(); it != directories.end(); ++it)
-        it->second.dumpSnapshot(stream);
+    uint64_t pathLength = path.size();
+    for (auto it = directories.begin(); it != directories.end(); ++it) {
+        path.append("/");
+        path.append(it->first);
+        it->second.dumpSnapshot(stream, path, base, minIndexedBytes, index,
+                                pool);
+        path.resize(pathLength);
+    }
     for (auto it = files.begin(); it != files.end(); ++it)
-        it->second.dumpSnapshot(stream);
+        it->second.dumpSnapshot(stream, pool != NULL);
 }
 
 void
-Directory::loadSnapshot(Core::ProtoBuf::InputStream& stream)
+Directory::loadSnapshot(Core::ProtoBuf::InputStream& stream,
+                        ValuePool* pool,
+                        const ValueTable* values)
 {
+    lazy.reset();
     Snapshot::Directory dir;
     std::string error = stream.readMessage(dir);
     if (!error.empty()) {
         PANIC("Couldn't read snapshot: %s", error.c_str());
     }
+    nextSequence = dir.next_sequence();
+    std::shared_ptr<const ValueTable> table;
+    if (dir.num_values() > 0) {
+        table = readValues(stream, dir.num_values(), pool);
+        values = table.get();
+    }
     for (auto it = dir.directories().begin();
          it != dir.directories().end();
          ++it) {
-        directories[*it].loadSnapshot(stream);
+        directories[*it].loadSnapshot(stream, pool, values);
     }
     for (auto it = dir.files().begin();
          it != dir.files().end();
          ++it) {
-        files[*it].loadSnapshot(stream);
+        files[*it].loadSnapshot(stream, pool, values);
     }
 }
 
+void
+Directory::loadSnapshot(Core::ProtoBuf::MemoryInputStream& stream,
+                        std::string& path,
+                        const SnapshotBase& layout,
+                        uint64_t maxDeferredBytes,
+                        std::vector<DeferredLoad>& deferred,
+                        ValuePool* pool,
+                        std::shared_ptr<const ValueTable> values)
+{
+    lazy.reset();
+    Snapshot::Directory dir;
+    std::string error = stream.readMessage(dir);
+    if (!error.empty()) {
+        PANIC("Couldn't read snapshot: %s", error.c_str());
+    }
+    nextSequence = dir.next_sequence();
+    if (dir.num_values() > 0)
+        values = readValues(stream, dir.num_values(), pool);
+    uint64_t pathLength = path.size();
+    for (auto it = dir.directories().begin();
+         it != dir.directories().end();
+         ++it) {
+        Directory& child = directories[*it];
+        path.append("/");
+        path.append(*it);
+        auto location = layout.subtrees.find(path);
+        if (location == layout.subtrees.end() ||
+            location->second.first != stream.getBytesRead()) {
+            child.loadSnapshot(stream, pool, values.get());
+        } else {
+            uint64_t length = location->second.second;
+            std::string prefix = path + "/";
+            auto next = layout.subtrees.lower_bound(prefix);
+            if (length > maxDeferredBytes &&
+                next != layout.subtrees.end() &&
+                Core::StringUtil::startsWith(next->first, prefix)) {
+                // Too big to hand out whole, and it has indexed children to
+                // split it up with.
+                child.loadSnapshot(stream, path, layout,
+                                   maxDeferredBytes, deferred, pool, values);
+            } else {
+                deferred.push_back({&child, path,
+                                    stream.getBytesRead(), length, values});
+                if (stream.skip(length) != length) {
+                    PANIC("Couldn't read snapshot: directory %s claims %lu "
+                          "bytes but the snapshot ends first",
+                          path.c_str(), length);
+                }
+            }
+        }
+        path.resize(pathLength);
+    }
+    for (auto it = dir.files().begin();
+         it != dir.files().end();
+         ++it) {
+        files[*it].loadSnapshot(stream, pool, values.get());
+    }
+}
+
+void
+Directory::loadLazily(std::shared_ptr<const SnapshotBase> source,
+                      const std::string& path,
+                      uint64_t offset,
+                      uint64_t length,
+                      std::shared_ptr<ValuePool> pool,
+                      std::shared_ptr<const ValueTable> values)
+{
+    lazy.reset(new LazyLoad {source, path, offset, length, pool, values});
+}
+
+bool
+Directory::isLazy() const
+{
+    return bool(lazy);
+}
+
+bool
+Directory::loadPlaceholders(uint64_t& budget)
+{
+    if (lazy) {
+        if (budget == 0)
+            return false;
+        budget -= std::min(budget, lazy->length);
+        materialize();
+    }
+    for (auto it = directories.begin(); it != directories.end(); ++it) {
+        if (!it->second.loadPlaceholders(budget))
+            return false;
+    }
+    return true;
+}
+
+void
+Directory::materialize() const
+{
+    if (!lazy)
+        return;
+    std::unique_ptr<LazyLoad> load = std::move(lazy);
+    const SnapshotBase& source = *load->source;
+    uint64_t end = load->offset + load->length;
+    if (load->offset > end || end > source.length) {
+        PANIC("Couldn't read snapshot: directory %s at bytes %lu-%lu is past "
+              "the end of the %lu-byte snapshot",
+              load->path.c_str(), load->offset, end, source.length);
+    }
+    Core::ProtoBuf::MemoryInputStream stream(source.data, end);
+    stream.skip(load->offset);
+    std::string path = load->path;
+    std::vector<DeferredLoad> deferred;
+    Directory loaded;
+    loaded.loadSnapshot(stream, path, source,
+                        std::numeric_limits<uint64_t>::max(), deferred,
+                        load->pool.get(), load->values);
+    // Moving the maps keeps their nodes, so 'deferred' still points at the
+    // right children.
+    directories = std::move(loaded.directories);
+    files = std::move(loaded.files);
+    nextSequence = loaded.nextSequence;
+    if (stream.getBytesRead() != end) {
+        PANIC("Couldn't read snapshot: directory %s should be %lu bytes but "
+              "was %lu",
+              load->path.c_str(), load->length,
+              stream.getBytesRead() - load->offset);
+    }
+    for (auto it = deferred.begin(); it != deferred.end(); ++it)
+        it->directory->loadLazily(load->source, it->path,
+                                  it->offset, it->length,
+                                  load->pool, it->values);
+}
+
 ////////// class Path //////////
 
 Path::Path(const std::string& symbolic)
@@ -277,8 +819,52 @@ Path::parentsThrough(std::vector<std::string>::const_iterator end) const
 
 ////////// class Tree //////////
 
+namespace {
+
+/**
+ * Parse the contents of a file as a signed decimal integer for
+ * Tree::increment(). The empty string is treated as zero.
+ * \return
+ *      True if 'contents' is the empty string or consists of an optional
+ *      minus sign followed by one or more decimal digits and fits in an
+ *      int64_t; false otherwise.
+ */
+bool
+parseInteger(const std::string& contents, int64_t& value)
+{
+    value = 0;
+    if (contents.empty())
+        return true;
+    bool negative = (contents.at(0) == '-');
+    size_t i = negative ? 1 : 0;
+    if (i == contents.size())
+        return false;
+    // Accumulate as a negative number, since its range is larger.
+    const int64_t min = std::numeric_limits<int64_t>::min();
+    for (; i < contents.size(); ++i) {
+        char c = contents.at(i);
+        if (c < '0' || c > '9')
+            return false;
+        int64_t digit = c - '0';
+        if (value < (min + digit) / 10)
+            return false;
+        value = value * 10 - digit;
+    }
+    if (!negative) {
+        if (value == min)
+            return false;
+        value = -value;
+    }
+    return true;
+}
+
+} // anonymous namespace
+
 Tree::Tree()
-    : superRoot()
+    : epoch(1)
+    , superRoot()
+    , valuePool(std::make_shared<ValuePool>())
+    , snapshotDedup(false)
     , numConditionsChecked(0)
     , numConditionsFailed(0)
     , numMakeDirectoryAttempted(0)
@@ -299,6 +885,12 @@ Tree::Tree()
     , numRemoveFileTargetNotFound(0)
     , numRemoveFileDone(0)
     , numRemoveFileSuccess(0)
+    , numIncrementAttempted(0)
+    , numIncrementSuccess(0)
+    , numAppendAttempted(0)
+    , numAppendSuccess(0)
+    , numCreateSequentialAttempted(0)
+    , numCreateSequentialSuccess(0)
 {
     // Create the root directory so that users don't have to explicitly
     // call makeDirectory("/").
@@ -308,8 +900,19 @@ Tree::Tree()
 Result
 Tree::normalLookup(const Path& path, Directory** parent)
 {
-    return normalLookup(path,
-                        const_cast<const Directory**>(parent));
+    Result result = normalLookup(path,
+                                 const_cast<const Directory**>(parent));
+    if (result.status == Status::OK) {
+        // The caller is about to modify the tree below *parent, so mark the
+        // directories along the way as changed.
+        Directory* current = &superRoot;
+        current->lastChanged = epoch;
+        for (auto it = path.parents.begin(); it != path.parents.end(); ++it) {
+            current = current->lookupDirectory(*it);
+            current->lastChanged = epoch;
+        }
+    }
+    return result;
 }
 
 Result
@@ -346,6 +949,7 @@ Tree::mkdirLookup(const Path& path, Directory** parent)
     *parent = NULL;
     Result result;
     Directory* current = &superRoot;
+    current->lastChanged = epoch;
     for (auto it = path.parents.begin(); it != path.parents.end(); ++it) {
         Directory* next = current->makeDirectory(*it);
         if (next == NULL) {
@@ -356,6 +960,7 @@ Tree::mkdirLookup(const Path& path, Directory** parent)
             return result;
         }
         current = next;
+        current->lastChanged = epoch;
     }
     *parent = current;
     return result;
@@ -364,7 +969,39 @@ Tree::mkdirLookup(const Path& path, Directory** parent)
 void
 Tree::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
 {
-    superRoot.dumpSnapshot(stream);
+    std::string path;
+    superRoot.dumpSnapshot(stream, path, NULL, 0, NULL,
+                           snapshotDedup ? valuePool.get() : NULL);
+}
+
+void
+Tree::dumpSnapshot(Core::ProtoBuf::OutputStream& stream,
+                   const SnapshotBase* base,
+                   uint64_t minIndexedBytes,
+                   Snapshot::Index& index) const
+{
+    index.Clear();
+    // The earlier snapshot's references to shared values would dangle in a
+    // snapshot that doesn't list them.
+    if (base != NULL && base->values && !snapshotDedup)
+        base = NULL;
+    std::string path;
+    superRoot.dumpSnapshot(stream, path, base, minIndexedBytes, &index,
+                           snapshotDedup ? valuePool.get() : NULL);
+    if (snapshotDedup)
+        index.set_values(true);
+}
+
+void
+Tree::setSnapshotDedup(bool enabled)
+{
+    snapshotDedup = enabled;
+}
+
+uint64_t
+Tree::markSnapshot()
+{
+    return epoch++;
 }
 
 /**
@@ -374,7 +1011,96 @@ void
 Tree::loadSnapshot(Core::ProtoBuf::InputStream& stream)
 {
     superRoot = Directory();
-    superRoot.loadSnapshot(stream);
+    valuePool = std::make_shared<ValuePool>();
+    superRoot.loadSnapshot(stream, valuePool.get());
+}
+
+void
+Tree::loadSnapshotLazily(std::shared_ptr<const SnapshotBase> layout,
+                         uint64_t offset)
+{
+    superRoot = Directory();
+    valuePool = std::make_shared<ValuePool>();
+    uint64_t length = layout->length - std::min(offset, layout->length);
+    auto root = layout->subtrees.find("");
+    if (root != layout->subtrees.end() && root->second.first == offset)
+        length = root->second.second;
+    superRoot.loadLazily(layout, "", offset, length, valuePool);
+}
+
+bool
+Tree::loadPlaceholders(uint64_t maxBytes)
+{
+    return !superRoot.loadPlaceholders(maxBytes);
+}
+
+void
+Tree::loadContents(Tree& other)
+{
+    superRoot = std::move(other.superRoot);
+    valuePool = other.valuePool;
+    other.superRoot = Directory();
+    other.valuePool = std::make_shared<ValuePool>();
+}
+
+void
+Tree::loadSnapshot(const SnapshotBase& layout,
+                   uint64_t offset,
+                   uint64_t numThreads)
+{
+    superRoot = Directory();
+    valuePool = std::make_shared<ValuePool>();
+    Core::ProtoBuf::MemoryInputStream stream(layout.data, layout.length);
+    if (stream.skip(offset) != offset) {
+        PANIC("Couldn't read snapshot: tree starts at byte %lu but the "
+              "snapshot is only %lu bytes long",
+              offset, layout.length);
+    }
+
+    // Walk down the tree, skipping over directories of about this size.
+    uint64_t treeBytes = layout.length - offset;
+    auto root = layout.subtrees.find("");
+    if (root != layout.subtrees.end())
+        treeBytes = root->second.second;
+    numThreads = std::max(1UL, numThreads);
+    uint64_t maxDeferredBytes = std::max(1UL, treeBytes / (4 * numThreads));
+    std::vector<Directory::DeferredLoad> deferred;
+    std::string path;
+    superRoot.loadSnapshot(stream, path, layout, maxDeferredBytes, deferred,
+                           valuePool.get());
+
+    // Load the skipped directories, largest first so that the threads finish
+    // at about the same time.
+    std::sort(deferred.begin(), deferred.end(),
+              [] (const Directory::DeferredLoad& a,
+                  const Directory::DeferredLoad& b) {
+                  return a.length > b.length;
+              });
+    std::atomic<uint64_t> next(0);
+    ValuePool* pool = valuePool.get();
+    auto worker = [&layout, &deferred, &next, pool] () {
+        while (true) {
+            uint64_t i = next.fetch_add(1);
+            if (i >= deferred.size())
+                return;
+            const Directory::DeferredLoad& load = deferred.at(i);
+            Core::ProtoBuf::MemoryInputStream in(layout.data + load.offset,
+                                                 load.length);
+            load.directory->loadSnapshot(in, pool, load.values.get());
+            if (in.getBytesRead() != load.length) {
+                PANIC("Couldn't read snapshot: directory at byte %lu should "
+                      "be %lu bytes but was %lu",
+                      load.offset, load.length, in.getBytesRead());
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    uint64_t numHelpers = std::min(numThreads, uint64_t(deferred.size()));
+    for (uint64_t i = 1; i < numHelpers; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
 }
 
 
@@ -422,12 +1148,16 @@ Tree::makeDirectory(const std::string& symbolicPath)
     Result result = mkdirLookup(path, &parent);
     if (result.status != Status::OK)
         return result;
-    if (parent->makeDirectory(path.target) == NULL) {
+    Directory* targetDir = parent->makeDirectory(path.target);
+    if (targetDir == NULL) {
         result.status = Status::TYPE_ERROR;
         result.error = format("%s already exists but is a file",
                               path.symbolic.c_str());
         return result;
     }
+    // A new directory may replace one that was removed, so it must not look
+    // unchanged to incremental snapshots.
+    targetDir->lastChanged = epoch;
     ++numMakeDirectorySuccess;
     return result;
 }
@@ -435,9 +1165,22 @@ Tree::makeDirectory(const std::string& symbolicPath)
 Result
 Tree::listDirectory(const std::string& symbolicPath,
                     std::vector<std::string>& children) const
+{
+    bool more;
+    return listDirectory(symbolicPath, "", "", 0, children, more);
+}
+
+Result
+Tree::listDirectory(const std::string& symbolicPath,
+                    const std::string& prefix,
+                    const std::string& startAfter,
+                    uint64_t limit,
+                    std::vector<std::string>& children,
+                    bool& more) const
 {
     ++numListDirectoryAttempted;
     children.clear();
+    more = false;
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
@@ -458,7 +1201,7 @@ Tree::listDirectory(const std::string& symbolicPath,
         }
         return result;
     }
-    children = targetDir->getChildren();
+    more = targetDir->getChildren(prefix, startAfter, limit, children);
     ++numListDirectorySuccess;
     return result;
 }
@@ -499,7 +1242,7 @@ Tree::removeDirectory(const std::string& symbolicPath)
         // If the caller is trying to remove the root directory, we remove the
         // contents but not the directory itself. The easiest way to do this
         // is to drop but then recreate the directory.
-        parent->makeDirectory(path.target);
+        parent->makeDirectory(path.target)->lastChanged = epoch;
     }
     ++numRemoveDirectoryDone;
     ++numRemoveDirectorySuccess;
@@ -524,7 +1267,48 @@ Tree::write(const std::string& symbolicPath, const std::string& contents)
                               path.symbolic.c_str());
         return result;
     }
-    targetFile->contents = contents;
+    targetFile->setContents(*valuePool, contents);
+    ++numWriteSuccess;
+    return result;
+}
+
+Result
+Tree::write(const std::string& symbolicPath,
+            uint64_t offset,
+            const std::string& contents)
+{
+    ++numWriteAttempted;
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+    Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status != Status::OK)
+        return result;
+    if (parent->lookupDirectory(path.target) != NULL) {
+        result.status = Status::TYPE_ERROR;
+        result.error = format("%s is a directory",
+                              path.symbolic.c_str());
+        return result;
+    }
+    File* targetFile = parent->lookupFile(path.target);
+    uint64_t size = (targetFile == NULL ? 0 :
+                     targetFile->getContents().size());
+    if (offset > size) {
+        result.status = Status::INVALID_ARGUMENT;
+        result.error = format("Offset %lu is past the end of %s "
+                              "(%lu bytes)",
+                              offset,
+                              path.symbolic.c_str(),
+                              size);
+        return result;
+    }
+    if (targetFile == NULL)
+        targetFile = parent->makeFile(path.target);
+    targetFile->mutableContents().replace(offset,
+                                          std::min(uint64_t(contents.size()),
+                                                   size - offset),
+                                          contents);
     ++numWriteSuccess;
     return result;
 }
@@ -554,7 +1338,47 @@ Tree::read(const std::string& symbolicPath, std::string& contents) const
         }
         return result;
     }
-    contents = targetFile->contents;
+    contents = targetFile->getContents();
+    ++numReadSuccess;
+    return result;
+}
+
+Result
+Tree::read(const std::string& symbolicPath,
+           uint64_t offset,
+           uint64_t length,
+           std::string& contents,
+           uint64_t& size) const
+{
+    ++numReadAttempted;
+    contents.clear();
+    size = 0;
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+    const Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status != Status::OK)
+        return result;
+    const File* targetFile = parent->lookupFile(path.target);
+    if (targetFile == NULL) {
+        if (parent->lookupDirectory(path.target) != NULL) {
+            result.status = Status::TYPE_ERROR;
+            result.error = format("%s is a directory",
+                                  path.symbolic.c_str());
+        } else {
+            result.status = Status::LOOKUP_ERROR;
+            result.error = format("%s does not exist",
+                                  path.symbolic.c_str());
+        }
+        return result;
+    }
+    size = targetFile->getContents().size();
+    if (offset < size) {
+        if (length == 0)
+            length = size - offset;
+        contents = targetFile->getContents().substr(offset, length);
+    }
     ++numReadSuccess;
     return result;
 }
@@ -590,6 +1414,123 @@ Tree::removeFile(const std::string& symbolicPath)
     return result;
 }
 
+Result
+Tree::increment(const std::string& symbolicPath,
+                int64_t delta,
+                int64_t& value)
+{
+    ++numIncrementAttempted;
+    value = 0;
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+    Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status != Status::OK)
+        return result;
+    if (parent->lookupDirectory(path.target) != NULL) {
+        result.status = Status::TYPE_ERROR;
+        result.error = format("%s is a directory",
+                              path.symbolic.c_str());
+        return result;
+    }
+    int64_t oldValue = 0;
+    const File* targetFile = parent->lookupFile(path.target);
+    if (targetFile != NULL &&
+        !parseInteger(targetFile->getContents(), oldValue)) {
+        result.status = Status::TYPE_ERROR;
+        result.error = format("%s does not contain an integer",
+                              path.symbolic.c_str());
+        return result;
+    }
+    if ((delta > 0 &&
+         oldValue > std::numeric_limits<int64_t>::max() - delta) ||
+        (delta < 0 &&
+         oldValue < std::numeric_limits<int64_t>::min() - delta)) {
+        result.status = Status::INVALID_ARGUMENT;
+        result.error = format("Adding %ld to %s (%ld) would overflow",
+                              delta,
+                              path.symbolic.c_str(),
+                              oldValue);
+        return result;
+    }
+    value = oldValue + delta;
+    parent->makeFile(path.target)->setContents(*valuePool,
+                                               format("%ld", value));
+    ++numIncrementSuccess;
+    return result;
+}
+
+Result
+Tree::append(const std::string& symbolicPath, const std::string& contents)
+{
+    ++numAppendAttempted;
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+    Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status != Status::OK)
+        return result;
+    File* targetFile = parent->makeFile(path.target);
+    if (targetFile == NULL) {
+        result.status = Status::TYPE_ERROR;
+        result.error = format("%s is a directory",
+                              path.symbolic.c_str());
+        return result;
+    }
+    targetFile->mutableContents() += contents;
+    ++numAppendSuccess;
+    return result;
+}
+
+Result
+Tree::createSequential(const std::string& symbolicPath,
+                       const std::string& contents,
+                       std::string& created)
+{
+    ++numCreateSequentialAttempted;
+    created.clear();
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+    Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status != Status::OK)
+        return result;
+    std::string prefix = path.target;
+    if (Core::StringUtil::endsWith(symbolicPath, "/")) {
+        // path names the directory itself
+        Directory* directory = parent->lookupDirectory(path.target);
+        if (directory == NULL) {
+            if (parent->lookupFile(path.target) != NULL) {
+                result.status = Status::TYPE_ERROR;
+                result.error = format("%s is a file",
+                                      path.symbolic.c_str());
+            } else {
+                result.status = Status::LOOKUP_ERROR;
+                result.error = format("%s does not exist",
+                                      path.symbolic.c_str());
+            }
+            return result;
+        }
+        // normalLookup only marked the directories above this one, but the
+        // new file goes into it.
+        directory->lastChanged = epoch;
+        parent = directory;
+        prefix.clear();
+        path.parents.push_back(path.target);
+    }
+    std::string name = parent->makeSequentialFile(prefix);
+    parent->lookupFile(name)->setContents(*valuePool, contents);
+    created = path.parentsThrough(path.parents.end() - 1);
+    if (created != "/")
+        created += "/";
+    created += name;
+    ++numCreateSequentialSuccess;
+    return result;
+}
+
 void
 Tree::updateServerStats(Protocol::ServerStats::Tree& tstats) const
 {
@@ -633,6 +1574,22 @@ Tree::updateServerStats(Protocol::ServerStats::Tree& tstats) const
         numRemoveFileDone);
     tstats.set_num_remove_file_success(
         numRemoveFileSuccess);
+    tstats.set_num_increment_attempted(
+        numIncrementAttempted);
+    tstats.set_num_increment_success(
+        numIncrementSuccess);
+    tstats.set_num_append_attempted(
+        numAppendAttempted);
+    tstats.set_num_append_success(
+        numAppendSuccess);
+    tstats.set_num_create_sequential_attempted(
+        numCreateSequentialAttempted);
+    tstats.set_num_create_sequential_success(
+        numCreateSequentialSuccess);
+    tstats.set_num_shared_values(
+        valuePool->getNumValues());
+    tstats.set_shared_value_bytes(
+        valuePool->getNumBytes());
 }
 
 } // namespace LogCabin::Tree
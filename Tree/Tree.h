@@ -15,7 +15,11 @@
  */
 
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "Core/ProtoBuf.h"
@@ -32,6 +36,11 @@ class ServerStats_Tree;
 
 namespace Tree {
 
+// forward declaration
+namespace Snapshot {
+class Index;
+}
+
 /**
  * Status codes returned by Tree operations.
  */
@@ -92,8 +101,151 @@ struct Result {
     std::string error;
 };
 
+/**
+ * Describes a snapshot of a Tree held in memory along with the locations of
+ * its large directories. Tree::dumpSnapshot() can copy the serialized forms
+ * of directories that haven't changed since an earlier snapshot instead of
+ * serializing them again, and Tree::loadSnapshot() can use the locations to
+ * load independent directories in parallel.
+ */
+struct SnapshotBase {
+    /// Default constructor.
+    SnapshotBase();
+    /// Copy constructor. The copy refers to the same bytes as 'other'.
+    SnapshotBase(const SnapshotBase& other) = default;
+    /// Assignment. This refers to the same bytes as 'other' afterwards.
+    SnapshotBase& operator=(const SnapshotBase& other) = default;
+    /**
+     * The value that Tree::markSnapshot() returned when the earlier snapshot
+     * was taken.
+     */
+    uint64_t epoch;
+    /**
+     * The bytes of the snapshot, which must remain valid while
+     * Tree::dumpSnapshot() or Tree::loadSnapshot() runs.
+     */
+    const char* data;
+    /**
+     * The number of bytes at 'data'.
+     */
+    uint64_t length;
+    /**
+     * Map from the paths of directories (such as "/root/a", as found in the
+     * index written with the earlier snapshot) to the offset and length in
+     * 'data' of their serialized forms. This is ordered so that the entries
+     * below a copied directory can be carried over to the new index.
+     */
+    std::map<std::string, std::pair<uint64_t, uint64_t>> subtrees;
+    /**
+     * True if the earlier snapshot's files may refer to shared values (see
+     * Tree::setSnapshotDedup()), in which case its directories can only be
+     * copied into snapshots that also list the shared values.
+     */
+    bool values;
+};
+
 namespace Internal {
 
+/**
+ * A file value that's shared by every File with the same contents. See
+ * ValuePool.
+ */
+struct Value {
+    /// Constructor.
+    Value(std::string contents, uint64_t id);
+    /// The contents of the Files that refer to this value.
+    const std::string contents;
+    /// Identifies the value in snapshots; see ValuePool.
+    const uint64_t id;
+};
+
+/**
+ * Map from IDs to the shared values that a snapshot lists ahead of its
+ * directories, so that its files can refer to them.
+ */
+typedef std::unordered_map<uint64_t, std::shared_ptr<const Value>> ValueTable;
+
+/**
+ * Keeps a single copy of each distinct large file value in a Tree, so that
+ * memory use and snapshot sizes depend on the number of unique values rather
+ * than the number of files. Values are reference counted and leave the pool
+ * when the last File lets go of them. A value keeps the same ID for as long
+ * as it's in the pool, so that directories copied from an earlier snapshot
+ * can go on referring to it.
+ *
+ * This class is thread-safe, since several threads may load parts of a
+ * snapshot at once. It must be owned by a std::shared_ptr: values hold on to
+ * the pool until they're destroyed.
+ */
+class ValuePool : public std::enable_shared_from_this<ValuePool> {
+  public:
+    /// Values smaller than this aren't worth sharing and are kept in Files.
+    static const uint64_t MIN_BYTES = 64;
+
+    /// Constructor.
+    ValuePool();
+
+    /**
+     * Return the value in the pool with the given contents, adding it first
+     * if there isn't one.
+     * \param contents
+     *      The value's contents.
+     * \param id
+     *      The ID to give the value if it's added (as when loading a
+     *      snapshot), or 0 to assign the next unused ID.
+     */
+    std::shared_ptr<const Value> intern(std::string contents, uint64_t id = 0);
+
+    /**
+     * Return every value in the pool, ordered by ID.
+     */
+    std::vector<std::shared_ptr<const Value>> getValues() const;
+
+    /**
+     * Return the number of values in the pool.
+     */
+    uint64_t getNumValues() const;
+
+    /**
+     * Return the total size of the values in the pool, in bytes.
+     */
+    uint64_t getNumBytes() const;
+
+  private:
+    /**
+     * Called as a value is destroyed to remove it from the pool.
+     */
+    void release(const Value* value);
+
+    /// Hashes the string that a key points to.
+    struct Hash {
+        size_t operator()(const std::string* key) const;
+    };
+    /// Compares the strings that keys point to.
+    struct Equal {
+        bool operator()(const std::string* a, const std::string* b) const;
+    };
+
+    /**
+     * Protects all of the members below.
+     */
+    mutable std::mutex mutex;
+    /**
+     * Map from the contents of each value (pointing into the value itself) to
+     * the value. An entry may briefly outlive its value, until release().
+     */
+    std::unordered_map<const std::string*, std::weak_ptr<const Value>,
+                       Hash, Equal> values;
+    /**
+     * The ID to give the next value added with intern() (IDs start at 1).
+     */
+    uint64_t nextId;
+    /**
+     * The total size of the values in #values, in bytes.
+     */
+    uint64_t numBytes;
+};
+
 /**
  * A leaf object in the Tree; stores an opaque blob of data.
  */
@@ -101,18 +253,51 @@ class File {
   public:
     /// Default constructor.
     File();
+    /**
+     * Return the data stored in the File.
+     */
+    const std::string& getContents() const;
+    /**
+     * Replace the data stored in the File, sharing it through the pool if
+     * it's large enough.
+     */
+    void setContents(ValuePool& pool, const std::string& newContents);
+    /**
+     * Return the data stored in the File for modifying in place. This stops
+     * sharing the data, if it was shared (values that change piece by piece
+     * are not worth hashing again every time).
+     */
+    std::string& mutableContents();
     /**
      * Write the file to the stream.
+     * \param stream
+     *      Where to write the file.
+     * \param refs
+     *      If true and the file's contents are shared, write the ID of the
+     *      shared value rather than the contents themselves.
      */
-    void dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const;
+    void dumpSnapshot(Core::ProtoBuf::OutputStream& stream,
+                      bool refs = false) const;
     /**
      * Load the file from the stream.
+     * \param stream
+     *      Where to read the file from.
+     * \param pool
+     *      Large contents are shared through this pool, if it's not NULL.
+     * \param values
+     *      The snapshot's shared values, which the file may refer to.
      */
-    void loadSnapshot(Core::ProtoBuf::InputStream& stream);
+    void loadSnapshot(Core::ProtoBuf::InputStream& stream,
+                      ValuePool* pool = NULL,
+                      const ValueTable* values = NULL);
     /**
-     * Opaque data stored in the File.
+     * Opaque data stored in the File, unless it's shared through 'value'.
      */
     std::string contents;
+    /**
+     * If set, the File's data is this shared value, and 'contents' is empty.
+     */
+    std::shared_ptr<const Value> value;
 };
 
 /**
@@ -135,6 +320,30 @@ class Directory {
      */
     std::vector<std::string> getChildren() const;
 
+    /**
+     * List a window of the contents of the directory, in the same order as
+     * getChildren().
+     * \param prefix
+     *      Only names beginning with this prefix are listed. Directory names
+     *      are matched without their trailing slash.
+     * \param startAfter
+     *      Only names ordered after this one are listed. This is normally the
+     *      last name returned from a previous call (including its trailing
+     *      slash for directories), or empty to start from the beginning.
+     * \param limit
+     *      The maximum number of names to list, or 0 for no limit.
+     * \param[out] children
+     *      This will be replaced by the listed names. The names of
+     *      directories will have a trailing slash.
+     * \return
+     *      True if more names matching 'prefix' follow those listed in
+     *      'children', false otherwise.
+     */
+    bool getChildren(const std::string& prefix,
+                     const std::string& startAfter,
+                     uint64_t limit,
+                     std::vector<std::string>& children) const;
+
     /**
      * Find the child directory by the given name.
      * \param name
@@ -200,25 +409,233 @@ class Directory {
      */
     bool removeFile(const std::string& name);
 
+    /**
+     * Create a new child file whose name is the given prefix followed by this
+     * directory's next sequence number, zero-padded to 10 digits. Sequence
+     * numbers start at 0 and increase with every call (they are never
+     * reused, even if the files are removed). Names that are already taken
+     * are skipped.
+     * \param prefix
+     *      The beginning of the new file's name. May be empty.
+     * \return
+     *      The name of the new file.
+     */
+    std::string makeSequentialFile(const std::string& prefix);
+
     /**
      * Write the directory and its children to the stream.
      */
     void dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const;
+    /**
+     * Write the directory and its children to the stream, copying it from an
+     * earlier snapshot if it hasn't changed since. See Tree::dumpSnapshot().
+     * \param stream
+     *      Where to write the directory.
+     * \param path
+     *      The path of this directory, used as its key in the index. This is
+     *      used as scratch space for children but restored before returning.
+     * \param base
+     *      An earlier snapshot, or NULL.
+     * \param minIndexedBytes
+     *      Directories smaller than this are not added to 'index'.
+     * \param[out] index
+     *      Where to record the locations of large directories, or NULL.
+     * \param pool
+     *      If not NULL, files refer to their shared values by ID, and the
+     *      super root (the directory with an empty path) lists every value in
+     *      this pool ahead of its children.
+     */
+    void dumpSnapshot(Core::ProtoBuf::OutputStream& stream,
+                      std::string& path,
+                      const SnapshotBase* base,
+                      uint64_t minIndexedBytes,
+                      Snapshot::Index* index,
+                      const ValuePool* pool = NULL) const;
     /**
      * Load the directory and its children from the stream.
+     * \param stream
+     *      Where to read the directory from.
+     * \param pool
+     *      Large file contents are shared through this pool, if it's not
+     *      NULL.
+     * \param values
+     *      The snapshot's shared values, unless this directory lists them
+     *      itself.
      */
-    void loadSnapshot(Core::ProtoBuf::InputStream& stream);
+    void loadSnapshot(Core::ProtoBuf::InputStream& stream,
+                      ValuePool* pool = NULL,
+                      const ValueTable* values = NULL);
+
+    /**
+     * A child directory whose serialized form was skipped over by
+     * loadSnapshot(), to be loaded separately (possibly by another thread).
+     */
+    struct DeferredLoad {
+        /// The (empty) directory to load into.
+        Directory* directory;
+        /// The directory's path, its key in SnapshotBase::subtrees.
+        std::string path;
+        /// The offset of its serialized form in SnapshotBase::data.
+        uint64_t offset;
+        /// The length of its serialized form.
+        uint64_t length;
+        /// The snapshot's shared values, if any.
+        std::shared_ptr<const ValueTable> values;
+    };
+
+    /**
+     * Load the directory from the stream, but skip over child directories
+     * whose locations are known and which are no larger than
+     * 'maxDeferredBytes', leaving them to be loaded later. See
+     * Tree::loadSnapshot().
+     * \param stream
+     *      Where to read the directory from. Its getBytesRead() must count
+     *      bytes from the start of layout.data.
+     * \param path
+     *      The path of this directory, used as its key in layout.subtrees.
+     *      This is used as scratch space for children but restored before
+     *      returning.
+     * \param layout
+     *      The snapshot and the locations of its large directories.
+     * \param maxDeferredBytes
+     *      Indexed child directories larger than this are loaded in place
+     *      (deferring their own children instead), so that the deferred loads
+     *      come out about this size.
+     * \param[out] deferred
+     *      The skipped child directories are appended here.
+     * \param pool
+     *      Large file contents are shared through this pool, if it's not
+     *      NULL.
+     * \param values
+     *      The snapshot's shared values, unless this directory lists them
+     *      itself.
+     */
+    void loadSnapshot(Core::ProtoBuf::MemoryInputStream& stream,
+                      std::string& path,
+                      const SnapshotBase& layout,
+                      uint64_t maxDeferredBytes,
+                      std::vector<DeferredLoad>& deferred,
+                      ValuePool* pool = NULL,
+                      std::shared_ptr<const ValueTable> values =
+                        std::shared_ptr<const ValueTable>());
+
+    /**
+     * The Tree's epoch (see Tree::markSnapshot()) when this directory or
+     * anything below it was last changed, or 0 if it hasn't changed since it
+     * was loaded or created.
+     */
+    uint64_t lastChanged;
+
+    /**
+     * Turn this (empty) directory into a placeholder whose contents are
+     * parsed out of a snapshot in memory the first time they're needed.
+     * Until then, dumpSnapshot() copies the serialized form as is.
+     * \param source
+     *      The snapshot and the locations of its large directories. Its data
+     *      is kept alive until every placeholder that refers to it has been
+     *      loaded or destroyed.
+     * \param path
+     *      The path of this directory, its key in source->subtrees.
+     * \param offset
+     *      The offset of the directory's serialized form in source->data.
+     * \param length
+     *      The length of the directory's serialized form.
+     * \param pool
+     *      Large file contents are shared through this pool when the
+     *      directory is loaded, if it's not NULL.
+     * \param values
+     *      The snapshot's shared values, if any. These are kept alive along
+     *      with 'source'.
+     */
+    void loadLazily(std::shared_ptr<const SnapshotBase> source,
+                    const std::string& path,
+                    uint64_t offset,
+                    uint64_t length,
+                    std::shared_ptr<ValuePool> pool =
+                        std::shared_ptr<ValuePool>(),
+                    std::shared_ptr<const ValueTable> values =
+                        std::shared_ptr<const ValueTable>());
+
+    /**
+     * Return true if this directory is a placeholder from loadLazily() that
+     * hasn't been loaded yet.
+     */
+    bool isLazy() const;
+
+    /**
+     * Load the placeholders in this directory and below it, in order, until
+     * about 'budget' bytes of their serialized forms have been parsed.
+     * \param[in,out] budget
+     *      The number of bytes left to parse. Each placeholder's length is
+     *      subtracted from this as it's loaded. At least one placeholder is
+     *      loaded if this starts out nonzero.
+     * \return
+     *      True if no placeholders are left in this directory or below it;
+     *      false if 'budget' ran out first.
+     */
+    bool loadPlaceholders(uint64_t& budget);
 
   private:
+    /**
+     * Where a placeholder directory's contents come from. See loadLazily().
+     */
+    struct LazyLoad {
+        /// See loadLazily().
+        std::shared_ptr<const SnapshotBase> source;
+        /// See loadLazily().
+        std::string path;
+        /// See loadLazily().
+        uint64_t offset;
+        /// See loadLazily().
+        uint64_t length;
+        /// See loadLazily().
+        std::shared_ptr<ValuePool> pool;
+        /// See loadLazily().
+        std::shared_ptr<const ValueTable> values;
+    };
+
+    /**
+     * If this directory is a placeholder, parse its contents now, leaving its
+     * large child directories as placeholders in turn. Every method that
+     * looks at the children calls this first. This is const because loading
+     * doesn't change what the directory logically contains; the members it
+     * fills in are mutable. As a result, even const methods modify a lazily
+     * loaded tree, so readers must be serialized with each other as well as
+     * with writers (StateMachine holds its mutex for both).
+     */
+    void materialize() const;
+
+    /**
+     * Serialize this directory and then its children. Helper for
+     * dumpSnapshot(); the parameters are the same.
+     */
+    void serializeChildren(Core::ProtoBuf::OutputStream& stream,
+                           std::string& path,
+                           const SnapshotBase* base,
+                           uint64_t minIndexedBytes,
+                           Snapshot::Index* index,
+                           const ValuePool* pool) const;
+
     /**
      * Map from names of child directories (without trailing slashes) to the
-     * Directory objects.
+     * Directory objects. Mutable for materialize().
      */
-    std::map<std::string, Directory> directories;
+    mutable std::map<std::string, Directory> directories;
     /**
-     * Map from names of child files to the File objects.
+     * Map from names of child files to the File objects. Mutable for
+     * materialize().
      */
-    std::map<std::string, File> files;
+    mutable std::map<std::string, File> files;
+    /**
+     * The sequence number for the next call to makeSequentialFile(). Mutable
+     * for materialize().
+     */
+    mutable uint64_t nextSequence;
+    /**
+     * Set if this directory is a placeholder that hasn't been loaded yet;
+     * see loadLazily(). The other members are empty until then.
+     */
+    mutable std::unique_ptr<LazyLoad> lazy;
 };
 
 /**
@@ -296,6 +713,50 @@ class Tree {
      */
     void dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const;
 
+    /**
+     * Write the tree to the given stream, copying directories that haven't
+     * changed since an earlier snapshot from that snapshot instead of
+     * serializing them again. The result is the same as with
+     * dumpSnapshot(stream), but the time it takes is proportional to the
+     * amount of data that has changed rather than the total size of the tree
+     * (once the directories are large enough to be indexed).
+     * \param stream
+     *      Where to write the tree. Its getBytesWritten() must count bytes
+     *      from the start of the snapshot file for 'index' to be useful.
+     * \param base
+     *      An earlier snapshot of this tree with its index, or NULL to
+     *      serialize every directory.
+     * \param minIndexedBytes
+     *      Directories whose serialized forms are smaller than this are not
+     *      added to 'index' (it's cheap enough to serialize them again).
+     * \param[out] index
+     *      Filled in with the locations of large directories in 'stream', to
+     *      be passed as the SnapshotBase for the next snapshot.
+     */
+    void dumpSnapshot(Core::ProtoBuf::OutputStream& stream,
+                      const SnapshotBase* base,
+                      uint64_t minIndexedBytes,
+                      Snapshot::Index& index) const;
+
+    /**
+     * Choose whether dumpSnapshot() writes each shared file value once, at
+     * the start of the snapshot, with files referring to it by ID, or writes
+     * every file's contents in full. The former is smaller when many files
+     * hold the same large values, but versions of LogCabin that predate it
+     * can't read such snapshots. Either kind can be loaded. Off by default.
+     */
+    void setSnapshotDedup(bool enabled);
+
+    /**
+     * Start a new epoch for tracking changes, for incremental snapshots. Call
+     * this just before taking a snapshot; directories changed after this
+     * call will be newer than the returned value.
+     * \return
+     *      The epoch that the snapshot covers, to be used as
+     *      SnapshotBase::epoch for the next snapshot.
+     */
+    uint64_t markSnapshot();
+
     /**
      * Load the tree from the given stream.
      * \warning
@@ -303,6 +764,70 @@ class Tree {
      */
     void loadSnapshot(Core::ProtoBuf::InputStream& stream);
 
+    /**
+     * Load the tree from a snapshot in memory, using the locations of its
+     * large directories to load independent directories on several threads.
+     * The result is the same as with loadSnapshot(stream).
+     * \param layout
+     *      The snapshot and the index written with it (see dumpSnapshot()).
+     *      The epoch is ignored.
+     * \param offset
+     *      Where the tree starts in layout.data.
+     * \param numThreads
+     *      The maximum number of threads to use, including the calling
+     *      thread.
+     * \warning
+     *      This will blow away any existing files and directories.
+     */
+    void loadSnapshot(const SnapshotBase& layout,
+                      uint64_t offset,
+                      uint64_t numThreads);
+
+    /**
+     * Load the tree from a snapshot in memory on demand: each large
+     * directory is parsed out of the snapshot only when it is first read or
+     * modified, and a later snapshot copies the directories that are never
+     * touched straight from this one. This returns right away, regardless of
+     * the size of the snapshot.
+     * \param layout
+     *      The snapshot and the index written with it (see dumpSnapshot()).
+     *      The epoch is ignored. This is kept until every directory has been
+     *      loaded (see loadPlaceholders()), the tree is loaded again, or the
+     *      tree is destroyed.
+     * \param offset
+     *      Where the tree starts in layout->data.
+     * \warning
+     *      This will blow away any existing files and directories. A snapshot
+     *      that is corrupt is only detected when the damaged directory is
+     *      used, at which point this PANICs.
+     */
+    void loadSnapshotLazily(std::shared_ptr<const SnapshotBase> layout,
+                            uint64_t offset);
+
+    /**
+     * Parse some of the directories that loadSnapshotLazily() left to be
+     * loaded when first used. Once none are left, the tree lets go of the
+     * snapshot it was loaded from. This lets that snapshot be released a
+     * piece at a time after it's been superseded, without waiting for every
+     * directory to be used.
+     * \param maxBytes
+     *      Stop once about this many bytes of the snapshot have been parsed.
+     *      Must be nonzero.
+     * \return
+     *      True if directories are still waiting to be loaded; false if the
+     *      whole tree is loaded.
+     */
+    bool loadPlaceholders(uint64_t maxBytes);
+
+    /**
+     * Replace this tree's files and directories with those of 'other', which
+     * is left empty. This lets a tree be loaded from a snapshot on another
+     * thread and take effect all at once.
+     * \warning
+     *      This will blow away any existing files and directories.
+     */
+    void loadContents(Tree& other);
+
     /**
      * Verify that the file at path has the given contents.
      * \param path
@@ -356,6 +881,38 @@ class Tree {
     listDirectory(const std::string& path,
                   std::vector<std::string>& children) const;
 
+    /**
+     * List part of the contents of a directory. This is used to page through
+     * large directories without copying out all of their children at once.
+     * \param path
+     *      The directory whose direct children to list.
+     * \param prefix
+     *      Only list children whose names begin with this prefix. Directory
+     *      names are matched without their trailing slash.
+     * \param startAfter
+     *      Only list children ordered after this name, which is normally the
+     *      last child returned by the previous call. Pass the empty string to
+     *      start from the beginning.
+     * \param limit
+     *      The maximum number of children to list, or 0 for no limit.
+     * \param[out] children
+     *      This will be replaced by the names of the listed children, in the
+     *      same order as listDirectory() above.
+     * \param[out] more
+     *      Set to true if more children matching 'prefix' follow those
+     *      returned, false otherwise.
+     * \return
+     *      Status and error message. Possible errors are the same as for
+     *      listDirectory() above.
+     */
+    Result
+    listDirectory(const std::string& path,
+                  const std::string& prefix,
+                  const std::string& startAfter,
+                  uint64_t limit,
+                  std::vector<std::string>& children,
+                  bool& more) const;
+
     /**
      * Make sure a directory does not exist.
      * Also removes all direct and indirect children of the directory.
@@ -392,6 +949,28 @@ class Tree {
     Result
     write(const std::string& path, const std::string& contents);
 
+    /**
+     * Overwrite part of the value of a file, creating the file if it does
+     * not exist. Bytes outside of the range written are left unchanged, and
+     * the file grows if the range extends past its end.
+     * \param path
+     *      The path of the file to modify.
+     * \param offset
+     *      The position within the file at which to place 'contents'. This
+     *      may be at most the current size of the file (writes may not leave
+     *      holes).
+     * \param contents
+     *      The bytes to place at 'offset'.
+     * \return
+     *      Status and error message. Possible errors are the same as for
+     *      write() above, plus:
+     *       - INVALID_ARGUMENT if offset is past the end of the file.
+     */
+    Result
+    write(const std::string& path,
+          uint64_t offset,
+          const std::string& contents);
+
     /**
      * Get the value of a file.
      * \param path
@@ -409,6 +988,32 @@ class Tree {
     Result
     read(const std::string& path, std::string& contents) const;
 
+    /**
+     * Get part of the value of a file. This is used to read large files
+     * without copying out their entire contents.
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param offset
+     *      The position within the file of the first byte to read. If this is
+     *      at or past the end of the file, no bytes are read.
+     * \param length
+     *      The maximum number of bytes to read, or 0 to read through the end
+     *      of the file.
+     * \param[out] contents
+     *      The bytes of the file in the requested range.
+     * \param[out] size
+     *      The total size of the file in bytes. Set to 0 on errors.
+     * \return
+     *      Status and error message. Possible errors are the same as for
+     *      read() above.
+     */
+    Result
+    read(const std::string& path,
+         uint64_t offset,
+         uint64_t length,
+         std::string& contents,
+         uint64_t& size) const;
+
     /**
      * Make sure a file does not exist.
      * \param path
@@ -422,6 +1027,72 @@ class Tree {
     Result
     removeFile(const std::string& path);
 
+    /**
+     * Add to the integer stored in a file. The file holds a signed decimal
+     * integer in ASCII (with no leading plus sign or whitespace). A file that
+     * does not exist or is empty is treated as holding 0, so it is created
+     * with the value 'delta'.
+     * \param path
+     *      The path of the file whose value to change.
+     * \param delta
+     *      The amount to add to the file's value (may be negative).
+     * \param[out] value
+     *      The file's new value. Set to 0 on errors.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the new value would not fit in an int64_t.
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     *       - TYPE_ERROR if the file's contents are not an integer.
+     */
+    Result
+    increment(const std::string& path, int64_t delta, int64_t& value);
+
+    /**
+     * Add to the end of a file's contents. The file is created if it does not
+     * exist.
+     * \param path
+     *      The path of the file to append to.
+     * \param contents
+     *      The bytes to add to the end of the file.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     */
+    Result
+    append(const std::string& path, const std::string& contents);
+
+    /**
+     * Create a new file with a unique name. The name is the last component of
+     * 'path' followed by a sequence number, zero-padded to 10 digits, that
+     * increases with every such file created in the same directory. This lets
+     * many clients add entries to a queue without coordinating.
+     * \param path
+     *      The directory and name prefix for the new file, such as
+     *      "/queue/item-". If this ends in a slash, it names the directory,
+     *      and the new file's name is just the sequence number.
+     * \param contents
+     *      The initial value of the new file.
+     * \param[out] created
+     *      The absolute path of the new file, such as
+     *      "/queue/item-0000000007". Set to the empty string on errors.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - LOOKUP_ERROR if the directory does not exist.
+     *       - TYPE_ERROR if a parent of the directory is a file.
+     *       - TYPE_ERROR if the directory is a file.
+     */
+    Result
+    createSequential(const std::string& path,
+                     const std::string& contents,
+                     std::string& created);
+
     /**
      * Add metrics about the tree to the given structure.
      */
@@ -467,6 +1138,13 @@ class Tree {
     Result
     mkdirLookup(const Internal::Path& path, Internal::Directory** parent);
 
+    /**
+     * The current epoch for tracking changes (see markSnapshot()). Every
+     * directory along the path of a modifying operation has its lastChanged
+     * set to this.
+     */
+    uint64_t epoch;
+
     /**
      * This directory contains the root directory. The super root has a single
      * child directory named "root", and the rest of the tree lies below
@@ -479,6 +1157,18 @@ class Tree {
      */
     Internal::Directory superRoot;
 
+    /**
+     * Shares large file values among the files in the tree. This is replaced
+     * whenever the tree is loaded, so that the IDs from the snapshot can be
+     * used as they are.
+     */
+    std::shared_ptr<Internal::ValuePool> valuePool;
+
+    /**
+     * See setSnapshotDedup().
+     */
+    bool snapshotDedup;
+
     // Server stats collected in updateServerStats.
     // Note that when a condition fails, the operation is not invoked,
     // so operations whose conditions fail are not counted as 'Attempted'.
@@ -502,6 +1192,12 @@ class Tree {
     uint64_t numRemoveFileTargetNotFound;
     uint64_t numRemoveFileDone;
     uint64_t numRemoveFileSuccess;
+    uint64_t numIncrementAttempted;
+    uint64_t numIncrementSuccess;
+    uint64_t numAppendAttempted;
+    uint64_t numAppendSuccess;
+    uint64_t numCreateSequentialAttempted;
+    uint64_t numCreateSequentialSuccess;
 };
 
 
@@ -19,6 +19,7 @@
 #include <stdexcept>
 #include <sys/stat.h>
 
+#include "build/Tree/Snapshot.pb.h"
 #include "Core/StringUtil.h"
 #include "Tree/Tree.h"
 #include "Storage/FilesystemUtil.h"
@@ -30,6 +31,7 @@ namespace Tree {
 namespace {
 
 using namespace Internal; // NOLINT
+using Core::StringUtil::format;
 
 #define EXPECT_OK(c) do { \
     Result result = (c); \
@@ -56,6 +58,52 @@ dumpTreeHelper(const Tree& tree,
     }
 }
 
+/**
+ * Collects snapshot bytes in memory, in the same format as
+ * Storage::SnapshotFile::Writer, and counts the bytes copied with writeRaw.
+ */
+class StringOutputStream : public Core::ProtoBuf::OutputStream {
+  public:
+    StringOutputStream()
+        : data()
+        , rawBytes(0)
+    {
+    }
+    uint64_t getBytesWritten() const {
+        return data.size();
+    }
+    void writeMessage(const google::protobuf::Message& message) {
+        std::string bytes = message.SerializeAsString();
+        uint32_t length = htobe32(uint32_t(bytes.size()));
+        data.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        data.append(bytes);
+    }
+    void writeRaw(const void* raw, uint64_t length) {
+        data.append(static_cast<const char*>(raw), length);
+        rawBytes += length;
+    }
+    std::string data;
+    uint64_t rawBytes;
+};
+
+/**
+ * Build a SnapshotBase for Tree::dumpSnapshot or Tree::loadSnapshot from an
+ * earlier dump.
+ */
+SnapshotBase
+makeBase(const StringOutputStream& stream,
+         const Snapshot::Index& index,
+         uint64_t epoch)
+{
+    SnapshotBase base;
+    base.epoch = epoch;
+    base.data = stream.data.data();
+    base.length = stream.data.size();
+    for (auto it = index.subtree().begin(); it != index.subtree().end(); ++it)
+        base.subtrees[it->path()] = {it->offset(), it->length()};
+    return base;
+}
+
 std::string
 dumpTree(const Tree& tree)
 {
@@ -89,6 +137,39 @@ TEST(TreeFileTest, dumpSnapshot)
     }
 }
 
+TEST(TreeValuePoolTest, intern)
+{
+    std::shared_ptr<ValuePool> pool = std::make_shared<ValuePool>();
+    std::string big(100, 'x');
+    std::shared_ptr<const Value> a = pool->intern(big);
+    std::shared_ptr<const Value> b = pool->intern(big);
+    EXPECT_EQ(a.get(), b.get());
+    EXPECT_EQ(1U, a->id);
+    std::shared_ptr<const Value> c = pool->intern(std::string(100, 'y'));
+    EXPECT_EQ(2U, c->id);
+    // IDs from a snapshot are kept, and new ones are assigned after them
+    std::shared_ptr<const Value> d = pool->intern(std::string(100, 'z'), 7);
+    EXPECT_EQ(7U, d->id);
+    EXPECT_EQ(8U, pool->intern(std::string(100, 'w'))->id);
+    EXPECT_EQ(3U, pool->getNumValues());
+    EXPECT_EQ(300U, pool->getNumBytes());
+    std::vector<std::shared_ptr<const Value>> values = pool->getValues();
+    ASSERT_EQ(3U, values.size());
+    EXPECT_EQ(1U, values.at(0)->id);
+    EXPECT_EQ(2U, values.at(1)->id);
+    EXPECT_EQ(7U, values.at(2)->id);
+
+    // values leave the pool with their last reference
+    values.clear();
+    a.reset();
+    EXPECT_EQ(3U, pool->getNumValues());
+    b.reset();
+    c.reset();
+    EXPECT_EQ(1U, pool->getNumValues());
+    EXPECT_EQ(100U, pool->getNumBytes());
+    EXPECT_EQ(9U, pool->intern(big)->id);
+}
+
 TEST(TreeDirectoryTest, getChildren)
 {
     Directory d;
@@ -103,6 +184,80 @@ TEST(TreeDirectoryTest, getChildren)
                }), d.getChildren());
 }
 
+TEST(TreeDirectoryTest, getChildren_window)
+{
+    Directory d;
+    std::vector<std::string> children;
+    EXPECT_FALSE(d.getChildren("", "", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+               }), children);
+    d.makeDirectory("aa");
+    d.makeDirectory("ab");
+    d.makeDirectory("b");
+    d.makeFile("ac");
+    d.makeFile("ad");
+    d.makeFile("c");
+
+    EXPECT_FALSE(d.getChildren("", "", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "aa/", "ab/", "b/", "ac", "ad", "c",
+               }), children);
+
+    // prefix
+    EXPECT_FALSE(d.getChildren("a", "", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "aa/", "ab/", "ac", "ad",
+               }), children);
+    EXPECT_FALSE(d.getChildren("z", "", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+               }), children);
+
+    // limit
+    EXPECT_TRUE(d.getChildren("", "", 2, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "aa/", "ab/",
+               }), children);
+    EXPECT_TRUE(d.getChildren("", "", 3, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "aa/", "ab/", "b/",
+               }), children);
+    EXPECT_FALSE(d.getChildren("a", "", 4, children));
+    EXPECT_EQ(4U, children.size());
+
+    // startAfter a directory
+    EXPECT_TRUE(d.getChildren("", "ab/", 2, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "b/", "ac",
+               }), children);
+    EXPECT_FALSE(d.getChildren("a", "ab/", 2, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "ac", "ad",
+               }), children);
+
+    // startAfter a file
+    EXPECT_FALSE(d.getChildren("", "ac", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "ad", "c",
+               }), children);
+    EXPECT_FALSE(d.getChildren("a", "ad", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+               }), children);
+
+    // startAfter a name that doesn't exist, before and after the prefix
+    EXPECT_FALSE(d.getChildren("a", "0", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "ac", "ad",
+               }), children);
+    EXPECT_FALSE(d.getChildren("a", "0/", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "aa/", "ab/", "ac", "ad",
+               }), children);
+    EXPECT_FALSE(d.getChildren("", "zz/", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "ac", "ad", "c",
+               }), children);
+}
+
 TEST(TreeDirectoryTest, lookupDirectory)
 {
     Directory d;
@@ -202,6 +357,20 @@ TEST(TreeDirectoryTest, removeFile)
                }), d.getChildren());
 }
 
+TEST(TreeDirectoryTest, makeSequentialFile)
+{
+    Directory d;
+    EXPECT_EQ("0000000000", d.makeSequentialFile(""));
+    d.makeDirectory("a-0000000002");
+    d.makeFile("a-0000000003");
+    EXPECT_EQ("a-0000000001", d.makeSequentialFile("a-"));
+    EXPECT_EQ("a-0000000004", d.makeSequentialFile("a-"));
+    d.removeFile("a-0000000004");
+    EXPECT_EQ("b-0000000005", d.makeSequentialFile("b-"));
+    EXPECT_EQ(6U, d.nextSequence);
+    EXPECT_TRUE(NULL != d.lookupFile("b-0000000005"));
+}
+
 TEST(TreeDirectoryTest, dumpSnapshot)
 {
     Tree tree;
@@ -229,6 +398,32 @@ TEST(TreeDirectoryTest, dumpSnapshot)
     }
 }
 
+TEST(TreeDirectoryTest, dumpSnapshot_nextSequence)
+{
+    Tree tree;
+    tree.makeDirectory("/a");
+    std::string created;
+    tree.createSequential("/a/", "", created);
+    tree.createSequential("/a/", "", created);
+    tree.removeFile(created);
+
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.superRoot.dumpSnapshot(writer);
+        writer.save();
+    }
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        Tree t2;
+        t2.superRoot.loadSnapshot(reader);
+        EXPECT_EQ(0U, t2.superRoot.lookupDirectory("root")->nextSequence);
+        EXPECT_OK(t2.createSequential("/a/", "", created));
+        EXPECT_EQ("/a/0000000002", created);
+    }
+}
+
 TEST(TreePathTest, constructor)
 {
     Path p1("");
@@ -302,6 +497,386 @@ TEST_F(TreeTreeTest, dumpSnapshot)
     EXPECT_EQ((std::vector<std::string>{ "c" }), children);
 }
 
+TEST_F(TreeTreeTest, dumpSnapshot_incremental)
+{
+    EXPECT_OK(tree.makeDirectory("/a"));
+    EXPECT_OK(tree.makeDirectory("/b"));
+    EXPECT_OK(tree.makeDirectory("/c/d"));
+    EXPECT_OK(tree.makeDirectory("/e"));
+    for (uint64_t i = 0; i < 10; ++i) {
+        EXPECT_OK(tree.write(format("/a/%lu", i), "aaaaaaaaaa"));
+        EXPECT_OK(tree.write(format("/b/%lu", i), "bbbbbbbbbb"));
+        EXPECT_OK(tree.write(format("/c/d/%lu", i), "dddddddddd"));
+    }
+    EXPECT_OK(tree.write("/e/f", "x"));
+
+    uint64_t epoch = tree.markSnapshot();
+    StringOutputStream first;
+    Snapshot::Index index;
+    tree.dumpSnapshot(first, NULL, 100, index);
+    EXPECT_EQ(0U, first.rawBytes);
+    std::vector<std::string> paths;
+    for (auto it = index.subtree().begin(); it != index.subtree().end(); ++it)
+        paths.push_back(it->path());
+    // small directories like /root/e are left out
+    EXPECT_EQ((std::vector<std::string>{
+                   "/root/a", "/root/b", "/root/c/d", "/root/c", "/root", "",
+               }), paths);
+
+    EXPECT_OK(tree.write("/a/3", "changed"));
+    EXPECT_OK(tree.write("/e/f", "changed"));
+    SnapshotBase base = makeBase(first, index, epoch);
+    tree.markSnapshot();
+    StringOutputStream second;
+    Snapshot::Index index2;
+    tree.dumpSnapshot(second, &base, 100, index2);
+    StringOutputStream full;
+    tree.dumpSnapshot(full);
+    EXPECT_EQ(full.data, second.data);
+    // /root/b and /root/c were copied
+    EXPECT_EQ(base.subtrees.at("/root/b").second +
+              base.subtrees.at("/root/c").second,
+              second.rawBytes);
+    EXPECT_EQ(index.subtree_size(), index2.subtree_size());
+
+    // a removed directory that's created again must not be copied
+    SnapshotBase base2 = makeBase(second, index2, tree.markSnapshot());
+    EXPECT_OK(tree.removeDirectory("/b"));
+    EXPECT_OK(tree.makeDirectory("/b"));
+    StringOutputStream third;
+    tree.dumpSnapshot(third, &base2, 100, index);
+    StringOutputStream full2;
+    tree.dumpSnapshot(full2);
+    EXPECT_EQ(full2.data, third.data);
+    // /root/a and /root/c were copied (/root/a changed before base2)
+    EXPECT_EQ(base2.subtrees.at("/root/a").second +
+              base2.subtrees.at("/root/c").second,
+              third.rawBytes);
+}
+
+TEST_F(TreeTreeTest, loadSnapshot_parallel)
+{
+    EXPECT_OK(tree.makeDirectory("/a"));
+    EXPECT_OK(tree.makeDirectory("/b"));
+    EXPECT_OK(tree.makeDirectory("/c/d"));
+    EXPECT_OK(tree.makeDirectory("/e"));
+    for (uint64_t i = 0; i < 10; ++i) {
+        EXPECT_OK(tree.write(format("/a/%lu", i), "aaaaaaaaaa"));
+        EXPECT_OK(tree.write(format("/b/%lu", i), "bbbbbbbbbb"));
+        EXPECT_OK(tree.write(format("/c/d/%lu", i), "dddddddddd"));
+    }
+    EXPECT_OK(tree.write("/c/f", "x"));
+    EXPECT_OK(tree.write("/e/f", "x"));
+    std::string name;
+    EXPECT_OK(tree.createSequential("/b/seq-", "x", name));
+
+    StringOutputStream stream;
+    Snapshot::Index index;
+    tree.dumpSnapshot(stream, NULL, 100, index);
+    SnapshotBase layout = makeBase(stream, index, 0);
+
+    // /root and /root/c are too big to defer whole, so their indexed
+    // children are deferred instead; /root/e isn't indexed.
+    Directory loaded;
+    Core::ProtoBuf::MemoryInputStream in(stream.data.data(),
+                                         stream.data.size());
+    std::string path;
+    std::vector<Directory::DeferredLoad> deferred;
+    loaded.loadSnapshot(in, path, layout,
+                        layout.subtrees.at("/root/c").second - 1, deferred);
+    EXPECT_EQ("", path);
+    EXPECT_EQ(stream.data.size(), in.getBytesRead());
+    ASSERT_EQ(3U, deferred.size());
+    Directory* root = loaded.lookupDirectory("root");
+    EXPECT_EQ(root->lookupDirectory("a"), deferred.at(0).directory);
+    EXPECT_EQ(root->lookupDirectory("b"), deferred.at(1).directory);
+    EXPECT_EQ(root->lookupDirectory("c")->lookupDirectory("d"),
+              deferred.at(2).directory);
+    EXPECT_EQ(layout.subtrees.at("/root/c/d"),
+              std::make_pair(deferred.at(2).offset, deferred.at(2).length));
+    EXPECT_EQ((std::vector<std::string>{"f"}),
+              root->lookupDirectory("e")->getChildren());
+    EXPECT_EQ(0U, deferred.at(0).directory->getChildren().size());
+
+    for (uint64_t threads = 1; threads <= 8; threads *= 2) {
+        Tree copy;
+        copy.loadSnapshot(layout, 0, threads);
+        EXPECT_EQ(dumpTree(tree), dumpTree(copy)) << threads;
+        StringOutputStream redump;
+        copy.dumpSnapshot(redump);
+        EXPECT_EQ(stream.data, redump.data) << threads;
+    }
+
+    // without an index, everything is loaded in place
+    layout.subtrees.clear();
+    Tree copy;
+    copy.loadSnapshot(layout, 0, 4);
+    EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+}
+
+TEST_F(TreeTreeTest, loadSnapshotLazily)
+{
+    EXPECT_OK(tree.makeDirectory("/a"));
+    EXPECT_OK(tree.makeDirectory("/b"));
+    EXPECT_OK(tree.makeDirectory("/c/d"));
+    for (uint64_t i = 0; i < 10; ++i) {
+        EXPECT_OK(tree.write(format("/a/%lu", i), "aaaaaaaaaa"));
+        EXPECT_OK(tree.write(format("/b/%lu", i), "bbbbbbbbbb"));
+        EXPECT_OK(tree.write(format("/c/d/%lu", i), "dddddddddd"));
+    }
+    EXPECT_OK(tree.write("/c/f", "x"));
+    StringOutputStream stream;
+    Snapshot::Index index;
+    tree.dumpSnapshot(stream, NULL, 100, index);
+    std::shared_ptr<SnapshotBase> layout =
+        std::make_shared<SnapshotBase>(makeBase(stream, index, 0));
+
+    Tree copy;
+    copy.loadSnapshotLazily(layout, 0);
+    EXPECT_TRUE(copy.superRoot.isLazy());
+    // an untouched tree is copied out whole, index and all
+    StringOutputStream copied;
+    Snapshot::Index copiedIndex;
+    copy.dumpSnapshot(copied, NULL, 100, copiedIndex);
+    EXPECT_EQ(stream.data, copied.data);
+    EXPECT_EQ(stream.data.size(), copied.rawBytes);
+    EXPECT_EQ(index.subtree_size(), copiedIndex.subtree_size());
+    EXPECT_TRUE(copy.superRoot.isLazy());
+
+    // reads load only the directories along the way
+    std::string contents;
+    EXPECT_OK(copy.read("/a/3", contents));
+    EXPECT_EQ("aaaaaaaaaa", contents);
+    EXPECT_FALSE(copy.superRoot.isLazy());
+    Directory* root = copy.superRoot.lookupDirectory("root");
+    EXPECT_FALSE(root->isLazy());
+    EXPECT_FALSE(root->lookupDirectory("a")->isLazy());
+    EXPECT_TRUE(root->lookupDirectory("b")->isLazy());
+    EXPECT_TRUE(root->lookupDirectory("c")->isLazy());
+
+    EXPECT_OK(tree.write("/c/d/new", "x"));
+    EXPECT_OK(copy.write("/c/d/new", "x"));
+    EXPECT_TRUE(root->lookupDirectory("b")->isLazy());
+    std::weak_ptr<SnapshotBase> weak = layout;
+    layout.reset();
+    EXPECT_FALSE(weak.expired());
+    StringOutputStream full;
+    tree.dumpSnapshot(full);
+    StringOutputStream mixed;
+    copy.dumpSnapshot(mixed);
+    EXPECT_EQ(full.data, mixed.data);
+
+    // the snapshot is released once everything has been loaded
+    EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+    EXPECT_TRUE(weak.expired());
+}
+
+TEST_F(TreeTreeTest, loadPlaceholders)
+{
+    EXPECT_OK(tree.makeDirectory("/a"));
+    EXPECT_OK(tree.makeDirectory("/b"));
+    for (uint64_t i = 0; i < 10; ++i) {
+        EXPECT_OK(tree.write(format("/a/%lu", i), "aaaaaaaaaa"));
+        EXPECT_OK(tree.write(format("/b/%lu", i), "bbbbbbbbbb"));
+    }
+    StringOutputStream stream;
+    Snapshot::Index index;
+    tree.dumpSnapshot(stream, NULL, 100, index);
+    std::shared_ptr<SnapshotBase> layout =
+        std::make_shared<SnapshotBase>(makeBase(stream, index, 0));
+    std::weak_ptr<SnapshotBase> weak = layout;
+
+    Tree copy;
+    copy.loadSnapshotLazily(layout, 0);
+    layout.reset();
+    // one byte at a time loads one directory per call
+    EXPECT_TRUE(copy.loadPlaceholders(1));
+    EXPECT_FALSE(copy.superRoot.isLazy());
+    Directory* root = copy.superRoot.lookupDirectory("root");
+    EXPECT_TRUE(root->isLazy());
+    EXPECT_TRUE(copy.loadPlaceholders(1));
+    EXPECT_FALSE(root->isLazy());
+    EXPECT_TRUE(root->lookupDirectory("a")->isLazy());
+    EXPECT_TRUE(copy.loadPlaceholders(1));
+    EXPECT_FALSE(root->lookupDirectory("a")->isLazy());
+    EXPECT_TRUE(root->lookupDirectory("b")->isLazy());
+    EXPECT_FALSE(weak.expired());
+    EXPECT_FALSE(copy.loadPlaceholders(1));
+    EXPECT_FALSE(root->lookupDirectory("b")->isLazy());
+    EXPECT_TRUE(weak.expired());
+    EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+    EXPECT_FALSE(copy.loadPlaceholders(1));
+
+    // a large budget loads everything at once
+    layout = std::make_shared<SnapshotBase>(makeBase(stream, index, 0));
+    copy.loadSnapshotLazily(layout, 0);
+    EXPECT_FALSE(copy.loadPlaceholders(~0UL));
+    EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+}
+
+TEST_F(TreeTreeTest, loadSnapshotLazily_pastEnd)
+{
+    StringOutputStream stream;
+    tree.dumpSnapshot(stream);
+    std::shared_ptr<SnapshotBase> layout =
+        std::make_shared<SnapshotBase>(makeBase(stream, Snapshot::Index(), 0));
+    Tree copy;
+    copy.loadSnapshotLazily(layout, stream.data.size() + 10);
+    std::vector<std::string> children;
+    EXPECT_DEATH(copy.listDirectory("/", children),
+                 "past the end");
+}
+
+TEST_F(TreeTreeTest, write_sharesValues)
+{
+    std::string big(100, 'x');
+    EXPECT_OK(tree.write("/a", big));
+    EXPECT_OK(tree.write("/b", big));
+    EXPECT_OK(tree.write("/c", big));
+    EXPECT_OK(tree.write("/d", "small"));
+    EXPECT_EQ(1U, tree.valuePool->getNumValues());
+    EXPECT_EQ(100U, tree.valuePool->getNumBytes());
+
+    // appending gives the file its own copy
+    EXPECT_OK(tree.append("/a", "y"));
+    std::string contents;
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ(big + "y", contents);
+    EXPECT_OK(tree.read("/b", contents));
+    EXPECT_EQ(big, contents);
+    EXPECT_EQ(1U, tree.valuePool->getNumValues());
+
+    EXPECT_OK(tree.write("/b", "small"));
+    EXPECT_OK(tree.removeFile("/c"));
+    EXPECT_EQ(0U, tree.valuePool->getNumValues());
+    EXPECT_EQ(0U, tree.valuePool->getNumBytes());
+}
+
+TEST_F(TreeTreeTest, dumpSnapshot_dedup)
+{
+    EXPECT_OK(tree.makeDirectory("/a"));
+    EXPECT_OK(tree.makeDirectory("/b"));
+    std::string big(100, 'x');
+    for (uint64_t i = 0; i < 10; ++i) {
+        EXPECT_OK(tree.write(format("/a/%lu", i), big));
+        EXPECT_OK(tree.write(format("/b/%lu", i), big));
+    }
+    EXPECT_OK(tree.write("/b/small", "x"));
+
+    StringOutputStream plain;
+    tree.dumpSnapshot(plain);
+    tree.setSnapshotDedup(true);
+    StringOutputStream stream;
+    Snapshot::Index index;
+    tree.dumpSnapshot(stream, NULL, 100, index);
+    EXPECT_TRUE(index.values());
+    EXPECT_GT(plain.data.size(), stream.data.size() + 15 * big.size());
+    SnapshotBase layout = makeBase(stream, index, 0);
+
+    {
+        Tree copy;
+        Core::ProtoBuf::MemoryInputStream in(stream.data.data(),
+                                             stream.data.size());
+        copy.loadSnapshot(in);
+        EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+        EXPECT_EQ(1U, copy.valuePool->getNumValues());
+        std::string contents;
+        EXPECT_OK(copy.read("/b/7", contents));
+        EXPECT_EQ(big, contents);
+    }
+    {
+        Tree copy;
+        copy.loadSnapshot(layout, 0, 4);
+        EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+        EXPECT_EQ(1U, copy.valuePool->getNumValues());
+        copy.setSnapshotDedup(true);
+        StringOutputStream redump;
+        copy.dumpSnapshot(redump);
+        StringOutputStream full;
+        tree.dumpSnapshot(full);
+        EXPECT_EQ(full.data, redump.data);
+    }
+    {
+        Tree copy;
+        copy.loadSnapshotLazily(
+            std::make_shared<SnapshotBase>(layout), 0);
+        std::string contents;
+        EXPECT_OK(copy.read("/a/3", contents));
+        EXPECT_EQ(big, contents);
+        // files in placeholders refer to values from the table
+        EXPECT_EQ(1U, copy.valuePool->getNumValues());
+        // without dedup, the placeholders are loaded to write out plainly
+        StringOutputStream redump;
+        copy.dumpSnapshot(redump);
+        EXPECT_EQ(plain.data, redump.data);
+        EXPECT_FALSE(copy.superRoot.isLazy());
+        EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+    }
+}
+
+TEST_F(TreeTreeTest, dumpSnapshot_dedupBase)
+{
+    EXPECT_OK(tree.makeDirectory("/a"));
+    EXPECT_OK(tree.makeDirectory("/b"));
+    std::string big(100, 'x');
+    for (uint64_t i = 0; i < 10; ++i) {
+        EXPECT_OK(tree.write(format("/a/%lu", i), big));
+        EXPECT_OK(tree.write(format("/b/%lu", i), big));
+    }
+    tree.setSnapshotDedup(true);
+    uint64_t epoch = tree.markSnapshot();
+    StringOutputStream first;
+    Snapshot::Index index;
+    tree.dumpSnapshot(first, NULL, 20, index);
+    SnapshotBase base = makeBase(first, index, epoch);
+    base.values = index.values();
+    ASSERT_EQ(1U, base.subtrees.count("/root/b"));
+
+    // with dedup on, unchanged directories are copied and keep their refs
+    EXPECT_OK(tree.write("/a/3", "changed"));
+    tree.markSnapshot();
+    StringOutputStream second;
+    Snapshot::Index index2;
+    tree.dumpSnapshot(second, &base, 20, index2);
+    EXPECT_LT(0U, second.rawBytes);
+    StringOutputStream full;
+    tree.dumpSnapshot(full);
+    EXPECT_EQ(full.data, second.data);
+
+    // with dedup off, a base that uses refs can't be copied from
+    tree.setSnapshotDedup(false);
+    StringOutputStream third;
+    Snapshot::Index index3;
+    tree.dumpSnapshot(third, &base, 20, index3);
+    EXPECT_EQ(0U, third.rawBytes);
+    EXPECT_FALSE(index3.values());
+    StringOutputStream plain;
+    tree.dumpSnapshot(plain);
+    EXPECT_EQ(plain.data, third.data);
+}
+
+TEST_F(TreeTreeTest, markSnapshot)
+{
+    EXPECT_EQ(1U, tree.markSnapshot());
+    EXPECT_OK(tree.makeDirectory("/a/b"));
+    EXPECT_OK(tree.makeDirectory("/c"));
+    EXPECT_EQ(2U, tree.markSnapshot());
+    EXPECT_OK(tree.write("/a/b/f", "x"));
+    Directory* root = tree.superRoot.lookupDirectory("root");
+    EXPECT_EQ(3U, tree.superRoot.lastChanged);
+    EXPECT_EQ(3U, root->lastChanged);
+    EXPECT_EQ(3U, root->lookupDirectory("a")->lastChanged);
+    EXPECT_EQ(3U, root->lookupDirectory("a")->lookupDirectory("b")
+                      ->lastChanged);
+    EXPECT_EQ(2U, root->lookupDirectory("c")->lastChanged);
+    // failed lookups don't count as changes
+    EXPECT_EQ(3U, tree.markSnapshot());
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.write("/x/y", "z").status);
+    EXPECT_EQ(3U, root->lastChanged);
+    // the root directory is recreated when it's removed
+    EXPECT_OK(tree.removeDirectory("/"));
+    EXPECT_EQ(4U, tree.superRoot.lookupDirectory("root")->lastChanged);
+}
 
 TEST_F(TreeTreeTest, normalLookup)
 {
@@ -411,6 +986,41 @@ TEST_F(TreeTreeTest, listDirectory)
     EXPECT_EQ("/d is a file", result.error);
 }
 
+TEST_F(TreeTreeTest, listDirectory_paginated)
+{
+    std::vector<std::string> children;
+    bool more = true;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.listDirectory("", "", "", 0, children, more).status);
+    EXPECT_FALSE(more);
+
+    EXPECT_OK(tree.makeDirectory("/a/"));
+    EXPECT_OK(tree.write("/b", "foo"));
+    EXPECT_OK(tree.makeDirectory("/c"));
+    EXPECT_OK(tree.write("/d", "foo"));
+    EXPECT_OK(tree.listDirectory("/", "", "", 3, children, more));
+    EXPECT_EQ((std::vector<std::string>{
+                    "a/", "c/", "b",
+               }), children);
+    EXPECT_TRUE(more);
+    EXPECT_OK(tree.listDirectory("/", "", "b", 3, children, more));
+    EXPECT_EQ((std::vector<std::string>{
+                    "d",
+               }), children);
+    EXPECT_FALSE(more);
+    EXPECT_OK(tree.listDirectory("/", "c", "", 0, children, more));
+    EXPECT_EQ((std::vector<std::string>{
+                    "c/",
+               }), children);
+    EXPECT_FALSE(more);
+
+    Result result;
+    result = tree.listDirectory("/e", "", "", 1, children, more);
+    EXPECT_EQ(Status::LOOKUP_ERROR, result.status);
+    result = tree.listDirectory("/d", "", "", 1, children, more);
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+}
+
 TEST_F(TreeTreeTest, removeDirectory)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT, tree.removeDirectory("").status);
@@ -454,6 +1064,35 @@ TEST_F(TreeTreeTest, write)
     EXPECT_EQ("/b is a directory", result.error);
 }
 
+TEST_F(TreeTreeTest, write_range)
+{
+    EXPECT_EQ(Status::INVALID_ARGUMENT, tree.write("", 0, "").status);
+    EXPECT_EQ(Status::TYPE_ERROR, tree.write("/", 0, "").status);
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.write("/x/y", 0, "").status);
+    Result result = tree.write("/a", 1, "foo");
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_EQ("Offset 1 is past the end of /a (0 bytes)", result.error);
+    EXPECT_EQ("/", dumpTree(tree));
+
+    std::string contents;
+    EXPECT_OK(tree.write("/a", 0, "hello world"));
+    EXPECT_OK(tree.write("/a", 6, "there"));
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("hello there", contents);
+    EXPECT_OK(tree.write("/a", 9, "se folks"));
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("hello these folks", contents);
+    EXPECT_OK(tree.write("/a", 17, "!"));
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("hello these folks!", contents);
+    EXPECT_EQ(Status::INVALID_ARGUMENT, tree.write("/a", 19, "").status);
+
+    EXPECT_OK(tree.makeDirectory("/b"));
+    result = tree.write("/b", 1, "baz");
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/b is a directory", result.error);
+}
+
 TEST_F(TreeTreeTest, read)
 {
     std::string contents;
@@ -476,6 +1115,35 @@ TEST_F(TreeTreeTest, read)
     EXPECT_EQ("/c does not exist", result.error);
 }
 
+TEST_F(TreeTreeTest, read_range)
+{
+    std::string contents;
+    uint64_t size = 7;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.read("", 0, 0, contents, size).status);
+    EXPECT_EQ(0U, size);
+    EXPECT_EQ(Status::TYPE_ERROR,
+              tree.read("/", 0, 0, contents, size).status);
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.read("/c", 0, 0, contents, size).status);
+
+    EXPECT_OK(tree.write("/a", "hello world"));
+    EXPECT_OK(tree.read("/a", 0, 0, contents, size));
+    EXPECT_EQ("hello world", contents);
+    EXPECT_EQ(11U, size);
+    EXPECT_OK(tree.read("/a", 6, 0, contents, size));
+    EXPECT_EQ("world", contents);
+    EXPECT_OK(tree.read("/a", 2, 3, contents, size));
+    EXPECT_EQ("llo", contents);
+    EXPECT_OK(tree.read("/a", 9, 100, contents, size));
+    EXPECT_EQ("ld", contents);
+    EXPECT_OK(tree.read("/a", 11, 1, contents, size));
+    EXPECT_EQ("", contents);
+    EXPECT_OK(tree.read("/a", 100, 0, contents, size));
+    EXPECT_EQ("", contents);
+    EXPECT_EQ(11U, size);
+}
+
 TEST_F(TreeTreeTest, removeFile)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT, tree.removeFile("").status);
@@ -494,6 +1162,146 @@ TEST_F(TreeTreeTest, removeFile)
     EXPECT_EQ("/e is a directory", result.error);
 }
 
+TEST_F(TreeTreeTest, increment)
+{
+    int64_t value = 3;
+    EXPECT_EQ(Status::INVALID_ARGUMENT, tree.increment("", 1, value).status);
+    EXPECT_EQ(0, value);
+    EXPECT_EQ(Status::TYPE_ERROR, tree.increment("/", 1, value).status);
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.increment("/x/y", 1, value).status);
+
+    // missing file counts as 0
+    EXPECT_OK(tree.increment("/a", 5, value));
+    EXPECT_EQ(5, value);
+    EXPECT_OK(tree.increment("/a", -7, value));
+    EXPECT_EQ(-2, value);
+    std::string contents;
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("-2", contents);
+
+    // empty file counts as 0
+    EXPECT_OK(tree.write("/b", ""));
+    EXPECT_OK(tree.increment("/b", 0, value));
+    EXPECT_EQ(0, value);
+    EXPECT_OK(tree.read("/b", contents));
+    EXPECT_EQ("0", contents);
+
+    // bad contents
+    std::vector<std::string> bad = {"-", "+1", " 1", "1 ", "1x", "0x10",
+                                    "9223372036854775808"};
+    for (auto it = bad.begin(); it != bad.end(); ++it) {
+        EXPECT_OK(tree.write("/c", *it));
+        Result result = tree.increment("/c", 1, value);
+        EXPECT_EQ(Status::TYPE_ERROR, result.status) << *it;
+        EXPECT_EQ("/c does not contain an integer", result.error);
+        EXPECT_OK(tree.read("/c", contents));
+        EXPECT_EQ(*it, contents);
+    }
+
+    // limits
+    EXPECT_OK(tree.write("/d", "9223372036854775806"));
+    EXPECT_OK(tree.increment("/d", 1, value));
+    EXPECT_EQ(INT64_MAX, value);
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.increment("/d", 1, value).status);
+    EXPECT_OK(tree.write("/d", "-9223372036854775808"));
+    EXPECT_OK(tree.increment("/d", 0, value));
+    EXPECT_EQ(INT64_MIN, value);
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.increment("/d", -1, value).status);
+    EXPECT_OK(tree.read("/d", contents));
+    EXPECT_EQ("-9223372036854775808", contents);
+
+    EXPECT_OK(tree.makeDirectory("/e"));
+    Result result = tree.increment("/e", 1, value);
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/e is a directory", result.error);
+}
+
+TEST_F(TreeTreeTest, append)
+{
+    EXPECT_EQ(Status::INVALID_ARGUMENT, tree.append("", "").status);
+    EXPECT_EQ(Status::TYPE_ERROR, tree.append("/", "").status);
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.append("/x/y", "").status);
+    EXPECT_OK(tree.append("/a", "foo"));
+    EXPECT_OK(tree.append("/a", "bar"));
+    std::string contents;
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("foobar", contents);
+
+    EXPECT_OK(tree.makeDirectory("/b"));
+    Result result = tree.append("/b", "baz");
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/b is a directory", result.error);
+}
+
+TEST_F(TreeTreeTest, createSequential)
+{
+    std::string created = "junk";
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.createSequential("", "", created).status);
+    EXPECT_EQ("", created);
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.createSequential("/x/y", "", created).status);
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.createSequential("/x/", "", created).status);
+    EXPECT_OK(tree.write("/f", "foo"));
+    Result result = tree.createSequential("/f/", "", created);
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/f/ is a file", result.error);
+    EXPECT_EQ(Status::TYPE_ERROR,
+              tree.createSequential("/f/x", "", created).status);
+
+    EXPECT_OK(tree.createSequential("/", "a", created));
+    EXPECT_EQ("/0000000000", created);
+    EXPECT_OK(tree.createSequential("/item-", "b", created));
+    EXPECT_EQ("/item-0000000001", created);
+    EXPECT_OK(tree.makeDirectory("/q"));
+    EXPECT_OK(tree.createSequential("/q/item-", "c", created));
+    EXPECT_EQ("/q/item-0000000000", created);
+    EXPECT_OK(tree.createSequential("/q/", "d", created));
+    EXPECT_EQ("/q/0000000001", created);
+    std::string contents;
+    EXPECT_OK(tree.read("/q/item-0000000000", contents));
+    EXPECT_EQ("c", contents);
+    EXPECT_OK(tree.read("/0000000000", contents));
+    EXPECT_EQ("a", contents);
+    EXPECT_EQ(9U, tree.numCreateSequentialAttempted);
+    EXPECT_EQ(4U, tree.numCreateSequentialSuccess);
+}
+
+TEST_F(TreeTreeTest, createSequential_incremental)
+{
+    EXPECT_OK(tree.makeDirectory("/d"));
+    for (uint64_t i = 0; i < 10; ++i)
+        EXPECT_OK(tree.write(format("/d/%lu", i), "dddddddddd"));
+    uint64_t epoch = tree.markSnapshot();
+    StringOutputStream first;
+    Snapshot::Index index;
+    tree.dumpSnapshot(first, NULL, 100, index);
+    SnapshotBase base = makeBase(first, index, epoch);
+    ASSERT_EQ(1U, base.subtrees.count("/root/d"));
+
+    // The new file goes into /d itself, which must not be copied from base.
+    std::string created;
+    EXPECT_OK(tree.createSequential("/d/", "x", created));
+    tree.markSnapshot();
+    StringOutputStream second;
+    Snapshot::Index index2;
+    tree.dumpSnapshot(second, &base, 100, index2);
+    StringOutputStream full;
+    tree.dumpSnapshot(full);
+    EXPECT_EQ(full.data, second.data);
+
+    Tree copy;
+    copy.loadSnapshot(makeBase(second, index2, 0), 0, 1);
+    std::string contents;
+    EXPECT_OK(copy.read(created, contents));
+    EXPECT_EQ("x", contents);
+    EXPECT_EQ(dumpTree(tree), dumpTree(copy));
+}
+
 } // namespace LogCabin::Tree::<anonymous>
 } // namespace LogCabin::Tree
 } // namespace LogCabin
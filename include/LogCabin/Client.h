@@ -466,6 +466,54 @@ class Tree {
      */
     std::vector<std::string> listDirectoryEx(const std::string& path) const;
 
+    /**
+     * List part of the contents of a directory. This is useful for paging
+     * through directories that are too large to list in a single request;
+     * see also DirectoryIterator.
+     * \param path
+     *      The directory whose direct children to list.
+     * \param prefix
+     *      Only list children whose names begin with this prefix. Directory
+     *      names are matched without their trailing slash. Pass the empty
+     *      string to list all children.
+     * \param startAfter
+     *      Only list children ordered after this name. This is normally the
+     *      last child returned by the previous call, or the empty string to
+     *      start from the beginning.
+     * \param limit
+     *      The maximum number of children to list, or 0 for no limit.
+     * \param[out] children
+     *      This will be replaced by the names of the listed children, in the
+     *      same order and format as the other listDirectory().
+     * \param[out] more
+     *      Set to true if more children follow those returned, false
+     *      otherwise.
+     * \return
+     *      Status and error message. Possible errors are the same as for the
+     *      other listDirectory().
+     * \warning
+     *      Each call is a separate read of the directory. Children that are
+     *      created or removed between calls may or may not be listed.
+     * \since LogCabin v1.2.0
+     */
+    Result
+    listDirectory(const std::string& path,
+                  const std::string& prefix,
+                  const std::string& startAfter,
+                  uint64_t limit,
+                  std::vector<std::string>& children,
+                  bool& more) const;
+
+    /**
+     * Like the paginated listDirectory but throws exceptions upon errors.
+     * \since LogCabin v1.2.0
+     */
+    std::vector<std::string> listDirectoryEx(const std::string& path,
+                                             const std::string& prefix,
+                                             const std::string& startAfter,
+                                             uint64_t limit,
+                                             bool& more) const;
+
     /**
      * Make sure a directory does not exist.
      * Also removes all direct and indirect children of the directory.
@@ -518,6 +566,42 @@ class Tree {
     void
     writeEx(const std::string& path, const std::string& contents);
 
+    /**
+     * Overwrite part of the value of a file, creating the file if it does not
+     * exist. Only the bytes written are replicated, so this is much cheaper
+     * than rewriting a large file to change a small part of it.
+     * \param path
+     *      The path of the file to modify.
+     * \param offset
+     *      The position within the file at which to place 'contents'. Bytes
+     *      before and after the range written are left unchanged, and the
+     *      file grows if the range extends past its end. This may be at most
+     *      the current size of the file (writes may not leave holes); pass
+     *      the file's size to append.
+     * \param contents
+     *      The bytes to place at 'offset'.
+     * \return
+     *      Status and error message. Possible errors are the same as for the
+     *      other write(), plus:
+     *       - INVALID_ARGUMENT if offset is past the end of the file.
+     *       - INVALID_ARGUMENT if the cluster does not support this command
+     *         (it requires all servers to run LogCabin v1.2.0 or newer).
+     * \since LogCabin v1.2.0
+     */
+    Result
+    write(const std::string& path,
+          uint64_t offset,
+          const std::string& contents);
+
+    /**
+     * Like the ranged write but throws exceptions upon errors.
+     * \since LogCabin v1.2.0
+     */
+    void
+    writeEx(const std::string& path,
+            uint64_t offset,
+            const std::string& contents);
+
     /**
      * Get the value of a file.
      * \param path
@@ -543,6 +627,45 @@ class Tree {
     std::string
     readEx(const std::string& path) const;
 
+    /**
+     * Get part of the value of a file. This is used to read large files
+     * without copying out their entire contents.
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param offset
+     *      The position within the file of the first byte to read. If this is
+     *      at or past the end of the file, no bytes are read.
+     * \param length
+     *      The maximum number of bytes to read, or 0 to read through the end
+     *      of the file.
+     * \param[out] contents
+     *      The bytes of the file in the requested range.
+     * \param[out] size
+     *      The total size of the file in bytes.
+     * \return
+     *      Status and error message. Possible errors are the same as for the
+     *      other read().
+     * \since LogCabin v1.2.0
+     */
+    Result
+    read(const std::string& path,
+         uint64_t offset,
+         uint64_t length,
+         std::string& contents,
+         uint64_t& size) const;
+
+    /**
+     * Like the ranged read but throws exceptions upon errors.
+     * \return
+     *      The bytes of the file in the requested range.
+     * \since LogCabin v1.2.0
+     */
+    std::string
+    readEx(const std::string& path,
+           uint64_t offset,
+           uint64_t length,
+           uint64_t& size) const;
+
     /**
      * Make sure a file does not exist.
      * \param path
@@ -564,6 +687,163 @@ class Tree {
     void
     removeFileEx(const std::string& path);
 
+    /**
+     * Atomically add to the integer stored in a file. Unlike a read followed
+     * by a conditional write, this takes a single log entry no matter how
+     * many other clients are updating the same file.
+     * \param path
+     *      The path of the file whose value to change. The file holds a signed
+     *      decimal integer in ASCII; if it does not exist or is empty, it is
+     *      treated as holding 0.
+     * \param delta
+     *      The amount to add to the file's value (may be negative).
+     * \param[out] value
+     *      The file's new value. Set to 0 on errors.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the new value would not fit in an int64_t.
+     *       - INVALID_ARGUMENT if the cluster does not support this command
+     *         (it requires all servers to run LogCabin v1.2.0 or newer).
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     *       - TYPE_ERROR if the file's contents are not an integer.
+     *       - CONDITION_NOT_MET if predicate from setCondition() was false.
+     *       - TIMEOUT if timeout elapsed before the operation completed.
+     * \since LogCabin v1.2.0
+     */
+    Result
+    increment(const std::string& path, int64_t delta, int64_t& value);
+
+    /**
+     * Like increment but throws exceptions upon errors.
+     * \return
+     *      The file's new value.
+     */
+    int64_t
+    incrementEx(const std::string& path, int64_t delta);
+
+    /**
+     * Atomically add to the end of a file's contents, creating the file if it
+     * does not exist.
+     * \param path
+     *      The path of the file to append to.
+     * \param contents
+     *      The bytes to add to the end of the file.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the cluster does not support this command
+     *         (it requires all servers to run LogCabin v1.2.0 or newer).
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     *       - CONDITION_NOT_MET if predicate from setCondition() was false.
+     *       - TIMEOUT if timeout elapsed before the operation completed.
+     * \since LogCabin v1.2.0
+     */
+    Result
+    append(const std::string& path, const std::string& contents);
+
+    /**
+     * Like append but throws exceptions upon errors.
+     */
+    void
+    appendEx(const std::string& path, const std::string& contents);
+
+    /**
+     * Atomically create a new file with a unique name, such as for adding
+     * entries to a queue without contention between clients. The name is the
+     * last component of path followed by a sequence number, zero-padded to
+     * 10 digits. Sequence numbers increase with every file created this way
+     * in the same directory and are never reused, so listing the directory
+     * returns the entries in creation order.
+     * \param path
+     *      The directory and name prefix for the new file, such as
+     *      "/queue/item-". If this ends in a slash, it names the directory,
+     *      and the new file's name is just the sequence number.
+     * \param contents
+     *      The initial contents of the new file.
+     * \param[out] created
+     *      The absolute path of the new file, such as
+     *      "/queue/item-0000000007". Set to the empty string on errors.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the cluster does not support this command
+     *         (it requires all servers to run LogCabin v1.2.0 or newer).
+     *       - LOOKUP_ERROR if the directory does not exist.
+     *       - TYPE_ERROR if a parent of the directory is a file.
+     *       - TYPE_ERROR if the directory is a file.
+     *       - CONDITION_NOT_MET if predicate from setCondition() was false.
+     *       - TIMEOUT if timeout elapsed before the operation completed.
+     * \since LogCabin v1.2.0
+     */
+    Result
+    createSequential(const std::string& path,
+                     const std::string& contents,
+                     std::string& created);
+
+    /**
+     * Like createSequential but throws exceptions upon errors.
+     * \return
+     *      The absolute path of the new file.
+     */
+    std::string
+    createSequentialEx(const std::string& path, const std::string& contents);
+
+    /**
+     * Wait for a change to a path. This replaces polling with read(): the
+     * cluster holds the request and responds once a command that modifies
+     * the path is applied, so idle watchers cost the cluster very little.
+     *
+     * Changes to the path itself, to its direct children, and to any of its
+     * ancestors trigger the watch. Watches may be triggered spuriously, so
+     * callers should re-read the path afterwards rather than assume that it
+     * changed.
+     *
+     * A typical loop is:
+     *     uint64_t index = tree.watchEx(path, false, 0);
+     *     while (true) {
+     *         ... read path ...
+     *         index = tree.watchEx(path, false, index);
+     *     }
+     * \param path
+     *      The path to watch. It need not exist.
+     * \param recursive
+     *      If true, changes anywhere in the subtree below 'path' also trigger
+     *      the watch.
+     * \param afterIndex
+     *      Only changes that came after this point trigger the watch. Pass
+     *      the index returned by the previous call to watch(). If zero, this
+     *      returns right away with the index of the cluster's current state.
+     * \param[out] index
+     *      Identifies the change that triggered the watch. Pass this as
+     *      'afterIndex' to the next call to watch(). Set to 0 on errors.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the cluster does not support watches.
+     *       - TIMEOUT if timeout elapsed before the path changed.
+     * \since LogCabin v1.2.0
+     */
+    Result
+    watch(const std::string& path,
+          bool recursive,
+          uint64_t afterIndex,
+          uint64_t& index) const;
+
+    /**
+     * Like watch but throws exceptions upon errors.
+     * \return
+     *      See 'index' in watch().
+     */
+    uint64_t
+    watchEx(const std::string& path,
+            bool recursive,
+            uint64_t afterIndex) const;
+
   private:
     /**
      * Get a reference to the implementation-specific members of this class.
@@ -582,6 +862,99 @@ class Tree {
     friend class Cluster;
 };
 
+/**
+ * Iterates over the children of a directory, fetching them from the cluster
+ * lazily, one page at a time, with the paginated Tree::listDirectory(). This
+ * avoids transferring the entire listing of a large directory in a single
+ * response.
+ *
+ * Each page is a separate read of the directory. Children that are created or
+ * removed during the iteration may or may not be returned, but children that
+ * exist throughout are returned exactly once, in the same order as
+ * Tree::listDirectory().
+ * \since LogCabin v1.2.0
+ */
+class DirectoryIterator {
+  public:
+    /**
+     * Constructor. This does not contact the cluster.
+     * \param tree
+     *      Used to list the directory. Its working directory, condition, and
+     *      timeout apply to each page. This object keeps a copy, so later
+     *      changes to 'tree' have no effect on the iteration.
+     * \param path
+     *      The directory whose direct children to list.
+     * \param prefix
+     *      Only return children whose names begin with this prefix. Directory
+     *      names are matched without their trailing slash.
+     * \param pageSize
+     *      The maximum number of children to fetch in each request, or 0 to
+     *      fetch the entire listing in a single request.
+     */
+    DirectoryIterator(const Tree& tree,
+                      const std::string& path,
+                      const std::string& prefix = "",
+                      uint64_t pageSize = 1000);
+    /// Destructor.
+    ~DirectoryIterator();
+
+    /**
+     * Advance to the next child, fetching another page from the cluster if
+     * necessary.
+     * \param[out] child
+     *      Set to the name of the next child. The names of directories will
+     *      have a trailing slash. Set to the empty string if 'done' is set.
+     * \param[out] done
+     *      Set to true if there are no more children, false otherwise.
+     * \return
+     *      Status and error message, as for Tree::listDirectory(). After an
+     *      error, calling next() again will retry the failed request.
+     */
+    Result next(std::string& child, bool& done);
+
+    /**
+     * Like next but throws exceptions upon errors.
+     * \param[out] child
+     *      Set to the name of the next child, or to the empty string if
+     *      there are no more children.
+     * \return
+     *      True if 'child' was set to the next child, false if there are no
+     *      more children.
+     */
+    bool nextEx(std::string& child);
+
+  private:
+    /**
+     * Used to fetch pages of the listing.
+     */
+    Tree tree;
+    /**
+     * The directory being listed.
+     */
+    std::string path;
+    /**
+     * See constructor.
+     */
+    std::string prefix;
+    /**
+     * See constructor.
+     */
+    uint64_t pageSize;
+    /**
+     * The current page of children.
+     */
+    std::vector<std::string> page;
+    /**
+     * The index into 'page' of the next child to return.
+     */
+    size_t index;
+    /**
+     * True if more children may follow those in 'page' (initially true,
+     * since no page has been fetched yet).
+     */
+    bool more;
+};
+
 /**
  * When running in testing mode, these callbacks serve as a way for the
  * application to interpose on requests and responses to inject failures and